@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Build flag autotuning per class of acceleration structure. Every preset
+// is applied to all structures of a class in turn while the others stay
+// put, and the frames traced with it give its share of the trace time.
+// The decisions are kept in a profile per scene and device.
+namespace buildtune {
+    enum class AccelClass : uint32_t {
+        eStatic,      // built once
+        eDeformable,  // refit or rebuilt every frame
+        eStreamed,    // built while the camera moves through a mesh pack
+    };
+    constexpr uint32_t kClassCount = 3;
+
+    enum class Preset : uint32_t {
+        eFastTrace,
+        eFastBuild,
+        eLowMemory,
+    };
+    constexpr uint32_t kPresetCount = 3;
+
+    inline const char* toString(AccelClass accelClass) {
+        switch (accelClass) {
+        case AccelClass::eStatic: return "static";
+        case AccelClass::eDeformable: return "deformable";
+        case AccelClass::eStreamed: return "streamed";
+        }
+        return "unknown";
+    }
+
+    inline const char* toString(Preset preset) {
+        switch (preset) {
+        case Preset::eFastTrace: return "fast-trace";
+        case Preset::eFastBuild: return "fast-build";
+        case Preset::eLowMemory: return "low-memory";
+        }
+        return "unknown";
+    }
+
+    template <typename T, uint32_t Count>
+    bool parse(const std::string& name, T& value) {
+        for (uint32_t i = 0; i < Count; i++) {
+            if (name == toString(static_cast<T>(i))) {
+                value = static_cast<T>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // FNV-1a of a description of everything that decides the structures,
+    // the scene options and the device
+    inline uint64_t hashScene(const std::string& description) {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (unsigned char c : description) {
+            hash = (hash ^ c) * 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    struct Measurement {
+        bool valid = false;
+        double buildMs = 0.0;          // building every structure of the class once
+        double buildMsPerFrame = 0.0;  // builds and refits while tracing
+        double traceMs = 0.0;
+        uint64_t bytes = 0;
+
+        double getFrameMs() const { return traceMs + buildMsPerFrame; }
+    };
+
+    // Fastest frame time, and among presets within tolerance of it the one
+    // with the least memory, so rarely traced geometry ends up small
+    inline Preset choosePreset(const std::array<Measurement, kPresetCount>& measurements,
+        Preset fallback, double tolerance = 0.03) {
+        const Measurement* best = nullptr;
+        for (const Measurement& measurement : measurements) {
+            if (measurement.valid && (!best || measurement.getFrameMs() < best->getFrameMs())) {
+                best = &measurement;
+            }
+        }
+        if (!best) {
+            return fallback;
+        }
+        double limit = best->getFrameMs() * (1.0 + tolerance);
+        for (const Measurement& measurement : measurements) {
+            if (measurement.valid && measurement.getFrameMs() <= limit && measurement.bytes < best->bytes) {
+                best = &measurement;
+            }
+        }
+        return static_cast<Preset>(best - measurements.data());
+    }
+
+    // Chosen presets of any number of scenes, one text line each:
+    // scene class preset trace-ms build-ms-per-frame bytes. The numbers
+    // are what the choice was based on and are only informative.
+    class Profile {
+    public:
+        bool load(const std::string& path) {
+            std::ifstream file(path);
+            if (!file) {
+                return false;
+            }
+            std::string line;
+            while (std::getline(file, line)) {
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                std::istringstream fields(line);
+                Entry entry{};
+                std::string className, presetName;
+                fields >> std::hex >> entry.scene >> std::dec >> className >> presetName
+                    >> entry.measurement.traceMs >> entry.measurement.buildMsPerFrame >> entry.measurement.bytes;
+                AccelClass accelClass;
+                if (!fields || !parse<AccelClass, kClassCount>(className, accelClass) ||
+                    !parse<Preset, kPresetCount>(presetName, entry.preset)) {
+                    continue;
+                }
+                entry.measurement.valid = true;
+                entries[{ entry.scene, static_cast<uint32_t>(accelClass) }] = entry;
+            }
+            return true;
+        }
+
+        bool save(const std::string& path) const {
+            std::ofstream file(path);
+            if (!file) {
+                return false;
+            }
+            file << "# scene class preset trace-ms build-ms-per-frame bytes\n";
+            for (const auto& [key, entry] : entries) {
+                file << std::hex << std::setw(16) << std::setfill('0') << entry.scene << std::dec << std::setfill(' ')
+                    << " " << toString(static_cast<AccelClass>(key.second)) << " " << toString(entry.preset)
+                    << " " << entry.measurement.traceMs << " " << entry.measurement.buildMsPerFrame
+                    << " " << entry.measurement.bytes << "\n";
+            }
+            return static_cast<bool>(file);
+        }
+
+        bool find(uint64_t scene, AccelClass accelClass, Preset& preset) const {
+            auto it = entries.find({ scene, static_cast<uint32_t>(accelClass) });
+            if (it == entries.end()) {
+                return false;
+            }
+            preset = it->second.preset;
+            return true;
+        }
+
+        void set(uint64_t scene, AccelClass accelClass, Preset preset, const Measurement& measurement) {
+            entries[{ scene, static_cast<uint32_t>(accelClass) }] = { scene, preset, measurement };
+        }
+
+    private:
+        struct Entry {
+            uint64_t scene = 0;
+            Preset preset = Preset::eFastTrace;
+            Measurement measurement;
+        };
+        std::map<std::pair<uint64_t, uint32_t>, Entry> entries;
+    };
+
+    // Steps through every preset of the tuned classes. After start and
+    // whenever addFrame returns true the caller builds every class with
+    // getActivePreset and reports the builds with setBuild, then feeds one
+    // sample per traced frame. Tuned classes keep their choice, the
+    // others their preset from before.
+    class Tuner {
+    public:
+        void start(const std::vector<AccelClass>& tunedClasses, const std::array<Preset, kClassCount>& presets,
+            uint32_t warmup = 8, uint32_t measured = 32) {
+            classes = tunedClasses;
+            initialPresets = presets;
+            choices = presets;
+            measurements = {};
+            warmupFrames = warmup;
+            measuredFrames = measured;
+            classIndex = 0;
+            presetIndex = 0;
+            frames = 0;
+        }
+
+        bool isRunning() const { return classIndex < classes.size(); }
+        // The class being tuned, only while running
+        AccelClass getClass() const { return classes[classIndex]; }
+
+        Preset getActivePreset(AccelClass accelClass) const {
+            if (isRunning() && classes[classIndex] == accelClass) {
+                return static_cast<Preset>(presetIndex);
+            }
+            return choices[static_cast<uint32_t>(accelClass)];
+        }
+
+        // Time of building a class with its active preset, only kept for
+        // the class being tuned
+        void setBuild(AccelClass accelClass, double buildMs) {
+            if (isRunning() && classes[classIndex] == accelClass) {
+                getCurrent().buildMs = buildMs;
+            }
+        }
+
+        // buildMs: build time in the frame, bytes: memory of the class now.
+        // Returns true when the presets to build with have changed.
+        bool addFrame(double traceMs, double buildMs, uint64_t bytes) {
+            // Frames in flight may still use the previous structures
+            if (++frames <= warmupFrames) {
+                return false;
+            }
+            Measurement& measurement = getCurrent();
+            measurement.traceMs += traceMs / measuredFrames;
+            measurement.buildMsPerFrame += buildMs / measuredFrames;
+            measurement.bytes = bytes;
+            if (frames < warmupFrames + measuredFrames) {
+                return false;
+            }
+
+            measurement.valid = true;
+            frames = 0;
+            if (++presetIndex < kPresetCount) {
+                return true;
+            }
+            uint32_t accelClass = static_cast<uint32_t>(classes[classIndex]);
+            choices[accelClass] = choosePreset(measurements[accelClass], initialPresets[accelClass]);
+            presetIndex = 0;
+            classIndex++;
+            return true;
+        }
+
+        const std::vector<AccelClass>& getClasses() const { return classes; }
+        Preset getChoice(AccelClass accelClass) const { return choices[static_cast<uint32_t>(accelClass)]; }
+        const Measurement& getMeasurement(AccelClass accelClass, Preset preset) const {
+            return measurements[static_cast<uint32_t>(accelClass)][static_cast<uint32_t>(preset)];
+        }
+
+        void print(std::ostream& out) const {
+            out << "Class\t\tPreset\t\tBuild ms\tBuild ms/frame\tMB\tTrace ms\n";
+            for (AccelClass accelClass : classes) {
+                for (uint32_t preset = 0; preset < kPresetCount; preset++) {
+                    const Measurement& measurement = getMeasurement(accelClass, static_cast<Preset>(preset));
+                    out << toString(accelClass) << "\t" << (accelClass == AccelClass::eStatic ? "\t" : "")
+                        << toString(static_cast<Preset>(preset)) << "\t" << measurement.buildMs << "\t"
+                        << measurement.buildMsPerFrame << "\t" << measurement.bytes / (1024.0 * 1024.0) << "\t"
+                        << measurement.traceMs << (getChoice(accelClass) == static_cast<Preset>(preset) ? "\t*" : "")
+                        << "\n";
+                }
+            }
+        }
+
+    private:
+        std::vector<AccelClass> classes;
+        std::array<Preset, kClassCount> initialPresets{};
+        std::array<Preset, kClassCount> choices{};
+        std::array<std::array<Measurement, kPresetCount>, kClassCount> measurements{};
+        uint32_t warmupFrames = 8;
+        uint32_t measuredFrames = 32;
+        size_t classIndex = 0;
+        uint32_t presetIndex = 0;
+        uint32_t frames = 0;
+
+        Measurement& getCurrent() {
+            return measurements[static_cast<uint32_t>(classes[classIndex])][presetIndex];
+        }
+    };
+}  // namespace buildtune
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// Interactive fly camera. WASD moves, Q/E moves down and up, Shift moves
+// faster, and dragging with the right mouse button looks around.
+namespace camera {
+    class FlyCamera {
+    public:
+        glm::vec3 position{ 0.0f, 0.0f, 5.0f };
+        float yaw = 0.0f;    // radians, 0 looks down -z
+        float pitch = 0.0f;  // radians, positive looks up
+        // Same field of view as the image plane 3 units ahead used before
+        float fovY = 2.0f * std::atan(1.0f / 3.0f);
+        float moveSpeed = 2.0f;       // units per second
+        float lookSpeed = 0.003f;     // radians per pixel
+
+        glm::vec3 getForward() const {
+            return { -std::sin(yaw) * std::cos(pitch), std::sin(pitch), -std::cos(yaw) * std::cos(pitch) };
+        }
+
+        glm::mat4 getView() const {
+            return glm::lookAt(position, position + getForward(), glm::vec3(0.0f, 1.0f, 0.0f));
+        }
+
+        glm::mat4 getProjection(float aspect) const {
+            return glm::perspective(fovY, aspect, 0.01f, 10000.0f);
+        }
+
+        std::array<float, 3> getPositionArray() const {
+            return { position.x, position.y, position.z };
+        }
+
+        std::array<float, 3> getForwardArray() const {
+            glm::vec3 forward = getForward();
+            return { forward.x, forward.y, forward.z };
+        }
+
+        // Applies the input of the last deltaTime seconds. The caller passes
+        // false for inputs the UI has captured. Returns whether the camera moved.
+        bool update(GLFWwindow* window, float deltaTime, bool useMouse, bool useKeyboard) {
+            bool moved = false;
+
+            double x, y;
+            glfwGetCursorPos(window, &x, &y);
+            bool looking = useMouse && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+            if (looking && dragging) {
+                float dx = static_cast<float>(x - lastCursorX);
+                float dy = static_cast<float>(y - lastCursorY);
+                if (dx != 0.0f || dy != 0.0f) {
+                    yaw -= dx * lookSpeed;
+                    pitch = std::clamp(pitch - dy * lookSpeed, -1.55f, 1.55f);
+                    moved = true;
+                }
+            }
+            dragging = looking;
+            lastCursorX = x;
+            lastCursorY = y;
+
+            if (!useKeyboard) {
+                return moved;
+            }
+            glm::vec3 forward = getForward();
+            glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+            glm::vec3 up(0.0f, 1.0f, 0.0f);
+            auto pressed = [&](int key) { return glfwGetKey(window, key) == GLFW_PRESS ? 1.0f : 0.0f; };
+            glm::vec3 direction = forward * (pressed(GLFW_KEY_W) - pressed(GLFW_KEY_S)) +
+                right * (pressed(GLFW_KEY_D) - pressed(GLFW_KEY_A)) +
+                up * (pressed(GLFW_KEY_E) - pressed(GLFW_KEY_Q));
+            if (glm::dot(direction, direction) > 0.0f) {
+                float speed = moveSpeed * (1.0f + 3.0f * pressed(GLFW_KEY_LEFT_SHIFT));
+                position += glm::normalize(direction) * speed * deltaTime;
+                moved = true;
+            }
+            return moved;
+        }
+
+    private:
+        bool dragging = false;
+        double lastCursorX = 0.0;
+        double lastCursorY = 0.0;
+    };
+}  // namespace camera
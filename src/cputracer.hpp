@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "geometry.hpp"
+
+// CPU tracer of primary rays. It mirrors getRayDirection in
+// trace_common.glsl and the barycentric color of getHitInfo in
+// hit_common.glsl, so a frame traced with --bounces 0 on the GPU and one
+// traced here show the same image.
+namespace cputracer {
+    // Miss color of miss.rmiss
+    const glm::vec3 kMissColor{ 0.0f, 0.5f, 0.2f };
+    constexpr float kTMin = 0.001f;
+    constexpr float kTMax = 10000.0f;
+
+    // Camera of a frame, the same matrices as FrameUniforms
+    struct View {
+        glm::mat4 viewInverse{ 1.0f };
+        glm::mat4 projectionInverse{ 1.0f };
+        glm::vec3 position{ 0.0f };
+    };
+
+    inline View makeView(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& position) {
+        return { glm::inverse(view), glm::inverse(projection), position };
+    }
+
+    // uv in [0, 1] with y pointing down, like the launch ID
+    inline glm::vec3 getRayDirection(const View& view, glm::vec2 uv) {
+        glm::vec4 target = view.projectionInverse * glm::vec4(uv.x * 2.0f - 1.0f, 1.0f - uv.y * 2.0f, 1.0f, 1.0f);
+        glm::vec3 direction = glm::vec3(view.viewInverse * glm::vec4(glm::vec3(target) / target.w, 0.0f));
+        return glm::normalize(direction);
+    }
+
+    struct Node {
+        glm::vec3 minBound;
+        uint32_t first;   // first triangle of a leaf, else the right child
+        glm::vec3 maxBound;
+        uint32_t count;   // triangles of a leaf, 0 for inner nodes
+    };
+
+    struct Hit {
+        float t = kTMax;
+        glm::vec2 barycentrics{ 0.0f };
+        uint32_t triangle = UINT32_MAX;
+
+        bool isHit() const { return triangle != UINT32_MAX; }
+    };
+
+    // Binary BVH over the triangles of a mesh. Inner nodes store the left
+    // child right after themselves.
+    class Scene {
+    public:
+        static constexpr uint32_t kLeafSize = 4;
+
+        explicit Scene(const geometry::Mesh& mesh) {
+            for (size_t i = 0; i + 2 < mesh.positions.size(); i += 3) {
+                vertices.emplace_back(mesh.positions[i], mesh.positions[i + 1], mesh.positions[i + 2]);
+            }
+            indices = mesh.indices;
+            triangles.resize(mesh.triangleCount());
+            std::iota(triangles.begin(), triangles.end(), 0u);
+            centroids.resize(triangles.size());
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                centroids[t] = (getVertex(t, 0) + getVertex(t, 1) + getVertex(t, 2)) / 3.0f;
+            }
+            if (!triangles.empty()) {
+                nodes.reserve(triangles.size() * 2);
+                build(0, static_cast<uint32_t>(triangles.size()));
+            }
+            centroids.clear();
+        }
+
+        uint32_t getTriangleCount() const { return static_cast<uint32_t>(triangles.size()); }
+
+        Hit trace(const glm::vec3& origin, const glm::vec3& direction) const {
+            Hit hit{};
+            if (nodes.empty()) {
+                return hit;
+            }
+            glm::vec3 inverseDirection = 1.0f / direction;
+            uint32_t stack[64];
+            uint32_t stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0) {
+                const Node& node = nodes[stack[--stackSize]];
+                if (!intersectBounds(node, origin, inverseDirection, hit.t)) {
+                    continue;
+                }
+                if (node.count > 0) {
+                    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                        intersectTriangle(triangles[i], origin, direction, hit);
+                    }
+                    continue;
+                }
+                uint32_t index = static_cast<uint32_t>(&node - nodes.data());
+                stack[stackSize++] = node.first;
+                stack[stackSize++] = index + 1;
+            }
+            return hit;
+        }
+
+        // Radiance of a primary ray with the shading of the hit shaders at bounce 0
+        glm::vec3 shade(const glm::vec3& origin, const glm::vec3& direction) const {
+            Hit hit = trace(origin, direction);
+            if (!hit.isHit()) {
+                return kMissColor;
+            }
+            return { 1.0f - hit.barycentrics.x - hit.barycentrics.y, hit.barycentrics.x, hit.barycentrics.y };
+        }
+
+        // Traces pixels [x, x + width) x [y, y + height) of the image into
+        // rgba, which holds width * height tightly packed pixels
+        void renderRegion(const View& view, uint32_t imageWidth, uint32_t imageHeight,
+            uint32_t x, uint32_t y, uint32_t width, uint32_t height, float* rgba) const {
+            for (uint32_t row = 0; row < height; row++) {
+                for (uint32_t column = 0; column < width; column++) {
+                    glm::vec2 uv((x + column + 0.5f) / imageWidth, (y + row + 0.5f) / imageHeight);
+                    glm::vec3 color = shade(view.position, getRayDirection(view, uv));
+                    float* pixel = rgba + (static_cast<size_t>(row) * width + column) * 4;
+                    pixel[0] = color.r;
+                    pixel[1] = color.g;
+                    pixel[2] = color.b;
+                    pixel[3] = 1.0f;
+                }
+            }
+        }
+
+    private:
+        std::vector<glm::vec3> vertices;
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> triangles;
+        std::vector<glm::vec3> centroids;
+        std::vector<Node> nodes;
+
+        glm::vec3 getVertex(uint32_t triangle, uint32_t corner) const {
+            return vertices[indices[triangle * 3 + corner]];
+        }
+
+        // Median split on the longest axis of the centroid bounds
+        uint32_t build(uint32_t first, uint32_t count) {
+            uint32_t index = static_cast<uint32_t>(nodes.size());
+            nodes.push_back({});
+
+            glm::vec3 minBound(FLT_MAX), maxBound(-FLT_MAX);
+            glm::vec3 minCentroid(FLT_MAX), maxCentroid(-FLT_MAX);
+            for (uint32_t i = first; i < first + count; i++) {
+                for (uint32_t corner = 0; corner < 3; corner++) {
+                    minBound = glm::min(minBound, getVertex(triangles[i], corner));
+                    maxBound = glm::max(maxBound, getVertex(triangles[i], corner));
+                }
+                minCentroid = glm::min(minCentroid, centroids[triangles[i]]);
+                maxCentroid = glm::max(maxCentroid, centroids[triangles[i]]);
+            }
+            nodes[index].minBound = minBound;
+            nodes[index].maxBound = maxBound;
+
+            if (count <= kLeafSize) {
+                nodes[index].first = first;
+                nodes[index].count = count;
+                return index;
+            }
+
+            glm::vec3 extent = maxCentroid - minCentroid;
+            int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+            uint32_t half = count / 2;
+            std::nth_element(triangles.begin() + first, triangles.begin() + first + half,
+                triangles.begin() + first + count,
+                [&](uint32_t a, uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+            build(first, half);
+            uint32_t right = build(first + half, count - half);
+            nodes[index].first = right;
+            nodes[index].count = 0;
+            return index;
+        }
+
+        static bool intersectBounds(const Node& node, const glm::vec3& origin,
+            const glm::vec3& inverseDirection, float tMax) {
+            glm::vec3 t0 = (node.minBound - origin) * inverseDirection;
+            glm::vec3 t1 = (node.maxBound - origin) * inverseDirection;
+            glm::vec3 tNear = glm::min(t0, t1);
+            glm::vec3 tFar = glm::max(t0, t1);
+            float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, kTMin));
+            float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+            return enter <= exit;
+        }
+
+        // Moller-Trumbore, both faces like eTriangleFacingCullDisable
+        void intersectTriangle(uint32_t triangle, const glm::vec3& origin,
+            const glm::vec3& direction, Hit& hit) const {
+            glm::vec3 v0 = getVertex(triangle, 0);
+            glm::vec3 edge1 = getVertex(triangle, 1) - v0;
+            glm::vec3 edge2 = getVertex(triangle, 2) - v0;
+            glm::vec3 p = glm::cross(direction, edge2);
+            float determinant = glm::dot(edge1, p);
+            if (std::abs(determinant) < 1e-12f) {
+                return;
+            }
+            float inverseDeterminant = 1.0f / determinant;
+            glm::vec3 s = origin - v0;
+            float u = glm::dot(s, p) * inverseDeterminant;
+            if (u < 0.0f || u > 1.0f) {
+                return;
+            }
+            glm::vec3 q = glm::cross(s, edge1);
+            float v = glm::dot(direction, q) * inverseDeterminant;
+            if (v < 0.0f || u + v > 1.0f) {
+                return;
+            }
+            float t = glm::dot(edge2, q) * inverseDeterminant;
+            if (t > kTMin && t < hit.t) {
+                hit.t = t;
+                hit.barycentrics = { u, v };
+                hit.triangle = triangle;
+            }
+        }
+    };
+
+    // Grid of spheres in front of the default camera, enough triangles to
+    // make tiles cost different amounts of time
+    inline geometry::Mesh makeTestScene(uint32_t grid = 4, uint32_t segments = 48) {
+        geometry::Mesh scene{};
+        float spacing = 3.0f / grid;
+        for (uint32_t y = 0; y < grid; y++) {
+            for (uint32_t x = 0; x < grid; x++) {
+                std::array<float, 3> center = {
+                    (x + 0.5f) * spacing - 1.5f, (y + 0.5f) * spacing - 1.5f, -static_cast<float>((x + y) % 3),
+                };
+                // Denser spheres on one side of the image
+                uint32_t sphereSegments = segments * (1 + x) / grid + 4;
+                geometry::Mesh sphere = geometry::makeUvSphere(center, spacing * 0.4f,
+                    sphereSegments, sphereSegments / 2 + 2);
+                uint32_t base = scene.vertexCount();
+                scene.positions.insert(scene.positions.end(), sphere.positions.begin(), sphere.positions.end());
+                for (uint32_t index : sphere.indices) {
+                    scene.indices.push_back(base + index);
+                }
+            }
+        }
+        return scene;
+    }
+}  // namespace cputracer
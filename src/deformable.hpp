@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "instances.hpp"
+#include "resources.hpp"
+
+// Skinned meshes whose BLAS follows the animation. A compute pass skins the
+// rest pose into a device local position buffer every frame and the BLAS,
+// built with eAllowUpdate, is refit in place from it. A refit keeps the tree
+// of the last full build, so as the pose drifts away from that build the
+// node bounds grow and traversal slows down; RefitTracker decides when a
+// full rebuild pays off again.
+namespace deformable {
+    constexpr uint32_t kMaxInfluences = 4;
+    // Instance custom index of deformable instances, hit_common.glsl gives
+    // them no interpolated normals
+    constexpr uint32_t kInstanceCustomIndex = instances::kDeformable;
+    // Triangles per cluster of the refit quality estimate
+    constexpr uint32_t kClusterSize = 32;
+
+    // Rest pose vertex, std430 layout of SkinVertex in skinning.comp
+    struct SkinVertex {
+        float position[3];
+        uint32_t joints;  // kMaxInfluences joint indices, 8 bits each
+        float weights[kMaxInfluences];
+    };
+    static_assert(sizeof(SkinVertex) == 32);
+
+    // Rows of an affine 3x4 matrix, the layout of vk::TransformMatrixKHR
+    struct JointTransform {
+        float rows[3][4];
+    };
+
+    inline JointTransform makeTranslation(float x, float y, float z) {
+        return { { { 1.0f, 0.0f, 0.0f, x }, { 0.0f, 1.0f, 0.0f, y }, { 0.0f, 0.0f, 1.0f, z } } };
+    }
+
+    inline JointTransform makeRotationX(float angle) {
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        return { { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, c, -s, 0.0f }, { 0.0f, s, c, 0.0f } } };
+    }
+
+    inline JointTransform makeRotationZ(float angle) {
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        return { { { c, -s, 0.0f, 0.0f }, { s, c, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } } };
+    }
+
+    inline JointTransform multiply(const JointTransform& a, const JointTransform& b) {
+        JointTransform result{};
+        for (int r = 0; r < 3; r++) {
+            for (int c = 0; c < 4; c++) {
+                result.rows[r][c] = a.rows[r][0] * b.rows[0][c] + a.rows[r][1] * b.rows[1][c] +
+                    a.rows[r][2] * b.rows[2][c] + (c == 3 ? a.rows[r][3] : 0.0f);
+            }
+        }
+        return result;
+    }
+
+    struct Character {
+        std::vector<SkinVertex> vertices;
+        std::vector<uint32_t> indices;
+        // Bind pose joint positions, each joint is the child of the previous one
+        std::vector<std::array<float, 3>> jointOrigins;
+
+        uint32_t vertexCount() const { return static_cast<uint32_t>(vertices.size()); }
+        uint32_t triangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+        uint32_t jointCount() const { return static_cast<uint32_t>(jointOrigins.size()); }
+    };
+
+    // Test character: a closed tube standing on the origin along +y, with a
+    // chain of joints up its axis. Every ring blends the two joints around it.
+    inline Character makeTentacle(uint32_t jointCount = 4, uint32_t rings = 64,
+        uint32_t segments = 24, float length = 2.0f, float radius = 0.15f) {
+        Character character;
+        float spacing = length / jointCount;
+        for (uint32_t j = 0; j < jointCount; j++) {
+            character.jointOrigins.push_back({ 0.0f, j * spacing, 0.0f });
+        }
+
+        auto addVertex = [&](float x, float y, float z) {
+            float segment = std::min(y / spacing, static_cast<float>(jointCount - 1));
+            uint32_t lower = static_cast<uint32_t>(segment);
+            uint32_t upper = std::min(lower + 1, jointCount - 1);
+            float t = segment - lower;
+            SkinVertex vertex{ { x, y, z }, lower | (upper << 8), { 1.0f - t, t, 0.0f, 0.0f } };
+            character.vertices.push_back(vertex);
+        };
+        for (uint32_t ring = 0; ring <= rings; ring++) {
+            float y = length * ring / rings;
+            // Taper towards the tip
+            float ringRadius = radius * (1.0f - 0.7f * ring / rings);
+            for (uint32_t s = 0; s < segments; s++) {
+                float angle = 2.0f * 3.14159265f * s / segments;
+                addVertex(ringRadius * std::cos(angle), y, ringRadius * std::sin(angle));
+            }
+        }
+        uint32_t bottom = character.vertexCount();
+        addVertex(0.0f, 0.0f, 0.0f);
+        uint32_t top = character.vertexCount();
+        addVertex(0.0f, length, 0.0f);
+
+        for (uint32_t ring = 0; ring < rings; ring++) {
+            for (uint32_t s = 0; s < segments; s++) {
+                uint32_t a = ring * segments + s;
+                uint32_t b = ring * segments + (s + 1) % segments;
+                character.indices.insert(character.indices.end(), { a, a + segments, b, b, a + segments, b + segments });
+            }
+        }
+        for (uint32_t s = 0; s < segments; s++) {
+            uint32_t next = (s + 1) % segments;
+            character.indices.insert(character.indices.end(), { bottom, s, next });
+            character.indices.insert(character.indices.end(), { top, rings * segments + next, rings * segments + s });
+        }
+        return character;
+    }
+
+    // Skinning matrices of the animation at time, bind pose to posed space
+    inline std::vector<JointTransform> computeJointTransforms(const Character& character, float time) {
+        std::vector<JointTransform> skinning;
+        JointTransform parent = makeTranslation(0.0f, 0.0f, 0.0f);
+        std::array<float, 3> parentOrigin = { 0.0f, 0.0f, 0.0f };
+        for (uint32_t j = 0; j < character.jointCount(); j++) {
+            const auto& origin = character.jointOrigins[j];
+            // Swing that travels up the chain, large enough to fold the tube
+            float bend = 0.6f * std::sin(1.7f * time - 0.9f * j);
+            float sway = 0.4f * std::sin(1.1f * time + 1.3f * j);
+            JointTransform local = multiply(
+                makeTranslation(origin[0] - parentOrigin[0], origin[1] - parentOrigin[1], origin[2] - parentOrigin[2]),
+                multiply(makeRotationZ(bend), makeRotationX(sway)));
+            JointTransform world = multiply(parent, local);
+            skinning.push_back(multiply(world, makeTranslation(-origin[0], -origin[1], -origin[2])));
+            parent = world;
+            parentOrigin = origin;
+        }
+        return skinning;
+    }
+
+    // CPU mirror of skinning.comp, positions as xyz float triples
+    inline void skin(const Character& character, std::span<const JointTransform> joints,
+        std::vector<float>& positions) {
+        positions.assign(character.vertices.size() * 3, 0.0f);
+        for (size_t i = 0; i < character.vertices.size(); i++) {
+            const SkinVertex& vertex = character.vertices[i];
+            for (uint32_t k = 0; k < kMaxInfluences; k++) {
+                if (vertex.weights[k] == 0.0f) {
+                    continue;
+                }
+                const JointTransform& joint = joints[(vertex.joints >> (8 * k)) & 0xFF];
+                for (int r = 0; r < 3; r++) {
+                    positions[i * 3 + r] += vertex.weights[k] * (joint.rows[r][0] * vertex.position[0] +
+                        joint.rows[r][1] * vertex.position[1] + joint.rows[r][2] * vertex.position[2] + joint.rows[r][3]);
+                }
+            }
+        }
+    }
+
+    // Triangles ordered by the Morton code of their centroids. Consecutive
+    // runs of kClusterSize stand in for the subtrees a builder would make.
+    inline std::vector<uint32_t> clusterTriangles(std::span<const float> positions, std::span<const uint32_t> indices) {
+        uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+        std::vector<std::array<float, 3>> centroids(triangleCount);
+        std::array<float, 3> minBound = { FLT_MAX, FLT_MAX, FLT_MAX };
+        std::array<float, 3> maxBound = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (uint32_t t = 0; t < triangleCount; t++) {
+            for (int c = 0; c < 3; c++) {
+                centroids[t][c] = (positions[indices[t * 3] * 3 + c] + positions[indices[t * 3 + 1] * 3 + c] +
+                    positions[indices[t * 3 + 2] * 3 + c]) / 3.0f;
+                minBound[c] = std::min(minBound[c], centroids[t][c]);
+                maxBound[c] = std::max(maxBound[c], centroids[t][c]);
+            }
+        }
+
+        // Spreads the low 10 bits so that three codes interleave
+        auto expandBits = [](uint32_t v) {
+            v = (v * 0x00010001u) & 0xFF0000FFu;
+            v = (v * 0x00000101u) & 0x0F00F00Fu;
+            v = (v * 0x00000011u) & 0xC30C30C3u;
+            v = (v * 0x00000005u) & 0x49249249u;
+            return v;
+        };
+        std::vector<uint32_t> codes(triangleCount);
+        for (uint32_t t = 0; t < triangleCount; t++) {
+            uint32_t code = 0;
+            for (int c = 0; c < 3; c++) {
+                float extent = maxBound[c] - minBound[c];
+                float unit = extent > 0.0f ? (centroids[t][c] - minBound[c]) / extent : 0.0f;
+                code |= expandBits(static_cast<uint32_t>(std::clamp(unit * 1023.0f, 0.0f, 1023.0f))) << (2 - c);
+            }
+            codes[t] = code;
+        }
+        std::vector<uint32_t> order(triangleCount);
+        std::iota(order.begin(), order.end(), 0u);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return codes[a] < codes[b]; });
+        return order;
+    }
+
+    // Summed surface area of the cluster bounds, the part of the SAH cost
+    // that refitting lets grow
+    inline double getClusterArea(std::span<const float> positions, std::span<const uint32_t> indices,
+        std::span<const uint32_t> order) {
+        double area = 0.0;
+        for (size_t first = 0; first < order.size(); first += kClusterSize) {
+            std::array<float, 3> minBound = { FLT_MAX, FLT_MAX, FLT_MAX };
+            std::array<float, 3> maxBound = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+            for (size_t i = first; i < std::min(first + kClusterSize, order.size()); i++) {
+                for (uint32_t v = 0; v < 3; v++) {
+                    const float* position = &positions[indices[order[i] * 3 + v] * 3];
+                    for (int c = 0; c < 3; c++) {
+                        minBound[c] = std::min(minBound[c], position[c]);
+                        maxBound[c] = std::max(maxBound[c], position[c]);
+                    }
+                }
+            }
+            double dx = maxBound[0] - minBound[0];
+            double dy = maxBound[1] - minBound[1];
+            double dz = maxBound[2] - minBound[2];
+            area += 2.0 * (dx * dy + dy * dz + dz * dx);
+        }
+        return area;
+    }
+
+    struct RefitPolicy {
+        // Full rebuild after this many refits in a row
+        uint32_t maxRefits = 64;
+        // Full rebuild once the refit clusters cover this much more area
+        // than freshly built ones would
+        float maxDegradation = 1.5f;
+        // The area is estimated after every this many refits, the frames
+        // in between refit without skinning or clustering on the CPU
+        uint32_t estimateInterval = 8;
+    };
+
+    // Decides per frame whether the BLAS is refit or rebuilt. The tracker
+    // keeps the clusters of the last rebuild and compares their area in the
+    // current pose against clusters made for that pose. The comparison costs
+    // a skinning and two clusterings on the CPU, so it only runs on the
+    // frames needsPose asks for.
+    class RefitTracker {
+    public:
+        explicit RefitTracker(RefitPolicy policy = {}) : policy(policy) {}
+
+        // Records a full build for the positions
+        void reset(std::span<const float> positions, std::span<const uint32_t> indices) {
+            buildOrder = clusterTriangles(positions, indices);
+            refits = 0;
+            degradation = 1.0f;
+            rebuilds++;
+        }
+
+        // True when the next decision needs the current pose: before the
+        // first build, when maxRefits forces a rebuild and every
+        // estimateInterval refits
+        bool needsPose() const {
+            return buildOrder.empty() || refits >= policy.maxRefits ||
+                (refits + 1) % std::max(policy.estimateInterval, 1u) == 0;
+        }
+
+        // Decision of a frame without the pose, when needsPose is false: a refit
+        void skipEstimate() {
+            refits++;
+        }
+
+        // True when the positions should get a full build, which is then recorded
+        bool needsRebuild(std::span<const float> positions, std::span<const uint32_t> indices) {
+            if (buildOrder.empty()) {
+                reset(positions, indices);
+                return true;
+            }
+            std::vector<uint32_t> freshOrder = clusterTriangles(positions, indices);
+            double freshArea = getClusterArea(positions, indices, freshOrder);
+            double refitArea = getClusterArea(positions, indices, buildOrder);
+            // Morton clusters only approximate a builder and can come out
+            // worse than the refit ones, which still means no gain
+            degradation = freshArea > 0.0 ? std::max(1.0f, static_cast<float>(refitArea / freshArea)) : 1.0f;
+            if (refits >= policy.maxRefits || degradation > policy.maxDegradation) {
+                buildOrder = std::move(freshOrder);
+                refits = 0;
+                rebuilds++;
+                return true;
+            }
+            refits++;
+            return false;
+        }
+
+        uint32_t getRefitCount() const { return refits; }
+        uint32_t getRebuildCount() const { return rebuilds; }
+        // Area of the refit clusters over that of fresh ones, at the last decision
+        float getDegradation() const { return degradation; }
+        const RefitPolicy& getPolicy() const { return policy; }
+
+    private:
+        RefitPolicy policy;
+        std::vector<uint32_t> buildOrder;
+        uint32_t refits = 0;
+        uint32_t rebuilds = 0;
+        float degradation = 1.0f;
+    };
+
+    // Push constants of skinning.comp
+    struct SkinParams {
+        uint32_t vertexCount;
+        uint32_t jointOffset;  // first joint row of the frame's slot
+    };
+
+    // GPU side of one character: rest pose, per frame joint slots, skinned
+    // positions and the updatable BLAS built from them
+    class DeformableMesh {
+    public:
+        void init(vk::PhysicalDevice physicalDevice, vk::Device device,
+            vk::CommandPool commandPool, vk::Queue queue,
+            const std::string& shaderPath, Character source, RefitPolicy policy, uint32_t frameCount,
+            vk::BuildAccelerationStructureFlagsKHR buildFlags =
+            vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace) {
+            character = std::move(source);
+            tracker = RefitTracker(policy);
+            jointSlotSize = sizeof(JointTransform) * character.jointCount();
+
+            vk::MemoryPropertyFlags hostMemory =
+                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+            restBuffer.init(physicalDevice, device, sizeof(SkinVertex) * character.vertexCount(),
+                vk::BufferUsageFlagBits::eStorageBuffer, hostMemory, character.vertices.data());
+            jointBuffer.init(physicalDevice, device, jointSlotSize * frameCount,
+                vk::BufferUsageFlagBits::eStorageBuffer, hostMemory);
+            jointData = static_cast<uint8_t*>(device.mapMemory(*jointBuffer.memory, 0, VK_WHOLE_SIZE));
+            indexBuffer.init(physicalDevice, device, sizeof(uint32_t) * character.indices.size(),
+                vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                hostMemory, character.indices.data());
+            positionBuffer.init(physicalDevice, device, sizeof(float) * 3 * character.vertexCount(),
+                vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+            shader = vkutils::createShaderModule(device, shaderPath);
+            setLayout = vkutils::createStorageBufferSetLayout(device, 3);
+            vk::DescriptorPoolSize poolSize{ vk::DescriptorType::eStorageBuffer, 3 };
+            vk::DescriptorPoolCreateInfo poolInfo{};
+            poolInfo.setPoolSizes(poolSize);
+            poolInfo.setMaxSets(1);
+            descPool = device.createDescriptorPoolUnique(poolInfo);
+            descSet = device.allocateDescriptorSets({ *descPool, *setLayout }).front();
+            vkutils::updateStorageBufferDescriptors(device, descSet,
+                { *restBuffer.buffer, *jointBuffer.buffer, *positionBuffer.buffer });
+
+            vk::PushConstantRange pushRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(SkinParams) };
+            vk::PipelineLayoutCreateInfo layoutInfo{};
+            layoutInfo.setSetLayouts(*setLayout);
+            layoutInfo.setPushConstantRanges(pushRange);
+            pipelineLayout = device.createPipelineLayoutUnique(layoutInfo);
+            pipeline = vkutils::createComputePipeline(device, *shader, *pipelineLayout);
+
+            // The BLAS is first built from the bind pose of the animation
+            update(0, 0.0f);
+            vkutils::oneTimeSubmit(device, commandPool, queue, [&](vk::CommandBuffer commandBuffer) {
+                recordSkinning(commandBuffer, 0);
+                vk::MemoryBarrier barrier{};
+                barrier.setSrcAccessMask(vk::AccessFlagBits::eShaderWrite);
+                barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+                commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                    vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, barrier, {}, {});
+            });
+            setBuildFlags(physicalDevice, device, commandPool, queue, buildFlags);
+        }
+
+        // Rebuilds the BLAS from the last skinned pose with other flags. The
+        // structure moves, so instances must be rebuilt with getInstance.
+        void setBuildFlags(vk::PhysicalDevice physicalDevice, vk::Device device,
+            vk::CommandPool commandPool, vk::Queue queue, vk::BuildAccelerationStructureFlagsKHR buildFlags) {
+            accel.init(physicalDevice, device, commandPool, queue,
+                vk::AccelerationStructureTypeKHR::eBottomLevel, getGeometry(), character.triangleCount(),
+                vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate | buildFlags);
+        }
+
+        // Host side of a frame: poses the joints of slot frameIndex and
+        // decides between refit and rebuild for that pose. The pose is only
+        // skinned on the CPU when the tracker estimates the refit quality.
+        void update(uint32_t frameIndex, float time) {
+            std::vector<JointTransform> joints = computeJointTransforms(character, time);
+            std::memcpy(jointData + frameIndex * jointSlotSize, joints.data(), jointSlotSize);
+            if (!tracker.needsPose()) {
+                tracker.skipEstimate();
+                rebuild = false;
+                return;
+            }
+            skin(character, joints, positions);
+            rebuild = tracker.needsRebuild(positions, character.indices);
+        }
+
+        void recordSkinning(vk::CommandBuffer commandBuffer, uint32_t frameIndex) const {
+            SkinParams params{ character.vertexCount(),
+                static_cast<uint32_t>(frameIndex * character.jointCount() * 3) };
+            commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+            commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout, 0, descSet, nullptr);
+            commandBuffer.pushConstants(*pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(params), &params);
+            commandBuffer.dispatch((character.vertexCount() + 63) / 64, 1, 1);
+        }
+
+        // Refit or rebuild, as decided by the last update
+        void recordBuild(vk::CommandBuffer commandBuffer) const {
+            accel.record(commandBuffer, getGeometry(), character.triangleCount(), !rebuild);
+        }
+
+        vk::AccelerationStructureInstanceKHR getInstance(const vk::TransformMatrixKHR& transform) const {
+            vk::AccelerationStructureInstanceKHR instance{};
+            instance.setTransform(transform);
+            instance.setInstanceCustomIndex(kInstanceCustomIndex);
+            instance.setMask(0xFF);
+            instance.setInstanceShaderBindingTableRecordOffset(0);
+            instance.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+            instance.setAccelerationStructureReference(accel.buffer.address);
+            return instance;
+        }
+
+        bool isRebuild() const { return rebuild; }
+        const RefitTracker& getTracker() const { return tracker; }
+        const Character& getCharacter() const { return character; }
+        vk::Buffer getPositionBuffer() const { return *positionBuffer.buffer; }
+        vk::DeviceSize getAccelSize() const { return accel.size; }
+
+    private:
+        Character character;
+        RefitTracker tracker;
+        std::vector<float> positions;  // CPU skinned pose of the last estimate
+        bool rebuild = false;
+
+        Buffer restBuffer{};
+        Buffer jointBuffer{};         // one slot of joint transforms per frame in flight
+        uint8_t* jointData = nullptr;
+        vk::DeviceSize jointSlotSize = 0;
+        Buffer indexBuffer{};
+        Buffer positionBuffer{};      // skinned positions, xyz float
+        AccelStruct accel{};
+
+        vk::UniqueShaderModule shader;
+        vk::UniqueDescriptorSetLayout setLayout;
+        vk::UniqueDescriptorPool descPool;
+        vk::DescriptorSet descSet;
+        vk::UniquePipelineLayout pipelineLayout;
+        vk::UniquePipeline pipeline;
+
+        vk::AccelerationStructureGeometryKHR getGeometry() const {
+            vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+            triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+            triangles.setVertexData(positionBuffer.address);
+            triangles.setVertexStride(sizeof(float) * 3);
+            triangles.setMaxVertex(character.vertexCount());
+            triangles.setIndexType(vk::IndexType::eUint32);
+            triangles.setIndexData(indexBuffer.address);
+
+            vk::AccelerationStructureGeometryKHR geometry{};
+            geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+            geometry.setGeometry({ triangles });
+            geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+            return geometry;
+        }
+    };
+}  // namespace deformable
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "geometry.hpp"
+
+// CPU reference of the SVGF-style denoiser in svgf_temporal.comp and
+// svgf_atrous.comp. It follows the shaders operation by operation and
+// rounds every intermediate image to half precision like the RGBA16F
+// targets, so its output can be compared with a GPU readback.
+namespace denoiser {
+    struct Params {
+        uint32_t iterations = 5;
+        float sigmaDepth = 0.1f;       // world units per filter step
+        float sigmaNormal = 128.0f;    // exponent of the normal weight
+        float sigmaLuminance = 4.0f;   // in standard deviations
+        float minAlpha = 0.2f;         // temporal blend factor floor
+        float maxHistoryLength = 32.0f;
+    };
+
+    // Push constant blocks of the shaders
+    struct TemporalPushConstants {
+        float minAlpha;
+        float maxHistoryLength;
+        uint32_t reset;
+        uint32_t padding;
+    };
+
+    struct AtrousPushConstants {
+        int32_t stepSize;
+        float sigmaDepth;
+        float sigmaNormal;
+        float sigmaLuminance;
+    };
+
+    using Pixel = std::array<float, 4>;
+
+    struct Frame {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<Pixel> color;                 // noisy radiance
+        std::vector<Pixel> normalDepth;           // xyz normal, w hit distance (0: miss)
+        std::vector<std::array<float, 2>> motion; // uv offset to the previous frame
+    };
+
+    inline float luminance(const Pixel& c) {
+        return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+    }
+
+    inline float roundToHalf(float value) {
+        return geometry::halfToFloat(geometry::floatToHalf(value));
+    }
+
+    inline Pixel roundToHalf(const Pixel& p) {
+        return { roundToHalf(p[0]), roundToHalf(p[1]), roundToHalf(p[2]), roundToHalf(p[3]) };
+    }
+
+    // Runs body(y) for every row on all hardware threads
+    inline void parallelRows(uint32_t height, const std::function<void(uint32_t)>& body) {
+        uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < threadCount; t++) {
+            threads.emplace_back([&, t]() {
+                for (uint32_t y = t; y < height; y += threadCount) {
+                    body(y);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    class Reference {
+    public:
+        explicit Reference(Params params = {}) : params(params) {}
+
+        void reset() {
+            historyColor.clear();
+            historyMoments.clear();
+            historyNormalDepth.clear();
+        }
+
+        std::vector<Pixel> denoise(const Frame& frame) {
+            bool reset = historyColor.size() != frame.color.size();
+            if (reset) {
+                historyColor.assign(frame.color.size(), Pixel{});
+                historyMoments.assign(frame.color.size(), Pixel{});
+                historyNormalDepth.assign(frame.color.size(), Pixel{});
+            }
+
+            std::vector<Pixel> ping(frame.color.size());
+            std::vector<Pixel> pong(frame.color.size());
+            std::vector<Pixel> moments(frame.color.size());
+            temporal(frame, reset, ping, moments);
+            historyNormalDepth = frame.normalDepth;
+            historyMoments = moments;
+
+            for (uint32_t i = 0; i < params.iterations; i++) {
+                atrous(frame, 1 << i, ping, pong);
+                if (i == 0) {
+                    // Like SVGF, the first filtered image feeds the next frame
+                    historyColor = pong;
+                }
+                std::swap(ping, pong);
+            }
+            return ping;
+        }
+
+    private:
+        Params params;
+        std::vector<Pixel> historyColor;
+        std::vector<Pixel> historyMoments;
+        std::vector<Pixel> historyNormalDepth;
+
+        void temporal(const Frame& frame, bool reset,
+            std::vector<Pixel>& outColor, std::vector<Pixel>& outMoments) const {
+            uint32_t width = frame.width;
+            uint32_t height = frame.height;
+            parallelRows(height, [&](uint32_t y) {
+                for (uint32_t x = 0; x < width; x++) {
+                    size_t i = static_cast<size_t>(y) * width + x;
+                    const Pixel& color = frame.color[i];
+                    const Pixel& nd = frame.normalDepth[i];
+                    float lum = luminance(color);
+
+                    // Nearest history sample at the reprojected position
+                    bool valid = false;
+                    size_t p = 0;
+                    if (!reset && nd[3] > 0.0f) {
+                        float prevU = (x + 0.5f) / width + frame.motion[i][0];
+                        float prevV = (y + 0.5f) / height + frame.motion[i][1];
+                        int px = static_cast<int>(std::floor(prevU * width));
+                        int py = static_cast<int>(std::floor(prevV * height));
+                        if (px >= 0 && py >= 0 && px < static_cast<int>(width) && py < static_cast<int>(height)) {
+                            p = static_cast<size_t>(py) * width + px;
+                            const Pixel& prevNd = historyNormalDepth[p];
+                            float cosine = nd[0] * prevNd[0] + nd[1] * prevNd[1] + nd[2] * prevNd[2];
+                            valid = std::abs(prevNd[3] - nd[3]) <= 0.1f * nd[3] &&
+                                cosine >= 0.9f && historyMoments[p][2] > 0.0f;
+                        }
+                    }
+
+                    Pixel result;
+                    Pixel moments;
+                    if (valid) {
+                        float length = std::min(historyMoments[p][2] + 1.0f, params.maxHistoryLength);
+                        float alpha = std::max(1.0f / length, params.minAlpha);
+                        for (int c = 0; c < 3; c++) {
+                            result[c] = historyColor[p][c] + (color[c] - historyColor[p][c]) * alpha;
+                        }
+                        moments[0] = historyMoments[p][0] + (lum - historyMoments[p][0]) * alpha;
+                        moments[1] = historyMoments[p][1] + (lum * lum - historyMoments[p][1]) * alpha;
+                        moments[2] = length;
+                    }
+                    else {
+                        result = color;
+                        moments = { lum, lum * lum, 1.0f, 0.0f };
+                    }
+                    moments[3] = 0.0f;
+                    // Too little history for a temporal estimate, assume high variance
+                    result[3] = moments[2] < 4.0f ? 1.0f : std::max(0.0f, moments[1] - moments[0] * moments[0]);
+
+                    outColor[i] = roundToHalf(result);
+                    outMoments[i] = roundToHalf(moments);
+                }
+            });
+        }
+
+        void atrous(const Frame& frame, int stepSize,
+            const std::vector<Pixel>& src, std::vector<Pixel>& dst) const {
+            static constexpr float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+            int width = static_cast<int>(frame.width);
+            int height = static_cast<int>(frame.height);
+            parallelRows(frame.height, [&](uint32_t row) {
+                int y = static_cast<int>(row);
+                for (int x = 0; x < width; x++) {
+                    size_t i = static_cast<size_t>(y) * width + x;
+                    const Pixel& center = src[i];
+                    const Pixel& nd = frame.normalDepth[i];
+                    float lumCenter = luminance(center);
+                    float lumScale = params.sigmaLuminance * std::sqrt(std::max(center[3], 0.0f)) + 1e-4f;
+                    float depthScale = params.sigmaDepth * stepSize + 1e-4f;
+
+                    float sum[3] = { 0.0f, 0.0f, 0.0f };
+                    float variance = 0.0f;
+                    float weightSum = 0.0f;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        for (int dx = -2; dx <= 2; dx++) {
+                            int qx = x + dx * stepSize;
+                            int qy = y + dy * stepSize;
+                            if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                                continue;
+                            }
+                            size_t q = static_cast<size_t>(qy) * width + qx;
+                            const Pixel& sample = src[q];
+                            float w = kernel[dx + 2] * kernel[dy + 2];
+                            if (dx != 0 || dy != 0) {
+                                const Pixel& qnd = frame.normalDepth[q];
+                                float cosine = nd[0] * qnd[0] + nd[1] * qnd[1] + nd[2] * qnd[2];
+                                if (cosine <= 0.0f) {
+                                    continue;
+                                }
+                                // Normal, depth and luminance edge-stopping weights in one exp
+                                float exponent = params.sigmaNormal * std::log(cosine) -
+                                    std::abs(nd[3] - qnd[3]) / depthScale -
+                                    std::abs(lumCenter - luminance(sample)) / lumScale;
+                                w *= std::exp(exponent);
+                            }
+                            for (int c = 0; c < 3; c++) {
+                                sum[c] += w * sample[c];
+                            }
+                            variance += w * w * sample[3];
+                            weightSum += w;
+                        }
+                    }
+
+                    Pixel result = {
+                        sum[0] / weightSum, sum[1] / weightSum, sum[2] / weightSum,
+                        variance / (weightSum * weightSum),
+                    };
+                    dst[i] = roundToHalf(result);
+                }
+            });
+        }
+    };
+
+    // Noisy frame of a sphere in front of a wall, for benchmarking without a GPU
+    inline Frame makeTestFrame(uint32_t width, uint32_t height, uint32_t seed) {
+        Frame frame{};
+        frame.width = width;
+        frame.height = height;
+        size_t count = static_cast<size_t>(width) * height;
+        frame.color.resize(count);
+        frame.normalDepth.resize(count);
+        frame.motion.assign(count, { 0.0f, 0.0f });
+
+        uint32_t state = seed * 747796405u + 2891336453u;
+        auto random = [&]() {
+            state = state * 1664525u + 1013904223u;
+            return static_cast<float>(state >> 8) / 16777216.0f;
+        };
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                size_t i = static_cast<size_t>(y) * width + x;
+                float u = (x + 0.5f) / width * 2.0f - 1.0f;
+                float v = (y + 0.5f) / height * 2.0f - 1.0f;
+                float r2 = u * u + v * v;
+                float shade;
+                if (r2 < 0.25f) {
+                    float z = std::sqrt(0.25f - r2) * 2.0f;
+                    frame.normalDepth[i] = { u * 2.0f, v * 2.0f, z, 4.0f - z };
+                    shade = 0.2f + 0.8f * z;
+                }
+                else {
+                    frame.normalDepth[i] = { 0.0f, 0.0f, 1.0f, 6.0f };
+                    shade = 0.3f;
+                }
+                // 1 spp style noise: most samples dark, a few bright
+                float noise = random() < 0.25f ? 4.0f : 0.0f;
+                for (int c = 0; c < 3; c++) {
+                    frame.color[i][c] = shade * noise;
+                }
+                frame.color[i][3] = 1.0f;
+            }
+        }
+        return frame;
+    }
+
+    // Average milliseconds per frame of the CPU reference
+    inline double benchmark(uint32_t width, uint32_t height, uint32_t frameCount) {
+        Reference reference;
+        std::vector<Frame> frames;
+        for (uint32_t i = 0; i < 4; i++) {
+            frames.push_back(makeTestFrame(width, height, i));
+        }
+        reference.denoise(frames[0]);
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < frameCount; i++) {
+            reference.denoise(frames[i % frames.size()]);
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count() / frameCount;
+    }
+
+    struct Comparison {
+        float maxError = 0.0f;
+        float meanError = 0.0f;
+    };
+
+    inline Comparison compare(const std::vector<Pixel>& a, const std::vector<Pixel>& b) {
+        Comparison result{};
+        double sum = 0.0;
+        for (size_t i = 0; i < a.size(); i++) {
+            for (int c = 0; c < 3; c++) {
+                float error = std::abs(a[i][c] - b[i][c]);
+                result.maxError = std::max(result.maxError, error);
+                sum += error;
+            }
+        }
+        if (!a.empty()) {
+            result.meanError = static_cast<float>(sum / (a.size() * 3.0));
+        }
+        return result;
+    }
+}  // namespace denoiser
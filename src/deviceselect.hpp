@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "vkutils.hpp"
+
+// Device probing and selection. Every device is queried for its ray
+// tracing limits, memory and optional extensions, sorted into a feature
+// tier and scored by expected ray throughput. The best device wins, and
+// the optional fast paths are enabled only when the chosen device has them.
+namespace deviceselect {
+    // Each tier includes the ones below
+    enum class Tier {
+        eUnsupported,   // misses a required extension, feature or limit
+        eBaseline,      // ray tracing pipelines and acceleration structures
+        eRayQuery,      // + ray queries and synchronization2
+        eReorder,       // + shader execution reordering or hit position fetch
+    };
+
+    inline const char* toString(Tier tier) {
+        switch (tier) {
+        case Tier::eBaseline: return "baseline";
+        case Tier::eRayQuery: return "ray-query";
+        case Tier::eReorder:  return "reorder";
+        default:              return "unsupported";
+        }
+    }
+
+    struct DeviceCapabilities {
+        vk::PhysicalDevice physicalDevice;
+        uint32_t index = 0;         // in enumeration order
+        std::string name;
+        vk::PhysicalDeviceType type = vk::PhysicalDeviceType::eOther;
+        uint32_t apiVersion = 0;
+        uint32_t driverVersion = 0;
+
+        // Limits the renderer depends on
+        uint32_t maxRayRecursionDepth = 0;
+        uint32_t shaderGroupHandleSize = 0;
+        uint32_t maxRayDispatchInvocationCount = 0;
+        uint64_t maxInstanceCount = 0;
+        uint64_t maxPrimitiveCount = 0;
+        uint32_t subgroupSize = 0;
+        vk::DeviceSize deviceLocalBytes = 0;
+        // Device local memory the host can map directly (resizable BAR)
+        vk::DeviceSize hostVisibleDeviceLocalBytes = 0;
+
+        bool presentation = false;
+        bool requiredExtensions = false;
+        bool requiredFeatures = false;
+
+        // Optional extensions with their features
+        bool memoryBudget = false;
+        bool synchronization2 = false;
+        bool rayQuery = false;
+        bool positionFetch = false;
+        bool invocationReorder = false;
+        // Optional feature of the required ray tracing pipeline extension
+        bool traceRaysIndirect = false;
+
+        Tier tier = Tier::eUnsupported;
+        double score = 0.0;
+        std::string rejection;      // why the device is unsupported
+    };
+
+    // Recursion depth of the trace pipelines
+    constexpr uint32_t kRequiredRecursionDepth = 1;
+
+    inline bool hasExtension(const std::vector<vk::ExtensionProperties>& extensions, const char* name) {
+        for (const auto& extension : extensions) {
+            if (strcmp(extension.extensionName, name) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline DeviceCapabilities probe(vk::PhysicalDevice physicalDevice, uint32_t index,
+        vk::SurfaceKHR surface, const std::vector<const char*>& requiredExtensions) {
+        DeviceCapabilities caps{};
+        caps.physicalDevice = physicalDevice;
+        caps.index = index;
+
+        vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+        caps.name = properties.deviceName.data();
+        caps.type = properties.deviceType;
+        caps.apiVersion = properties.apiVersion;
+        caps.driverVersion = properties.driverVersion;
+
+        auto extensions = physicalDevice.enumerateDeviceExtensionProperties();
+        caps.requiredExtensions = vkutils::checkDeviceExtensionSupport(physicalDevice, requiredExtensions);
+        if (!caps.requiredExtensions) {
+            caps.rejection = "missing required extensions";
+            return caps;
+        }
+        if (surface) {
+            caps.presentation = !physicalDevice.getSurfaceFormatsKHR(surface).empty() &&
+                !physicalDevice.getSurfacePresentModesKHR(surface).empty();
+            if (!caps.presentation) {
+                caps.rejection = "cannot present to the window";
+                return caps;
+            }
+        }
+
+        // Feature structs of extensions the device lacks must not be chained
+        bool hasRayQuery = hasExtension(extensions, VK_KHR_RAY_QUERY_EXTENSION_NAME);
+        bool hasSynchronization2 = hasExtension(extensions, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+        caps.memoryBudget = hasExtension(extensions, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+        vk::PhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingFeatures{};
+        vk::PhysicalDeviceAccelerationStructureFeaturesKHR accelFeatures{};
+        vk::PhysicalDeviceBufferDeviceAddressFeatures addressFeatures{};
+        vk::PhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{};
+        vk::PhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+        vk::PhysicalDeviceFeatures2 features{};
+        rayTracingFeatures.setPNext(&accelFeatures);
+        accelFeatures.setPNext(&addressFeatures);
+        features.setPNext(&rayTracingFeatures);
+        auto chain = [&](auto& next) {
+            next.setPNext(features.pNext);
+            features.setPNext(&next);
+        };
+        if (hasRayQuery) {
+            chain(rayQueryFeatures);
+        }
+        if (hasSynchronization2) {
+            chain(synchronization2Features);
+        }
+#ifdef VK_KHR_ray_tracing_position_fetch
+        vk::PhysicalDeviceRayTracingPositionFetchFeaturesKHR positionFetchFeatures{};
+        if (hasExtension(extensions, VK_KHR_RAY_TRACING_POSITION_FETCH_EXTENSION_NAME)) {
+            chain(positionFetchFeatures);
+        }
+#endif
+#ifdef VK_NV_ray_tracing_invocation_reorder
+        vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV reorderFeatures{};
+        vk::PhysicalDeviceRayTracingInvocationReorderPropertiesNV reorderProperties{};
+        if (hasExtension(extensions, VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME)) {
+            chain(reorderFeatures);
+        }
+#endif
+        physicalDevice.getFeatures2(&features);
+
+        caps.requiredFeatures = rayTracingFeatures.rayTracingPipeline &&
+            accelFeatures.accelerationStructure && addressFeatures.bufferDeviceAddress;
+        caps.traceRaysIndirect = rayTracingFeatures.rayTracingPipelineTraceRaysIndirect;
+        caps.rayQuery = hasRayQuery && rayQueryFeatures.rayQuery;
+        caps.synchronization2 = hasSynchronization2 && synchronization2Features.synchronization2;
+#ifdef VK_KHR_ray_tracing_position_fetch
+        caps.positionFetch = positionFetchFeatures.rayTracingPositionFetch;
+#endif
+
+        vk::PhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingProperties{};
+        vk::PhysicalDeviceAccelerationStructurePropertiesKHR accelProperties{};
+        vk::PhysicalDeviceSubgroupProperties subgroupProperties{};
+        vk::PhysicalDeviceProperties2 properties2{};
+        properties2.setPNext(&rayTracingProperties);
+        rayTracingProperties.setPNext(&accelProperties);
+        accelProperties.setPNext(&subgroupProperties);
+#ifdef VK_NV_ray_tracing_invocation_reorder
+        if (reorderFeatures.rayTracingInvocationReorder) {
+            subgroupProperties.setPNext(&reorderProperties);
+        }
+#endif
+        physicalDevice.getProperties2(&properties2);
+#ifdef VK_NV_ray_tracing_invocation_reorder
+        // Drivers may accept the calls but not reorder anything
+        caps.invocationReorder = reorderFeatures.rayTracingInvocationReorder &&
+            reorderProperties.rayTracingInvocationReorderReorderingHint ==
+            vk::RayTracingInvocationReorderModeNV::eReorder;
+#endif
+        caps.maxRayRecursionDepth = rayTracingProperties.maxRayRecursionDepth;
+        caps.shaderGroupHandleSize = rayTracingProperties.shaderGroupHandleSize;
+        caps.maxRayDispatchInvocationCount = rayTracingProperties.maxRayDispatchInvocationCount;
+        caps.maxInstanceCount = accelProperties.maxInstanceCount;
+        caps.maxPrimitiveCount = accelProperties.maxPrimitiveCount;
+        caps.subgroupSize = subgroupProperties.subgroupSize;
+
+        auto memoryProperties = physicalDevice.getMemoryProperties();
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+            if (memoryProperties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+                caps.deviceLocalBytes += memoryProperties.memoryHeaps[i].size;
+            }
+        }
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+            const auto& memoryType = memoryProperties.memoryTypes[i];
+            vk::MemoryPropertyFlags flags = vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible;
+            if ((memoryType.propertyFlags & flags) == flags) {
+                caps.hostVisibleDeviceLocalBytes = std::max(caps.hostVisibleDeviceLocalBytes,
+                    memoryProperties.memoryHeaps[memoryType.heapIndex].size);
+            }
+        }
+
+        if (!caps.requiredFeatures) {
+            caps.rejection = "ray tracing features not supported";
+        }
+        else if (caps.maxRayRecursionDepth < kRequiredRecursionDepth) {
+            caps.rejection = "maxRayRecursionDepth too low";
+        }
+        else if (caps.rayQuery && caps.synchronization2 && (caps.invocationReorder || caps.positionFetch)) {
+            caps.tier = Tier::eReorder;
+        }
+        else if (caps.rayQuery && caps.synchronization2) {
+            caps.tier = Tier::eRayQuery;
+        }
+        else {
+            caps.tier = Tier::eBaseline;
+        }
+        return caps;
+    }
+
+    // Expected ray throughput, relative. The device type dominates, memory
+    // breaks ties between devices of a type and the tier adds a little for
+    // the fast paths it unlocks.
+    inline double score(const DeviceCapabilities& caps) {
+        if (caps.tier == Tier::eUnsupported) {
+            return 0.0;
+        }
+        double typeWeight = 1.0;
+        switch (caps.type) {
+        case vk::PhysicalDeviceType::eDiscreteGpu:   typeWeight = 100.0; break;
+        case vk::PhysicalDeviceType::eIntegratedGpu: typeWeight = 20.0; break;
+        case vk::PhysicalDeviceType::eVirtualGpu:    typeWeight = 10.0; break;
+        case vk::PhysicalDeviceType::eCpu:           typeWeight = 1.0; break;
+        default:                                     typeWeight = 5.0; break;
+        }
+        double memoryGB = static_cast<double>(caps.deviceLocalBytes) / (1024.0 * 1024.0 * 1024.0);
+        double memoryWeight = 1.0 + std::log2(1.0 + memoryGB) * 0.1;
+        double tierWeight = 1.0 + 0.05 * static_cast<int>(caps.tier);
+        return typeWeight * memoryWeight * tierWeight;
+    }
+
+    inline void printCapabilities(const DeviceCapabilities& caps, bool chosen) {
+        std::cout << (chosen ? " * " : "   ") << "[" << caps.index << "] " << caps.name
+            << " (" << vk::to_string(caps.type) << "), Vulkan "
+            << VK_API_VERSION_MAJOR(caps.apiVersion) << "." << VK_API_VERSION_MINOR(caps.apiVersion)
+            << "." << VK_API_VERSION_PATCH(caps.apiVersion) << ", driver " << caps.driverVersion << "\n";
+        if (caps.tier == Tier::eUnsupported) {
+            std::cout << "       unsupported: " << caps.rejection << "\n";
+            return;
+        }
+        std::cout << "       tier " << toString(caps.tier) << ", score " << std::fixed << std::setprecision(1)
+            << caps.score << std::defaultfloat << ", " << caps.deviceLocalBytes / (1024 * 1024) << " MB local ("
+            << caps.hostVisibleDeviceLocalBytes / (1024 * 1024) << " MB host visible), subgroup "
+            << caps.subgroupSize << "\n";
+        std::cout << "       recursion " << caps.maxRayRecursionDepth << ", handle " << caps.shaderGroupHandleSize
+            << " B, max instances " << caps.maxInstanceCount << ", max primitives " << caps.maxPrimitiveCount << "\n";
+        std::cout << "       ray query " << caps.rayQuery << ", sync2 " << caps.synchronization2
+            << ", memory budget " << caps.memoryBudget << ", position fetch " << caps.positionFetch
+            << ", reorder " << caps.invocationReorder << ", indirect trace " << caps.traceRaysIndirect << "\n";
+    }
+
+    // Probes every device and returns the best one, or the one at
+    // forcedIndex when it is usable. Aborts when no device qualifies.
+    inline DeviceCapabilities selectDevice(vk::Instance instance, vk::SurfaceKHR surface,
+        const std::vector<const char*>& requiredExtensions, int forcedIndex = -1) {
+        std::vector<DeviceCapabilities> devices;
+        auto physicalDevices = instance.enumeratePhysicalDevices();
+        for (uint32_t i = 0; i < physicalDevices.size(); i++) {
+            devices.push_back(probe(physicalDevices[i], i, surface, requiredExtensions));
+            devices.back().score = score(devices.back());
+        }
+
+        int best = -1;
+        for (int i = 0; i < static_cast<int>(devices.size()); i++) {
+            if (devices[i].tier != Tier::eUnsupported && (best < 0 || devices[i].score > devices[best].score)) {
+                best = i;
+            }
+        }
+        if (forcedIndex >= 0) {
+            if (forcedIndex < static_cast<int>(devices.size()) && devices[forcedIndex].tier != Tier::eUnsupported) {
+                best = forcedIndex;
+            }
+            else {
+                std::cerr << "Device " << forcedIndex << " is not usable, picking the best device\n";
+            }
+        }
+
+        std::cout << "Devices:\n";
+        for (int i = 0; i < static_cast<int>(devices.size()); i++) {
+            printCapabilities(devices[i], i == best);
+        }
+        if (best < 0) {
+            std::cerr << "Failed to find physical device.\n";
+            std::abort();
+        }
+        std::cout << "Device tier: " << toString(devices[best].tier) << " (" << devices[best].name << ")\n";
+        return devices[best];
+    }
+}  // namespace deviceselect
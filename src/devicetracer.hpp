@@ -0,0 +1,312 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "resources.hpp"
+#include "splitframe.hpp"
+
+// Split-frame worker on one Vulkan device. Each worker owns a logical
+// device with a replica of the scene BLAS and TLAS and traces its tiles
+// with tile_trace.comp. Per-tile times come from timestamp queries, the
+// tiles are serialized by barriers so that their times do not overlap.
+namespace devicetracer {
+    inline std::vector<const char*> getDeviceExtensions() {
+        return {
+            VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+            VK_KHR_RAY_QUERY_EXTENSION_NAME,
+            VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+            VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
+        };
+    }
+
+    // Layout of the View block of tile_trace.comp
+    struct ViewUniforms {
+        glm::mat4 viewInverse;
+        glm::mat4 projectionInverse;
+        glm::vec4 position;
+    };
+
+    struct TilePushConstants {
+        uint32_t offset[2];
+        uint32_t size[2];
+        uint32_t imageSize[2];
+    };
+
+    class DeviceWorker : public splitframe::Worker {
+    public:
+        DeviceWorker(vk::PhysicalDevice physicalDevice, const geometry::Mesh& mesh,
+            uint32_t imageWidth, uint32_t imageHeight, const std::filesystem::path& shaderDirectory,
+            uint32_t maxTileCount)
+            : physicalDevice(physicalDevice), imageWidth(imageWidth), imageHeight(imageHeight) {
+            vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+            name = properties.deviceName.data();
+            timestampPeriod = properties.limits.timestampPeriod;
+
+            queueFamilyIndex = vkutils::findComputeQueueFamily(physicalDevice);
+            timestampsSupported = physicalDevice.getQueueFamilyProperties()[queueFamilyIndex].timestampValidBits > 0;
+            device = vkutils::createRayQueryDevice(physicalDevice, queueFamilyIndex, getDeviceExtensions());
+            queue = device->getQueue(queueFamilyIndex, 0);
+            commandPool = vkutils::createCommandPool(*device, queueFamilyIndex);
+            commandBuffer = vkutils::createCommandBuffer(*device, *commandPool);
+            fence = device->createFenceUnique({});
+
+            createAccelerationStructures(mesh);
+            createBuffers();
+            createPipeline(shaderDirectory);
+
+            vk::QueryPoolCreateInfo queryPoolInfo{};
+            queryPoolInfo.setQueryType(vk::QueryType::eTimestamp);
+            queryPoolInfo.setQueryCount(maxTileCount + 1);
+            queryPool = device->createQueryPoolUnique(queryPoolInfo);
+        }
+
+        std::string getName() const override { return name; }
+
+        std::vector<double> render(const cputracer::View& view,
+            const std::vector<splitframe::Tile>& tiles, splitframe::Image& image) override {
+            std::vector<double> tileMs(tiles.size(), 0.0);
+            if (tiles.empty()) {
+                return tileMs;
+            }
+            ViewUniforms uniforms{ view.viewInverse, view.projectionInverse, glm::vec4(view.position, 1.0f) };
+            memcpy(viewData, &uniforms, sizeof(uniforms));
+
+            // Timestamp i + 1 is written when tile i has finished
+            uint32_t queryCount = static_cast<uint32_t>(tiles.size()) + 1;
+            commandBuffer->begin(vk::CommandBufferBeginInfo{ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+            commandBuffer->resetQueryPool(*queryPool, 0, queryCount);
+            commandBuffer->bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+            commandBuffer->bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout, 0, *descriptorSet, nullptr);
+            commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *queryPool, 0);
+            for (uint32_t i = 0; i < tiles.size(); i++) {
+                const splitframe::Tile& tile = tiles[i];
+                TilePushConstants pushConstants{
+                    { tile.x, tile.y }, { tile.width, tile.height }, { imageWidth, imageHeight },
+                };
+                commandBuffer->pushConstants(*pipelineLayout, vk::ShaderStageFlagBits::eCompute,
+                    0, sizeof(TilePushConstants), &pushConstants);
+                if (i > 0) {
+                    // Tiles write disjoint pixels, the barrier only keeps
+                    // the next one from starting early
+                    commandBuffer->pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                        vk::PipelineStageFlagBits::eComputeShader, {}, nullptr, nullptr, nullptr);
+                }
+                commandBuffer->dispatch((tile.width + 7) / 8, (tile.height + 7) / 8, 1);
+                commandBuffer->writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *queryPool, i + 1);
+            }
+            vk::MemoryBarrier barrier{ vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eHostRead };
+            commandBuffer->pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eHost, {}, barrier, nullptr, nullptr);
+            commandBuffer->end();
+
+            auto start = std::chrono::steady_clock::now();
+            device->resetFences(*fence);
+            vk::SubmitInfo submitInfo{};
+            submitInfo.setCommandBuffers(*commandBuffer);
+            queue.submit(submitInfo, *fence);
+            if (device->waitForFences(*fence, true, std::numeric_limits<uint64_t>::max()) != vk::Result::eSuccess) {
+                std::cerr << "Failed to wait for fence.\n";
+                std::abort();
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            std::vector<uint64_t> timestamps(queryCount);
+            vk::Result result = vk::Result::eNotReady;
+            if (timestampsSupported) {
+                result = device->getQueryPoolResults(*queryPool, 0, queryCount,
+                    timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+                    vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+            }
+            if (result == vk::Result::eSuccess) {
+                for (size_t i = 0; i < tiles.size(); i++) {
+                    tileMs[i] = (timestamps[i + 1] - timestamps[i]) * timestampPeriod * 1e-6;
+                }
+            }
+            else {
+                // Without timestamps, share the submission time out by pixels
+                double ms = std::chrono::duration<double, std::milli>(end - start).count();
+                uint64_t pixelCount = 0;
+                for (const auto& tile : tiles) {
+                    pixelCount += tile.getPixelCount();
+                }
+                for (size_t i = 0; i < tiles.size(); i++) {
+                    tileMs[i] = ms * tiles[i].getPixelCount() / pixelCount;
+                }
+            }
+
+            // The whole image buffer is host visible, copy the rows of our tiles
+            std::vector<float> rgba;
+            for (const auto& tile : tiles) {
+                rgba.resize(tile.getPixelCount() * 4);
+                for (uint32_t row = 0; row < tile.height; row++) {
+                    const float* src = pixelData + (static_cast<size_t>(tile.y + row) * imageWidth + tile.x) * 4;
+                    std::copy(src, src + tile.width * 4, rgba.data() + static_cast<size_t>(row) * tile.width * 4);
+                }
+                image.composite(tile, rgba.data());
+            }
+            return tileMs;
+        }
+
+    private:
+        vk::PhysicalDevice physicalDevice;
+        std::string name;
+        uint32_t imageWidth;
+        uint32_t imageHeight;
+        float timestampPeriod = 1.0f;
+        bool timestampsSupported = false;
+
+        vk::UniqueDevice device;
+        uint32_t queueFamilyIndex = 0;
+        vk::Queue queue;
+        vk::UniqueCommandPool commandPool;
+        vk::UniqueCommandBuffer commandBuffer;
+        vk::UniqueFence fence;
+        vk::UniqueQueryPool queryPool;
+
+        Buffer vertexBuffer;
+        Buffer indexBuffer;
+        Buffer instanceBuffer;
+        AccelStruct bottomAccel;
+        AccelStruct topAccel;
+
+        Buffer viewBuffer;
+        Buffer pixelBuffer;
+        void* viewData = nullptr;
+        const float* pixelData = nullptr;
+
+        vk::UniqueShaderModule shaderModule;
+        vk::UniqueDescriptorSetLayout descriptorSetLayout;
+        vk::UniqueDescriptorPool descriptorPool;
+        vk::UniqueDescriptorSet descriptorSet;
+        vk::UniquePipelineLayout pipelineLayout;
+        vk::UniquePipeline pipeline;
+
+        // Each device gets its own copy of the scene
+        void createAccelerationStructures(const geometry::Mesh& mesh) {
+            vk::BufferUsageFlags inputUsage =
+                vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+                vk::BufferUsageFlagBits::eShaderDeviceAddress;
+            vk::MemoryPropertyFlags hostMemory =
+                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+            vertexBuffer.init(physicalDevice, *device, mesh.positions.size() * sizeof(float),
+                inputUsage, hostMemory, mesh.positions.data());
+            indexBuffer.init(physicalDevice, *device, mesh.indices.size() * sizeof(uint32_t),
+                inputUsage, hostMemory, mesh.indices.data());
+
+            vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+            triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+            triangles.setVertexData(vertexBuffer.address);
+            triangles.setVertexStride(sizeof(float) * 3);
+            triangles.setMaxVertex(mesh.vertexCount());
+            triangles.setIndexType(vk::IndexType::eUint32);
+            triangles.setIndexData(indexBuffer.address);
+
+            vk::AccelerationStructureGeometryKHR geometry{};
+            geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+            geometry.setGeometry({ triangles });
+            geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+            bottomAccel.init(physicalDevice, *device, *commandPool, queue,
+                vk::AccelerationStructureTypeKHR::eBottomLevel,
+                geometry, mesh.triangleCount());
+
+            vk::TransformMatrixKHR transform = std::array{
+                std::array{1.0f, 0.0f, 0.0f, 0.0f},
+                std::array{0.0f, 1.0f, 0.0f, 0.0f},
+                std::array{0.0f, 0.0f, 1.0f, 0.0f},
+            };
+            vk::AccelerationStructureInstanceKHR accelInstance{};
+            accelInstance.setTransform(transform);
+            accelInstance.setMask(0xFF);
+            accelInstance.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+            accelInstance.setAccelerationStructureReference(bottomAccel.buffer.address);
+            instanceBuffer.init(physicalDevice, *device, sizeof(accelInstance),
+                inputUsage, hostMemory, &accelInstance);
+
+            vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
+            instancesData.setArrayOfPointers(false);
+            instancesData.setData(instanceBuffer.address);
+
+            vk::AccelerationStructureGeometryKHR instanceGeometry{};
+            instanceGeometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+            instanceGeometry.setGeometry({ instancesData });
+            instanceGeometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+            topAccel.init(physicalDevice, *device, *commandPool, queue,
+                vk::AccelerationStructureTypeKHR::eTopLevel,
+                instanceGeometry, 1);
+        }
+
+        void createBuffers() {
+            vk::MemoryPropertyFlags hostMemory =
+                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+            viewBuffer.init(physicalDevice, *device, sizeof(ViewUniforms),
+                vk::BufferUsageFlagBits::eUniformBuffer, hostMemory);
+            viewData = device->mapMemory(*viewBuffer.memory, 0, sizeof(ViewUniforms));
+
+            vk::DeviceSize pixelSize = static_cast<vk::DeviceSize>(imageWidth) * imageHeight * 4 * sizeof(float);
+            pixelBuffer.init(physicalDevice, *device, pixelSize,
+                vk::BufferUsageFlagBits::eStorageBuffer, hostMemory);
+            pixelData = static_cast<const float*>(device->mapMemory(*pixelBuffer.memory, 0, pixelSize));
+        }
+
+        void createPipeline(const std::filesystem::path& shaderDirectory) {
+            std::vector<vk::DescriptorSetLayoutBinding> bindings = {
+                { 0, vk::DescriptorType::eAccelerationStructureKHR, 1, vk::ShaderStageFlagBits::eCompute },
+                { 1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eCompute },
+                { 2, vk::DescriptorType::eUniformBuffer, 1, vk::ShaderStageFlagBits::eCompute },
+            };
+            vk::DescriptorSetLayoutCreateInfo layoutInfo{};
+            layoutInfo.setBindings(bindings);
+            descriptorSetLayout = device->createDescriptorSetLayoutUnique(layoutInfo);
+
+            vk::PushConstantRange pushRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(TilePushConstants) };
+            vk::PipelineLayoutCreateInfo pipelineLayoutInfo{};
+            pipelineLayoutInfo.setSetLayouts(*descriptorSetLayout);
+            pipelineLayoutInfo.setPushConstantRanges(pushRange);
+            pipelineLayout = device->createPipelineLayoutUnique(pipelineLayoutInfo);
+
+            shaderModule = vkutils::createShaderModule(*device, (shaderDirectory / "tile_trace.comp.spv").string());
+            pipeline = vkutils::createComputePipeline(*device, *shaderModule, *pipelineLayout);
+
+            std::vector<vk::DescriptorPoolSize> poolSizes = {
+                { vk::DescriptorType::eAccelerationStructureKHR, 1 },
+                { vk::DescriptorType::eStorageBuffer, 1 },
+                { vk::DescriptorType::eUniformBuffer, 1 },
+            };
+            vk::DescriptorPoolCreateInfo poolInfo{};
+            poolInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+            poolInfo.setMaxSets(1);
+            poolInfo.setPoolSizes(poolSizes);
+            descriptorPool = device->createDescriptorPoolUnique(poolInfo);
+
+            vk::DescriptorSetAllocateInfo allocateInfo{};
+            allocateInfo.setDescriptorPool(*descriptorPool);
+            allocateInfo.setSetLayouts(*descriptorSetLayout);
+            descriptorSet = std::move(device->allocateDescriptorSetsUnique(allocateInfo).front());
+
+            vk::WriteDescriptorSetAccelerationStructureKHR accelInfo{};
+            accelInfo.setAccelerationStructures(*topAccel.accel);
+            vk::DescriptorBufferInfo pixelInfo{ *pixelBuffer.buffer, 0, VK_WHOLE_SIZE };
+            vk::DescriptorBufferInfo viewInfo{ *viewBuffer.buffer, 0, sizeof(ViewUniforms) };
+
+            std::array<vk::WriteDescriptorSet, 3> writes{};
+            writes[0].setDstSet(*descriptorSet);
+            writes[0].setDstBinding(0);
+            writes[0].setDescriptorCount(1);
+            writes[0].setDescriptorType(vk::DescriptorType::eAccelerationStructureKHR);
+            writes[0].setPNext(&accelInfo);
+            writes[1].setDstSet(*descriptorSet);
+            writes[1].setDstBinding(1);
+            writes[1].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+            writes[1].setBufferInfo(pixelInfo);
+            writes[2].setDstSet(*descriptorSet);
+            writes[2].setDstBinding(2);
+            writes[2].setDescriptorType(vk::DescriptorType::eUniformBuffer);
+            writes[2].setBufferInfo(viewInfo);
+            device->updateDescriptorSets(writes, nullptr);
+        }
+    };
+}  // namespace devicetracer
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <span>
+#include <vector>
+
+#include "instances.hpp"
+
+// Alpha-tested foliage: leaf cards textured with an alpha mask. Any-hit
+// shaders that test the mask are expensive, so a pre-pass classifies every
+// triangle against the mask. Fully transparent triangles are dropped,
+// fully opaque ones go into an opaque geometry that never runs any-hit and
+// only the mixed rest is alpha tested.
+namespace foliage {
+    // Mirrors kAlphaCutoff in alpha_common.glsl
+    constexpr float kAlphaCutoff = 0.5f;
+    // Instance custom index of foliage, see hit_common.glsl
+    constexpr uint32_t kInstanceCustomIndex = instances::kFoliage;
+
+    // Square 8 bit alpha mask, sampled with wrapping and nearest filtering
+    struct AlphaMask {
+        uint32_t size = 0;
+        std::vector<uint8_t> texels;
+
+        float fetch(int32_t x, int32_t y) const {
+            int32_t s = static_cast<int32_t>(size);
+            x = ((x % s) + s) % s;
+            y = ((y % s) + s) % s;
+            return texels[static_cast<size_t>(y) * size + x] / 255.0f;
+        }
+
+        // Same texel as alphaTest in alpha_common.glsl
+        float sample(float u, float v) const {
+            float fu = u - std::floor(u);
+            float fv = v - std::floor(v);
+            uint32_t x = std::min(static_cast<uint32_t>(fu * size), size - 1);
+            uint32_t y = std::min(static_cast<uint32_t>(fv * size), size - 1);
+            return fetch(static_cast<int32_t>(x), static_cast<int32_t>(y));
+        }
+    };
+
+    // A leaf filling the middle of the card, with a gap along its midrib
+    inline AlphaMask makeLeafMask(uint32_t size = 64) {
+        AlphaMask mask;
+        mask.size = size;
+        mask.texels.resize(static_cast<size_t>(size) * size);
+        for (uint32_t y = 0; y < size; y++) {
+            for (uint32_t x = 0; x < size; x++) {
+                float u = (x + 0.5f) / size * 2.0f - 1.0f;
+                float v = (y + 0.5f) / size;
+                float halfWidth = 0.9f * std::sin(3.14159265f * v);
+                bool leaf = std::abs(u) < halfWidth && std::abs(u) > 0.04f;
+                mask.texels[static_cast<size_t>(y) * size + x] = leaf ? 255 : 0;
+            }
+        }
+        return mask;
+    }
+
+    struct Mesh {
+        std::vector<float> positions;  // xyz
+        std::vector<float> uvs;        // uv per vertex
+        std::vector<uint32_t> indices;
+
+        uint32_t triangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+    };
+
+    // A bush of leaf cards scattered around the origin, every card split
+    // into a grid of cells so the classification has something to sort
+    inline Mesh makeBush(uint32_t cardCount = 48, uint32_t cells = 8, float radius = 0.8f, float cardSize = 0.5f) {
+        Mesh mesh;
+        auto random = [state = 0x9E3779B9u]() mutable {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state & 0xFFFFFF) / static_cast<float>(0x1000000);
+        };
+        for (uint32_t card = 0; card < cardCount; card++) {
+            std::array<float, 3> center = {
+                (random() * 2.0f - 1.0f) * radius, (random() * 2.0f - 1.0f) * radius, (random() * 2.0f - 1.0f) * radius * 0.5f };
+            float yaw = random() * 6.2831853f;
+            float pitch = (random() - 0.5f) * 1.5f;
+            // Card axes: u across the leaf, v along it
+            std::array<float, 3> axisU = { std::cos(yaw), 0.0f, std::sin(yaw) };
+            std::array<float, 3> axisV = {
+                -std::sin(yaw) * std::sin(pitch), std::cos(pitch), std::cos(yaw) * std::sin(pitch) };
+
+            uint32_t first = static_cast<uint32_t>(mesh.positions.size() / 3);
+            for (uint32_t y = 0; y <= cells; y++) {
+                for (uint32_t x = 0; x <= cells; x++) {
+                    float u = static_cast<float>(x) / cells;
+                    float v = static_cast<float>(y) / cells;
+                    for (int c = 0; c < 3; c++) {
+                        mesh.positions.push_back(center[c] + (u - 0.5f) * cardSize * axisU[c] + (v - 0.5f) * cardSize * axisV[c]);
+                    }
+                    mesh.uvs.push_back(u);
+                    mesh.uvs.push_back(v);
+                }
+            }
+            for (uint32_t y = 0; y < cells; y++) {
+                for (uint32_t x = 0; x < cells; x++) {
+                    uint32_t a = first + y * (cells + 1) + x;
+                    uint32_t b = a + cells + 1;
+                    mesh.indices.insert(mesh.indices.end(), { a, a + 1, b, a + 1, b + 1, b });
+                }
+            }
+        }
+        return mesh;
+    }
+
+    enum class Opacity {
+        eOpaque,
+        eTransparent,
+        eMixed,
+    };
+
+    // Conservative class of one triangle: every texel whose square overlaps
+    // its UV footprint is tested, found by separating axes. Texels the
+    // bounds of the footprint reach are only skipped when one triangle
+    // edge has all four texel corners outside.
+    inline Opacity classifyTriangle(const AlphaMask& mask, const std::array<std::array<float, 2>, 3>& uv) {
+        bool anyOpaque = false;
+        bool anyTransparent = false;
+
+        // Texel space, texel (x, y) covers [x, x + 1) x [y, y + 1)
+        float size = static_cast<float>(mask.size);
+        std::array<std::array<float, 2>, 3> p;
+        for (uint32_t k = 0; k < 3; k++) {
+            p[k] = { uv[k][0] * size, uv[k][1] * size };
+        }
+        float minU = std::min({ p[0][0], p[1][0], p[2][0] });
+        float maxU = std::max({ p[0][0], p[1][0], p[2][0] });
+        float minV = std::min({ p[0][1], p[1][1], p[2][1] });
+        float maxV = std::max({ p[0][1], p[1][1], p[2][1] });
+        auto edge = [](const std::array<float, 2>& a, const std::array<float, 2>& b, float x, float y) {
+            return (b[0] - a[0]) * (y - a[1]) - (b[1] - a[1]) * (x - a[0]);
+        };
+        // Positive inside, a degenerate triangle keeps the segment between
+        // its opposite edges
+        float orientation = edge(p[0], p[1], p[2][0], p[2][1]) >= 0.0f ? 1.0f : -1.0f;
+        auto overlaps = [&](float x, float y) {
+            for (uint32_t k = 0; k < 3; k++) {
+                const auto& a = p[k];
+                const auto& b = p[(k + 1) % 3];
+                float inside = std::max({
+                    orientation * edge(a, b, x, y), orientation * edge(a, b, x + 1.0f, y),
+                    orientation * edge(a, b, x, y + 1.0f), orientation * edge(a, b, x + 1.0f, y + 1.0f) });
+                if (inside < 0.0f) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        for (int32_t y = static_cast<int32_t>(std::floor(minV)); y <= static_cast<int32_t>(std::floor(maxV)); y++) {
+            for (int32_t x = static_cast<int32_t>(std::floor(minU)); x <= static_cast<int32_t>(std::floor(maxU)); x++) {
+                if (!overlaps(static_cast<float>(x), static_cast<float>(y))) {
+                    continue;
+                }
+                (mask.fetch(x, y) >= kAlphaCutoff ? anyOpaque : anyTransparent) = true;
+                if (anyOpaque && anyTransparent) {
+                    return Opacity::eMixed;
+                }
+            }
+        }
+        return anyOpaque ? Opacity::eOpaque : Opacity::eTransparent;
+    }
+
+    // The mesh split for a BLAS with an opaque and an alpha-tested geometry
+    struct ClassifiedMesh {
+        std::vector<uint32_t> opaqueIndices;
+        std::vector<uint32_t> mixedIndices;
+        // Corner UVs of every mixed triangle, the any-hit shader indexes
+        // them by primitive index
+        std::vector<float> mixedUVs;
+        uint32_t opaqueCount = 0;
+        uint32_t transparentCount = 0;
+        uint32_t mixedCount = 0;
+
+        void print(std::ostream& os) const {
+            uint32_t total = opaqueCount + transparentCount + mixedCount;
+            auto percent = [&](uint32_t count) { return total ? 100.0 * count / total : 0.0; };
+            os << "Opacity classes of " << total << " triangles: "
+                << opaqueCount << " opaque (" << percent(opaqueCount) << "%), "
+                << transparentCount << " transparent, culled (" << percent(transparentCount) << "%), "
+                << mixedCount << " alpha tested (" << percent(mixedCount) << "%)\n";
+        }
+    };
+
+    inline ClassifiedMesh classify(const Mesh& mesh, const AlphaMask& mask) {
+        ClassifiedMesh result;
+        for (uint32_t t = 0; t < mesh.triangleCount(); t++) {
+            std::array<std::array<float, 2>, 3> uv;
+            for (uint32_t k = 0; k < 3; k++) {
+                uint32_t index = mesh.indices[t * 3 + k];
+                uv[k] = { mesh.uvs[index * 2], mesh.uvs[index * 2 + 1] };
+            }
+            std::span<const uint32_t> triangle(&mesh.indices[t * 3], 3);
+            switch (classifyTriangle(mask, uv)) {
+            case Opacity::eOpaque:
+                result.opaqueIndices.insert(result.opaqueIndices.end(), triangle.begin(), triangle.end());
+                result.opaqueCount++;
+                break;
+            case Opacity::eTransparent:
+                result.transparentCount++;
+                break;
+            case Opacity::eMixed:
+                result.mixedIndices.insert(result.mixedIndices.end(), triangle.begin(), triangle.end());
+                for (const auto& corner : uv) {
+                    result.mixedUVs.insert(result.mixedUVs.end(), corner.begin(), corner.end());
+                }
+                result.mixedCount++;
+                break;
+            }
+        }
+        return result;
+    }
+}  // namespace foliage
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <span>
+#include <vector>
+
+namespace geometry {
+    // Position encodings usable as acceleration structure vertex formats.
+    // eSnorm16 and eFloat16 both store 4 components (w unused) because the
+    // 3 component 16 bit formats are not required AS vertex formats.
+    enum class PositionEncoding {
+        eFloat32,
+        eFloat16,
+        eSnorm16,
+    };
+
+    inline const char* toString(PositionEncoding encoding) {
+        switch (encoding) {
+        case PositionEncoding::eFloat32: return "R32G32B32_SFLOAT";
+        case PositionEncoding::eFloat16: return "R16G16B16A16_SFLOAT";
+        case PositionEncoding::eSnorm16: return "R16G16B16A16_SNORM";
+        }
+        return "unknown";
+    }
+
+    inline uint16_t floatToHalf(float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        uint32_t sign = (bits >> 16) & 0x8000u;
+        int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFFu) - 127 + 15;
+        uint32_t mantissa = bits & 0x007FFFFFu;
+
+        if (exponent <= 0) {
+            // Denormal or zero
+            if (exponent < -10) {
+                return static_cast<uint16_t>(sign);
+            }
+            mantissa |= 0x00800000u;
+            uint32_t shift = static_cast<uint32_t>(14 - exponent);
+            uint32_t half = mantissa >> shift;
+            // Round to nearest
+            if ((mantissa >> (shift - 1)) & 1u) {
+                half += 1;
+            }
+            return static_cast<uint16_t>(sign | half);
+        }
+        if (exponent >= 31) {
+            // Overflow, Inf or NaN
+            uint32_t nan = (((bits >> 23) & 0xFFu) == 0xFFu && mantissa) ? 0x200u : 0u;
+            return static_cast<uint16_t>(sign | 0x7C00u | nan);
+        }
+        uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+        if (mantissa & 0x00001000u) {
+            half += 1;
+        }
+        return static_cast<uint16_t>(half);
+    }
+
+    inline float halfToFloat(uint16_t half) {
+        uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+        uint32_t exponent = (half >> 10) & 0x1Fu;
+        uint32_t mantissa = half & 0x03FFu;
+        uint32_t bits;
+        if (exponent == 0) {
+            if (mantissa == 0) {
+                bits = sign;
+            }
+            else {
+                // Normalize the denormal
+                exponent = 127 - 15 + 1;
+                while ((mantissa & 0x0400u) == 0) {
+                    mantissa <<= 1;
+                    exponent--;
+                }
+                mantissa &= 0x03FFu;
+                bits = sign | (exponent << 23) | (mantissa << 13);
+            }
+        }
+        else if (exponent == 31) {
+            bits = sign | 0x7F800000u | (mantissa << 13);
+        }
+        else {
+            bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+        }
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    inline int16_t floatToSnorm16(float value) {
+        value = std::clamp(value, -1.0f, 1.0f);
+        return static_cast<int16_t>(std::lround(value * 32767.0f));
+    }
+
+    inline float snorm16ToFloat(int16_t value) {
+        return std::max(static_cast<float>(value) / 32767.0f, -1.0f);
+    }
+
+    // Octahedral normal encoding packed as two snorm16 in a uint32
+    inline uint32_t encodeOctahedral(std::array<float, 3> n) {
+        float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+        if (l1 == 0.0f) {
+            return 0;
+        }
+        float x = n[0] / l1;
+        float y = n[1] / l1;
+        if (n[2] < 0.0f) {
+            float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        uint16_t ex = static_cast<uint16_t>(floatToSnorm16(x));
+        uint16_t ey = static_cast<uint16_t>(floatToSnorm16(y));
+        return static_cast<uint32_t>(ex) | (static_cast<uint32_t>(ey) << 16);
+    }
+
+    inline std::array<float, 3> decodeOctahedral(uint32_t packed) {
+        float x = snorm16ToFloat(static_cast<int16_t>(packed & 0xFFFFu));
+        float y = snorm16ToFloat(static_cast<int16_t>(packed >> 16));
+        float z = 1.0f - std::abs(x) - std::abs(y);
+        if (z < 0.0f) {
+            float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        float length = std::sqrt(x * x + y * y + z * z);
+        return { x / length, y / length, z / length };
+    }
+
+    // Indexed triangle mesh, positions are tightly packed xyz
+    struct Mesh {
+        std::vector<float> positions;
+        std::vector<uint32_t> indices;
+
+        uint32_t vertexCount() const { return static_cast<uint32_t>(positions.size() / 3); }
+        uint32_t triangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+    };
+
+    inline void computeBounds(std::span<const float> positions,
+        std::array<float, 3>& minBound,
+        std::array<float, 3>& maxBound) {
+        minBound = { FLT_MAX, FLT_MAX, FLT_MAX };
+        maxBound = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+        for (size_t i = 0; i + 2 < positions.size(); i += 3) {
+            for (uint32_t c = 0; c < 3; c++) {
+                minBound[c] = std::min(minBound[c], positions[i + c]);
+                maxBound[c] = std::max(maxBound[c], positions[i + c]);
+            }
+        }
+    }
+
+    inline Mesh makeUvSphere(std::array<float, 3> center, float radius,
+        uint32_t segments, uint32_t rings) {
+        Mesh mesh{};
+        for (uint32_t r = 0; r <= rings; r++) {
+            float theta = 3.14159265f * static_cast<float>(r) / static_cast<float>(rings);
+            for (uint32_t s = 0; s <= segments; s++) {
+                float phi = 2.0f * 3.14159265f * static_cast<float>(s) / static_cast<float>(segments);
+                mesh.positions.push_back(center[0] + radius * std::sin(theta) * std::cos(phi));
+                mesh.positions.push_back(center[1] + radius * std::cos(theta));
+                mesh.positions.push_back(center[2] + radius * std::sin(theta) * std::sin(phi));
+            }
+        }
+        for (uint32_t r = 0; r < rings; r++) {
+            for (uint32_t s = 0; s < segments; s++) {
+                uint32_t i0 = r * (segments + 1) + s;
+                uint32_t i1 = i0 + segments + 1;
+                mesh.indices.insert(mesh.indices.end(), { i0, i1, i0 + 1 });
+                mesh.indices.insert(mesh.indices.end(), { i0 + 1, i1, i1 + 1 });
+            }
+        }
+        return mesh;
+    }
+
+    // Area weighted vertex normals, positions are tightly packed xyz
+    inline std::vector<std::array<float, 3>> computeVertexNormals(
+        std::span<const float> positions,
+        std::span<const uint32_t> indices) {
+        size_t vertexCount = positions.size() / 3;
+        std::vector<std::array<float, 3>> normals(vertexCount, { 0.0f, 0.0f, 0.0f });
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            const float* p0 = &positions[indices[i + 0] * 3];
+            const float* p1 = &positions[indices[i + 1] * 3];
+            const float* p2 = &positions[indices[i + 2] * 3];
+            float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+            float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+            float n[3] = {
+                e1[1] * e2[2] - e1[2] * e2[1],
+                e1[2] * e2[0] - e1[0] * e2[2],
+                e1[0] * e2[1] - e1[1] * e2[0],
+            };
+            for (uint32_t c = 0; c < 3; c++) {
+                auto& dst = normals[indices[i + c]];
+                dst[0] += n[0];
+                dst[1] += n[1];
+                dst[2] += n[2];
+            }
+        }
+        for (auto& n : normals) {
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length > 0.0f) {
+                n = { n[0] / length, n[1] / length, n[2] / length };
+            }
+            else {
+                n = { 0.0f, 0.0f, 1.0f };
+            }
+        }
+        return normals;
+    }
+
+    // Geometry sizes against the baseline layout, which had no normals.
+    // The normal buffer is an addition and reported on its own.
+    struct CompressionReport {
+        size_t originalBytes = 0;
+        size_t compressedBytes = 0;
+        size_t normalBytes = 0;
+        float maxPositionError = 0.0f;
+        float rmsPositionError = 0.0f;
+        float maxNormalErrorDegrees = 0.0f;
+
+        float savedRatio() const {
+            if (originalBytes == 0) {
+                return 0.0f;
+            }
+            return 1.0f - static_cast<float>(compressedBytes) / static_cast<float>(originalBytes);
+        }
+
+        void print(std::ostream& os) const {
+            os << "Geometry compression: " << originalBytes << " -> " << compressedBytes
+               << " bytes (" << savedRatio() * 100.0f << "% saved), plus "
+               << normalBytes << " bytes of normals\n";
+            os << "  position error max: " << maxPositionError
+               << ", rms: " << rmsPositionError << "\n";
+            os << "  normal error max: " << maxNormalErrorDegrees << " deg\n";
+        }
+    };
+
+    // Compressed geometry ready for upload. Quantized positions are stored
+    // relative to the mesh bounds, the decode transform
+    // (p = q * decodeScale + decodeOffset) has to be applied through the
+    // instance transform of the TLAS.
+    struct CompressedMesh {
+        PositionEncoding positionEncoding = PositionEncoding::eFloat32;
+        std::vector<uint8_t> positions;
+        uint32_t positionStride = 0;
+        uint32_t vertexCount = 0;
+
+        bool use16BitIndices = false;
+        std::vector<uint8_t> indices;
+        uint32_t indexCount = 0;
+
+        std::vector<uint32_t> normals;
+
+        std::array<float, 3> decodeScale = { 1.0f, 1.0f, 1.0f };
+        std::array<float, 3> decodeOffset = { 0.0f, 0.0f, 0.0f };
+
+        CompressionReport report;
+
+        std::array<float, 3> decodePosition(uint32_t index) const {
+            std::array<float, 3> p{};
+            const uint8_t* src = positions.data() + static_cast<size_t>(index) * positionStride;
+            for (uint32_t c = 0; c < 3; c++) {
+                switch (positionEncoding) {
+                case PositionEncoding::eFloat32: {
+                    std::memcpy(&p[c], src + c * sizeof(float), sizeof(float));
+                    break;
+                }
+                case PositionEncoding::eFloat16: {
+                    uint16_t h;
+                    std::memcpy(&h, src + c * sizeof(uint16_t), sizeof(uint16_t));
+                    p[c] = halfToFloat(h);
+                    break;
+                }
+                case PositionEncoding::eSnorm16: {
+                    int16_t s;
+                    std::memcpy(&s, src + c * sizeof(int16_t), sizeof(int16_t));
+                    p[c] = snorm16ToFloat(s);
+                    break;
+                }
+                }
+                p[c] = p[c] * decodeScale[c] + decodeOffset[c];
+            }
+            return p;
+        }
+    };
+
+    inline CompressedMesh compressMesh(std::span<const float> positions,
+        std::span<const uint32_t> indices,
+        PositionEncoding encoding) {
+        CompressedMesh mesh{};
+        mesh.positionEncoding = encoding;
+        mesh.vertexCount = static_cast<uint32_t>(positions.size() / 3);
+        mesh.indexCount = static_cast<uint32_t>(indices.size());
+
+        // Bounds for quantization
+        std::array<float, 3> minBound;
+        std::array<float, 3> maxBound;
+        computeBounds(positions, minBound, maxBound);
+        if (encoding != PositionEncoding::eFloat32 && mesh.vertexCount > 0) {
+            for (uint32_t c = 0; c < 3; c++) {
+                mesh.decodeOffset[c] = (minBound[c] + maxBound[c]) * 0.5f;
+                mesh.decodeScale[c] = std::max((maxBound[c] - minBound[c]) * 0.5f, 1e-6f);
+            }
+        }
+
+        // Positions
+        mesh.positionStride = encoding == PositionEncoding::eFloat32
+            ? 3 * sizeof(float) : 4 * sizeof(uint16_t);
+        mesh.positions.resize(static_cast<size_t>(mesh.vertexCount) * mesh.positionStride);
+        for (uint32_t v = 0; v < mesh.vertexCount; v++) {
+            uint8_t* dst = mesh.positions.data() + static_cast<size_t>(v) * mesh.positionStride;
+            uint16_t packed[4] = { 0, 0, 0, 0 };
+            for (uint32_t c = 0; c < 3; c++) {
+                float p = positions[v * 3 + c];
+                float q = (p - mesh.decodeOffset[c]) / mesh.decodeScale[c];
+                switch (encoding) {
+                case PositionEncoding::eFloat32:
+                    std::memcpy(dst + c * sizeof(float), &p, sizeof(float));
+                    break;
+                case PositionEncoding::eFloat16:
+                    packed[c] = floatToHalf(q);
+                    break;
+                case PositionEncoding::eSnorm16:
+                    packed[c] = static_cast<uint16_t>(floatToSnorm16(q));
+                    break;
+                }
+            }
+            if (encoding != PositionEncoding::eFloat32) {
+                std::memcpy(dst, packed, sizeof(packed));
+            }
+        }
+
+        // Indices, narrowed to 16 bit when every vertex is addressable
+        mesh.use16BitIndices = mesh.vertexCount <= 0x10000u;
+        if (mesh.use16BitIndices) {
+            mesh.indices.resize(indices.size() * sizeof(uint16_t));
+            for (size_t i = 0; i < indices.size(); i++) {
+                uint16_t index = static_cast<uint16_t>(indices[i]);
+                std::memcpy(mesh.indices.data() + i * sizeof(uint16_t), &index, sizeof(uint16_t));
+            }
+        }
+        else {
+            mesh.indices.resize(indices.size() * sizeof(uint32_t));
+            std::memcpy(mesh.indices.data(), indices.data(), mesh.indices.size());
+        }
+
+        // Shading normals
+        auto normals = computeVertexNormals(positions, indices);
+        mesh.normals.resize(normals.size());
+        for (size_t v = 0; v < normals.size(); v++) {
+            mesh.normals[v] = encodeOctahedral(normals[v]);
+        }
+
+        // Round trip error
+        CompressionReport& report = mesh.report;
+        double squaredErrorSum = 0.0;
+        for (uint32_t v = 0; v < mesh.vertexCount; v++) {
+            auto p = mesh.decodePosition(v);
+            for (uint32_t c = 0; c < 3; c++) {
+                float error = std::abs(p[c] - positions[v * 3 + c]);
+                report.maxPositionError = std::max(report.maxPositionError, error);
+                squaredErrorSum += static_cast<double>(error) * error;
+            }
+        }
+        if (mesh.vertexCount > 0) {
+            report.rmsPositionError = static_cast<float>(
+                std::sqrt(squaredErrorSum / (mesh.vertexCount * 3.0)));
+        }
+        for (size_t v = 0; v < normals.size(); v++) {
+            auto n = decodeOctahedral(mesh.normals[v]);
+            float cosine = n[0] * normals[v][0] + n[1] * normals[v][1] + n[2] * normals[v][2];
+            float degrees = std::acos(std::clamp(cosine, -1.0f, 1.0f)) * 57.2957795f;
+            report.maxNormalErrorDegrees = std::max(report.maxNormalErrorDegrees, degrees);
+        }
+
+        // Baseline layout: float3 positions and uint32 indices
+        report.originalBytes = static_cast<size_t>(mesh.vertexCount) * sizeof(float) * 3 +
+            indices.size() * sizeof(uint32_t);
+        report.compressedBytes = mesh.positions.size() + mesh.indices.size();
+        report.normalBytes = mesh.normals.size() * sizeof(uint32_t);
+        return mesh;
+    }
+}  // namespace geometry
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+// Instance custom indices of the TLAS. Mesh pack instances take their mesh
+// index, so the fixed instances live in a reserved range at the top of the
+// 24 bit custom index that no mesh index reaches. Mirrored by
+// shaders/instances.glsl.
+namespace instances {
+    constexpr uint32_t kReservedFirst = 0xFFFF00u;
+    // Static mesh whose normals are bound
+    constexpr uint32_t kStaticMesh = kReservedFirst + 0;
+    constexpr uint32_t kDeformable = kReservedFirst + 1;
+    constexpr uint32_t kFoliage = kReservedFirst + 2;
+    constexpr uint32_t kProcedural = kReservedFirst + 3;
+    constexpr uint32_t kLights = kReservedFirst + 4;
+    constexpr uint32_t kCad = kReservedFirst + 5;
+    // Mesh pack instances are 0 .. kMaxMeshes - 1
+    constexpr uint32_t kMaxMeshes = kReservedFirst;
+}
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "instances.hpp"
+
+// Many-light sampling for next event estimation. Emissive triangles are
+// picked by a stochastic descent of a light BVH whose nodes carry the
+// emitted power of their subtree, the environment by an alias table over
+// its texels. Both are built on the CPU with all cores and read by
+// lighting.glsl.
+namespace lights {
+    // Instance custom index of the emitters, see hit_common.glsl
+    constexpr uint32_t kInstanceCustomIndex = instances::kLights;
+    // LightNode::child of a leaf: the flag and the light index
+    constexpr uint32_t kLeafFlag = 0x80000000u;
+
+    using Vec3 = std::array<float, 3>;
+
+    inline float getLuminance(const Vec3& color) {
+        return 0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+    }
+
+    // An emissive triangle in world space, emitting on both sides. Mirrors
+    // LightTriangle of lighting.glsl.
+    struct Triangle {
+        Vec3 p0;
+        float area = 0.0f;
+        Vec3 p1;
+        float padding0 = 0.0f;
+        Vec3 p2;
+        float padding1 = 0.0f;
+        Vec3 emission;
+        float power = 0.0f;  // luminance times area
+
+        Vec3 getCentroid() const {
+            return { (p0[0] + p1[0] + p2[0]) / 3.0f, (p0[1] + p1[1] + p2[1]) / 3.0f, (p0[2] + p1[2] + p2[2]) / 3.0f };
+        }
+
+        // Fills in area and power from the corners and the emission
+        void finalize() {
+            Vec3 e1 = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+            Vec3 e2 = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+            Vec3 n = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+            area = 0.5f * std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            power = getLuminance(emission) * area;
+        }
+    };
+    static_assert(sizeof(Triangle) == 64);
+
+    // Node of the light BVH in depth-first order: the left child follows
+    // its parent, child is the index of the right one. Mirrors LightNode of
+    // lighting.glsl.
+    struct Node {
+        Vec3 boundsMin;
+        uint32_t child = 0;
+        Vec3 boundsMax;
+        float power = 0.0f;
+
+        bool isLeaf() const { return (child & kLeafFlag) != 0; }
+    };
+    static_assert(sizeof(Node) == 32);
+
+    // Small triangles scattered in a box of half size extent around the
+    // origin. Most are dim, every sixteenth is a bright lamp so importance
+    // sampling has a power difference to exploit.
+    inline std::vector<Triangle> makeTriangles(uint32_t count, float extent = 4.0f, float size = 0.08f) {
+        auto random = [state = 0x1B873593u]() mutable {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state & 0xFFFFFF) / static_cast<float>(0x1000000);
+        };
+        std::vector<Triangle> triangles(count);
+        for (uint32_t i = 0; i < count; i++) {
+            Triangle& triangle = triangles[i];
+            Vec3 center;
+            for (int c = 0; c < 3; c++) {
+                center[c] = (random() * 2.0f - 1.0f) * extent;
+            }
+            for (Vec3* corner : { &triangle.p0, &triangle.p1, &triangle.p2 }) {
+                for (int c = 0; c < 3; c++) {
+                    (*corner)[c] = center[c] + (random() * 2.0f - 1.0f) * size;
+                }
+            }
+            float intensity = i % 16 == 0 ? 400.0f : 20.0f;
+            triangle.emission = { intensity * (0.5f + 0.5f * random()), intensity * (0.5f + 0.5f * random()),
+                intensity * (0.5f + 0.5f * random()) };
+            triangle.finalize();
+        }
+        return triangles;
+    }
+
+    namespace detail {
+        inline Node makeNode(const std::vector<Triangle>& triangles, std::span<const uint32_t> order) {
+            Node node;
+            node.boundsMin = { INFINITY, INFINITY, INFINITY };
+            node.boundsMax = { -INFINITY, -INFINITY, -INFINITY };
+            for (uint32_t index : order) {
+                const Triangle& triangle = triangles[index];
+                for (const Vec3* corner : { &triangle.p0, &triangle.p1, &triangle.p2 }) {
+                    for (int c = 0; c < 3; c++) {
+                        node.boundsMin[c] = std::min(node.boundsMin[c], (*corner)[c]);
+                        node.boundsMax[c] = std::max(node.boundsMax[c], (*corner)[c]);
+                    }
+                }
+                node.power += triangle.power;
+            }
+            return node;
+        }
+
+        // Median split of the centroids along the axis of their largest
+        // extent, returns the size of the left half
+        inline size_t split(const std::vector<Triangle>& triangles, std::span<uint32_t> order) {
+            Vec3 low = { INFINITY, INFINITY, INFINITY };
+            Vec3 high = { -INFINITY, -INFINITY, -INFINITY };
+            for (uint32_t index : order) {
+                Vec3 centroid = triangles[index].getCentroid();
+                for (int c = 0; c < 3; c++) {
+                    low[c] = std::min(low[c], centroid[c]);
+                    high[c] = std::max(high[c], centroid[c]);
+                }
+            }
+            int axis = 0;
+            for (int c = 1; c < 3; c++) {
+                if (high[c] - low[c] > high[axis] - low[axis]) {
+                    axis = c;
+                }
+            }
+            size_t middle = order.size() / 2;
+            std::nth_element(order.begin(), order.begin() + middle, order.end(), [&](uint32_t a, uint32_t b) {
+                return triangles[a].getCentroid()[axis] < triangles[b].getCentroid()[axis];
+            });
+            return middle;
+        }
+
+        // Appends the subtree of the lights in order to nodes
+        inline void buildSubtree(const std::vector<Triangle>& triangles, std::span<uint32_t> order, std::vector<Node>& nodes) {
+            size_t index = nodes.size();
+            nodes.push_back(makeNode(triangles, order));
+            if (order.size() == 1) {
+                nodes[index].child = kLeafFlag | order[0];
+                return;
+            }
+            size_t middle = split(triangles, order);
+            buildSubtree(triangles, order.first(middle), nodes);
+            nodes[index].child = static_cast<uint32_t>(nodes.size());
+            buildSubtree(triangles, order.subspan(middle), nodes);
+        }
+
+        // The top depth levels fork a thread for the left half. Subtrees
+        // are built with local indices and shifted into place when joined.
+        inline std::vector<Node> buildParallel(const std::vector<Triangle>& triangles, std::span<uint32_t> order, uint32_t depth) {
+            constexpr size_t kMinParallelLights = 1024;
+            std::vector<Node> nodes;
+            if (depth == 0 || order.size() < kMinParallelLights) {
+                nodes.reserve(2 * order.size() - 1);
+                buildSubtree(triangles, order, nodes);
+                return nodes;
+            }
+            Node root = makeNode(triangles, order);
+            size_t middle = split(triangles, order);
+            std::vector<Node> left;
+            std::thread thread([&]() { left = buildParallel(triangles, order.first(middle), depth - 1); });
+            std::vector<Node> right = buildParallel(triangles, order.subspan(middle), depth - 1);
+            thread.join();
+
+            nodes.reserve(1 + left.size() + right.size());
+            root.child = static_cast<uint32_t>(1 + left.size());
+            nodes.push_back(root);
+            auto append = [&](const std::vector<Node>& subtree) {
+                uint32_t offset = static_cast<uint32_t>(nodes.size());
+                for (Node node : subtree) {
+                    if (!node.isLeaf()) {
+                        node.child += offset;
+                    }
+                    nodes.push_back(node);
+                }
+            };
+            append(left);
+            append(right);
+            return nodes;
+        }
+
+        // Calls work(begin, end, chunk) for one contiguous range per
+        // thread, returns the number of chunks
+        template <typename Work>
+        uint32_t forEachChunk(size_t count, uint32_t threadCount, Work work) {
+            size_t chunk = std::max<size_t>((count + threadCount - 1) / threadCount, 1);
+            uint32_t chunkCount = static_cast<uint32_t>((count + chunk - 1) / chunk);
+            std::vector<std::thread> threads;
+            for (uint32_t c = 1; c < chunkCount; c++) {
+                threads.emplace_back(work, c * chunk, std::min(count, (c + 1) * chunk), c);
+            }
+            if (chunkCount > 0) {
+                work(size_t{ 0 }, std::min(count, chunk), 0u);
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            return chunkCount;
+        }
+    }  // namespace detail
+
+    inline uint32_t getThreadCount(uint32_t threadCount) {
+        return threadCount != 0 ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Light BVH with one triangle per leaf, the first node is the root.
+    // 0 threads uses all cores.
+    inline std::vector<Node> buildTree(const std::vector<Triangle>& triangles, uint32_t threadCount = 0) {
+        if (triangles.empty()) {
+            return {};
+        }
+        std::vector<uint32_t> order(triangles.size());
+        std::iota(order.begin(), order.end(), 0u);
+        uint32_t depth = 0;
+        while ((1u << depth) < getThreadCount(threadCount)) {
+            depth++;
+        }
+        return detail::buildParallel(triangles, order, depth);
+    }
+
+    // Entry of an alias table: the texel keeps probability of its bucket
+    // and alias gets the rest. pdf is the weight relative to the mean.
+    struct AliasEntry {
+        float probability = 1.0f;
+        uint32_t alias = 0;
+        float pdf = 0.0f;
+    };
+
+    // Alias table for O(1) sampling proportional to weights, built without
+    // the sequential worklist of Vose's method. Buckets have the mean weight
+    // W. Light items (w < W) and heavy items are split apart and prefix
+    // sums give every light item its deficit offset D and every heavy item
+    // its excess offset E. A sweep that fills deficits from excesses in
+    // order hands light item i to the heavy item whose excess range holds
+    // D_i, and heavy item j, once spent, keeps the part of its bucket that
+    // the next heavy item does not cover. Both are found by binary search,
+    // so every step runs in parallel. 0 threads uses all cores.
+    inline std::vector<AliasEntry> buildAliasTable(std::span<const float> weights, uint32_t threadCount = 0) {
+        size_t count = weights.size();
+        std::vector<AliasEntry> table(count);
+        threadCount = getThreadCount(threadCount);
+
+        // Per chunk: weight sum, then the light and heavy partition
+        std::vector<double> chunkSums(threadCount, 0.0);
+        detail::forEachChunk(count, threadCount, [&](size_t begin, size_t end, uint32_t chunk) {
+            double sum = 0.0;
+            for (size_t i = begin; i < end; i++) {
+                sum += weights[i];
+            }
+            chunkSums[chunk] = sum;
+        });
+        double mean = std::accumulate(chunkSums.begin(), chunkSums.end(), 0.0) / std::max<size_t>(count, 1);
+        if (!(mean > 0.0)) {
+            return {};
+        }
+        auto scaled = [&](size_t i) { return weights[i] / mean; };
+
+        struct ChunkSums {
+            size_t lightCount = 0;
+            size_t heavyCount = 0;
+            double deficit = 0.0;
+            double excess = 0.0;
+        };
+        std::vector<ChunkSums> chunks(threadCount);
+        detail::forEachChunk(count, threadCount, [&](size_t begin, size_t end, uint32_t chunk) {
+            ChunkSums& sums = chunks[chunk];
+            for (size_t i = begin; i < end; i++) {
+                double q = scaled(i);
+                if (q < 1.0) {
+                    sums.lightCount++;
+                    sums.deficit += 1.0 - q;
+                }
+                else {
+                    sums.heavyCount++;
+                    sums.excess += q - 1.0;
+                }
+            }
+        });
+        // Exclusive scan over the chunks
+        std::vector<ChunkSums> offsets(threadCount);
+        for (uint32_t c = 1; c < threadCount; c++) {
+            offsets[c].lightCount = offsets[c - 1].lightCount + chunks[c - 1].lightCount;
+            offsets[c].heavyCount = offsets[c - 1].heavyCount + chunks[c - 1].heavyCount;
+            offsets[c].deficit = offsets[c - 1].deficit + chunks[c - 1].deficit;
+            offsets[c].excess = offsets[c - 1].excess + chunks[c - 1].excess;
+        }
+        size_t lightCount = offsets.back().lightCount + chunks.back().lightCount;
+        size_t heavyCount = offsets.back().heavyCount + chunks.back().heavyCount;
+
+        // Stable partition with the offsets of every item, plus the totals
+        std::vector<uint32_t> light(lightCount);
+        std::vector<uint32_t> heavy(heavyCount);
+        std::vector<double> deficits(lightCount + 1);
+        std::vector<double> excesses(heavyCount + 1);
+        deficits[lightCount] = offsets.back().deficit + chunks.back().deficit;
+        excesses[heavyCount] = offsets.back().excess + chunks.back().excess;
+        detail::forEachChunk(count, threadCount, [&](size_t begin, size_t end, uint32_t chunk) {
+            ChunkSums running = offsets[chunk];
+            for (size_t i = begin; i < end; i++) {
+                double q = scaled(i);
+                table[i].pdf = static_cast<float>(q);
+                if (q < 1.0) {
+                    light[running.lightCount] = static_cast<uint32_t>(i);
+                    deficits[running.lightCount++] = running.deficit;
+                    running.deficit += 1.0 - q;
+                }
+                else {
+                    heavy[running.heavyCount] = static_cast<uint32_t>(i);
+                    excesses[running.heavyCount++] = running.excess;
+                    running.excess += q - 1.0;
+                }
+            }
+        });
+        if (heavyCount == 0) {
+            return table;
+        }
+
+        // Light item k: the heavy item whose excess ends at or after D_k
+        detail::forEachChunk(lightCount, threadCount, [&](size_t begin, size_t end, uint32_t) {
+            for (size_t k = begin; k < end; k++) {
+                auto it = std::lower_bound(excesses.begin() + 1, excesses.end(), deficits[k]);
+                size_t j = std::min<size_t>(it - excesses.begin() - 1, heavyCount - 1);
+                AliasEntry& entry = table[light[k]];
+                entry.probability = entry.pdf;
+                entry.alias = heavy[j];
+            }
+        });
+        // Heavy item j: the light item straddling the end of its excess
+        // overdraws it, the next heavy item pays the difference
+        detail::forEachChunk(heavyCount, threadCount, [&](size_t begin, size_t end, uint32_t) {
+            for (size_t j = begin; j < end; j++) {
+                AliasEntry& entry = table[heavy[j]];
+                entry.alias = heavy[j];
+                if (j + 1 == heavyCount) {
+                    continue;
+                }
+                auto it = std::upper_bound(deficits.begin(), deficits.end(), excesses[j + 1]);
+                if (it == deficits.begin() || it == deficits.end()) {
+                    continue;
+                }
+                double overdraw = *it - excesses[j + 1];
+                entry.probability = static_cast<float>(std::clamp(1.0 - overdraw, 0.0, 1.0));
+                entry.alias = heavy[j + 1];
+            }
+        });
+        return table;
+    }
+
+    // Equirectangular radiance map: x is the azimuth, y the polar angle
+    // from +y. Texel directions follow getEnvironmentDirection of
+    // lighting.glsl.
+    struct Environment {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<float> radiance;  // rgb
+
+        Vec3 getRadiance(uint32_t x, uint32_t y) const {
+            size_t i = (static_cast<size_t>(y) * width + x) * 3;
+            return { radiance[i], radiance[i + 1], radiance[i + 2] };
+        }
+        float getSinTheta(uint32_t y) const {
+            return std::sin(3.14159265f * (y + 0.5f) / height);
+        }
+    };
+
+    // A daylight sky: a gradient from the horizon to the zenith, a dark
+    // ground and a small sun thousands of times brighter than the rest,
+    // the case where uniform sampling of the sphere fails
+    inline Environment makeSky(uint32_t width = 512, uint32_t height = 256, Vec3 sun = { 0.4f, 0.6f, 0.3f }) {
+        constexpr float kPi = 3.14159265f;
+        float sunLength = std::sqrt(sun[0] * sun[0] + sun[1] * sun[1] + sun[2] * sun[2]);
+        for (float& c : sun) {
+            c /= sunLength;
+        }
+        const float sunCosine = std::cos(0.03f);
+        Environment environment;
+        environment.width = width;
+        environment.height = height;
+        environment.radiance.resize(static_cast<size_t>(width) * height * 3);
+        for (uint32_t y = 0; y < height; y++) {
+            float theta = kPi * (y + 0.5f) / height;
+            for (uint32_t x = 0; x < width; x++) {
+                float phi = 2.0f * kPi * (x + 0.5f) / width;
+                Vec3 direction = { std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi) };
+                Vec3 color;
+                if (direction[1] < 0.0f) {
+                    color = { 0.05f, 0.04f, 0.03f };
+                }
+                else {
+                    float t = std::sqrt(direction[1]);
+                    color = { 0.9f - 0.6f * t, 0.95f - 0.45f * t, 1.0f - 0.1f * t };
+                }
+                float cosine = direction[0] * sun[0] + direction[1] * sun[1] + direction[2] * sun[2];
+                if (cosine > sunCosine) {
+                    color = { 5000.0f, 4500.0f, 4000.0f };
+                }
+                float* texel = &environment.radiance[(static_cast<size_t>(y) * width + x) * 3];
+                std::copy(color.begin(), color.end(), texel);
+            }
+        }
+        return environment;
+    }
+
+    // Texel of the environment buffer, mirrors EnvironmentTexel of
+    // lighting.glsl
+    struct EnvironmentTexel {
+        Vec3 radiance;
+        float probability;
+        uint32_t alias;
+        float pdf;
+        uint32_t padding[2] = {};
+    };
+    static_assert(sizeof(EnvironmentTexel) == 32);
+
+    // Texels weighted by luminance and the solid angle they cover, empty
+    // if the environment is black
+    inline std::vector<EnvironmentTexel> buildEnvironmentTexels(const Environment& environment, uint32_t threadCount = 0) {
+        size_t count = static_cast<size_t>(environment.width) * environment.height;
+        std::vector<float> weights(count);
+        detail::forEachChunk(count, getThreadCount(threadCount), [&](size_t begin, size_t end, uint32_t) {
+            for (size_t i = begin; i < end; i++) {
+                uint32_t x = static_cast<uint32_t>(i % environment.width);
+                uint32_t y = static_cast<uint32_t>(i / environment.width);
+                weights[i] = getLuminance(environment.getRadiance(x, y)) * environment.getSinTheta(y);
+            }
+        });
+        std::vector<AliasEntry> table = buildAliasTable(weights, threadCount);
+        std::vector<EnvironmentTexel> texels(table.size());
+        for (size_t i = 0; i < table.size(); i++) {
+            uint32_t x = static_cast<uint32_t>(i % environment.width);
+            uint32_t y = static_cast<uint32_t>(i / environment.width);
+            texels[i] = { environment.getRadiance(x, y), table[i].probability, table[i].alias, table[i].pdf };
+        }
+        return texels;
+    }
+}  // namespace lights
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <numeric>
+#include <queue>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "geometry.hpp"
+
+// Level of detail chains. Meshes are simplified offline by edge collapses
+// ordered by quadric error (Garland and Heckbert). A vertex only ever
+// collapses onto one of its neighbors, so every level indexes the vertices
+// of the full mesh and a level costs nothing but its indices. At runtime
+// each instance takes the coarsest level whose error covers at most a few
+// pixels on screen.
+namespace lod {
+    constexpr uint32_t kMaxLevels = 4;
+
+    // Symmetric 4x4 quadric of a set of planes, with the total weight of
+    // the planes so the error can be normalized to a distance
+    struct Quadric {
+        // a2 ab ac ad b2 bc bd c2 cd d2
+        std::array<double, 10> m{};
+        double weight = 0.0;
+
+        static Quadric fromPlane(double a, double b, double c, double d, double weight) {
+            Quadric q;
+            q.m = { a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d };
+            for (double& value : q.m) {
+                value *= weight;
+            }
+            q.weight = weight;
+            return q;
+        }
+
+        Quadric& operator+=(const Quadric& other) {
+            for (size_t i = 0; i < m.size(); i++) {
+                m[i] += other.m[i];
+            }
+            weight += other.weight;
+            return *this;
+        }
+
+        // Weighted sum of squared distances of p to the planes
+        double evaluate(const float* p) const {
+            double x = p[0], y = p[1], z = p[2];
+            return m[0] * x * x + 2.0 * m[1] * x * y + 2.0 * m[2] * x * z + 2.0 * m[3] * x +
+                m[4] * y * y + 2.0 * m[5] * y * z + 2.0 * m[6] * y +
+                m[7] * z * z + 2.0 * m[8] * z + m[9];
+        }
+    };
+
+    struct Level {
+        std::vector<uint32_t> indices;
+        // Object space distance, never smaller than that of a finer level
+        float error = 0.0f;
+
+        uint32_t triangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+    };
+
+    class Simplifier {
+    public:
+        // Boundary edges are held in place by planes through them, weighted
+        // like this many times the squared edge length
+        static constexpr double kBoundaryWeight = 10.0;
+
+        Simplifier(std::span<const float> positions, std::span<const uint32_t> indices)
+            : positions(positions) {
+            uint32_t vertexCount = static_cast<uint32_t>(positions.size() / 3);
+            std::vector<uint32_t> canonical = weldVertices(vertexCount);
+            for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+                std::array<uint32_t, 3> triangle = {
+                    canonical[indices[i]], canonical[indices[i + 1]], canonical[indices[i + 2]] };
+                if (triangle[0] != triangle[1] && triangle[1] != triangle[2] && triangle[2] != triangle[0]) {
+                    triangles.push_back(triangle);
+                }
+            }
+            alive.assign(triangles.size(), true);
+            aliveCount = static_cast<uint32_t>(triangles.size());
+            vertexTriangles.resize(vertexCount);
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                for (uint32_t v : triangles[t]) {
+                    vertexTriangles[v].push_back(t);
+                }
+            }
+            computeQuadrics(vertexCount);
+            versions.assign(vertexCount, 0);
+            for (const auto& triangle : triangles) {
+                for (uint32_t k = 0; k < 3; k++) {
+                    pushCollapse(triangle[k], triangle[(k + 1) % 3]);
+                    pushCollapse(triangle[(k + 1) % 3], triangle[k]);
+                }
+            }
+        }
+
+        // Collapses edges until at most targetTriangles are left or no
+        // collapse keeps the surface from folding over. Can be called
+        // again with a smaller target to continue.
+        Level simplify(uint32_t targetTriangles) {
+            while (aliveCount > targetTriangles && !queue.empty()) {
+                Collapse collapse = queue.top();
+                queue.pop();
+                if (versions[collapse.from] != collapse.fromVersion || versions[collapse.to] != collapse.toVersion) {
+                    continue;
+                }
+                if (!canCollapse(collapse.from, collapse.to)) {
+                    continue;
+                }
+                applyCollapse(collapse.from, collapse.to);
+            }
+
+            Level level;
+            level.error = static_cast<float>(maxError);
+            for (uint32_t t = 0; t < triangles.size(); t++) {
+                if (alive[t]) {
+                    level.indices.insert(level.indices.end(), triangles[t].begin(), triangles[t].end());
+                }
+            }
+            return level;
+        }
+
+    private:
+        struct Collapse {
+            double cost;
+            uint32_t from;
+            uint32_t to;
+            uint32_t fromVersion;
+            uint32_t toVersion;
+
+            bool operator>(const Collapse& other) const { return cost > other.cost; }
+        };
+
+        std::span<const float> positions;
+        std::vector<std::array<uint32_t, 3>> triangles;
+        std::vector<bool> alive;
+        uint32_t aliveCount = 0;
+        std::vector<std::vector<uint32_t>> vertexTriangles;
+        std::vector<Quadric> quadrics;
+        std::vector<uint32_t> versions;
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> queue;
+        double maxError = 0.0;
+
+        const float* position(uint32_t vertex) const { return &positions[static_cast<size_t>(vertex) * 3]; }
+
+        // Vertices at the same position, such as the seam and poles of a
+        // UV sphere, become one so the surface is closed across them.
+        // Returns the first vertex at the position of every vertex.
+        std::vector<uint32_t> weldVertices(uint32_t vertexCount) const {
+            std::vector<uint32_t> order(vertexCount);
+            std::iota(order.begin(), order.end(), 0u);
+            auto key = [&](uint32_t v) { return std::tie(position(v)[0], position(v)[1], position(v)[2]); };
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+            std::vector<uint32_t> canonical(vertexCount);
+            for (size_t i = 0; i < order.size(); i++) {
+                bool same = i > 0 && key(order[i]) == key(order[i - 1]);
+                canonical[order[i]] = same ? canonical[order[i - 1]] : order[i];
+            }
+            return canonical;
+        }
+
+        static std::array<double, 3> cross(const std::array<double, 3>& a, const std::array<double, 3>& b) {
+            return { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+        }
+
+        static double dot(const std::array<double, 3>& a, const std::array<double, 3>& b) {
+            return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        }
+
+        std::array<double, 3> edge(uint32_t from, uint32_t to) const {
+            return { static_cast<double>(position(to)[0]) - position(from)[0],
+                     static_cast<double>(position(to)[1]) - position(from)[1],
+                     static_cast<double>(position(to)[2]) - position(from)[2] };
+        }
+
+        std::array<double, 3> getNormal(const std::array<uint32_t, 3>& triangle) const {
+            return cross(edge(triangle[0], triangle[1]), edge(triangle[0], triangle[2]));
+        }
+
+        void computeQuadrics(uint32_t vertexCount) {
+            quadrics.assign(vertexCount, Quadric{});
+            std::map<std::pair<uint32_t, uint32_t>, uint32_t> edgeUses;
+            for (const auto& triangle : triangles) {
+                std::array<double, 3> normal = getNormal(triangle);
+                double length = std::sqrt(dot(normal, normal));
+                if (length <= 0.0) {
+                    continue;
+                }
+                for (double& c : normal) {
+                    c /= length;
+                }
+                const float* p = position(triangle[0]);
+                double d = -(normal[0] * p[0] + normal[1] * p[1] + normal[2] * p[2]);
+                Quadric plane = Quadric::fromPlane(normal[0], normal[1], normal[2], d, length * 0.5);
+                for (uint32_t v : triangle) {
+                    quadrics[v] += plane;
+                }
+                for (uint32_t k = 0; k < 3; k++) {
+                    edgeUses[std::minmax(triangle[k], triangle[(k + 1) % 3])]++;
+                }
+            }
+
+            for (const auto& triangle : triangles) {
+                std::array<double, 3> normal = getNormal(triangle);
+                for (uint32_t k = 0; k < 3; k++) {
+                    uint32_t a = triangle[k];
+                    uint32_t b = triangle[(k + 1) % 3];
+                    if (edgeUses[std::minmax(a, b)] != 1) {
+                        continue;
+                    }
+                    std::array<double, 3> e = edge(a, b);
+                    std::array<double, 3> side = cross(e, normal);
+                    double length = std::sqrt(dot(side, side));
+                    if (length <= 0.0) {
+                        continue;
+                    }
+                    for (double& c : side) {
+                        c /= length;
+                    }
+                    const float* p = position(a);
+                    double d = -(side[0] * p[0] + side[1] * p[1] + side[2] * p[2]);
+                    Quadric plane = Quadric::fromPlane(side[0], side[1], side[2], d, kBoundaryWeight * dot(e, e));
+                    quadrics[a] += plane;
+                    quadrics[b] += plane;
+                }
+            }
+        }
+
+        void pushCollapse(uint32_t from, uint32_t to) {
+            Quadric merged = quadrics[from];
+            merged += quadrics[to];
+            queue.push({ merged.evaluate(position(to)), from, to, versions[from], versions[to] });
+        }
+
+        // The vertices must still share a triangle and no other triangle of
+        // from may flip when it moves onto to
+        bool canCollapse(uint32_t from, uint32_t to) const {
+            bool adjacent = false;
+            for (uint32_t t : vertexTriangles[from]) {
+                if (!alive[t]) {
+                    continue;
+                }
+                const auto& triangle = triangles[t];
+                if (std::find(triangle.begin(), triangle.end(), to) != triangle.end()) {
+                    adjacent = true;
+                    continue;
+                }
+                std::array<uint32_t, 3> moved = triangle;
+                std::replace(moved.begin(), moved.end(), from, to);
+                std::array<double, 3> before = getNormal(triangle);
+                std::array<double, 3> after = getNormal(moved);
+                if (dot(before, after) <= 0.0) {
+                    return false;
+                }
+            }
+            return adjacent;
+        }
+
+        void applyCollapse(uint32_t from, uint32_t to) {
+            Quadric merged = quadrics[from];
+            merged += quadrics[to];
+            if (merged.weight > 0.0) {
+                maxError = std::max(maxError, std::sqrt(std::max(merged.evaluate(position(to)), 0.0) / merged.weight));
+            }
+            quadrics[to] = merged;
+
+            for (uint32_t t : vertexTriangles[from]) {
+                if (!alive[t]) {
+                    continue;
+                }
+                auto& triangle = triangles[t];
+                if (std::find(triangle.begin(), triangle.end(), to) != triangle.end()) {
+                    alive[t] = false;
+                    aliveCount--;
+                    continue;
+                }
+                std::replace(triangle.begin(), triangle.end(), from, to);
+                vertexTriangles[to].push_back(t);
+            }
+            vertexTriangles[from].clear();
+            std::erase_if(vertexTriangles[to], [&](uint32_t t) { return !alive[t]; });
+            versions[from]++;
+            versions[to]++;
+
+            for (uint32_t t : vertexTriangles[to]) {
+                for (uint32_t neighbor : triangles[t]) {
+                    if (neighbor != to) {
+                        pushCollapse(to, neighbor);
+                        pushCollapse(neighbor, to);
+                    }
+                }
+            }
+        }
+    };
+
+    // Level 0 is the mesh itself, every further level keeps about ratio of
+    // the triangles of the one before. The chain ends early once a level
+    // would remove less than a tenth of the triangles.
+    inline std::vector<Level> buildChain(const geometry::Mesh& mesh, uint32_t levelCount, float ratio = 0.25f) {
+        std::vector<Level> levels;
+        levels.push_back({ mesh.indices, 0.0f });
+        Simplifier simplifier(mesh.positions, mesh.indices);
+        for (uint32_t l = 1; l < std::min(levelCount, kMaxLevels); l++) {
+            uint32_t previous = levels.back().triangleCount();
+            Level level = simplifier.simplify(static_cast<uint32_t>(previous * ratio));
+            if (level.triangleCount() == 0 || level.triangleCount() > previous * 0.9f) {
+                break;
+            }
+            level.error = std::max(level.error, levels.back().error);
+            levels.push_back(std::move(level));
+        }
+        return levels;
+    }
+
+    // One chain per mesh, the meshes are spread over all cores
+    inline std::vector<std::vector<Level>> buildChains(const std::vector<geometry::Mesh>& meshes, uint32_t levelCount) {
+        std::vector<std::vector<Level>> chains(meshes.size());
+        std::atomic<size_t> next{ 0 };
+        auto work = [&]() {
+            for (size_t i = next++; i < meshes.size(); i = next++) {
+                chains[i] = buildChain(meshes[i], levelCount);
+            }
+        };
+        size_t threadCount = std::min<size_t>(meshes.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < threadCount; t++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return chains;
+    }
+
+    struct SelectionConfig {
+        // Largest error of the selected level on screen, in pixels
+        float pixelError = 1.0f;
+        // Relative band around pixelError: a coarser level is taken once its
+        // error is below pixelError * (1 - hysteresis), the current one is
+        // kept up to pixelError * (1 + hysteresis)
+        float hysteresis = 0.25f;
+        float screenHeight = 1080.0f;
+        float fovY = 0.6435f;
+    };
+
+    // Height in pixels of an object space error at a distance
+    inline float getPixelError(float error, float distance, const SelectionConfig& config) {
+        float viewHeight = 2.0f * std::tan(config.fovY * 0.5f) * std::max(distance, 1e-4f);
+        return error * config.screenHeight / viewHeight;
+    }
+
+    // Coarsest level within the pixel budget, biased towards the current
+    // one so an instance near a threshold does not switch every frame
+    inline uint32_t selectLevel(std::span<const float> levelErrors, float distance, uint32_t current,
+        const SelectionConfig& config) {
+        uint32_t selected = 0;
+        for (uint32_t level = 0; level < levelErrors.size(); level++) {
+            float scale = level <= current ? 1.0f + config.hysteresis : 1.0f - config.hysteresis;
+            if (getPixelError(levelErrors[level], distance, config) <= config.pixelError * scale) {
+                selected = level;
+            }
+        }
+        return selected;
+    }
+}  // namespace lod
@@ -1,8 +1,43 @@
 #pragma once
 #include "config.h"
 #include "vkutils.hpp"
+#include "geometry.hpp"
+#include "resources.hpp"
+#include "instances.hpp"
+#include "residency.hpp"
+#include "scenecache.hpp"
+#include "options.hpp"
+#include "rendergraph.hpp"
+#include "denoiser.hpp"
+#include "shaderreload.hpp"
+#include "camera.hpp"
+#include "splitframe.hpp"
+#include "devicetracer.hpp"
+#include "renderfarm.hpp"
+#include "deviceselect.hpp"
+#include "deformable.hpp"
+#include "foliage.hpp"
+#include "procedural.hpp"
+#include "lights.hpp"
+#include "probes.hpp"
+#include "presplit.hpp"
+#include "buildtune.hpp"
+#include "validation.hpp"
 #include <array>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
 #include <filesystem>
+#include <iomanip>
+#include <sstream>
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_vulkan.h>
@@ -12,143 +47,346 @@ constexpr uint32_t height = 600;
 
 constexpr int g_MaxFramesInFlight = 2;
 
-struct Buffer {
-	vk::UniqueBuffer buffer;
-	vk::UniqueDeviceMemory memory;
-	vk::DeviceAddress address;
-
-	void init(vk::PhysicalDevice physicalDevice,
-		vk::Device device,
-		vk::DeviceSize size,
-		vk::BufferUsageFlags usage,
-		vk::MemoryPropertyFlags memoryProperty,
-		const void* data = nullptr) {
-		// create buffer
-		vk::BufferCreateInfo createInfo{};
-		createInfo.setSize(size);
-		createInfo.setUsage(usage);
-		buffer = device.createBufferUnique(createInfo);
-
-		//Allocate memory
-		vk::MemoryAllocateFlagsInfo allocateFlags{};
-		if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
-			allocateFlags.flags = vk::MemoryAllocateFlagBits::eDeviceAddress;
-		}
-
-		vk::MemoryRequirements memoryReq = 
-			device.getBufferMemoryRequirements(*buffer);
-		uint32_t memoryType = vkutils::getMemoryType(physicalDevice,
-			memoryReq, memoryProperty);
-		vk::MemoryAllocateInfo allocateInfo{};
-		allocateInfo.setAllocationSize(memoryReq.size);
-		allocateInfo.setMemoryTypeIndex(memoryType);
-		allocateInfo.setPNext(&allocateFlags);
-		memory = device.allocateMemoryUnique(allocateInfo);
-
-		device.bindBufferMemory(*buffer, *memory, 0);
-
-		if (data) {
-			void* mappedPtr = device.mapMemory(*memory, 0, size);
-			memcpy(mappedPtr, data, size);
-			device.unmapMemory(*memory);
-		}
-
-		if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
-			vk::BufferDeviceAddressInfo addressInfo{};
-			addressInfo.setBuffer(*buffer);
-			address = device.getBufferAddressKHR(&addressInfo);
-		}
-	}
+// Push constants of tonemap.comp
+struct TonemapParams {
+	float exposure;
+	uint32_t tonemapOperator;
+	uint32_t flags;
 };
 
-struct Vertex {
-	float pose[3];
+// Tonemap output flags, keep in sync with tonemap.comp
+constexpr uint32_t g_TonemapFlagLinear = 1;        // the blit to an sRGB swapchain encodes
+constexpr uint32_t g_TonemapFlagSwapRedBlue = 2;   // copied raw into a BGRA swapchain
+
+// Push constants of the ray tracing shaders, see trace_common.glsl
+struct TraceParams {
+	uint32_t bounce;
+	uint32_t statsSlot;
+	uint32_t viewOffset;   // multiview.rgen: view of launch depth 0
+	uint32_t sampleIndex;  // multiview.rgen: samples already in the views
 };
 
-struct AccelStruct {
-	vk::UniqueAccelerationStructureKHR accel;
-	Buffer buffer;
+// Uniform block of the ray tracing shaders with std140 layout. The buffer
+// holds one slot per frame in flight, picked with a dynamic offset.
+struct FrameUniforms {
+	glm::mat4 viewInverse;
+	glm::mat4 projectionInverse;
+	glm::mat4 previousViewProjection;
+	glm::vec4 cameraPosition;
+	uint32_t frame;
+	uint32_t maxBounces;
+	uint32_t flags;
+	float adaptiveThreshold;
+};
+constexpr uint32_t g_TraceFlagVertexNormals = 1;
+constexpr uint32_t g_TraceFlag16BitIndices = 2;
+constexpr uint32_t g_TraceFlagAlphaTest = 4;    // rays are not forced opaque
+constexpr uint32_t g_TraceFlagUniformSampling = 8;  // adaptive sampling lists every pixel
+constexpr uint32_t g_TraceFlagLights = 16;          // next event estimation, see lighting.glsl
+constexpr uint32_t g_TraceFlagUniformLights = 32;   // emitters sampled uniformly instead of by the light BVH
+// Every trace shader declares the push constants, see trace_common.glsl
+constexpr vk::ShaderStageFlags g_TraceStages =
+	vk::ShaderStageFlagBits::eRaygenKHR | vk::ShaderStageFlagBits::eClosestHitKHR |
+	vk::ShaderStageFlagBits::eAnyHitKHR | vk::ShaderStageFlagBits::eIntersectionKHR |
+	vk::ShaderStageFlagBits::eMissKHR | vk::ShaderStageFlagBits::eCompute;
+
+// Trace backends, selectable at runtime
+constexpr int g_TraceBackendPipeline = 0;   // megakernel traceRays
+constexpr int g_TraceBackendWavefront = 1;  // sorted per-bounce traceRays
+constexpr int g_TraceBackendRayQuery = 2;   // ray queries in trace_query.comp
+
+// Push constants of ray_sort.comp
+struct RaySortParams {
+	uint32_t step;
+	uint32_t statsSlot;
+};
+constexpr uint32_t g_RaySize = 48;          // Ray in trace_common.glsl
+constexpr uint32_t g_RaySortBinCount = 4096;
+
+// Adaptive sampling, see adaptive_common.glsl
+constexpr uint32_t g_PixelStatsSize = 32;           // PixelStats
+constexpr uint32_t g_AdaptivePixelHeaderSize = 16;  // indirect trace command and padding
+constexpr uint32_t g_AdaptiveStatsSize = 16;        // uvec4 of AdaptiveStats per frame in flight
+constexpr double g_AdaptiveErrorScale = 256.0;      // kErrorScale
+// --adaptive-benchmark: fraction of converged pixels that ends a run, and
+// the frame count after which a run gives up
+constexpr double g_AdaptiveTargetFraction = 0.99;
+constexpr uint32_t g_AdaptiveBenchmarkMaxFrames = 4096;
+
+// Timestamp queries of each frame in flight
+constexpr uint32_t g_TimestampTraceBegin = 0;
+constexpr uint32_t g_TimestampTraceEnd = 1;
+constexpr uint32_t g_TimestampDenoiserBegin = 2;
+constexpr uint32_t g_TimestampDenoiserEnd = 3;
+// Deformable mesh: skinning, BLAS refit or rebuild and TLAS refit back to back
+constexpr uint32_t g_TimestampSkinningBegin = 4;
+constexpr uint32_t g_TimestampSkinningEnd = 5;
+constexpr uint32_t g_TimestampBlasEnd = 6;
+constexpr uint32_t g_TimestampTlasEnd = 7;
+constexpr uint32_t g_TimestampsPerFrame = 8;
+
+// Placement of the deformable character next to the static mesh
+const vk::TransformMatrixKHR g_DeformableTransform{ std::array{
+	std::array{ 1.0f, 0.0f, 0.0f, 1.8f },
+	std::array{ 0.0f, 1.0f, 0.0f, -1.0f },
+	std::array{ 0.0f, 0.0f, 1.0f, 0.0f },
+} };
+
+// Placement of the alpha-tested bush on the other side of the static mesh
+const vk::TransformMatrixKHR g_FoliageTransform{ std::array{
+	std::array{ 1.0f, 0.0f, 0.0f, -1.8f },
+	std::array{ 0.0f, 1.0f, 0.0f, -0.4f },
+	std::array{ 0.0f, 0.0f, 1.0f, 0.0f },
+} };
+
+// Placement of the particles above the static mesh
+const vk::TransformMatrixKHR g_ParticleTransform{ std::array{
+	std::array{ 1.0f, 0.0f, 0.0f, 0.0f },
+	std::array{ 0.0f, 1.0f, 0.0f, 1.6f },
+	std::array{ 0.0f, 0.0f, 1.0f, -1.0f },
+} };
+// Particles of --particle-benchmark without --particles
+constexpr uint32_t g_BenchmarkParticleCount = 100000;
+
+// Placement of the CAD test mesh below the static mesh
+const vk::TransformMatrixKHR g_CadTransform{ std::array{
+	std::array{ 1.0f, 0.0f, 0.0f, 0.0f },
+	std::array{ 0.0f, 1.0f, 0.0f, -1.8f },
+	std::array{ 0.0f, 0.0f, 1.0f, -1.0f },
+} };
+// Triangles of --presplit-benchmark without --cad-mesh
+constexpr uint32_t g_BenchmarkCadTriangles = 1000000;
+
+// Emissive triangles of --light-benchmark without --lights
+constexpr uint32_t g_BenchmarkLightCount = 4096;
+// GPU trace time each light sampling strategy gets in --light-benchmark
+constexpr double g_LightBenchmarkMs = 2000.0;
+// Header of the light tree and environment buffers, see lighting.glsl
+constexpr uint32_t g_LightHeaderSize = 16;
+static_assert(sizeof(procedural::Aabb) == sizeof(vk::AabbPositionsKHR));
+
+// Frames left out of the CPU frame time while caches and pipelines warm up
+constexpr uint32_t g_FrameTimeWarmupFrames = 16;
+// Frames every mode of --validation-benchmark runs without --frame-limit
+constexpr uint32_t g_ValidationBenchmarkFrames = 500;
+
+// --split-frame fails when more pixels than the fraction differ from the CPU
+// reference by more than the tolerance. Pixels on triangle edges may hit the
+// neighbouring triangle and get its barycentric color.
+constexpr float g_SplitFrameTolerance = 1e-3f;
+constexpr double g_SplitFrameMismatchFraction = 0.001;
+
+// Frame whose denoiser input and output are read back with --validate-denoiser
+constexpr uint64_t g_DenoiserValidationFrame = 16;
+
+#ifndef GLSLC_EXECUTABLE
+#define GLSLC_EXECUTABLE "glslc"
+#endif
+
+// Ray tracing stages in shaderStages
+constexpr uint32_t g_RaygenShader = 0;
+constexpr uint32_t g_MissShader = 1;
+constexpr uint32_t g_ClosestHitShader = 2;
+constexpr uint32_t g_WavefrontRaygenShader = 3;
+constexpr uint32_t g_AnyHitShader = 4;
+constexpr uint32_t g_ProceduralHitShader = 5;
+constexpr uint32_t g_IntersectionShader = 6;
+constexpr uint32_t g_AdaptiveRaygenShader = 7;
+constexpr uint32_t g_MultiviewRaygenShader = 8;
+
+// Shader groups of the linked pipeline: the general library's groups
+// followed by one hit group per material library
+constexpr uint32_t g_RaygenGroup = 0;
+constexpr uint32_t g_MissGroup = 1;
+constexpr uint32_t g_WavefrontRaygenGroup = 2;
+constexpr uint32_t g_AdaptiveRaygenGroup = 3;
+constexpr uint32_t g_MultiviewRaygenGroup = 4;
+constexpr uint32_t g_FirstHitGroup = 5;
+// A hit takes the record of its geometry index, so the materials are in
+// the order of the geometries of a BLAS: opaque first, alpha-tested second.
+// Procedural instances start at their own record.
+constexpr uint32_t g_OpaqueMaterial = 0;
+constexpr uint32_t g_AlphaTestedMaterial = 1;
+constexpr uint32_t g_ProceduralMaterial = 2;
+constexpr uint32_t g_MaterialCount = 3;
+// Material mask of rebuildLibraries, one bit per material
+constexpr uint32_t g_AllMaterials = (1u << g_MaterialCount) - 1;
+
+// Largest payload (HitInfo) and hit attribute (barycentrics) of the RT
+// shaders, shared by all pipeline libraries
+constexpr vk::RayTracingPipelineInterfaceCreateInfoKHR g_LibraryInterface{ 32, 8 };
+
+// Values of the trace variant constants in trace_common.glsl
+constexpr uint32_t g_RuntimeBounces = 0xffffffff;  // bounce count from the push constants
+constexpr uint32_t g_ShadingPath = 0;
+constexpr uint32_t g_ShadingHeadlight = 1;
+constexpr uint32_t g_DebugViewOff = 0;
+constexpr uint32_t g_DebugViewNormals = 1;
+constexpr uint32_t g_DebugViewDistance = 2;
+
+// Specialization constants of the trace shaders. A pipeline is built per
+// variant so the shader compiler can unroll and strip code for it.
+struct TraceVariant {
+	uint32_t maxBounces = g_RuntimeBounces;
+	uint32_t shadingModel = g_ShadingPath;
+	uint32_t debugView = g_DebugViewOff;
+
+	bool operator<(const TraceVariant& other) const {
+		return std::tie(maxBounces, shadingModel, debugView) <
+			std::tie(other.maxBounces, other.shadingModel, other.debugView);
+	}
+	bool operator==(const TraceVariant& other) const {
+		return !(*this < other) && !(other < *this);
+	}
+	bool operator!=(const TraceVariant& other) const {
+		return !(*this == other);
+	}
+};
 
-	void init(vk::PhysicalDevice physicalDevice, vk::Device device,
-		VkCommandPool commandPool, vk::Queue queue,
-		vk::AccelerationStructureTypeKHR type,
-		vk::AccelerationStructureGeometryKHR geometry,
-		uint32_t primitiveCount) {
-		
-		vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
-		buildInfo.setType(type);
-		buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
-		buildInfo.setFlags(vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
-		buildInfo.setGeometries(geometry);
-
-		vk::AccelerationStructureBuildSizesInfoKHR buildSizes =
-			device.getAccelerationStructureBuildSizesKHR(
-				vk::AccelerationStructureBuildTypeKHR::eDevice, buildInfo, primitiveCount);
-
-		buffer.init(physicalDevice, device,
-			buildSizes.accelerationStructureSize,
-			vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|
-			vk::BufferUsageFlagBits::eShaderDeviceAddress,
-			vk::MemoryPropertyFlagBits::eDeviceLocal);
+struct SpecializationConstant {
+	uint32_t id;
+	uint32_t offset;  // of the value in TraceVariant
+	const char* name;
+};
 
-		vk::AccelerationStructureCreateInfoKHR createInfo{};
-		createInfo.setBuffer(*buffer.buffer);
-		createInfo.setSize(buildSizes.accelerationStructureSize);
-		createInfo.setType(type);
-		accel = device.createAccelerationStructureKHRUnique(createInfo);
+// Mirrors the constant_id declarations in trace_common.glsl
+constexpr std::array<SpecializationConstant, 3> g_TraceVariantConstants = { {
+	{ 10, offsetof(TraceVariant, maxBounces), "kMaxBounces" },
+	{ 11, offsetof(TraceVariant, shadingModel), "kShadingModel" },
+	{ 12, offsetof(TraceVariant, debugView), "kDebugView" },
+} };
+
+// Map entries of the variant constants for a TraceVariant at dataOffset
+inline std::vector<vk::SpecializationMapEntry> getVariantMapEntries(uint32_t dataOffset = 0) {
+	std::vector<vk::SpecializationMapEntry> entries;
+	for (const auto& constant : g_TraceVariantConstants) {
+		entries.push_back({ constant.id, dataOffset + constant.offset, sizeof(uint32_t) });
+	}
+	return entries;
+}
+
+inline std::string describeVariant(const TraceVariant& variant) {
+	std::string description;
+	for (const auto& constant : g_TraceVariantConstants) {
+		uint32_t value;
+		std::memcpy(&value, reinterpret_cast<const char*>(&variant) + constant.offset, sizeof(value));
+		description += std::string(description.empty() ? "" : " ") + constant.name + "=" +
+			(value == g_RuntimeBounces ? std::string("runtime") : std::to_string(value));
+	}
+	return description;
+}
 
-		Buffer scratchBuffer;
-		scratchBuffer.init(physicalDevice, device, buildSizes.buildScratchSize,
-			vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-			vk::MemoryPropertyFlagBits::eDeviceLocal);
+// Shader binding table of the ray tracing pipeline
+struct ShaderBindingTable {
+	Buffer buffer{};
+	vk::StridedDeviceAddressRegionKHR raygenRegion{};
+	vk::StridedDeviceAddressRegionKHR wavefrontRaygenRegion{};
+	vk::StridedDeviceAddressRegionKHR adaptiveRaygenRegion{};
+	vk::StridedDeviceAddressRegionKHR multiviewRaygenRegion{};
+	vk::StridedDeviceAddressRegionKHR missRegion{};
+	vk::StridedDeviceAddressRegionKHR hitRegion{};
+};
 
-		buildInfo.setDstAccelerationStructure(*accel);
-		buildInfo.setScratchData(scratchBuffer.address);
+// Pipelines built by the shader reloader, swapped in at a frame boundary
+struct ReloadedPipelines {
+	std::set<std::string> shaders;
+	vk::UniquePipeline rayTracing;
+	ShaderBindingTable table{};
+	// Libraries and cached variants made obsolete by this reload
+	std::vector<vk::UniquePipeline> replaced;
+	std::vector<ShaderBindingTable> replacedTables;
+	// Compute pipeline members to replace and their replacements
+	std::vector<std::pair<vk::UniquePipeline*, vk::UniquePipeline>> compute;
+	std::vector<vk::UniquePipeline> rayQuery;
+};
 
-		vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo{};
-		buildRangeInfo.setPrimitiveCount(primitiveCount);
-		buildRangeInfo.setPrimitiveOffset(0);
-		buildRangeInfo.setFirstVertex(0);
-		buildRangeInfo.setTransformOffset(0);
+// Replaced pipelines, destroyed once the frames in flight that use them retire
+struct RetiredPipelines {
+	uint64_t frame = 0;
+	std::vector<vk::UniquePipeline> pipelines;
+	std::vector<ShaderBindingTable> tables;
+};
 
-		vkutils::oneTimeSubmit(
-			device, commandPool, queue,
-			[&](vk::CommandBuffer commandBuffer) {
-				commandBuffer.buildAccelerationStructuresKHR(buildInfo, &buildRangeInfo);
-			});
+// Evicted BLASes and replaced TLAS instance buffers, destroyed once the
+// frames in flight that use them retire
+struct RetiredAccels {
+	uint64_t frame = 0;
+	std::vector<AccelStruct> accels;
+	std::vector<Buffer> buffers;
+};
 
-		vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
-		addressInfo.setAccelerationStructure(*accel);
-		buffer.address = device.getAccelerationStructureAddressKHR(addressInfo);
-	}
+// Inputs of a static BLAS, kept to build it again with other flags. The
+// geometries point into the buffers here or into members of Application.
+struct StaticAccelInputs {
+	AccelStruct* accel = nullptr;
+	std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+	std::vector<uint32_t> primitiveCounts;
+	std::vector<Buffer> buffers;
+};
+
+// Trace pipelines of an inactive variant, kept for switching back
+struct VariantPipelines {
+	vk::UniquePipeline generalLibrary;
+	std::vector<vk::UniquePipeline> materialLibraries;
+	vk::UniquePipeline rayTracing;
+	ShaderBindingTable table{};
+	std::vector<vk::UniquePipeline> rayQuery;
 };
 
 class Application
 {
 public:
+	explicit Application(const AppOptions& options) : options(options) {}
+
 	void run() {
 		initWindow();
 		initVulkan();
 
 		uint32_t frameIndex = 0;
+		uint64_t frames = 0;
 		while (!glfwWindowShouldClose(window)) {
+			auto start = std::chrono::steady_clock::now();
 			glfwPollEvents();
 			drawFrame(frameIndex);
+			addCpuFrameTime(std::chrono::duration<double, std::milli>(
+				std::chrono::steady_clock::now() - start).count() - fenceWaitMs);
+			validationLog.drain(validationQueue, std::cerr);
 			frameIndex = (frameIndex + 1) % g_MaxFramesInFlight;
+			if (options.frameLimit > 0 && ++frames >= options.frameLimit) {
+				break;
+			}
 		}
+		shaderReloader.stop();
+		validationLog.summarize(std::cerr);
+		reportCpuFrameTime();
 
 		glfwDestroyWindow(window);
 		glfwTerminate();
 	}
 
 private:
-	
+	AppOptions options;
+
 	vk::UniqueRenderPass renderPass;
 	ImDrawData* draw_data;
 	ImGuiContext* imGuicontext;
 
 	GLFWwindow* window = nullptr;
 
+	// Messages of perf-warnings validation, the queue outlives the messenger
+	validation::Config validationConfig{};
+	validation::MessageQueue validationQueue;
+	validation::MessageLog validationLog;
+	// CPU time of a frame without the wait for its fence, to compare the
+	// validation modes
+	double fenceWaitMs = 0.0;
+	float cpuFrameMs = 0.0f;        // mean of the last 100 frames
+	double cpuFrameMsWindow = 0.0;
+	uint32_t cpuFrameWindowCount = 0;
+	double cpuFrameMsSum = 0.0;     // after the warmup, for the report on exit
+	uint64_t cpuFrameCount = 0;
+	uint64_t cpuFramesSeen = 0;
+
 	vk::UniqueInstance instance;
 	vk::UniqueDebugUtilsMessengerEXT debugMessenger;
 	vk::UniqueSurfaceKHR surface;
@@ -174,14 +412,244 @@ private:
 	std::vector<vk::UniqueFence>       inFlightFences;
 	std::vector<vk::UniqueDescriptorPool> descriptorPoolsForFrame;
 
+	// One graph per frame in flight so transient images are never shared
+	std::vector<rendergraph::RenderGraph> renderGraphs;
+	bool synchronization2Enabled = false;
+	vk::PipelineStageFlags acquireWaitStage = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+	// Probed limits and optional features of the chosen device
+	deviceselect::DeviceCapabilities deviceCapabilities;
+
 	vk::Extent2D swapchainExtent;
+	// Swapchain images take the tonemap output directly instead of a blit
+	bool swapchainStorage = false;
+	// Otherwise blitted if the format allows, or copied as raw texels
+	bool swapchainBlit = false;
+	uint32_t tonemapFlags = 0;
+
+	// Linear radiance written by the tracer, at the render resolution
+	Image hdrImage{};
+	vk::Extent2D renderExtent;
+
+	vk::UniqueShaderModule          tonemapShader;
+	vk::UniqueDescriptorSetLayout   tonemapSetLayout;
+	vk::UniqueDescriptorPool        tonemapDescPool;
+	std::vector<vk::DescriptorSet>  tonemapDescSets;
+	vk::UniquePipelineLayout        tonemapPipelineLayout;
+	vk::UniquePipeline              tonemapPipeline;
+	float exposure = 1.0f;
+	int tonemapOperator = 2;
+
+	// Denoiser G-buffer and history, at the render resolution
+	Image normalDepthImage{};
+	Image motionImage{};
+	Image prevNormalDepthImage{};
+	Image momentsImage{};
+	Image prevMomentsImage{};
+	Image historyColorImage{};
+
+	vk::UniqueShaderModule          svgfTemporalShader;
+	vk::UniqueShaderModule          svgfAtrousShader;
+	vk::UniqueDescriptorSetLayout   svgfTemporalSetLayout;
+	vk::UniqueDescriptorSetLayout   svgfAtrousSetLayout;
+	vk::UniqueDescriptorPool        svgfDescPool;
+	std::vector<vk::DescriptorSet>  svgfTemporalDescSets;  // per frame in flight
+	std::vector<vk::DescriptorSet>  svgfAtrousDescSets;    // per frame in flight and iteration
+	vk::UniquePipelineLayout        svgfTemporalPipelineLayout;
+	vk::UniquePipelineLayout        svgfAtrousPipelineLayout;
+	vk::UniquePipeline              svgfTemporalPipeline;
+	vk::UniquePipeline              svgfAtrousPipeline;
+	denoiser::Params denoiserParams{};
+	bool denoiserEnabled = true;
+	bool denoiserHistoryValid = false;
+
+	// Wavefront mode: bounces are queued, sorted and traced one dispatch at a time
+	int traceBackend = g_TraceBackendPipeline;
+	int maxBounces = 1;
+	Buffer queuedRayBuffer{};
+	Buffer sortedRayBuffer{};
+	Buffer rayCounterBuffer{};
+	Buffer rayBinBuffer{};
+	Buffer rayStatsBuffer{};    // rays traced, one counter per frame in flight
+	Buffer anyHitStatsBuffer{}; // alpha tests, one counter per frame in flight
+	vk::UniqueShaderModule          raySortShader;
+	vk::UniqueDescriptorSetLayout   raySortSetLayout;
+	vk::UniqueDescriptorPool        raySortDescPool;
+	vk::DescriptorSet               raySortDescSet;
+	vk::UniquePipelineLayout        raySortPipelineLayout;
+	vk::UniquePipeline              raySortPipeline;
+
+	// Adaptive sampling: paths accumulate per pixel while the view is still,
+	// adaptive_compact.comp lists the unconverged pixels and an indirect
+	// trace spends the frame's paths on them. Needs traceRaysIndirect.
+	bool adaptiveEnabled = false;
+	bool adaptiveSampling = false;
+	bool adaptiveUniform = false;   // list every pixel, the reference for the benchmark
+	float adaptiveThreshold = 0.02f;
+	bool adaptiveReset = true;
+	// State the accumulation belongs to, a change restarts it
+	glm::mat4 adaptiveView{ 1.0f };
+	int adaptiveBounces = 0;
+	TraceVariant adaptiveVariant{};
+	bool adaptiveUniformLights = false;
+	Buffer pixelStatsBuffer{};
+	Buffer adaptivePixelBuffer{};
+	Buffer adaptiveStatsBuffer{};   // listed and converged pixels per frame in flight
+	vk::UniqueShaderModule          adaptiveCompactShader;
+	vk::UniquePipeline              adaptiveCompactPipeline;
+	std::vector<bool> adaptiveStatsWritten;
+	std::vector<bool> adaptiveStatsUniform;
+	uint32_t listedPixels = 0;
+	uint32_t convergedPixels = 0;
+	double meanPixelError = 0.0;    // written only while every pixel is listed
+	// --adaptive-benchmark accumulates with uniform, then adaptive sampling
+	bool adaptiveBenchmarkRunning = false;
+	uint32_t adaptiveBenchmarkFrames = 0;
+	std::array<double, 2> adaptiveBenchmarkMs{};
+	std::array<uint32_t, 2> adaptiveBenchmarkFrameCounts{};
+	std::array<bool, 2> adaptiveBenchmarkReached{};
+
+	// Ray query backend, one pipeline per workgroup size candidate
+	bool rayQueryEnabled = false;
+	vk::UniqueShaderModule          rayQueryShader;
+	std::vector<vk::UniquePipeline> rayQueryPipelines;
+	std::vector<vk::Extent2D>       rayQueryWorkgroups;
+	int rayQueryWorkgroup = 0;
+	// Workgroup tuning: every candidate runs for a number of frames
+	bool tuningWorkgroup = false;
+	std::vector<double> workgroupMs;
+	uint32_t tuningFrames = 0;
+	// Build flag preset of each class of BLAS, from the build profile or
+	// --tune-builds. The TLAS is always built for fast trace.
+	std::array<buildtune::Preset, buildtune::kClassCount> buildPresets{};
+	buildtune::Profile buildProfile;
+	uint64_t buildScene = 0;        // key of this scene and device in the profile
+	buildtune::Tuner buildTuner;
+	bool tuningBuilds = false;
+	double staticBuildMs = 0.0;     // of the last build of every static BLAS
+	std::vector<StaticAccelInputs> staticAccelInputs;
+	double residencyBuildMs = 0.0;  // residency.getBuildMs() at the last frame
+
+	// GPU time of the trace and denoiser passes
+	vk::UniqueQueryPool timestampPool;
+	std::vector<bool> timestampsWritten;
+	std::vector<bool> denoiserTimestampsWritten;
+	float timestampPeriod = 0.0f;
+	float traceMs = 0.0f;
+	float raysPerSecond = 0.0f;
+	uint32_t tracedRays = 0;
+	uint32_t anyHitCount = 0;
+	float denoiserMs = 0.0f;
+	double denoiserMsSum = 0.0;
+	uint32_t denoiserMsCount = 0;
+	// GPU time of the deformation passes of the frames recorded with --deformable
+	std::vector<bool> deformTimestampsWritten;
+	std::vector<bool> deformRebuilt;
+	float skinningMs = 0.0f;
+	float blasMs = 0.0f;
+	float tlasMs = 0.0f;
+	bool blasRebuilt = false;
+	double skinningMsSum = 0.0;
+	double refitMsSum = 0.0;
+	double rebuildMsSum = 0.0;
+	uint32_t refitFrames = 0;
+	uint32_t rebuildFrames = 0;
+
+	Buffer denoiserCaptureBuffer{};
+	uint64_t frameCount = 0;
 
 	AccelStruct bottomAccel{};
 	AccelStruct topAccel{};
+	// Instances of topAccel, kept for the per-frame refit with --deformable
+	// and replaced when the mesh pack residency changes
+	Buffer topInstanceBuffer{};
+	uint32_t topInstanceCount = 0;
+	// Set by updateResidency, the frame's graph rebuilds the TLAS from the new instances
+	bool topAccelRebuild = false;
+	std::deque<RetiredAccels> retiredAccels;
+
+	// Skinned character, its BLAS is refit or rebuilt in every frame
+	deformable::DeformableMesh deformableMesh;
+
+	// Alpha-tested bush: an opaque and an alpha-tested geometry in one BLAS
+	AccelStruct foliageAccel{};
+	Buffer foliagePositionBuffer{};
+	Buffer foliageOpaqueIndexBuffer{};
+	Buffer foliageMixedIndexBuffer{};
+	// Read by the alpha test, placeholders without --foliage
+	Buffer alphaMaskBuffer{};
+	Buffer alphaUVBuffer{};
+
+	// Particles as spheres and capsules in AABBs, and their tessellation
+	// with --particles-tessellated or --particle-benchmark
+	AccelStruct particleAccel{};
+	AccelStruct tessellatedParticleAccel{};
+	Buffer particleBuffer{};    // procedural::Primitive, placeholder without particles
+	bool particlesTessellated = false;
+	// --particle-benchmark traces both representations in turn
+	bool particleBenchmarkRunning = false;
+	uint32_t particleBenchmarkFrames = 0;
+	std::array<double, 2> particleBenchmarkMs{};
+	std::array<uint64_t, 2> particleBenchmarkRays{};
+
+	// CAD test mesh as exported and after presplit::preprocess, the
+	// second is built with --presplit or --presplit-benchmark
+	AccelStruct cadAccel{};
+	AccelStruct presplitCadAccel{};
+	bool cadPreprocessed = false;
+	// --presplit-benchmark traces both BLASes in turn
+	bool presplitBenchmarkRunning = false;
+	uint32_t presplitBenchmarkFrames = 0;
+	std::array<double, 2> presplitBenchmarkMs{};
+	std::array<uint64_t, 2> presplitBenchmarkRays{};
+	std::array<double, 2> cadBuildMs{};
+
+	// Next event estimation towards emissive triangles and the sky. The
+	// buffers are placeholders without --lights.
+	AccelStruct lightAccel{};
+	Buffer lightTriangleBuffer{};   // lights::Triangle
+	Buffer lightTreeBuffer{};       // light count and lights::Node
+	Buffer environmentBuffer{};     // size and lights::EnvironmentTexel
+	bool uniformLights = false;     // emitters sampled uniformly, the reference for the benchmark
+	// --light-benchmark accumulates with uniform, then light BVH sampling
+	// for the same GPU time and compares the error of the images
+	bool lightBenchmarkRunning = false;
+	std::vector<bool> adaptiveStatsUniformLights;
+	std::array<double, 2> lightBenchmarkMs{};
+	std::array<uint32_t, 2> lightBenchmarkFrames{};
+	std::array<double, 2> lightBenchmarkError{};
+	std::array<uint32_t, 2> lightBenchmarkConverged{};
+
+	// Views of the batched multiview mode, a layer each. --bake-probes
+	// renders six per probe, the placeholders have a single layer.
+	Image probeImage{};
+	Buffer probeViewBuffer{};       // probes::View per layer
+
+	// Compressed geometry kept for shading
+	Buffer meshIndexBuffer{};
+	Buffer meshNormalBuffer{};
+	vk::IndexType meshIndexType = vk::IndexType::eUint32;
+	// Dequantization of the BLAS positions, applied by the instance transform
+	vk::TransformMatrixKHR meshTransform{};
+
+	// Out-of-core scene streamed from options.meshPack
+	ResidencyManager residency;
+	std::array<float, 3> cameraPosition = { 0.0f, 0.0f, 5.0f };
+	std::array<float, 3> cameraDirection = { 0.0f, 0.0f, -1.0f };
+	uint32_t traceFlags = 0;
+
+	camera::FlyCamera flyCamera;
+	glm::mat4 previousViewProjection{ 1.0f };
+	double lastFrameTime = 0.0;
+
+	// Persistently mapped ring of FrameUniforms. Slot frameIndex is written
+	// after the fence of that frame, so updates need no other sync and the
+	// descriptor sets are never rewritten for them.
+	Buffer frameUniformBuffer{};
+	uint8_t* frameUniformData = nullptr;
+	vk::DeviceSize frameUniformStride = 0;
 
 	std::vector<vk::UniqueShaderModule> shaderModules;
 	std::vector<vk::PipelineShaderStageCreateInfo> shaderStages;
-	std::vector<vk::RayTracingShaderGroupCreateInfoKHR> shaderGroups;
 
 	vk::UniqueDescriptorPool        descPool;
 	vk::UniqueDescriptorPool        imGuiDescPool;
@@ -191,10 +659,31 @@ private:
 	vk::UniquePipeline            pipeline;
 	vk::UniquePipelineLayout      pipelineLayout;
 
-	Buffer sbt{};
-	vk::StridedDeviceAddressRegionKHR raygenRegion{};
-	vk::StridedDeviceAddressRegionKHR missRegion{};
-	vk::StridedDeviceAddressRegionKHR hitRegion{};
+	ShaderBindingTable sbt{};
+
+	// Pipeline libraries the ray tracing pipeline is linked from
+	vk::UniquePipeline generalLibrary;
+	std::vector<vk::UniquePipeline> materialLibraries;
+
+	// Trace variant of pipeline, sbt and rayQueryPipelines, and the other
+	// variants built so far. The shader stages point at activeVariant.
+	TraceVariant activeVariant{};
+	std::vector<vk::SpecializationMapEntry> variantEntries;
+	vk::SpecializationInfo variantSpecialization{};
+	std::map<TraceVariant, VariantPipelines> variantCache;
+	bool specializeBounces = false;
+	int shadingModel = g_ShadingPath;
+	int debugView = g_DebugViewOff;
+	// Held while the shader stages, libraries or variants change, by the
+	// reloader thread and by variant switches
+	std::mutex libraryMutex;
+
+	// Hot shader reload. The reloader is declared last so that its thread
+	// stops before anything it uses is destroyed.
+	std::mutex reloadMutex;
+	std::unique_ptr<ReloadedPipelines> pendingPipelines;
+	std::deque<RetiredPipelines> retiredPipelines;
+	shaderreload::Reloader shaderReloader;
 
 	void initWindow() {
 		glfwInit();
@@ -210,13 +699,21 @@ private:
 	}
 
 	void initVulkan() {
-		std::vector<const char*> layers = {
-			"VK_LAYER_KHRONOS_validation",
-		};
-
-		instance = vkutils::createInstance(VK_API_VERSION_1_2, layers);
+		validationConfig = getValidationConfig();
+		std::vector<const char*> layers = validation::getLayers(validationConfig);
+		vk::DebugUtilsMessengerCreateInfoEXT messengerInfo =
+			validation::getMessengerCreateInfo(validationConfig, &validationQueue);
+		validation::Features validationFeatures = validation::getFeatures(validationConfig);
+		vk::ValidationFeaturesEXT features = validationFeatures.get();
+		bool validating = validationConfig.mode != validation::Mode::eRelease;
+
+		// Release mode creates the instance without any layer or messenger
+		instance = vkutils::createInstance(VK_API_VERSION_1_2, layers, true,
+			validating ? &messengerInfo : nullptr, validationFeatures.empty() ? nullptr : &features);
 		std::cout << "create vulkan instance" << std::endl;
-		debugMessenger = vkutils::createDebugMessenger(*instance);
+		if (validating) {
+			debugMessenger = vkutils::createDebugMessenger(*instance, messengerInfo);
+		}
 		surface = vkutils::createSurface(*instance, window);
 
 		std::vector<const char*> deviceExtensions = {
@@ -227,16 +724,67 @@ private:
 			VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
 			VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 		};
-		physicalDevice = vkutils::pickPhysicalDevice(*instance, *surface, deviceExtensions);
+		deviceCapabilities = deviceselect::selectDevice(*instance, *surface, deviceExtensions, options.deviceIndex);
+		physicalDevice = deviceCapabilities.physicalDevice;
+		// Optional extensions are enabled only when their features are supported
+		if (deviceCapabilities.memoryBudget) {
+			deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+		}
+		vk::PhysicalDeviceSynchronization2FeaturesKHR synchronization2Features{};
+		if (deviceCapabilities.synchronization2) {
+			deviceExtensions.push_back(VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME);
+			synchronization2Features.setSynchronization2(VK_TRUE);
+			synchronization2Enabled = true;
+		}
+		vk::PhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures{};
+		if (deviceCapabilities.rayQuery) {
+			deviceExtensions.push_back(VK_KHR_RAY_QUERY_EXTENSION_NAME);
+			rayQueryFeatures.setRayQuery(VK_TRUE);
+			rayQueryEnabled = true;
+		}
+		// Optional feature structs are chained in front of each other
+		void* optionalFeatures = nullptr;
+		if (synchronization2Enabled) {
+			synchronization2Features.setPNext(optionalFeatures);
+			optionalFeatures = &synchronization2Features;
+		}
+		if (rayQueryEnabled) {
+			rayQueryFeatures.setPNext(optionalFeatures);
+			optionalFeatures = &rayQueryFeatures;
+		}
+#ifdef VK_KHR_ray_tracing_position_fetch
+		vk::PhysicalDeviceRayTracingPositionFetchFeaturesKHR positionFetchFeatures{};
+		if (deviceCapabilities.positionFetch) {
+			deviceExtensions.push_back(VK_KHR_RAY_TRACING_POSITION_FETCH_EXTENSION_NAME);
+			positionFetchFeatures.setRayTracingPositionFetch(VK_TRUE);
+			positionFetchFeatures.setPNext(optionalFeatures);
+			optionalFeatures = &positionFetchFeatures;
+		}
+#endif
+#ifdef VK_NV_ray_tracing_invocation_reorder
+		vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV reorderFeatures{};
+		if (deviceCapabilities.invocationReorder) {
+			deviceExtensions.push_back(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME);
+			reorderFeatures.setRayTracingInvocationReorder(VK_TRUE);
+			reorderFeatures.setPNext(optionalFeatures);
+			optionalFeatures = &reorderFeatures;
+		}
+#endif
 		VkPhysicalDeviceProperties physProp;
 		vkGetPhysicalDeviceProperties(physicalDevice, &physProp);
 		std::cout << "Device Name: " << physProp.deviceName << std::endl;
 
 		queueFamilyIndex = vkutils::findGeneralQueueFamily(physicalDevice, *surface);
 		std::cout << "queue family index: " << queueFamilyIndex << std::endl;
-		device = vkutils::createLogicalDevice(physicalDevice, queueFamilyIndex, deviceExtensions);
+		device = vkutils::createLogicalDevice(physicalDevice, queueFamilyIndex, deviceExtensions,
+			optionalFeatures);
 		queue = device->getQueue(queueFamilyIndex, 0);
 
+		renderGraphs.resize(g_MaxFramesInFlight);
+		for (auto& graph : renderGraphs) {
+			graph.init(physicalDevice, *device, synchronization2Enabled);
+		}
+
 		commandPool = vkutils::createCommandPool(*device, queueFamilyIndex);
 		commandBuffer = vkutils::createCommandBuffer(*device, *commandPool);
 
@@ -244,9 +792,41 @@ private:
 		auto capabilities = physicalDevice.getSurfaceCapabilitiesKHR(static_cast<vk::SurfaceKHR>(*surface));
 		swapchainExtent = vkutils::chooseExtent(capabilities, width, height);
 
+		// The tonemap shader writes rgba8, other formats get the result through a blit
+		auto formatProps = physicalDevice.getFormatProperties(surfaceFormat.format);
+		swapchainStorage = surfaceFormat.format == vk::Format::eR8G8B8A8Unorm &&
+			(capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eStorage) &&
+			(formatProps.optimalTilingFeatures & vk::FormatFeatureFlagBits::eStorageImage);
+		swapchainBlit = !swapchainStorage &&
+			(formatProps.optimalTilingFeatures & vk::FormatFeatureFlagBits::eBlitDst);
+		tonemapFlags = 0;
+		if (swapchainBlit) {
+			if (vkutils::isSrgbFormat(surfaceFormat.format)) {
+				tonemapFlags |= g_TonemapFlagLinear;
+			}
+		}
+		else if (!swapchainStorage) {
+			// A copy does not convert, the rgba8 texels have to match the swapchain layout
+			switch (surfaceFormat.format) {
+			case vk::Format::eR8G8B8A8Unorm:
+			case vk::Format::eR8G8B8A8Srgb:
+				break;
+			case vk::Format::eB8G8R8A8Unorm:
+			case vk::Format::eB8G8R8A8Srgb:
+				tonemapFlags |= g_TonemapFlagSwapRedBlue;
+				break;
+			default:
+				std::cerr << "Swapchain format " << vk::to_string(surfaceFormat.format)
+					<< " supports neither storage nor blits\n";
+				std::abort();
+			}
+		}
+		vk::ImageUsageFlags swapchainUsage = vk::ImageUsageFlagBits::eColorAttachment |
+			(swapchainStorage ? vk::ImageUsageFlagBits::eStorage : vk::ImageUsageFlagBits::eTransferDst);
+
 		swapchain = (vkutils::createSwapchain(
 			physicalDevice, *device, *surface, queueFamilyIndex,
-			vk::ImageUsageFlagBits::eColorAttachment|vk::ImageUsageFlagBits::eStorage, surfaceFormat,
+			swapchainUsage, surfaceFormat,
 			width, height, swapchainExtent));
 
 		swapchainImages = device->getSwapchainImagesKHR(static_cast<vk::SwapchainKHR>(*swapchain));
@@ -257,8 +837,25 @@ private:
 
 		createRenderPass();
 		createFramebuffers();
+		createRenderTarget();
+		createRayQueues();
+		createFrameUniforms();
+		loadBuildProfile();
 
-		createBottomLevelAS();
+		if (options.meshPack.empty()) {
+			createBottomLevelAS();
+		}
+		else {
+			initResidency();
+		}
+		if (options.deformable) {
+			createDeformableMesh();
+		}
+		createFoliage();
+		createParticles();
+		createCadMesh();
+		createLights();
+		createProbes();
 		createTopLevelAS();
 
 		prepareShaders();
@@ -268,14 +865,75 @@ private:
 		createDescriptorSets();
 
 		createRayTracingPipeline();
+		createTonemapPipeline();
+		createDenoiserPipelines();
+		createRaySortPipeline();
+		createRayQueryPipelines();
+		createAdaptivePipeline();
+		createTimestampQueries();
 
 		initImGui();
 		ImGui_ImplGlfw_InitForVulkan(window, true);
 
 		createShaderBindingTable();
+		bakeProbes();
+		if (options.tuneBuilds) {
+			startBuildTuning();
+		}
+
+		if (options.hotReload) {
+			std::filesystem::path shaderDir = options.shaderDir.empty() ? SHADER_ROOT_DIR : options.shaderDir;
+			shaderReloader.start(shaderDir, std::filesystem::current_path(), GLSLC_EXECUTABLE,
+				[this](const std::set<std::string>& shaders) { rebuildPipelines(shaders); });
+		}
 		
 	}
 
+	// Mode of --validation, release when the layer is not installed
+	validation::Config getValidationConfig() {
+		validation::Config config{};
+		validation::parseMode(options.validation, config.mode);
+		config.gpuAssisted = options.gpuAssistedValidation;
+		config.synchronization = options.syncValidation;
+		vkutils::initLoader();
+		if (config.mode != validation::Mode::eRelease && !vkutils::checkLayerSupport({ validation::kLayerName })) {
+			std::cerr << validation::kLayerName << " is not available, running without validation\n";
+			config.mode = validation::Mode::eRelease;
+		}
+		if ((config.gpuAssisted || config.synchronization) && config.mode != validation::Mode::eDebug) {
+			std::cerr << "GPU-assisted and synchronization validation need --validation debug\n";
+		}
+		std::cout << "Validation: " << validation::toString(config.mode) << "\n";
+		return config;
+	}
+
+	void addCpuFrameTime(double ms) {
+		cpuFrameMsWindow += ms;
+		if (++cpuFrameWindowCount == 100) {
+			cpuFrameMs = static_cast<float>(cpuFrameMsWindow / cpuFrameWindowCount);
+			cpuFrameMsWindow = 0.0;
+			cpuFrameWindowCount = 0;
+		}
+		if (++cpuFramesSeen > g_FrameTimeWarmupFrames) {
+			cpuFrameMsSum += ms;
+			cpuFrameCount++;
+		}
+	}
+
+	// Mean CPU frame time of the run, written for --validation-benchmark
+	void reportCpuFrameTime() {
+		if (cpuFrameCount == 0) {
+			return;
+		}
+		double ms = cpuFrameMsSum / cpuFrameCount;
+		std::cout << "CPU frame time (" << validation::toString(validationConfig.mode) << " validation): "
+			<< ms << " ms over " << cpuFrameCount << " frames\n";
+		if (!options.frameTimeOutput.empty()) {
+			std::ofstream file(options.frameTimeOutput);
+			file << validation::toString(validationConfig.mode) << " " << ms << "\n";
+		}
+	}
+
 	void createSwapchainImageViews() {
 		for (auto image : swapchainImages) {
 			vk::ImageViewCreateInfo createInfo{};
@@ -326,7 +984,7 @@ private:
 			vk::AttachmentLoadOp::eDontCare,
 			vk::AttachmentStoreOp::eDontCare,
 			vk::ImageLayout::eColorAttachmentOptimal,
-			vk::ImageLayout::ePresentSrcKHR);
+			vk::ImageLayout::eColorAttachmentOptimal);  // the render graph transitions to present
 
 		vk::AttachmentReference colorAttachmentRef(0, vk::ImageLayout::eColorAttachmentOptimal);
 
@@ -347,15 +1005,258 @@ private:
 		}
 	}
 
+	void createRenderTarget() {
+		renderExtent.setWidth(std::max(1u, static_cast<uint32_t>(swapchainExtent.width * options.renderScale)));
+		renderExtent.setHeight(std::max(1u, static_cast<uint32_t>(swapchainExtent.height * options.renderScale)));
+		if (options.denoiserBenchmark) {
+			renderExtent = vk::Extent2D{ 1920, 1080 };
+		}
+		std::cout << "Render resolution: " << renderExtent.width << "x" << renderExtent.height << "\n";
+
+		vk::ImageUsageFlags storage = vk::ImageUsageFlagBits::eStorage;
+		vk::ImageUsageFlags source = storage | vk::ImageUsageFlagBits::eTransferSrc;
+		vk::ImageUsageFlags destination = storage | vk::ImageUsageFlagBits::eTransferDst;
+		hdrImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, source);
+		normalDepthImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, source);
+		motionImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16Sfloat, source);
+		prevNormalDepthImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, destination);
+		momentsImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, source);
+		prevMomentsImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, destination);
+		historyColorImage.init(physicalDevice, *device, renderExtent, vk::Format::eR16G16B16A16Sfloat, destination);
+
+		// Render targets stay in the general layout between frames
+		vkutils::oneTimeSubmit(*device, *commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				for (Image* image : { &hdrImage, &normalDepthImage, &motionImage, &prevNormalDepthImage,
+					&momentsImage, &prevMomentsImage, &historyColorImage }) {
+					vkutils::setImageLayout(commandBuffer, *image->image,
+						vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral);
+				}
+			});
+	}
+
+	void createRayQueues() {
+		if (options.rayQuery) {
+			traceBackend = g_TraceBackendRayQuery;
+		}
+		else if (options.wavefront) {
+			traceBackend = g_TraceBackendWavefront;
+		}
+		maxBounces = static_cast<int>(options.bounces);
+
+		// Every pixel has at most one live ray per bounce
+		vk::DeviceSize rayCount = static_cast<vk::DeviceSize>(renderExtent.width) * renderExtent.height;
+		vk::BufferUsageFlags usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst;
+		queuedRayBuffer.init(physicalDevice, *device, rayCount * g_RaySize, usage,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		sortedRayBuffer.init(physicalDevice, *device, rayCount * g_RaySize, usage,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		rayCounterBuffer.init(physicalDevice, *device, 2 * sizeof(uint32_t), usage,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		rayBinBuffer.init(physicalDevice, *device, 2 * g_RaySortBinCount * sizeof(uint32_t), usage,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		rayStatsBuffer.init(physicalDevice, *device, g_MaxFramesInFlight * sizeof(uint32_t), usage,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		anyHitStatsBuffer.init(physicalDevice, *device, g_MaxFramesInFlight * sizeof(uint32_t), usage,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+
+		// Without indirect traces the adaptive buffers are placeholders for the descriptors
+		adaptiveEnabled = deviceCapabilities.traceRaysIndirect;
+		vk::DeviceSize adaptivePixelCount = adaptiveEnabled ? rayCount : 1;
+		pixelStatsBuffer.init(physicalDevice, *device, adaptivePixelCount * g_PixelStatsSize, usage,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		adaptivePixelBuffer.init(physicalDevice, *device,
+			g_AdaptivePixelHeaderSize + adaptivePixelCount * sizeof(uint32_t),
+			usage | vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+		adaptiveStatsBuffer.init(physicalDevice, *device, g_MaxFramesInFlight * g_AdaptiveStatsSize, usage,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+	}
+
+	void createFrameUniforms() {
+		vk::DeviceSize alignment = physicalDevice.getProperties().limits.minUniformBufferOffsetAlignment;
+		frameUniformStride = (sizeof(FrameUniforms) + alignment - 1) / alignment * alignment;
+		frameUniformBuffer.init(physicalDevice, *device, frameUniformStride * g_MaxFramesInFlight,
+			vk::BufferUsageFlagBits::eUniformBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		frameUniformData = static_cast<uint8_t*>(device->mapMemory(*frameUniformBuffer.memory, 0, VK_WHOLE_SIZE));
+
+		float aspect = static_cast<float>(renderExtent.width) / renderExtent.height;
+		previousViewProjection = flyCamera.getProjection(aspect) * flyCamera.getView();
+		lastFrameTime = glfwGetTime();
+	}
+
+	// Applies the input since the last frame, unless ImGui has taken it
+	void updateCamera() {
+		double time = glfwGetTime();
+		float deltaTime = static_cast<float>(time - lastFrameTime);
+		lastFrameTime = time;
+
+		const ImGuiIO& io = ImGui::GetIO();
+		flyCamera.update(window, deltaTime, !io.WantCaptureMouse, !io.WantCaptureKeyboard);
+		cameraPosition = flyCamera.getPositionArray();
+		cameraDirection = flyCamera.getForwardArray();
+	}
+
+	void writeFrameUniforms(uint32_t frameIndex) {
+		float aspect = static_cast<float>(renderExtent.width) / renderExtent.height;
+		glm::mat4 view = flyCamera.getView();
+		glm::mat4 projection = flyCamera.getProjection(aspect);
+
+		FrameUniforms uniforms{};
+		uniforms.viewInverse = glm::inverse(view);
+		uniforms.projectionInverse = glm::inverse(projection);
+		uniforms.previousViewProjection = previousViewProjection;
+		uniforms.cameraPosition = glm::vec4(flyCamera.position, 1.0f);
+		uniforms.frame = static_cast<uint32_t>(frameCount);
+		uniforms.maxBounces = static_cast<uint32_t>(maxBounces);
+		uniforms.flags = traceFlags | (adaptiveUniform ? g_TraceFlagUniformSampling : 0) |
+			(uniformLights ? g_TraceFlagUniformLights : 0);
+		uniforms.adaptiveThreshold = adaptiveThreshold;
+		std::memcpy(frameUniformData + frameIndex * frameUniformStride, &uniforms, sizeof(uniforms));
+
+		previousViewProjection = projection * view;
+	}
+
+	// Presets stored for this scene on this device, fast trace for the rest
+	void loadBuildProfile() {
+		vk::PhysicalDeviceProperties properties = physicalDevice.getProperties();
+		std::ostringstream scene;
+		scene << properties.deviceName.data() << " " << properties.driverVersion << " " << options.meshPack
+			<< " " << options.deformable << " " << options.foliage << " " << options.particleCount
+			<< " " << options.particleBenchmark << " " << options.cadTriangles << " " << options.presplit
+			<< " " << options.presplitBudget << " " << options.presplitBenchmark << " " << options.lighting
+			<< " " << options.lightCount << " " << options.lightBenchmark;
+		buildScene = buildtune::hashScene(scene.str());
+		if (!buildProfile.load(options.buildProfile)) {
+			return;
+		}
+		for (uint32_t i = 0; i < buildtune::kClassCount; i++) {
+			auto accelClass = static_cast<buildtune::AccelClass>(i);
+			if (buildProfile.find(buildScene, accelClass, buildPresets[i])) {
+				std::cout << "Build profile: " << buildtune::toString(accelClass) << " BLASes use "
+					<< buildtune::toString(buildPresets[i]) << "\n";
+			}
+		}
+	}
+
+	vk::BuildAccelerationStructureFlagsKHR getBuildFlags(buildtune::AccelClass accelClass) const {
+		switch (buildPresets[static_cast<uint32_t>(accelClass)]) {
+		case buildtune::Preset::eFastBuild:
+			return vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild;
+		case buildtune::Preset::eLowMemory:
+			return vk::BuildAccelerationStructureFlagBitsKHR::eLowMemory;
+		default:
+			return vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+		}
+	}
+
+	vk::BuildAccelerationStructureFlagsKHR getStaticBuildFlags() const {
+		return getBuildFlags(buildtune::AccelClass::eStatic) |
+			vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+	}
+
+	// Keeps the inputs of a static BLAS for rebuildStaticAccels, buffers
+	// holds those the geometries point into that are not members
+	StaticAccelInputs& keepStaticAccelInputs(AccelStruct& accel,
+		std::span<const vk::AccelerationStructureGeometryKHR> geometries,
+		std::span<const uint32_t> primitiveCounts, std::vector<Buffer> buffers) {
+		auto it = std::find_if(staticAccelInputs.begin(), staticAccelInputs.end(),
+			[&](const StaticAccelInputs& inputs) { return inputs.accel == &accel; });
+		if (it == staticAccelInputs.end()) {
+			it = staticAccelInputs.emplace(staticAccelInputs.end());
+		}
+		it->accel = &accel;
+		it->geometries.assign(geometries.begin(), geometries.end());
+		it->primitiveCounts.assign(primitiveCounts.begin(), primitiveCounts.end());
+		it->buffers = std::move(buffers);
+		return *it;
+	}
+
+	// Builds and compacts a BLAS with the flags of the static class.
+	// Returns the time taken, which is also added to staticBuildMs.
+	double buildStaticAccel(const StaticAccelInputs& inputs) {
+		auto start = std::chrono::steady_clock::now();
+		inputs.accel->init(physicalDevice, *device, *commandPool, queue,
+			vk::AccelerationStructureTypeKHR::eBottomLevel, inputs.geometries, inputs.primitiveCounts,
+			getStaticBuildFlags());
+		inputs.accel->compact(physicalDevice, *device, *commandPool, queue);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		staticBuildMs += ms;
+		return ms;
+	}
+
+	double buildStaticAccel(AccelStruct& accel,
+		std::span<const vk::AccelerationStructureGeometryKHR> geometries,
+		std::span<const uint32_t> primitiveCounts, std::vector<Buffer> buffers = {}) {
+		return buildStaticAccel(keepStaticAccelInputs(accel, geometries, primitiveCounts, std::move(buffers)));
+	}
+
+	double buildStaticAccel(AccelStruct& accel,
+		vk::AccelerationStructureGeometryKHR geometry, uint32_t primitiveCount, std::vector<Buffer> buffers = {}) {
+		return buildStaticAccel(accel, std::span(&geometry, 1), std::span(&primitiveCount, 1), std::move(buffers));
+	}
+
+	vk::DeviceSize getStaticAccelBytes() const {
+		vk::DeviceSize bytes = 0;
+		for (const AccelStruct* accel : { &bottomAccel, &foliageAccel, &particleAccel,
+			&tessellatedParticleAccel, &cadAccel, &presplitCadAccel, &lightAccel }) {
+			bytes += accel->size;
+		}
+		return bytes;
+	}
+
 	void createBottomLevelAS() {
 		std::cout << "Create BLAS\n";
 
-		std::vector<Vertex> vertices = {
-			{{1.0f, 1.0f, 0.0f}},
-			{{-1.0f, 1.0f, 0.0f}},
-			{{0.0f, -1.0f, 0.0f}},
-		};
-		std::vector<uint32_t> indices = { 0, 1, 2 };
+		uint8_t deviceUUID[VK_UUID_SIZE];
+		uint8_t driverUUID[VK_UUID_SIZE];
+		vkutils::getDeviceUUIDs(physicalDevice, deviceUUID, driverUUID);
+
+		// Warm start uploads straight from the mapped scene cache
+		scenecache::Cache cache;
+		scenecache::MeshView mesh{};
+		geometry::CompressedMesh compressed;
+		if (!options.sceneCache.empty() && cache.open(options.sceneCache) && cache.meshCount() > 0) {
+			std::cout << "Load scene cache: " << options.sceneCache << "\n";
+			mesh = cache.mesh(0);
+			if (!cache.matchesDevice(deviceUUID, driverUUID)) {
+				std::cout << "Scene cache was written by another device, rebuild BLAS\n";
+				mesh.accel = {};
+			}
+			// Any other device may not build from the cached vertex format,
+			// float32 is always supported
+			auto cachedEncoding = static_cast<geometry::PositionEncoding>(mesh.record.positionEncoding);
+			if (cachedEncoding != geometry::PositionEncoding::eFloat32 &&
+				!vkutils::isAccelerationStructureVertexFormatSupported(physicalDevice, getVertexFormat(cachedEncoding))) {
+				std::vector<float> positions;
+				std::vector<uint32_t> indices;
+				scenecache::decodeMesh(mesh, positions, indices);
+				geometry::PositionEncoding encoding = choosePositionEncoding(physicalDevice);
+				std::cout << "Scene cache position format " << geometry::toString(cachedEncoding)
+					<< " is not supported, recompress as " << geometry::toString(encoding) << "\n";
+				compressed = geometry::compressMesh(positions, indices, encoding);
+				compressed.report.print(std::cout);
+				mesh = scenecache::makeView(compressed);
+			}
+		}
+		else {
+			std::vector<Vertex> vertices = {
+				{{1.0f, 1.0f, 0.0f}},
+				{{-1.0f, 1.0f, 0.0f}},
+				{{0.0f, -1.0f, 0.0f}},
+			};
+			std::vector<uint32_t> indices = { 0, 1, 2 };
+
+			geometry::PositionEncoding encoding = choosePositionEncoding(physicalDevice);
+			compressed = geometry::compressMesh(
+				std::span<const float>(reinterpret_cast<const float*>(vertices.data()), vertices.size() * 3),
+				indices, encoding);
+			std::cout << "Position format: " << geometry::toString(encoding)
+				<< ", index type: " << (compressed.use16BitIndices ? "uint16" : "uint32") << "\n";
+			compressed.report.print(std::cout);
+			mesh = scenecache::makeView(compressed);
+		}
 
 		vk::BufferUsageFlags bufferUsage{
 			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
@@ -366,206 +1267,973 @@ private:
 			vk::MemoryPropertyFlagBits::eHostVisible |
 			vk::MemoryPropertyFlagBits::eHostCoherent};
 
-		Buffer vertexBuffer;
-		Buffer indexBuffer;
-
+		// Shaders read 16 bit indices in pairs, so pad to whole words
+		std::vector<uint8_t> indexData(vkutils::alignUp(static_cast<uint32_t>(mesh.indices.size()), 4), 0);
+		std::copy(mesh.indices.begin(), mesh.indices.end(), indexData.begin());
+		meshIndexBuffer.init(physicalDevice, *device, 
+						 indexData.size(), bufferUsage | vk::BufferUsageFlagBits::eStorageBuffer, 
+						 memoryProperty, indexData.data());
+
+		meshNormalBuffer.init(physicalDevice, *device,
+						 mesh.normals.size(), vk::BufferUsageFlagBits::eStorageBuffer,
+						 memoryProperty, mesh.normals.data());
+
+		meshIndexType = mesh.record.use16BitIndices ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+		traceFlags = g_TraceFlagVertexNormals |
+			(meshIndexType == vk::IndexType::eUint16 ? g_TraceFlag16BitIndices : 0);
+		meshTransform = getDecodeTransform(mesh.record.decodeScale, mesh.record.decodeOffset);
+
+		// Kept for builds with other flags even when the BLAS is deserialized
+		std::vector<Buffer> inputs(1);
+		Buffer& vertexBuffer = inputs[0];
 		vertexBuffer.init(physicalDevice, *device, 
-						  vertices.size() * sizeof(Vertex), bufferUsage, 
-						  memoryProperty, vertices.data());
-
-		indexBuffer.init(physicalDevice, *device, 
-						 indices.size() * sizeof(uint32_t), bufferUsage, 
-						 memoryProperty, indices.data());
+						  mesh.positions.size(), bufferUsage, 
+						  memoryProperty, mesh.positions.data());
 
+		auto encoding = static_cast<geometry::PositionEncoding>(mesh.record.positionEncoding);
 		vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
-		triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+		triangles.setVertexFormat(getVertexFormat(encoding));
 		triangles.setVertexData(vertexBuffer.address);
-		triangles.setVertexStride(sizeof(Vertex));
-		triangles.setMaxVertex(static_cast<uint32_t>(vertices.size()));
-		triangles.setIndexType(vk::IndexType::eUint32);
-		triangles.setIndexData(indexBuffer.address);
+		triangles.setVertexStride(mesh.record.positionStride);
+		triangles.setMaxVertex(mesh.record.vertexCount);
+		triangles.setIndexType(meshIndexType);
+		triangles.setIndexData(meshIndexBuffer.address);
 
 		vk::AccelerationStructureGeometryKHR geometry{};
 		geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
 		geometry.setGeometry({ triangles });
 		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
 
-		uint32_t primitiveCount = static_cast<uint32_t>(indices.size() / 3);
-		bottomAccel.init(physicalDevice, *device, *commandPool, queue,
-			vk::AccelerationStructureTypeKHR::eBottomLevel,
-			geometry, primitiveCount);
-
+		uint32_t primitiveCount = mesh.record.indexCount / 3;
+		// The serialized BLAS is only used when it was built with the flags
+		// the static class has now
+		auto buildFlags = static_cast<VkBuildAccelerationStructureFlagsKHR>(getStaticBuildFlags());
+		if (!mesh.accel.empty() && mesh.record.buildFlags != buildFlags) {
+			std::cout << "Scene cache BLAS was built with other flags, rebuild BLAS\n";
+			mesh.accel = {};
+		}
+		if (!mesh.accel.empty() &&
+			vkutils::isAccelerationStructureCompatible(*device, mesh.accel.data()) &&
+			bottomAccel.deserialize(physicalDevice, *device, *commandPool, queue,
+				vk::AccelerationStructureTypeKHR::eBottomLevel, mesh.accel)) {
+			std::cout << "Deserialized BLAS from scene cache\n";
+			keepStaticAccelInputs(bottomAccel, std::span(&geometry, 1), std::span(&primitiveCount, 1), std::move(inputs));
+			return;
+		}
+		buildStaticAccel(bottomAccel, geometry, primitiveCount, std::move(inputs));
+
+		if (!options.sceneCache.empty()) {
+			// Copy the blobs out before the old mapping is replaced
+			std::vector<uint8_t> positions(mesh.positions.begin(), mesh.positions.end());
+			std::vector<uint8_t> indices(mesh.indices.begin(), mesh.indices.end());
+			std::vector<uint8_t> normals(mesh.normals.begin(), mesh.normals.end());
+			std::vector<uint8_t> accelData = bottomAccel.serialize(
+				physicalDevice, *device, *commandPool, queue);
+			cache.close();
+
+			scenecache::MeshView cached = mesh;
+			cached.positions = positions;
+			cached.indices = indices;
+			cached.normals = normals;
+			cached.accel = accelData;
+			cached.record.buildFlags = buildFlags;
+			if (scenecache::writeCache(options.sceneCache, deviceUUID, driverUUID, { cached })) {
+				std::cout << "Wrote scene cache: " << options.sceneCache << "\n";
+			}
+		}
 	}
 
-	void createTopLevelAS() {
-		std::cout << "Create TLAS\n";
+	void initResidency() {
+		ResidencyConfig config{};
+		config.maxResidentBytes = static_cast<vk::DeviceSize>(options.blasBudgetMB) * 1024 * 1024;
+		config.lodSelection.pixelError = options.lodPixelError;
+		config.lodSelection.screenHeight = static_cast<float>(renderExtent.height);
+		config.lodSelection.fovY = flyCamera.fovY;
+		config.buildFlags = getBuildFlags(buildtune::AccelClass::eStreamed);
+		if (!residency.init(physicalDevice, *device, *commandPool, queue, options.meshPack, config)) {
+			std::cerr << "Failed to load mesh pack.\n";
+			std::abort();
+		}
 
-		vk::TransformMatrixKHR transform = std::array{
-			std::array{1.0f, 0.0f, 0.0f, 0.0f},
-			std::array{0.0f, 1.0f, 0.0f, 0.0f},
-			std::array{0.0f, 0.0f, 1.0f, 0.0f},
-		};
+		// Streamed meshes carry no normals, the hit shader falls back to the ray direction
+		uint32_t placeholder = 0;
+		meshIndexBuffer.init(physicalDevice, *device, sizeof(placeholder), vk::BufferUsageFlagBits::eStorageBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, &placeholder);
+		meshNormalBuffer.init(physicalDevice, *device, sizeof(placeholder), vk::BufferUsageFlagBits::eStorageBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, &placeholder);
+		traceFlags = 0;
+		residency.update(cameraPosition, cameraDirection);
+	}
 
-		vk::AccelerationStructureInstanceKHR accelInstance{};
-		accelInstance.setTransform(transform);
-		accelInstance.setInstanceCustomIndex(0);
-		accelInstance.setMask(0xFF);
-		accelInstance.setInstanceShaderBindingTableRecordOffset(0);
-		accelInstance.setFlags(
-			vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
-		accelInstance.setAccelerationStructureReference(
-			bottomAccel.buffer.address);
+	void createDeformableMesh() {
+		std::cout << "Create deformable mesh\n";
+		deformable::RefitPolicy policy{};
+		policy.maxRefits = options.refitMaxUpdates;
+		policy.maxDegradation = options.refitThreshold;
+		policy.estimateInterval = options.refitEstimateInterval;
+		deformableMesh.init(physicalDevice, *device, *commandPool, queue,
+			(std::filesystem::current_path() / "skinning.comp.spv").string(),
+			deformable::makeTentacle(), policy, g_MaxFramesInFlight,
+			getBuildFlags(buildtune::AccelClass::eDeformable));
+		const deformable::Character& character = deformableMesh.getCharacter();
+		std::cout << "Deformable mesh: " << character.vertexCount() << " vertices, "
+			<< character.triangleCount() << " triangles, " << character.jointCount() << " joints, "
+			<< "rebuild after " << policy.maxRefits << " refits or at " << policy.maxDegradation << "x cluster area, "
+			<< "estimated every " << policy.estimateInterval << " refits\n";
+	}
 
-		Buffer instanceBuffer;
-		instanceBuffer.init(
-			physicalDevice, *device,
-			sizeof(vk::AccelerationStructureInstanceKHR),
-			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
-			vk::BufferUsageFlagBits::eShaderDeviceAddress,
-			vk::MemoryPropertyFlagBits::eHostVisible |
-			vk::MemoryPropertyFlagBits::eHostCoherent,
-			&accelInstance);
+	// Leaf cards sorted by a CPU pre-pass against their alpha mask. Opaque
+	// triangles go into an eOpaque geometry that never runs any-hit,
+	// transparent ones are dropped and only the rest is alpha tested.
+	void createFoliage() {
+		vk::BufferUsageFlags storage = vk::BufferUsageFlagBits::eStorageBuffer;
+		vk::MemoryPropertyFlags memoryProperty =
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+		if (!options.foliage) {
+			uint32_t placeholder = 0;
+			alphaMaskBuffer.init(physicalDevice, *device, sizeof(placeholder), storage, memoryProperty, &placeholder);
+			alphaUVBuffer.init(physicalDevice, *device, sizeof(placeholder), storage, memoryProperty, &placeholder);
+			return;
+		}
+		std::cout << "Create foliage\n";
+
+		foliage::Mesh bush = foliage::makeBush();
+		foliage::AlphaMask mask = foliage::makeLeafMask();
+		auto start = std::chrono::steady_clock::now();
+		foliage::ClassifiedMesh classified = foliage::classify(bush, mask);
+		double classifyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		classified.print(std::cout);
+		std::cout << "Opacity classification: " << classifyMs << " ms\n";
+
+		// Size followed by the texels, four to a word, see alpha_common.glsl
+		std::vector<uint32_t> maskData(1 + (mask.texels.size() + 3) / 4, 0);
+		maskData[0] = mask.size;
+		for (size_t i = 0; i < mask.texels.size(); i++) {
+			maskData[1 + i / 4] |= static_cast<uint32_t>(mask.texels[i]) << (8 * (i % 4));
+		}
+		alphaMaskBuffer.init(physicalDevice, *device, maskData.size() * sizeof(uint32_t),
+			storage, memoryProperty, maskData.data());
 
-		vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
-		instancesData.setArrayOfPointers(false);
-		instancesData.setData(instanceBuffer.address);
+		// Buffers may not be empty, the geometries keep their real counts
+		classified.mixedUVs.resize(std::max<size_t>(classified.mixedUVs.size(), 6));
+		classified.opaqueIndices.resize(std::max<size_t>(classified.opaqueIndices.size(), 3));
+		classified.mixedIndices.resize(std::max<size_t>(classified.mixedIndices.size(), 3));
+		alphaUVBuffer.init(physicalDevice, *device, classified.mixedUVs.size() * sizeof(float),
+			storage, memoryProperty, classified.mixedUVs.data());
 
-		vk::AccelerationStructureGeometryKHR geometry{};
-		geometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
-		geometry.setGeometry({ instancesData });
-		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+		vk::BufferUsageFlags bufferUsage =
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress;
+		foliagePositionBuffer.init(physicalDevice, *device, bush.positions.size() * sizeof(float),
+			bufferUsage, memoryProperty, bush.positions.data());
+		foliageOpaqueIndexBuffer.init(physicalDevice, *device, classified.opaqueIndices.size() * sizeof(uint32_t),
+			bufferUsage, memoryProperty, classified.opaqueIndices.data());
+		foliageMixedIndexBuffer.init(physicalDevice, *device, classified.mixedIndices.size() * sizeof(uint32_t),
+			bufferUsage, memoryProperty, classified.mixedIndices.data());
+
+		// Geometry order matches g_OpaqueMaterial and g_AlphaTestedMaterial
+		std::array<vk::DeviceAddress, 2> indexAddresses = {
+			foliageOpaqueIndexBuffer.address, foliageMixedIndexBuffer.address };
+		std::array<uint32_t, 2> primitiveCounts = { classified.opaqueCount, classified.mixedCount };
+		std::array<vk::AccelerationStructureGeometryKHR, 2> geometries{};
+		for (uint32_t i = 0; i < geometries.size(); i++) {
+			vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+			triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+			triangles.setVertexData(foliagePositionBuffer.address);
+			triangles.setVertexStride(3 * sizeof(float));
+			triangles.setMaxVertex(static_cast<uint32_t>(bush.positions.size() / 3));
+			triangles.setIndexType(vk::IndexType::eUint32);
+			triangles.setIndexData(indexAddresses[i]);
+
+			geometries[i].setGeometryType(vk::GeometryTypeKHR::eTriangles);
+			geometries[i].setGeometry({ triangles });
+		}
+		geometries[g_OpaqueMaterial].setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+		// One alpha test per triangle and ray keeps the any-hit count exact
+		geometries[g_AlphaTestedMaterial].setFlags(vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation);
+		buildStaticAccel(foliageAccel, geometries, primitiveCounts);
 
-		constexpr uint32_t primitiveCount = 1;
-		topAccel.init(physicalDevice, *device, *commandPool, queue,
-			vk::AccelerationStructureTypeKHR::eTopLevel,
-			geometry, primitiveCount);
+		if (classified.mixedCount > 0) {
+			traceFlags |= g_TraceFlagAlphaTest;
+		}
 	}
 
-	void addShader(uint32_t shaderIndex,
-		const std::string& filename,
-		vk::ShaderStageFlagBits stage) {
-		auto shader_bin_root = std::filesystem::current_path();
+	void createParticles() {
+		vk::MemoryPropertyFlags memoryProperty =
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+		uint32_t particleCount = options.particleCount;
+		if (particleCount == 0 && options.particleBenchmark) {
+			particleCount = g_BenchmarkParticleCount;
+		}
+		if (particleCount == 0) {
+			uint32_t placeholder = 0;
+			particleBuffer.init(physicalDevice, *device, sizeof(placeholder),
+				vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, &placeholder);
+			return;
+		}
+		std::cout << "Create particles\n";
 
+		using clock = std::chrono::steady_clock;
+		auto elapsedMs = [](clock::time_point start) {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		};
+		constexpr double mb = 1024.0 * 1024.0;
 
+		std::vector<procedural::Primitive> primitives = procedural::makeParticles(particleCount);
+		particleBuffer.init(physicalDevice, *device, primitives.size() * sizeof(procedural::Primitive),
+			vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, primitives.data());
 
-		std::cout << "Loading shader: " << shader_bin_root/filename << std::endl;
+		auto start = clock::now();
+		std::vector<procedural::Aabb> aabbs = procedural::computeAabbs(primitives);
+		double aabbMs = elapsedMs(start);
 
-		shaderModules[shaderIndex] =
-			vkutils::createShaderModule(*device, (shader_bin_root / filename).string());
-		std::cout << "after createShader" << std::endl;
-		shaderStages[shaderIndex].setStage(stage);
-		shaderStages[shaderIndex].setModule(*shaderModules[shaderIndex]);
-		shaderStages[shaderIndex].setPName("main");
-	}
+		// Build inputs are kept for builds with other flags
+		vk::BufferUsageFlags bufferUsage =
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress;
+		std::vector<Buffer> aabbInputs(1);
+		Buffer& aabbBuffer = aabbInputs[0];
+		aabbBuffer.init(physicalDevice, *device, aabbs.size() * sizeof(procedural::Aabb),
+			bufferUsage, memoryProperty, aabbs.data());
 
-	void prepareShaders() {
-		std::cout << "Prepare shaders\n";
+		vk::AccelerationStructureGeometryAabbsDataKHR aabbData{};
+		aabbData.setData(aabbBuffer.address);
+		aabbData.setStride(sizeof(procedural::Aabb));
 
-		uint32_t raygenShader = 0;
-		uint32_t missShader = 1;
-		uint32_t chitShader = 2;
-		shaderStages.resize(3);
-		shaderModules.resize(3);
+		vk::AccelerationStructureGeometryKHR geometry{};
+		geometry.setGeometryType(vk::GeometryTypeKHR::eAabbs);
+		geometry.setGeometry({ aabbData });
+		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
 
-		std::cout << "before rgen" << std::endl;
-		addShader(raygenShader, "raygen.rgen.spv",
-			vk::ShaderStageFlagBits::eRaygenKHR);
+		double buildMs = buildStaticAccel(particleAccel, geometry, particleCount, std::move(aabbInputs));
+		std::cout << "Procedural particles: " << particleCount << " primitives, AABBs in " << aabbMs << " ms, "
+			<< "BLAS " << particleAccel.size / mb << " MB, inputs "
+			<< (aabbs.size() * sizeof(procedural::Aabb) + primitives.size() * sizeof(procedural::Primitive)) / mb
+			<< " MB, build " << buildMs << " ms\n";
 
-		std::cout << "before miss" << std::endl;
-		addShader(missShader, "miss.rmiss.spv",
-			vk::ShaderStageFlagBits::eMissKHR);
+		particlesTessellated = options.particlesTessellated && !options.particleBenchmark;
+		particleBenchmarkRunning = options.particleBenchmark;
+		if (!options.particlesTessellated && !options.particleBenchmark) {
+			return;
+		}
 
-		std::cout << "before chit" << std::endl;
-		addShader(chitShader, "closesthit.rchit.spv",
-			vk::ShaderStageFlagBits::eClosestHitKHR);
+		procedural::TriangleMesh mesh = procedural::tessellate(primitives);
+		std::vector<Buffer> triangleInputs(2);
+		Buffer& vertexBuffer = triangleInputs[0];
+		vertexBuffer.init(physicalDevice, *device, mesh.positions.size() * sizeof(float),
+			bufferUsage, memoryProperty, mesh.positions.data());
+		Buffer& indexBuffer = triangleInputs[1];
+		indexBuffer.init(physicalDevice, *device, mesh.indices.size() * sizeof(uint32_t),
+			bufferUsage, memoryProperty, mesh.indices.data());
 
-		uint32_t raygenGroup = 0;
-		uint32_t missGroup = 1;
-		uint32_t hitGroup = 2;
-		shaderGroups.resize(3);
-
-		// Raygen group
-		shaderGroups[raygenGroup].setType(
-			vk::RayTracingShaderGroupTypeKHR::eGeneral);
-		shaderGroups[raygenGroup].setGeneralShader(raygenShader);
-		shaderGroups[raygenGroup].setClosestHitShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[raygenGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[raygenGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
-
-		// Miss group
-		shaderGroups[missGroup].setType(
-			vk::RayTracingShaderGroupTypeKHR::eGeneral);
-		shaderGroups[missGroup].setGeneralShader(missShader);
-		shaderGroups[missGroup].setClosestHitShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[missGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[missGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
-
-		// Hit group
-		shaderGroups[hitGroup].setType(
-			vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup);
-		shaderGroups[hitGroup].setGeneralShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[hitGroup].setClosestHitShader(chitShader);
-		shaderGroups[hitGroup].setAnyHitShader(VK_SHADER_UNUSED_KHR);
-		shaderGroups[hitGroup].setIntersectionShader(VK_SHADER_UNUSED_KHR);
+		vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+		triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+		triangles.setVertexData(vertexBuffer.address);
+		triangles.setVertexStride(3 * sizeof(float));
+		triangles.setMaxVertex(static_cast<uint32_t>(mesh.positions.size() / 3));
+		triangles.setIndexType(vk::IndexType::eUint32);
+		triangles.setIndexData(indexBuffer.address);
 
+		vk::AccelerationStructureGeometryKHR triangleGeometry{};
+		triangleGeometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+		triangleGeometry.setGeometry({ triangles });
+		triangleGeometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+		buildMs = buildStaticAccel(tessellatedParticleAccel, triangleGeometry, mesh.triangleCount(),
+			std::move(triangleInputs));
+		std::cout << "Tessellated particles: " << mesh.triangleCount() << " triangles, "
+			<< "BLAS " << tessellatedParticleAccel.size / mb << " MB ("
+			<< static_cast<double>(tessellatedParticleAccel.size) / particleAccel.size << "x), inputs "
+			<< mesh.getByteSize() / mb << " MB, build " << buildMs << " ms\n";
 	}
 
-	void createDescriptorPool() {
-		std::vector<vk::DescriptorPoolSize> poolSizes = {
-			{ vk::DescriptorType::eAccelerationStructureKHR, (uint32_t) swapchainImageViews.size()},
-			{ vk::DescriptorType::eStorageImage,  (uint32_t)swapchainImageViews.size() },
+	// Emissive triangles in their own BLAS, the light BVH over them and the
+	// alias table of the sky. The CPU builds use all cores.
+	void createLights() {
+		vk::MemoryPropertyFlags memoryProperty =
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+		bool lighting = options.lighting || options.lightBenchmark;
+		if (!lighting) {
+			std::array<uint32_t, 4> placeholder = {};
+			lightTriangleBuffer.init(physicalDevice, *device, sizeof(placeholder),
+				vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, placeholder.data());
+			lightTreeBuffer.init(physicalDevice, *device, sizeof(placeholder),
+				vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, placeholder.data());
+			environmentBuffer.init(physicalDevice, *device, sizeof(placeholder),
+				vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, placeholder.data());
+			return;
+		}
+		std::cout << "Create lights\n";
+		traceFlags |= g_TraceFlagLights;
+		uniformLights = options.uniformLights;
+
+		using clock = std::chrono::steady_clock;
+		auto elapsedMs = [](clock::time_point start) {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
 		};
 
-		vk::DescriptorPoolCreateInfo createInfo{};
-		createInfo.setPoolSizes(poolSizes);
-		createInfo.setMaxSets(swapchainImageViews.size());
-		createInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
-		descPool = device->createDescriptorPoolUnique(createInfo);
+		uint32_t lightCount = options.lightCount;
+		if (lightCount == 0 && !options.lighting) {
+			lightCount = g_BenchmarkLightCount;
+		}
+		std::vector<lights::Triangle> triangles = lights::makeTriangles(lightCount);
+		auto start = clock::now();
+		std::vector<lights::Node> nodes = lights::buildTree(triangles);
+		double treeMs = elapsedMs(start);
+
+		// Header with the light count, then the nodes
+		std::vector<uint8_t> tree(g_LightHeaderSize + nodes.size() * sizeof(lights::Node));
+		std::memcpy(tree.data(), &lightCount, sizeof(lightCount));
+		if (!nodes.empty()) {
+			std::memcpy(tree.data() + g_LightHeaderSize, nodes.data(), nodes.size() * sizeof(lights::Node));
+		}
+		lightTreeBuffer.init(physicalDevice, *device, tree.size(),
+			vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, tree.data());
+		lights::Triangle placeholder{};
+		lightTriangleBuffer.init(physicalDevice, *device, std::max<size_t>(triangles.size(), 1) * sizeof(lights::Triangle),
+			vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, triangles.empty() ? &placeholder : triangles.data());
+
+		lights::Environment sky = lights::makeSky();
+		start = clock::now();
+		std::vector<lights::EnvironmentTexel> texels = lights::buildEnvironmentTexels(sky);
+		double aliasMs = elapsedMs(start);
+		// A black environment has no texels and a zero width
+		std::array<uint32_t, 4> header = { texels.empty() ? 0 : sky.width, sky.height, 0, 0 };
+		std::vector<uint8_t> environment(g_LightHeaderSize + texels.size() * sizeof(lights::EnvironmentTexel));
+		std::memcpy(environment.data(), header.data(), sizeof(header));
+		if (!texels.empty()) {
+			std::memcpy(environment.data() + g_LightHeaderSize, texels.data(), texels.size() * sizeof(lights::EnvironmentTexel));
+		}
+		environmentBuffer.init(physicalDevice, *device, environment.size(),
+			vk::BufferUsageFlagBits::eStorageBuffer, memoryProperty, environment.data());
 
-		std::vector<vk::DescriptorPoolSize> imGuiPoolSizes = {
-			{vk::DescriptorType::eSampler,1000},
-			{vk::DescriptorType::eCombinedImageSampler,1000},
-			{vk::DescriptorType::eSampledImage,1000},
-			{vk::DescriptorType::eStorageImage,1000},
-			{vk::DescriptorType::eUniformTexelBuffer,1000},
-			{vk::DescriptorType::eStorageTexelBuffer,1000},
-			{vk::DescriptorType::eUniformBuffer,1000},
-			{vk::DescriptorType::eStorageBuffer,1000},
-			{vk::DescriptorType::eUniformBufferDynamic,1000},
-			{vk::DescriptorType::eStorageBufferDynamic,1000},
-			{vk::DescriptorType::eInputAttachment,1000}
-		};
+		std::cout << "Lights: " << lightCount << " emissive triangles, light BVH of " << nodes.size()
+			<< " nodes in " << treeMs << " ms, environment alias table of " << texels.size()
+			<< " texels in " << aliasMs << " ms\n";
+		if (triangles.empty()) {
+			return;
+		}
 
-		vk::DescriptorPoolCreateInfo imGuiPoolInfo = {};
-		imGuiPoolInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
-		imGuiPoolInfo.setMaxSets(1000);
-		imGuiPoolInfo.poolSizeCount = static_cast<uint32_t>(imGuiPoolSizes.size());
-		imGuiPoolInfo.pPoolSizes = imGuiPoolSizes.data();
+		// Corners in world space, the instance is the identity
+		std::vector<float> positions;
+		positions.reserve(triangles.size() * 9);
+		for (const lights::Triangle& triangle : triangles) {
+			for (const lights::Vec3* corner : { &triangle.p0, &triangle.p1, &triangle.p2 }) {
+				positions.insert(positions.end(), corner->begin(), corner->end());
+			}
+		}
+		vk::BufferUsageFlags bufferUsage =
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress;
+		std::vector<Buffer> inputs(1);
+		Buffer& vertexBuffer = inputs[0];
+		vertexBuffer.init(physicalDevice, *device, positions.size() * sizeof(float),
+			bufferUsage, memoryProperty, positions.data());
+
+		vk::AccelerationStructureGeometryTrianglesDataKHR trianglesData{};
+		trianglesData.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+		trianglesData.setVertexData(vertexBuffer.address);
+		trianglesData.setVertexStride(3 * sizeof(float));
+		trianglesData.setMaxVertex(static_cast<uint32_t>(positions.size() / 3));
+		trianglesData.setIndexType(vk::IndexType::eNoneKHR);
 
-		imGuiDescPool = device->createDescriptorPoolUnique(imGuiPoolInfo);
+		vk::AccelerationStructureGeometryKHR geometry{};
+		geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+		geometry.setGeometry({ trianglesData });
+		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
 
+		buildStaticAccel(lightAccel, geometry, lightCount, std::move(inputs));
 	}
 
-	void createDescSetLayout() {
-		std::vector<vk::DescriptorSetLayoutBinding> bindings(2);
+	// Switches the particle instance between its two BLASes
+	void setParticlesTessellated(bool tessellated) {
+		// The old TLAS may still be in use by other frames
+		device->waitIdle();
+		particlesTessellated = tessellated;
+		createTopLevelAS();
+		for (size_t i = 0; i < descSets.size(); i++) {
+			updateDescriptorSet(descSets[i], *hdrImage.view);
+		}
+	}
 
-		bindings[0].setBinding(0);
-		bindings[0].setDescriptorType(vk::DescriptorType::eAccelerationStructureKHR);
-		bindings[0].setDescriptorCount(1);
-		bindings[0].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+	// Long thin triangles in random order, as CAD exports leave them. The
+	// preprocessed BLAS splits the worst of them and is in Morton order.
+	void createCadMesh() {
+		uint32_t triangleCount = options.cadTriangles;
+		if (triangleCount == 0 && options.presplitBenchmark) {
+			triangleCount = g_BenchmarkCadTriangles;
+		}
+		if (triangleCount == 0) {
+			return;
+		}
+		std::cout << "Create CAD mesh\n";
 
-		bindings[1].setBinding(1);
-		bindings[1].setDescriptorType(vk::DescriptorType::eStorageImage);
-		bindings[1].setDescriptorCount(1);
-		bindings[1].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+		using clock = std::chrono::steady_clock;
+		auto elapsedMs = [](clock::time_point start) {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		};
+		constexpr double mb = 1024.0 * 1024.0;
+
+		// Build inputs are kept for builds with other flags
+		auto buildAccel = [&](const geometry::Mesh& mesh, AccelStruct& accel) {
+			vk::BufferUsageFlags bufferUsage =
+				vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+				vk::BufferUsageFlagBits::eShaderDeviceAddress;
+			vk::MemoryPropertyFlags memoryProperty =
+				vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
+			std::vector<Buffer> inputs(2);
+			Buffer& vertexBuffer = inputs[0];
+			vertexBuffer.init(physicalDevice, *device, mesh.positions.size() * sizeof(float),
+				bufferUsage, memoryProperty, mesh.positions.data());
+			Buffer& indexBuffer = inputs[1];
+			indexBuffer.init(physicalDevice, *device, mesh.indices.size() * sizeof(uint32_t),
+				bufferUsage, memoryProperty, mesh.indices.data());
+
+			vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+			triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+			triangles.setVertexData(vertexBuffer.address);
+			triangles.setVertexStride(3 * sizeof(float));
+			triangles.setMaxVertex(mesh.vertexCount());
+			triangles.setIndexType(vk::IndexType::eUint32);
+			triangles.setIndexData(indexBuffer.address);
+
+			vk::AccelerationStructureGeometryKHR geometry{};
+			geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+			geometry.setGeometry({ triangles });
+			geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+			return buildStaticAccel(accel, geometry, mesh.triangleCount(), std::move(inputs));
+		};
 
-		vk::DescriptorSetLayoutCreateInfo createInfo{};
-		createInfo.setBindings(bindings);
-		descSetLayout = device->createDescriptorSetLayoutUnique(createInfo);
+		auto start = clock::now();
+		geometry::Mesh mesh = presplit::makeCadMesh(triangleCount);
+		double generateMs = elapsedMs(start);
+		cadBuildMs[0] = buildAccel(mesh, cadAccel);
+		std::cout << "CAD mesh: " << mesh.triangleCount() << " triangles, " << mesh.vertexCount()
+			<< " vertices in " << generateMs << " ms, BLAS " << cadAccel.size / mb << " MB, build "
+			<< cadBuildMs[0] << " ms\n";
+
+		presplitBenchmarkRunning = options.presplitBenchmark;
+		cadPreprocessed = options.presplit && !options.presplitBenchmark;
+		if (!options.presplit && !options.presplitBenchmark) {
+			return;
+		}
+		presplit::Settings settings{};
+		settings.budget = options.presplitBudget;
+		presplit::Report report{};
+		geometry::Mesh preprocessed = presplit::preprocess(mesh, settings, report);
+		report.print(std::cout);
+		cadBuildMs[1] = buildAccel(preprocessed, presplitCadAccel);
+		std::cout << "Preprocessed CAD mesh: BLAS " << presplitCadAccel.size / mb << " MB ("
+			<< static_cast<double>(presplitCadAccel.size) / cadAccel.size << "x), build " << cadBuildMs[1]
+			<< " ms, with preprocessing " << cadBuildMs[1] + report.splitMs + report.reorderMs << " ms\n";
 	}
 
-	void createDescriptorSets() {
-		std::cout << "Create Descriptor Set\n";
+	// Switches the CAD instance between its raw and preprocessed BLAS
+	void setCadPreprocessed(bool preprocessed) {
+		// The old TLAS may still be in use by other frames
+		device->waitIdle();
+		cadPreprocessed = preprocessed;
+		createTopLevelAS();
+		for (size_t i = 0; i < descSets.size(); i++) {
+			updateDescriptorSet(descSets[i], *hdrImage.view);
+		}
+	}
+
+	void createProbes() {
+		uint32_t viewCount = std::max(1u, options.probeCount * probes::kFaceCount);
+		vk::Extent2D extent{ 1, 1 };
+		std::vector<probes::View> views(viewCount);
+		if (options.probeCount > 0) {
+			extent = vk::Extent2D{ options.probeSize, options.probeSize };
+			std::vector<glm::vec3> positions = probes::makeGrid(options.probeCount);
+			for (uint32_t probe = 0; probe < options.probeCount; probe++) {
+				auto faces = probes::getCubeViews(positions[probe]);
+				std::copy(faces.begin(), faces.end(), views.begin() + probe * probes::kFaceCount);
+			}
+		}
+		probeImage.init(physicalDevice, *device, extent, vk::Format::eR32G32B32A32Sfloat,
+			vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc,
+			viewCount, vk::ImageViewType::e2DArray);
+		probeViewBuffer.init(physicalDevice, *device, views.size() * sizeof(probes::View),
+			vk::BufferUsageFlagBits::eStorageBuffer,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, views.data());
+
+		vkutils::oneTimeSubmit(*device, *commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				vkutils::setImageLayout(commandBuffer, *probeImage.image,
+					vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral,
+					{ vk::ImageAspectFlagBits::eColor, 0, 1, 0, viewCount });
+			});
+	}
+
+	// Renders the probes of --bake-probes twice, with one dispatch per face
+	// and sample and with one multiview dispatch per sample for all faces,
+	// compares the GPU time and writes the probes of the batched run.
+	void bakeProbes() {
+		if (options.probeCount == 0) {
+			return;
+		}
+		uint32_t size = options.probeSize;
+		uint32_t viewCount = probeImage.layers;
+		uint32_t samples = options.probeSamples;
+		std::cout << "Bake " << options.probeCount << " probes: " << viewCount << " views of "
+			<< size << "x" << size << ", " << samples << " samples\n";
+
+		// Nothing uses frame slot 0 before the first frame
+		writeFrameUniforms(0);
+		auto rayTracing = vk::PipelineStageFlagBits2::eRayTracingShaderKHR;
+		vk::ImageSubresourceRange layerRange{ vk::ImageAspectFlagBits::eColor, 0, 1, 0, viewCount };
+		vk::DeviceSize layerSize = static_cast<vk::DeviceSize>(size) * size * 4 * sizeof(float);
+		Buffer readback;
+		readback.init(physicalDevice, *device, layerSize * viewCount, vk::BufferUsageFlagBits::eTransferDst,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+
+		rendergraph::RenderGraph graph;
+		graph.init(physicalDevice, *device, synchronization2Enabled);
+		auto bake = [&](bool batched) {
+			graph.reset();
+			auto views = graph.importImage("probe-views", *probeImage.image, layerRange,
+				rendergraph::previousFrame(vk::ImageLayout::eGeneral), vk::ImageLayout::eGeneral);
+			auto stats = graph.importBuffer("ray-stats", *rayStatsBuffer.buffer);
+			auto tlas = graph.importAccel("tlas");
+			auto pixels = graph.importBuffer("probe-readback", *readback.buffer);
+
+			graph.addPass("ray-stats-clear", [&](vk::CommandBuffer commandBuffer) {
+				commandBuffer.fillBuffer(*rayStatsBuffer.buffer, 0, sizeof(uint32_t), 0);
+			})
+				.write(stats, rendergraph::transferDst());
+
+			// Every sample reads the mean of the one before
+			for (uint32_t sample = 0; sample < samples; sample++) {
+				graph.addPass("probe-trace", [=, this](vk::CommandBuffer commandBuffer) {
+					if (sample == 0 && timestampPool) {
+						commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+							g_TimestampTraceBegin);
+					}
+					commandBuffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *pipeline);
+					commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, *pipelineLayout,
+						0, descSets[0], 0u);
+					TraceParams params{};
+					params.sampleIndex = sample;
+					uint32_t dispatchCount = batched ? 1 : viewCount;
+					for (uint32_t dispatch = 0; dispatch < dispatchCount; dispatch++) {
+						params.viewOffset = dispatch;
+						commandBuffer.pushConstants(*pipelineLayout, g_TraceStages, 0, sizeof(TraceParams), &params);
+						commandBuffer.traceRaysKHR(sbt.multiviewRaygenRegion, sbt.missRegion, sbt.hitRegion, {},
+							size, size, batched ? viewCount : 1);
+					}
+					if (sample + 1 == samples && timestampPool) {
+						commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+							g_TimestampTraceEnd);
+					}
+				})
+					.read(tlas, rendergraph::accelRead(rayTracing))
+					.write(views, rendergraph::storageReadWrite(rayTracing))
+					.write(stats, rendergraph::storageReadWrite(rayTracing));
+			}
+
+			if (batched) {
+				graph.addPass("probe-readback", [&](vk::CommandBuffer commandBuffer) {
+					vk::BufferImageCopy region{};
+					region.setImageSubresource({ vk::ImageAspectFlagBits::eColor, 0, 0, viewCount });
+					region.setImageExtent({ size, size, 1 });
+					commandBuffer.copyImageToBuffer(*probeImage.image, vk::ImageLayout::eTransferSrcOptimal,
+						*readback.buffer, region);
+				})
+					.read(views, rendergraph::transferSrc())
+					.write(pixels, rendergraph::transferDst());
+			}
+
+			using clock = std::chrono::steady_clock;
+			auto start = clock::now();
+			vkutils::oneTimeSubmit(*device, *commandPool, queue,
+				[&](vk::CommandBuffer commandBuffer) {
+					if (timestampPool) {
+						commandBuffer.resetQueryPool(*timestampPool, 0, g_TimestampsPerFrame);
+					}
+					graph.compile();
+					graph.execute(commandBuffer);
+				});
+			double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+			// The submit time is an upper bound when timestamps are missing
+			uint64_t timestamps[2];
+			if (timestampPool && device->getQueryPoolResults(*timestampPool, g_TimestampTraceBegin, 2,
+				sizeof(timestamps), timestamps, sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess) {
+				ms = (timestamps[1] - timestamps[0]) * timestampPeriod / 1e6;
+			}
+			const uint32_t* rayCounts = static_cast<const uint32_t*>(
+				device->mapMemory(*rayStatsBuffer.memory, 0, VK_WHOLE_SIZE));
+			uint32_t rays = rayCounts[0];
+			device->unmapMemory(*rayStatsBuffer.memory);
+			std::cout << (batched ? "Batched\t\t" : "Per view\t") << (batched ? samples : samples * viewCount)
+				<< "\t\t" << ms << "\t" << (ms > 0.0 ? rays / (ms * 1e3) : 0.0) << "\n";
+			return ms;
+		};
+
+		std::cout << "Dispatch\tDispatches\tms\tMrays/s\n";
+		double perViewMs = bake(false);
+		double batchedMs = bake(true);
+		std::cout << "Batched speedup: " << (batchedMs > 0.0 ? perViewMs / batchedMs : 0.0) << "x\n";
+
+		const float* faces = static_cast<const float*>(device->mapMemory(*readback.memory, 0, VK_WHOLE_SIZE));
+		for (uint32_t probe = 0; probe < options.probeCount; probe++) {
+			std::ostringstream path;
+			path << options.probeOutput << "_" << std::setw(4) << std::setfill('0') << probe << ".pfm";
+			const float* probeFaces = faces + layerSize / sizeof(float) * probes::kFaceCount * probe;
+			if (!probes::writeProbe(path.str(), size, probeFaces)) {
+				std::cerr << "Failed to write " << path.str() << "\n";
+			}
+		}
+		device->unmapMemory(*readback.memory);
+		std::cout << "Wrote " << options.probeCount << " probes to " << options.probeOutput << "_*.pfm\n";
+	}
+
+	vk::AccelerationStructureGeometryKHR getTopLevelGeometry() const {
+		vk::AccelerationStructureGeometryInstancesDataKHR instancesData{};
+		instancesData.setArrayOfPointers(false);
+		instancesData.setData(topInstanceBuffer.address);
+
+		vk::AccelerationStructureGeometryKHR geometry{};
+		geometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+		geometry.setGeometry({ instancesData });
+		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+		return geometry;
+	}
+
+	// Instances of the TLAS: the static mesh or the mesh pack meshes, then
+	// the optional instances
+	std::vector<vk::AccelerationStructureInstanceKHR> getTopInstances() {
+		std::vector<vk::AccelerationStructureInstanceKHR> accelInstances;
+		if (options.meshPack.empty()) {
+			// Identity placement combined with the dequantization of the BLAS
+			vk::TransformMatrixKHR transform = meshTransform;
+
+			vk::AccelerationStructureInstanceKHR accelInstance{};
+			accelInstance.setTransform(transform);
+			accelInstance.setInstanceCustomIndex(instances::kStaticMesh);
+			accelInstance.setMask(0xFF);
+			accelInstance.setInstanceShaderBindingTableRecordOffset(0);
+			accelInstance.setFlags(
+				vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			accelInstance.setAccelerationStructureReference(
+				bottomAccel.buffer.address);
+			accelInstances.push_back(accelInstance);
+		}
+		else {
+			// Resident BLASes, or box proxies for evicted meshes
+			accelInstances = residency.getInstances();
+		}
+		if (options.deformable) {
+			accelInstances.push_back(deformableMesh.getInstance(g_DeformableTransform));
+		}
+		if (options.foliage) {
+			vk::AccelerationStructureInstanceKHR accelInstance{};
+			accelInstance.setTransform(g_FoliageTransform);
+			accelInstance.setInstanceCustomIndex(foliage::kInstanceCustomIndex);
+			accelInstance.setMask(0xFF);
+			accelInstance.setInstanceShaderBindingTableRecordOffset(0);
+			accelInstance.setFlags(
+				vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			accelInstance.setAccelerationStructureReference(
+				foliageAccel.buffer.address);
+			accelInstances.push_back(accelInstance);
+		}
+		if (particleAccel.accel) {
+			// The tessellation is plain triangles and takes the opaque hit group
+			vk::AccelerationStructureInstanceKHR accelInstance{};
+			accelInstance.setTransform(g_ParticleTransform);
+			accelInstance.setInstanceCustomIndex(procedural::kInstanceCustomIndex);
+			accelInstance.setMask(0xFF);
+			accelInstance.setInstanceShaderBindingTableRecordOffset(
+				particlesTessellated ? g_OpaqueMaterial : g_ProceduralMaterial);
+			accelInstance.setFlags(
+				vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			accelInstance.setAccelerationStructureReference(particlesTessellated ?
+				tessellatedParticleAccel.buffer.address : particleAccel.buffer.address);
+			accelInstances.push_back(accelInstance);
+		}
+		if (cadAccel.accel) {
+			vk::AccelerationStructureInstanceKHR accelInstance{};
+			accelInstance.setTransform(g_CadTransform);
+			accelInstance.setInstanceCustomIndex(presplit::kInstanceCustomIndex);
+			accelInstance.setMask(0xFF);
+			accelInstance.setInstanceShaderBindingTableRecordOffset(g_OpaqueMaterial);
+			accelInstance.setFlags(
+				vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			accelInstance.setAccelerationStructureReference(cadPreprocessed ?
+				presplitCadAccel.buffer.address : cadAccel.buffer.address);
+			accelInstances.push_back(accelInstance);
+		}
+		if (lightAccel.accel) {
+			// Emitters face both ways and take the opaque hit group
+			vk::AccelerationStructureInstanceKHR accelInstance{};
+			accelInstance.setTransform(vk::TransformMatrixKHR{ std::array{
+				std::array{ 1.0f, 0.0f, 0.0f, 0.0f },
+				std::array{ 0.0f, 1.0f, 0.0f, 0.0f },
+				std::array{ 0.0f, 0.0f, 1.0f, 0.0f },
+			} });
+			accelInstance.setInstanceCustomIndex(lights::kInstanceCustomIndex);
+			accelInstance.setMask(0xFF);
+			accelInstance.setInstanceShaderBindingTableRecordOffset(g_OpaqueMaterial);
+			accelInstance.setFlags(
+				vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			accelInstance.setAccelerationStructureReference(lightAccel.buffer.address);
+			accelInstances.push_back(accelInstance);
+		}
+		return accelInstances;
+	}
+
+	void createTopInstanceBuffer(const std::vector<vk::AccelerationStructureInstanceKHR>& accelInstances) {
+		topInstanceBuffer.init(
+			physicalDevice, *device,
+			sizeof(vk::AccelerationStructureInstanceKHR) * accelInstances.size(),
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eHostVisible |
+			vk::MemoryPropertyFlagBits::eHostCoherent,
+			accelInstances.data());
+		topInstanceCount = static_cast<uint32_t>(accelInstances.size());
+	}
+
+	void createTopLevelAS() {
+		std::cout << "Create TLAS\n";
+
+		createTopInstanceBuffer(getTopInstances());
+
+		// The deformable BLAS changes its bounds every frame. The instances
+		// stay the same, so a refit of the TLAS follows it. Streaming a mesh
+		// pack changes the instances but not their count, updateResidency
+		// rebuilds the TLAS in place with the kept scratch buffer.
+		vk::BuildAccelerationStructureFlagsKHR flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+		if (options.deformable) {
+			flags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+		}
+		topAccel.init(physicalDevice, *device, *commandPool, queue,
+			vk::AccelerationStructureTypeKHR::eTopLevel,
+			getTopLevelGeometry(), topInstanceCount, flags, !options.meshPack.empty());
+	}
+
+	void addShader(uint32_t shaderIndex,
+		const std::string& filename,
+		vk::ShaderStageFlagBits stage) {
+		auto shader_bin_root = std::filesystem::current_path();
+
+
+
+		std::cout << "Loading shader: " << shader_bin_root/filename << std::endl;
+
+		shaderModules[shaderIndex] =
+			vkutils::createShaderModule(*device, (shader_bin_root / filename).string());
+		std::cout << "after createShader" << std::endl;
+		shaderStages[shaderIndex].setStage(stage);
+		shaderStages[shaderIndex].setModule(*shaderModules[shaderIndex]);
+		shaderStages[shaderIndex].setPName("main");
+		shaderStages[shaderIndex].setPSpecializationInfo(&variantSpecialization);
+	}
+
+	void prepareShaders() {
+		std::cout << "Prepare shaders\n";
+
+		variantEntries = getVariantMapEntries();
+		variantSpecialization.setMapEntries(variantEntries);
+		variantSpecialization.setDataSize(sizeof(TraceVariant));
+		variantSpecialization.setPData(&activeVariant);
+
+		shaderStages.resize(9);
+		shaderModules.resize(9);
+
+		std::cout << "before rgen" << std::endl;
+		addShader(g_RaygenShader, "raygen.rgen.spv",
+			vk::ShaderStageFlagBits::eRaygenKHR);
+
+		std::cout << "before miss" << std::endl;
+		addShader(g_MissShader, "miss.rmiss.spv",
+			vk::ShaderStageFlagBits::eMissKHR);
+
+		std::cout << "before chit" << std::endl;
+		addShader(g_ClosestHitShader, "closesthit.rchit.spv",
+			vk::ShaderStageFlagBits::eClosestHitKHR);
+
+		addShader(g_WavefrontRaygenShader, "wavefront.rgen.spv",
+			vk::ShaderStageFlagBits::eRaygenKHR);
+
+		addShader(g_AdaptiveRaygenShader, "adaptive.rgen.spv",
+			vk::ShaderStageFlagBits::eRaygenKHR);
+
+		addShader(g_MultiviewRaygenShader, "multiview.rgen.spv",
+			vk::ShaderStageFlagBits::eRaygenKHR);
+
+		addShader(g_AnyHitShader, "alphatest.rahit.spv",
+			vk::ShaderStageFlagBits::eAnyHitKHR);
+
+		// Procedural hit group: spheres and capsules in AABBs
+		addShader(g_ProceduralHitShader, "procedural.rchit.spv",
+			vk::ShaderStageFlagBits::eClosestHitKHR);
+		addShader(g_IntersectionShader, "procedural.rint.spv",
+			vk::ShaderStageFlagBits::eIntersectionKHR);
+	}
+
+	static vk::RayTracingShaderGroupCreateInfoKHR getGeneralGroup(uint32_t shader) {
+		vk::RayTracingShaderGroupCreateInfoKHR group{};
+		group.setType(vk::RayTracingShaderGroupTypeKHR::eGeneral);
+		group.setGeneralShader(shader);
+		group.setClosestHitShader(VK_SHADER_UNUSED_KHR);
+		group.setAnyHitShader(VK_SHADER_UNUSED_KHR);
+		group.setIntersectionShader(VK_SHADER_UNUSED_KHR);
+		return group;
+	}
+
+	static vk::RayTracingShaderGroupCreateInfoKHR getHitGroup(uint32_t closestHitShader,
+		uint32_t anyHitShader = VK_SHADER_UNUSED_KHR) {
+		vk::RayTracingShaderGroupCreateInfoKHR group{};
+		group.setType(vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup);
+		group.setGeneralShader(VK_SHADER_UNUSED_KHR);
+		group.setClosestHitShader(closestHitShader);
+		group.setAnyHitShader(anyHitShader);
+		group.setIntersectionShader(VK_SHADER_UNUSED_KHR);
+		return group;
+	}
+
+	static vk::RayTracingShaderGroupCreateInfoKHR getProceduralHitGroup(uint32_t closestHitShader,
+		uint32_t intersectionShader) {
+		vk::RayTracingShaderGroupCreateInfoKHR group{};
+		group.setType(vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup);
+		group.setGeneralShader(VK_SHADER_UNUSED_KHR);
+		group.setClosestHitShader(closestHitShader);
+		group.setAnyHitShader(VK_SHADER_UNUSED_KHR);
+		group.setIntersectionShader(intersectionShader);
+		return group;
+	}
+
+	void createDescriptorPool() {
+		std::vector<vk::DescriptorPoolSize> poolSizes = {
+			{ vk::DescriptorType::eAccelerationStructureKHR, (uint32_t) swapchainImageViews.size()},
+			{ vk::DescriptorType::eStorageImage,  4 * (uint32_t)swapchainImageViews.size() },
+			{ vk::DescriptorType::eStorageBuffer,  17 * (uint32_t)swapchainImageViews.size() },
+			{ vk::DescriptorType::eUniformBufferDynamic, (uint32_t)swapchainImageViews.size() },
+		};
+
+		vk::DescriptorPoolCreateInfo createInfo{};
+		createInfo.setPoolSizes(poolSizes);
+		createInfo.setMaxSets(swapchainImageViews.size());
+		createInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+		descPool = device->createDescriptorPoolUnique(createInfo);
+
+		std::vector<vk::DescriptorPoolSize> imGuiPoolSizes = {
+			{vk::DescriptorType::eSampler,1000},
+			{vk::DescriptorType::eCombinedImageSampler,1000},
+			{vk::DescriptorType::eSampledImage,1000},
+			{vk::DescriptorType::eStorageImage,1000},
+			{vk::DescriptorType::eUniformTexelBuffer,1000},
+			{vk::DescriptorType::eStorageTexelBuffer,1000},
+			{vk::DescriptorType::eUniformBuffer,1000},
+			{vk::DescriptorType::eStorageBuffer,1000},
+			{vk::DescriptorType::eUniformBufferDynamic,1000},
+			{vk::DescriptorType::eStorageBufferDynamic,1000},
+			{vk::DescriptorType::eInputAttachment,1000}
+		};
+
+		vk::DescriptorPoolCreateInfo imGuiPoolInfo = {};
+		imGuiPoolInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet);
+		imGuiPoolInfo.setMaxSets(1000);
+		imGuiPoolInfo.poolSizeCount = static_cast<uint32_t>(imGuiPoolSizes.size());
+		imGuiPoolInfo.pPoolSizes = imGuiPoolSizes.data();
+
+		imGuiDescPool = device->createDescriptorPoolUnique(imGuiPoolInfo);
+
+	}
+
+	void createDescSetLayout() {
+		std::vector<vk::DescriptorSetLayoutBinding> bindings(23);
+		// The ray query backend binds the same set to trace_query.comp
+		vk::ShaderStageFlags compute = vk::ShaderStageFlagBits::eCompute;
+
+		bindings[0].setBinding(0);
+		bindings[0].setDescriptorType(vk::DescriptorType::eAccelerationStructureKHR);
+		bindings[0].setDescriptorCount(1);
+		bindings[0].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR | compute);
+
+		// Radiance, normal/depth and motion
+		for (uint32_t i = 1; i <= 3; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageImage);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR | compute);
+		}
+
+		// Mesh indices and normals
+		for (uint32_t i = 4; i <= 5; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eClosestHitKHR | compute);
+		}
+
+		// Wavefront ray queues, counters and the ray statistics
+		for (uint32_t i = 6; i <= 9; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR | (i == 9 ? compute : vk::ShaderStageFlags{}));
+		}
+
+		// Per-frame uniforms, also read by the hit shaders
+		bindings[10].setBinding(10);
+		bindings[10].setDescriptorType(vk::DescriptorType::eUniformBufferDynamic);
+		bindings[10].setDescriptorCount(1);
+		bindings[10].setStageFlags(g_TraceStages);
+
+		// Alpha mask, UVs of the alpha-tested triangles and the any-hit statistics
+		for (uint32_t i = 11; i <= 13; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eAnyHitKHR | compute);
+		}
+
+		// Particle primitives
+		bindings[14].setBinding(14);
+		bindings[14].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		bindings[14].setDescriptorCount(1);
+		bindings[14].setStageFlags(
+			vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eClosestHitKHR | compute);
+
+		// Adaptive sampling: accumulation, pixel list and statistics
+		for (uint32_t i = 15; i <= 17; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR | compute);
+		}
+
+		// Environment, light BVH and emissive triangles, sampled by the ray
+		// generation shaders
+		for (uint32_t i = 18; i <= 20; i++) {
+			bindings[i].setBinding(i);
+			bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			bindings[i].setDescriptorCount(1);
+			bindings[i].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR | compute);
+		}
+
+		// Layered views and their cameras, multiview.rgen only
+		bindings[21].setBinding(21);
+		bindings[21].setDescriptorType(vk::DescriptorType::eStorageImage);
+		bindings[21].setDescriptorCount(1);
+		bindings[21].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+		bindings[22].setBinding(22);
+		bindings[22].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		bindings[22].setDescriptorCount(1);
+		bindings[22].setStageFlags(vk::ShaderStageFlagBits::eRaygenKHR);
+
+		vk::DescriptorSetLayoutCreateInfo createInfo{};
+		createInfo.setBindings(bindings);
+		descSetLayout = device->createDescriptorSetLayoutUnique(createInfo);
+	}
+
+	void createDescriptorSets() {
+		std::cout << "Create Descriptor Set\n";
 
 		vk::DescriptorSetAllocateInfo allocateInfo{};
 		allocateInfo.setDescriptorPool(*descPool);
@@ -575,34 +2243,863 @@ private:
 
 		auto imageIndex = 0;
 		for (auto descSet : descSets) {
-			updateDescriptorSet(descSet, *swapchainImageViews[imageIndex]);
+			updateDescriptorSet(descSet, *hdrImage.view);
 			imageIndex++;
 		}
 	}
 
-	void createRayTracingPipeline() {
-		std::cout << "Create pipeline" << std::endl;
-
-		vk::PipelineLayoutCreateInfo layoutCreateInfo{};
-		layoutCreateInfo.setSetLayouts(*descSetLayout);
-		pipelineLayout = device->createPipelineLayoutUnique(layoutCreateInfo);
+	void createRayTracingPipeline() {
+		std::cout << "Create pipeline" << std::endl;
+
+		// Shared with the ray query pipeline
+		vk::PushConstantRange pushRange{ g_TraceStages, 0, sizeof(TraceParams) };
+		vk::PipelineLayoutCreateInfo layoutCreateInfo{};
+		layoutCreateInfo.setSetLayouts(*descSetLayout);
+		layoutCreateInfo.setPushConstantRanges(pushRange);
+		pipelineLayout = device->createPipelineLayoutUnique(layoutCreateInfo);
+
+		specializeBounces = options.specializeBounces;
+		activeVariant = getRequestedVariant();
+		materialLibraries.resize(g_MaterialCount);
+		rebuildLibraries(true, g_AllMaterials);
+		pipeline = buildRayTracingPipeline();
+
+		if (options.pipelineLibraryBenchmark) {
+			benchmarkPipelineLibraries();
+		}
+	}
+
+	// Raygen and miss shaders, shared by every material. The group order
+	// matches g_RaygenGroup, g_MissGroup, g_WavefrontRaygenGroup,
+	// g_AdaptiveRaygenGroup and g_MultiviewRaygenGroup.
+	vk::UniquePipeline buildGeneralLibrary() {
+		std::vector<vk::PipelineShaderStageCreateInfo> stages = {
+			shaderStages[g_RaygenShader], shaderStages[g_MissShader], shaderStages[g_WavefrontRaygenShader],
+			shaderStages[g_AdaptiveRaygenShader], shaderStages[g_MultiviewRaygenShader],
+		};
+		std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups = {
+			getGeneralGroup(0), getGeneralGroup(1), getGeneralGroup(2), getGeneralGroup(3), getGeneralGroup(4),
+		};
+		return vkutils::createRayTracingLibrary(*device, *pipelineLayout, stages, groups, g_LibraryInterface);
+	}
+
+	// Hit group of one material. Triangle materials use closesthit.rchit,
+	// the alpha-tested one adds alphatest.rahit. The procedural material
+	// intersects spheres and capsules instead.
+	vk::UniquePipeline buildMaterialLibrary(uint32_t material = g_OpaqueMaterial) {
+		std::vector<vk::PipelineShaderStageCreateInfo> stages = { shaderStages[g_ClosestHitShader] };
+		std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups = { getHitGroup(0) };
+		if (material == g_AlphaTestedMaterial) {
+			stages.push_back(shaderStages[g_AnyHitShader]);
+			groups = { getHitGroup(0, 1) };
+		}
+		else if (material == g_ProceduralMaterial) {
+			stages = { shaderStages[g_ProceduralHitShader], shaderStages[g_IntersectionShader] };
+			groups = { getProceduralHitGroup(0, 1) };
+		}
+		return vkutils::createRayTracingLibrary(*device, *pipelineLayout, stages, groups, g_LibraryInterface);
+	}
+
+	// Shader files of the stages buildMaterialLibrary uses for the material
+	static std::vector<const char*> getMaterialShaderFiles(uint32_t material) {
+		if (material == g_AlphaTestedMaterial) {
+			return { "closesthit.rchit.spv", "alphatest.rahit.spv" };
+		}
+		if (material == g_ProceduralMaterial) {
+			return { "procedural.rchit.spv", "procedural.rint.spv" };
+		}
+		return { "closesthit.rchit.spv" };
+	}
+
+	// Runs the tasks on up to one worker thread per core
+	static void runParallel(const std::vector<std::function<void()>>& tasks) {
+		std::atomic<size_t> next{ 0 };
+		auto worker = [&]() {
+			for (size_t i = next++; i < tasks.size(); i = next++) {
+				tasks[i]();
+			}
+		};
+		size_t threadCount = std::min<size_t>(tasks.size(), std::max(1u, std::thread::hardware_concurrency()));
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < threadCount; t++) {
+			threads.emplace_back(worker);
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	// Rebuilds the general library and the materials of the mask in
+	// parallel and returns the replaced ones, which the current pipeline may
+	// still use. The other libraries are kept for the next link.
+	std::vector<vk::UniquePipeline> rebuildLibraries(bool general, uint32_t materials) {
+		std::vector<vk::UniquePipeline> replaced;
+		std::vector<std::function<void()>> tasks;
+		if (general) {
+			replaced.push_back(std::move(generalLibrary));
+			tasks.push_back([this]() { generalLibrary = buildGeneralLibrary(); });
+		}
+		for (uint32_t material = 0; material < materialLibraries.size(); material++) {
+			if ((materials & (1u << material)) != 0) {
+				replaced.push_back(std::move(materialLibraries[material]));
+				tasks.push_back([this, material]() {
+					materialLibraries[material] = buildMaterialLibrary(material);
+				});
+			}
+		}
+		runParallel(tasks);
+		return replaced;
+	}
+
+	vk::UniquePipeline linkLibraries(vk::Pipeline general, const std::vector<vk::UniquePipeline>& materials) {
+		std::vector<vk::Pipeline> libraries = { general };
+		for (const auto& material : materials) {
+			libraries.push_back(*material);
+		}
+		return vkutils::linkRayTracingPipeline(*device, *pipelineLayout, libraries, g_LibraryInterface);
+	}
+
+	vk::UniquePipeline buildRayTracingPipeline() {
+		return linkLibraries(*generalLibrary, materialLibraries);
+	}
+
+	// All stages compiled in one pipeline, the way it was built before libraries
+	vk::UniquePipeline buildMonolithicPipeline(uint32_t materialCount) {
+		std::vector<vk::PipelineShaderStageCreateInfo> stages = {
+			shaderStages[g_RaygenShader], shaderStages[g_MissShader], shaderStages[g_WavefrontRaygenShader],
+			shaderStages[g_AdaptiveRaygenShader], shaderStages[g_MultiviewRaygenShader],
+		};
+		std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups = {
+			getGeneralGroup(0), getGeneralGroup(1), getGeneralGroup(2), getGeneralGroup(3), getGeneralGroup(4),
+		};
+		for (uint32_t i = 0; i < materialCount; i++) {
+			groups.push_back(getHitGroup(static_cast<uint32_t>(stages.size())));
+			stages.push_back(shaderStages[g_ClosestHitShader]);
+		}
+
+		vk::RayTracingPipelineCreateInfoKHR pipelineCreateInfo{};
+		pipelineCreateInfo.setLayout(*pipelineLayout);
+		pipelineCreateInfo.setStages(stages);
+		pipelineCreateInfo.setGroups(groups);
+		pipelineCreateInfo.setMaxPipelineRayRecursionDepth(1);
+		auto result = device->createRayTracingPipelineKHRUnique(
+			nullptr, nullptr, pipelineCreateInfo);
+		if (result.result != vk::Result::eSuccess) {
+			std::cerr << "Failed to create ray tracing pipeline\n";
+			std::abort();
+		}
+
+		return std::move(result.value);
+	}
+
+	// Compares compiling everything in one pipeline with building libraries
+	// in parallel and linking them, as the material count grows. Drivers may
+	// cache identical stages, so the monolithic times are a lower bound.
+	void benchmarkPipelineLibraries() {
+		using clock = std::chrono::steady_clock;
+		auto elapsedMs = [](clock::time_point start) {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		};
+
+		std::cout << "Materials\tMonolithic ms\tLibraries ms\tLink ms\tAdd material ms\n";
+		for (uint32_t materialCount : { 1u, 2u, 4u, 8u, 16u, 32u, 64u }) {
+			auto start = clock::now();
+			auto monolithic = buildMonolithicPipeline(materialCount);
+			double monolithicMs = elapsedMs(start);
+
+			vk::UniquePipeline general;
+			std::vector<vk::UniquePipeline> materials(materialCount);
+			std::vector<std::function<void()>> tasks;
+			tasks.push_back([&]() { general = buildGeneralLibrary(); });
+			for (auto& material : materials) {
+				tasks.push_back([&]() { material = buildMaterialLibrary(); });
+			}
+			start = clock::now();
+			runParallel(tasks);
+			double librariesMs = elapsedMs(start);
+
+			start = clock::now();
+			auto linked = linkLibraries(*general, materials);
+			double linkMs = elapsedMs(start);
+
+			start = clock::now();
+			materials.push_back(buildMaterialLibrary());
+			auto relinked = linkLibraries(*general, materials);
+			double addMs = elapsedMs(start);
+
+			std::cout << materialCount << "\t" << monolithicMs << "\t" << librariesMs << "\t"
+				<< linkMs << "\t" << addMs << "\n";
+		}
+	}
+
+	void createTonemapPipeline() {
+		std::cout << "Create tonemap pipeline" << std::endl;
+
+		auto shader_bin_root = std::filesystem::current_path();
+		tonemapShader = vkutils::createShaderModule(*device, (shader_bin_root / "tonemap.comp.spv").string());
+
+		tonemapSetLayout = vkutils::createStorageImageSetLayout(*device, 2);
+
+		// The output image changes with the swapchain image, so there is one set per frame
+		vk::DescriptorPoolSize poolSize{ vk::DescriptorType::eStorageImage, 2 * g_MaxFramesInFlight };
+		vk::DescriptorPoolCreateInfo poolInfo{};
+		poolInfo.setPoolSizes(poolSize);
+		poolInfo.setMaxSets(g_MaxFramesInFlight);
+		tonemapDescPool = device->createDescriptorPoolUnique(poolInfo);
+
+		auto setLayouts = std::vector<vk::DescriptorSetLayout>(g_MaxFramesInFlight, *tonemapSetLayout);
+		vk::DescriptorSetAllocateInfo allocateInfo{};
+		allocateInfo.setDescriptorPool(*tonemapDescPool);
+		allocateInfo.setSetLayouts(setLayouts);
+		tonemapDescSets = device->allocateDescriptorSets(allocateInfo);
+
+		vk::PushConstantRange pushRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(TonemapParams) };
+		vk::PipelineLayoutCreateInfo layoutCreateInfo{};
+		layoutCreateInfo.setSetLayouts(*tonemapSetLayout);
+		layoutCreateInfo.setPushConstantRanges(pushRange);
+		tonemapPipelineLayout = device->createPipelineLayoutUnique(layoutCreateInfo);
+
+		tonemapPipeline = vkutils::createComputePipeline(*device, *tonemapShader, *tonemapPipelineLayout);
+	}
+
+	void createDenoiserPipelines() {
+		std::cout << "Create denoiser pipelines" << std::endl;
+
+		auto shader_bin_root = std::filesystem::current_path();
+		svgfTemporalShader = vkutils::createShaderModule(*device, (shader_bin_root / "svgf_temporal.comp.spv").string());
+		svgfAtrousShader = vkutils::createShaderModule(*device, (shader_bin_root / "svgf_atrous.comp.spv").string());
+
+		svgfTemporalSetLayout = vkutils::createStorageImageSetLayout(*device, 8);
+		svgfAtrousSetLayout = vkutils::createStorageImageSetLayout(*device, 3);
+
+		// Ping-pong targets are transient, so the sets are rewritten every frame
+		uint32_t atrousSetCount = g_MaxFramesInFlight * denoiserParams.iterations;
+		vk::DescriptorPoolSize poolSize{ vk::DescriptorType::eStorageImage,
+			8 * g_MaxFramesInFlight + 3 * atrousSetCount };
+		vk::DescriptorPoolCreateInfo poolInfo{};
+		poolInfo.setPoolSizes(poolSize);
+		poolInfo.setMaxSets(g_MaxFramesInFlight + atrousSetCount);
+		svgfDescPool = device->createDescriptorPoolUnique(poolInfo);
+
+		auto temporalLayouts = std::vector<vk::DescriptorSetLayout>(g_MaxFramesInFlight, *svgfTemporalSetLayout);
+		svgfTemporalDescSets = device->allocateDescriptorSets({ *svgfDescPool, temporalLayouts });
+		auto atrousLayouts = std::vector<vk::DescriptorSetLayout>(atrousSetCount, *svgfAtrousSetLayout);
+		svgfAtrousDescSets = device->allocateDescriptorSets({ *svgfDescPool, atrousLayouts });
+
+		vk::PushConstantRange temporalRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(denoiser::TemporalPushConstants) };
+		vk::PipelineLayoutCreateInfo temporalLayoutInfo{};
+		temporalLayoutInfo.setSetLayouts(*svgfTemporalSetLayout);
+		temporalLayoutInfo.setPushConstantRanges(temporalRange);
+		svgfTemporalPipelineLayout = device->createPipelineLayoutUnique(temporalLayoutInfo);
+		svgfTemporalPipeline = vkutils::createComputePipeline(*device, *svgfTemporalShader, *svgfTemporalPipelineLayout);
+
+		vk::PushConstantRange atrousRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(denoiser::AtrousPushConstants) };
+		vk::PipelineLayoutCreateInfo atrousLayoutInfo{};
+		atrousLayoutInfo.setSetLayouts(*svgfAtrousSetLayout);
+		atrousLayoutInfo.setPushConstantRanges(atrousRange);
+		svgfAtrousPipelineLayout = device->createPipelineLayoutUnique(atrousLayoutInfo);
+		svgfAtrousPipeline = vkutils::createComputePipeline(*device, *svgfAtrousShader, *svgfAtrousPipelineLayout);
+
+		if (options.validateDenoiser) {
+			// Noisy color, normal/depth and motion in, denoised color out
+			vk::DeviceSize pixelCount = static_cast<vk::DeviceSize>(renderExtent.width) * renderExtent.height;
+			denoiserCaptureBuffer.init(physicalDevice, *device, pixelCount * (8 + 8 + 4 + 8),
+				vk::BufferUsageFlagBits::eTransferDst,
+				vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		}
+	}
+
+	void createRaySortPipeline() {
+		std::cout << "Create ray sort pipeline" << std::endl;
+
+		auto shader_bin_root = std::filesystem::current_path();
+		raySortShader = vkutils::createShaderModule(*device, (shader_bin_root / "ray_sort.comp.spv").string());
+		raySortSetLayout = vkutils::createStorageBufferSetLayout(*device, 5);
+
+		vk::DescriptorPoolSize poolSize{ vk::DescriptorType::eStorageBuffer, 5 };
+		vk::DescriptorPoolCreateInfo poolInfo{};
+		poolInfo.setPoolSizes(poolSize);
+		poolInfo.setMaxSets(1);
+		raySortDescPool = device->createDescriptorPoolUnique(poolInfo);
+		raySortDescSet = device->allocateDescriptorSets({ *raySortDescPool, *raySortSetLayout }).front();
+		vkutils::updateStorageBufferDescriptors(*device, raySortDescSet, {
+			*queuedRayBuffer.buffer, *sortedRayBuffer.buffer, *rayCounterBuffer.buffer,
+			*rayBinBuffer.buffer, *rayStatsBuffer.buffer });
+
+		vk::PushConstantRange pushRange{ vk::ShaderStageFlagBits::eCompute, 0, sizeof(RaySortParams) };
+		vk::PipelineLayoutCreateInfo layoutInfo{};
+		layoutInfo.setSetLayouts(*raySortSetLayout);
+		layoutInfo.setPushConstantRanges(pushRange);
+		raySortPipelineLayout = device->createPipelineLayoutUnique(layoutInfo);
+		raySortPipeline = vkutils::createComputePipeline(*device, *raySortShader, *raySortPipelineLayout);
+	}
+
+	void createAdaptivePipeline() {
+		adaptiveStatsWritten.assign(g_MaxFramesInFlight, false);
+		adaptiveStatsUniform.assign(g_MaxFramesInFlight, false);
+		adaptiveStatsUniformLights.assign(g_MaxFramesInFlight, false);
+		adaptiveThreshold = options.adaptiveThreshold;
+		if (!adaptiveEnabled) {
+			if (options.adaptiveSampling || options.adaptiveBenchmark || options.lightBenchmark) {
+				std::cout << "Indirect trace dispatches are not supported, adaptive sampling is disabled\n";
+			}
+			return;
+		}
+
+		// Shares the layout and descriptor sets of the trace pipeline
+		auto shader_bin_root = std::filesystem::current_path();
+		adaptiveCompactShader = vkutils::createShaderModule(*device, (shader_bin_root / "adaptive_compact.comp.spv").string());
+		adaptiveCompactPipeline = vkutils::createComputePipeline(*device, *adaptiveCompactShader, *pipelineLayout);
+
+		adaptiveSampling = options.adaptiveSampling || options.adaptiveBenchmark;
+		if (options.adaptiveBenchmark) {
+			traceBackend = g_TraceBackendPipeline;
+			adaptiveUniform = true;
+			adaptiveBenchmarkRunning = true;
+		}
+		// The light benchmark measures with the accumulation of adaptive
+		// sampling, one path per pixel and frame
+		if (options.lightBenchmark && options.adaptiveBenchmark) {
+			std::cout << "--light-benchmark is skipped while --adaptive-benchmark runs\n";
+		}
+		else if (options.lightBenchmark) {
+			traceBackend = g_TraceBackendPipeline;
+			adaptiveSampling = true;
+			adaptiveUniform = true;
+			uniformLights = true;
+			lightBenchmarkRunning = true;
+		}
+	}
+
+	void createRayQueryPipelines() {
+		if (!rayQueryEnabled) {
+			if (traceBackend == g_TraceBackendRayQuery) {
+				std::cout << "VK_KHR_ray_query is not supported, using the ray tracing pipeline\n";
+				traceBackend = g_TraceBackendPipeline;
+			}
+			return;
+		}
+		std::cout << "Create ray query pipelines" << std::endl;
+
+		auto shader_bin_root = std::filesystem::current_path();
+		rayQueryShader = vkutils::createShaderModule(*device, (shader_bin_root / "trace_query.comp.spv").string());
+
+		// Candidates within the device limits, the first one is the default
+		auto limits = physicalDevice.getProperties().limits;
+		std::vector<vk::Extent2D> candidates = {
+			{ 8, 8 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 1 }, { 8, 4 },
+		};
+		for (auto candidate : candidates) {
+			if (candidate.width * candidate.height <= limits.maxComputeWorkGroupInvocations &&
+				candidate.width <= limits.maxComputeWorkGroupSize[0] &&
+				candidate.height <= limits.maxComputeWorkGroupSize[1]) {
+				rayQueryWorkgroups.push_back(candidate);
+			}
+		}
+
+		rayQueryPipelines = buildRayQueryPipelines(*rayQueryShader);
+
+		if (!options.queryWorkgroup.empty()) {
+			auto it = std::find_if(rayQueryWorkgroups.begin(), rayQueryWorkgroups.end(), [&](vk::Extent2D workgroup) {
+				return std::to_string(workgroup.width) + "x" + std::to_string(workgroup.height) == options.queryWorkgroup;
+			});
+			if (it == rayQueryWorkgroups.end()) {
+				std::cerr << "Unsupported workgroup size: " << options.queryWorkgroup << "\n";
+				std::abort();
+			}
+			rayQueryWorkgroup = static_cast<int>(it - rayQueryWorkgroups.begin());
+		}
+		if (options.tuneWorkgroup) {
+			startWorkgroupTuning();
+		}
+	}
+
+	std::vector<vk::UniquePipeline> buildRayQueryPipelines(vk::ShaderModule shaderModule) {
+		struct RayQuerySpecialization {
+			uint32_t width;
+			uint32_t height;
+			TraceVariant variant;
+		};
+		std::vector<vk::SpecializationMapEntry> entries = {
+			vk::SpecializationMapEntry{ 0, offsetof(RayQuerySpecialization, width), sizeof(uint32_t) },
+			vk::SpecializationMapEntry{ 1, offsetof(RayQuerySpecialization, height), sizeof(uint32_t) },
+		};
+		for (auto entry : getVariantMapEntries(offsetof(RayQuerySpecialization, variant))) {
+			entries.push_back(entry);
+		}
+		std::vector<vk::UniquePipeline> pipelines;
+		for (auto workgroup : rayQueryWorkgroups) {
+			RayQuerySpecialization data{ workgroup.width, workgroup.height, activeVariant };
+			vk::SpecializationInfo specialization{};
+			specialization.setMapEntries(entries);
+			specialization.setDataSize(sizeof(data));
+			specialization.setPData(&data);
+			pipelines.push_back(vkutils::createComputePipeline(*device, shaderModule,
+				*pipelineLayout, &specialization));
+		}
+		return pipelines;
+	}
+
+	// Runs on the reloader thread. Builds pipelines from the recompiled
+	// shaders and leaves them for applyReloadedPipelines.
+	void rebuildPipelines(const std::set<std::string>& shaders) {
+		auto changed = [&](const char* name) { return shaders.count(name) > 0; };
+		auto shader_bin_root = std::filesystem::current_path();
+		ReloadedPipelines reloaded{};
+		reloaded.shaders = shaders;
+
+		std::lock_guard<std::mutex> libraryLock(libraryMutex);
+		bool generalChanged = changed("raygen.rgen.spv") || changed("miss.rmiss.spv") || changed("wavefront.rgen.spv") ||
+			changed("adaptive.rgen.spv") || changed("multiview.rgen.spv");
+		uint32_t materialsChanged = 0;
+		for (uint32_t material = 0; material < g_MaterialCount; material++) {
+			for (const char* name : getMaterialShaderFiles(material)) {
+				if (changed(name)) {
+					materialsChanged |= 1u << material;
+				}
+			}
+		}
+		bool materialChanged = materialsChanged != 0;
+		bool rayQueryChanged = rayQueryEnabled && changed("trace_query.comp.spv");
+		if (generalChanged || materialChanged || rayQueryChanged) {
+			// Other variants are rebuilt from the new shaders when selected again
+			for (auto& [variant, cached] : variantCache) {
+				reloaded.replaced.push_back(std::move(cached.generalLibrary));
+				for (auto& library : cached.materialLibraries) {
+					reloaded.replaced.push_back(std::move(library));
+				}
+				reloaded.replaced.push_back(std::move(cached.rayTracing));
+				reloaded.replacedTables.push_back(std::move(cached.table));
+				for (auto& rayQueryPipeline : cached.rayQuery) {
+					reloaded.replaced.push_back(std::move(rayQueryPipeline));
+				}
+			}
+			variantCache.clear();
+		}
+		if (generalChanged || materialChanged) {
+			prepareShaders();
+			for (auto& library : rebuildLibraries(generalChanged, materialsChanged)) {
+				reloaded.replaced.push_back(std::move(library));
+			}
+			reloaded.rayTracing = buildRayTracingPipeline();
+			reloaded.table = buildShaderBindingTable(*reloaded.rayTracing);
+		}
+
+		auto rebuildCompute = [&](const char* name, vk::UniquePipeline& target, vk::PipelineLayout layout) {
+			if (changed(name)) {
+				auto module = vkutils::createShaderModule(*device, (shader_bin_root / name).string());
+				reloaded.compute.emplace_back(&target, vkutils::createComputePipeline(*device, *module, layout));
+			}
+		};
+		rebuildCompute("tonemap.comp.spv", tonemapPipeline, *tonemapPipelineLayout);
+		rebuildCompute("svgf_temporal.comp.spv", svgfTemporalPipeline, *svgfTemporalPipelineLayout);
+		rebuildCompute("svgf_atrous.comp.spv", svgfAtrousPipeline, *svgfAtrousPipelineLayout);
+		rebuildCompute("ray_sort.comp.spv", raySortPipeline, *raySortPipelineLayout);
+		if (adaptiveEnabled) {
+			rebuildCompute("adaptive_compact.comp.spv", adaptiveCompactPipeline, *pipelineLayout);
+		}
+
+		if (rayQueryChanged) {
+			rayQueryShader = vkutils::createShaderModule(*device, (shader_bin_root / "trace_query.comp.spv").string());
+			reloaded.rayQuery = buildRayQueryPipelines(*rayQueryShader);
+		}
+
+		// Merge into a result the render thread has not picked up yet
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		if (!pendingPipelines) {
+			pendingPipelines = std::make_unique<ReloadedPipelines>(std::move(reloaded));
+			return;
+		}
+		pendingPipelines->shaders.insert(reloaded.shaders.begin(), reloaded.shaders.end());
+		if (reloaded.rayTracing) {
+			pendingPipelines->rayTracing = std::move(reloaded.rayTracing);
+			pendingPipelines->table = std::move(reloaded.table);
+		}
+		for (auto& replaced : reloaded.replaced) {
+			pendingPipelines->replaced.push_back(std::move(replaced));
+		}
+		for (auto& table : reloaded.replacedTables) {
+			pendingPipelines->replacedTables.push_back(std::move(table));
+		}
+		for (auto& replacement : reloaded.compute) {
+			pendingPipelines->compute.push_back(std::move(replacement));
+		}
+		if (!reloaded.rayQuery.empty()) {
+			pendingPipelines->rayQuery = std::move(reloaded.rayQuery);
+		}
+	}
+
+	// Swaps in reloaded pipelines. Called after the frame fence wait, before
+	// anything of the frame is recorded.
+	void applyReloadedPipelines() {
+		while (!retiredPipelines.empty() && retiredPipelines.front().frame + g_MaxFramesInFlight <= frameCount) {
+			retiredPipelines.pop_front();
+		}
+
+		std::unique_ptr<ReloadedPipelines> reloaded;
+		{
+			std::lock_guard<std::mutex> lock(reloadMutex);
+			reloaded = std::move(pendingPipelines);
+		}
+		if (!reloaded) {
+			return;
+		}
+
+		// The other frame in flight may still execute the old pipelines
+		RetiredPipelines retired{};
+		retired.frame = frameCount;
+		if (reloaded->rayTracing) {
+			retired.pipelines.push_back(std::move(pipeline));
+			retired.tables.push_back(std::move(sbt));
+			pipeline = std::move(reloaded->rayTracing);
+			sbt = std::move(reloaded->table);
+		}
+		for (auto& replaced : reloaded->replaced) {
+			retired.pipelines.push_back(std::move(replaced));
+		}
+		for (auto& table : reloaded->replacedTables) {
+			retired.tables.push_back(std::move(table));
+		}
+		for (auto& [target, replacement] : reloaded->compute) {
+			retired.pipelines.push_back(std::move(*target));
+			*target = std::move(replacement);
+		}
+		if (!reloaded->rayQuery.empty()) {
+			for (auto& rayQueryPipeline : rayQueryPipelines) {
+				retired.pipelines.push_back(std::move(rayQueryPipeline));
+			}
+			rayQueryPipelines = std::move(reloaded->rayQuery);
+		}
+		retiredPipelines.push_back(std::move(retired));
+
+		std::cout << "Reloaded";
+		for (const auto& shader : reloaded->shaders) {
+			std::cout << " " << shader;
+		}
+		std::cout << "\n";
+	}
+
+	TraceVariant getRequestedVariant() const {
+		TraceVariant variant{};
+		variant.maxBounces = specializeBounces ? static_cast<uint32_t>(maxBounces) : g_RuntimeBounces;
+		variant.shadingModel = static_cast<uint32_t>(shadingModel);
+		variant.debugView = static_cast<uint32_t>(debugView);
+		return variant;
+	}
+
+	// Makes variant the active one. Its pipelines are built unless a
+	// previous switch left them in the cache; the replaced ones are cached,
+	// which also keeps them alive for the frame in flight.
+	void switchVariant(const TraceVariant& variant) {
+		std::lock_guard<std::mutex> lock(libraryMutex);
+		// A finished reload was built for the active variant
+		applyReloadedPipelines();
+
+		VariantPipelines& previous = variantCache[activeVariant];
+		previous.generalLibrary = std::move(generalLibrary);
+		previous.materialLibraries = std::move(materialLibraries);
+		previous.rayTracing = std::move(pipeline);
+		previous.table = std::move(sbt);
+		previous.rayQuery = std::move(rayQueryPipelines);
+		activeVariant = variant;
+
+		auto it = variantCache.find(variant);
+		if (it != variantCache.end()) {
+			generalLibrary = std::move(it->second.generalLibrary);
+			materialLibraries = std::move(it->second.materialLibraries);
+			pipeline = std::move(it->second.rayTracing);
+			sbt = std::move(it->second.table);
+			rayQueryPipelines = std::move(it->second.rayQuery);
+			variantCache.erase(it);
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		materialLibraries.clear();
+		materialLibraries.resize(g_MaterialCount);
+		rebuildLibraries(true, g_AllMaterials);
+		pipeline = buildRayTracingPipeline();
+		sbt = buildShaderBindingTable(*pipeline);
+		if (rayQueryEnabled) {
+			rayQueryPipelines = buildRayQueryPipelines(*rayQueryShader);
+		}
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "Built trace variant " << describeVariant(variant) << " in "
+			<< std::chrono::duration<double, std::milli>(end - start).count() << " ms\n";
+	}
+
+	void startWorkgroupTuning() {
+		traceBackend = g_TraceBackendRayQuery;
+		tuningWorkgroup = true;
+		workgroupMs.assign(rayQueryWorkgroups.size(), 0.0);
+		rayQueryWorkgroup = 0;
+		tuningFrames = 0;
+	}
+
+	// Called with the trace time of every finished frame while tuning
+	void updateWorkgroupTuning() {
+		constexpr uint32_t warmupFrames = 8;
+		constexpr uint32_t measuredFrames = 32;
+		if (traceBackend != g_TraceBackendRayQuery) {
+			tuningWorkgroup = false;
+			return;
+		}
+		// Frames in flight may still use the previous candidate
+		if (++tuningFrames <= warmupFrames) {
+			return;
+		}
+		workgroupMs[rayQueryWorkgroup] += traceMs;
+		if (tuningFrames < warmupFrames + measuredFrames) {
+			return;
+		}
+
+		workgroupMs[rayQueryWorkgroup] /= measuredFrames;
+		vk::Extent2D workgroup = rayQueryWorkgroups[rayQueryWorkgroup];
+		std::cout << "Workgroup " << workgroup.width << "x" << workgroup.height << ": ";
+		printTraceStats(workgroupMs[rayQueryWorkgroup]);
+		tuningFrames = 0;
+		if (++rayQueryWorkgroup < static_cast<int>(rayQueryWorkgroups.size())) {
+			return;
+		}
+
+		rayQueryWorkgroup = static_cast<int>(
+			std::min_element(workgroupMs.begin(), workgroupMs.end()) - workgroupMs.begin());
+		tuningWorkgroup = false;
+		workgroup = rayQueryWorkgroups[rayQueryWorkgroup];
+		std::cout << "Selected workgroup " << workgroup.width << "x" << workgroup.height << "\n";
+	}
+
+	// Builds every static BLAS again from its kept inputs with the current
+	// flags, the scene itself is not generated again
+	double rebuildStaticAccels() {
+		staticBuildMs = 0.0;
+		for (const StaticAccelInputs& inputs : staticAccelInputs) {
+			buildStaticAccel(inputs);
+		}
+		return staticBuildMs;
+	}
+
+	// Builds the classes whose preset changed, or every class with force,
+	// and the TLAS over them. Returns the build time per class; streamed
+	// levels are built again by the residency updates of the next frames.
+	std::array<double, buildtune::kClassCount> setBuildPresets(
+		const std::array<buildtune::Preset, buildtune::kClassCount>& presets, bool force = false) {
+		using buildtune::AccelClass;
+		auto changed = [&](AccelClass accelClass) {
+			uint32_t i = static_cast<uint32_t>(accelClass);
+			return force || presets[i] != buildPresets[i];
+		};
+		bool rebuildStatic = changed(AccelClass::eStatic);
+		bool rebuildDeformable = options.deformable && changed(AccelClass::eDeformable);
+		bool rebuildStreamed = !options.meshPack.empty() && changed(AccelClass::eStreamed);
+		buildPresets = presets;
+		std::array<double, buildtune::kClassCount> buildMs{};
+		if (!rebuildStatic && !rebuildDeformable && !rebuildStreamed) {
+			return buildMs;
+		}
+
+		// The old structures may still be in use by other frames
+		device->waitIdle();
+		if (rebuildStatic) {
+			buildMs[static_cast<uint32_t>(AccelClass::eStatic)] = rebuildStaticAccels();
+		}
+		if (rebuildDeformable) {
+			auto start = std::chrono::steady_clock::now();
+			deformableMesh.setBuildFlags(physicalDevice, *device, *commandPool, queue,
+				getBuildFlags(AccelClass::eDeformable));
+			buildMs[static_cast<uint32_t>(AccelClass::eDeformable)] =
+				std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+		if (rebuildStreamed) {
+			residency.setBuildFlags(getBuildFlags(AccelClass::eStreamed));
+			residency.update(cameraPosition, cameraDirection);
+			residency.releaseEvicted();
+		}
+		createTopLevelAS();
+		for (size_t i = 0; i < descSets.size(); i++) {
+			updateDescriptorSet(descSets[i], *hdrImage.view);
+		}
+		return buildMs;
+	}
+
+	// Builds with the presets the tuner asks for and reports the build times
+	void applyBuildTuning(bool force = false) {
+		std::array<buildtune::Preset, buildtune::kClassCount> presets{};
+		for (uint32_t i = 0; i < buildtune::kClassCount; i++) {
+			presets[i] = buildTuner.getActivePreset(static_cast<buildtune::AccelClass>(i));
+		}
+		std::array<double, buildtune::kClassCount> buildMs = setBuildPresets(presets, force);
+		for (uint32_t i = 0; i < buildtune::kClassCount; i++) {
+			buildTuner.setBuild(static_cast<buildtune::AccelClass>(i), buildMs[i]);
+		}
+	}
+
+	void startBuildTuning() {
+		using buildtune::AccelClass;
+		// The benchmarks restart when their BLASes are created again
+		if (options.particleBenchmark || options.presplitBenchmark) {
+			std::cout << "Build flag tuning is not available with --particle-benchmark or --presplit-benchmark\n";
+			return;
+		}
+		std::vector<AccelClass> classes;
+		if (getStaticAccelBytes() > 0) {
+			classes.push_back(AccelClass::eStatic);
+		}
+		if (options.deformable) {
+			classes.push_back(AccelClass::eDeformable);
+		}
+		if (!options.meshPack.empty()) {
+			classes.push_back(AccelClass::eStreamed);
+		}
+		if (classes.empty()) {
+			return;
+		}
+		buildTuner.start(classes, buildPresets);
+		tuningBuilds = true;
+		// Every class is built once so the first preset has a build time too
+		applyBuildTuning(true);
+		residencyBuildMs = residency.getBuildMs();
+	}
+
+	// Called with the trace time of every finished frame while tuning. The
+	// choices are applied and saved to the build profile at the end.
+	void updateBuildTuning() {
+		using buildtune::AccelClass;
+		double streamedMs = residency.getBuildMs() - residencyBuildMs;
+		residencyBuildMs = residency.getBuildMs();
+		double buildMs = 0.0;
+		vk::DeviceSize bytes = 0;
+		switch (buildTuner.getClass()) {
+		case AccelClass::eStatic:
+			bytes = getStaticAccelBytes();
+			break;
+		case AccelClass::eDeformable:
+			buildMs = blasMs;
+			bytes = deformableMesh.getAccelSize();
+			break;
+		case AccelClass::eStreamed:
+			buildMs = streamedMs;
+			bytes = residency.getResidentBytes();
+			break;
+		}
+		if (!buildTuner.addFrame(traceMs, buildMs, bytes)) {
+			return;
+		}
+		applyBuildTuning();
+		if (buildTuner.isRunning()) {
+			return;
+		}
+
+		tuningBuilds = false;
+		buildTuner.print(std::cout);
+		for (AccelClass accelClass : buildTuner.getClasses()) {
+			buildtune::Preset choice = buildTuner.getChoice(accelClass);
+			buildProfile.set(buildScene, accelClass, choice, buildTuner.getMeasurement(accelClass, choice));
+			std::cout << "Selected " << buildtune::toString(choice) << " for "
+				<< buildtune::toString(accelClass) << " BLASes\n";
+		}
+		if (buildProfile.save(options.buildProfile)) {
+			std::cout << "Wrote build profile: " << options.buildProfile << "\n";
+		}
+		else {
+			std::cerr << "Failed to write build profile: " << options.buildProfile << "\n";
+		}
+	}
+
+	// Traces the procedural particles, then their tessellation, for the
+	// same number of frames and compares the throughput
+	void updateParticleBenchmark() {
+		constexpr uint32_t warmupFrames = 8;
+		constexpr uint32_t measuredFrames = 64;
+		// Frames in flight may still use the previous TLAS
+		if (++particleBenchmarkFrames <= warmupFrames) {
+			return;
+		}
+		uint32_t representation = particlesTessellated ? 1 : 0;
+		particleBenchmarkMs[representation] += traceMs;
+		particleBenchmarkRays[representation] += tracedRays;
+		if (particleBenchmarkFrames < warmupFrames + measuredFrames) {
+			return;
+		}
+
+		particleBenchmarkFrames = 0;
+		if (!particlesTessellated) {
+			setParticlesTessellated(true);
+			return;
+		}
+		const char* names[] = { "Procedural", "Tessellated" };
+		for (uint32_t i = 0; i < 2; i++) {
+			double ms = particleBenchmarkMs[i];
+			std::cout << names[i] << " particles: " << ms / measuredFrames << " ms, "
+				<< (ms > 0.0 ? particleBenchmarkRays[i] / (ms * 1e3) : 0.0) << " Mrays/s\n";
+		}
+		particleBenchmarkRunning = false;
+	}
+
+	void updatePresplitBenchmark() {
+		constexpr uint32_t warmupFrames = 8;
+		constexpr uint32_t measuredFrames = 64;
+		// Frames in flight may still use the previous TLAS
+		if (++presplitBenchmarkFrames <= warmupFrames) {
+			return;
+		}
+		uint32_t mesh = cadPreprocessed ? 1 : 0;
+		presplitBenchmarkMs[mesh] += traceMs;
+		presplitBenchmarkRays[mesh] += tracedRays;
+		if (presplitBenchmarkFrames < warmupFrames + measuredFrames) {
+			return;
+		}
+
+		presplitBenchmarkFrames = 0;
+		if (!cadPreprocessed) {
+			setCadPreprocessed(true);
+			return;
+		}
+		const char* names[] = { "Raw", "Preprocessed" };
+		for (uint32_t i = 0; i < 2; i++) {
+			double ms = presplitBenchmarkMs[i];
+			std::cout << names[i] << " CAD mesh: build " << cadBuildMs[i] << " ms, trace " << ms / measuredFrames
+				<< " ms, " << (ms > 0.0 ? presplitBenchmarkRays[i] / (ms * 1e3) : 0.0) << " Mrays/s\n";
+		}
+		presplitBenchmarkRunning = false;
+	}
+
+	// Same format for every backend so they can be compared
+	void printTraceStats(double ms) {
+		static const char* backendNames[] = { "pipeline", "wavefront", "ray query" };
+		std::cout << "Trace (" << backendNames[traceBackend] << ", " << maxBounces << " bounces): "
+			<< ms << " ms, " << (ms > 0.0 ? tracedRays / (ms * 1e3) : 0.0) << " Mrays/s";
+		if (traceFlags & g_TraceFlagAlphaTest) {
+			std::cout << ", " << anyHitCount << " alpha tests";
+		}
+		std::cout << "\n";
+	}
 
-		vk::RayTracingPipelineCreateInfoKHR pipelineCreateInfo{};
-		pipelineCreateInfo.setLayout(*pipelineLayout);
-		pipelineCreateInfo.setStages(shaderStages);
-		pipelineCreateInfo.setGroups(shaderGroups);
-		pipelineCreateInfo.setMaxPipelineRayRecursionDepth(1);
-		auto result = device->createRayTracingPipelineKHRUnique(
-			nullptr, nullptr, pipelineCreateInfo);
-		if (result.result != vk::Result::eSuccess) {
-			std::cerr << "Failed to create ray tracing pipeline\n";
-			std::abort();
+	void createTimestampQueries() {
+		timestampPeriod = physicalDevice.getProperties().limits.timestampPeriod;
+		if (physicalDevice.getQueueFamilyProperties()[queueFamilyIndex].timestampValidBits > 0) {
+			vk::QueryPoolCreateInfo queryPoolInfo{};
+			queryPoolInfo.setQueryType(vk::QueryType::eTimestamp);
+			queryPoolInfo.setQueryCount(g_TimestampsPerFrame * g_MaxFramesInFlight);
+			timestampPool = device->createQueryPoolUnique(queryPoolInfo);
 		}
+		timestampsWritten.assign(g_MaxFramesInFlight, false);
+		denoiserTimestampsWritten.assign(g_MaxFramesInFlight, false);
+		deformTimestampsWritten.assign(g_MaxFramesInFlight, false);
+		deformRebuilt.assign(g_MaxFramesInFlight, false);
+	}
 
-		pipeline = std::move(result.value);
+	void updateTonemapDescriptorSet(vk::DescriptorSet descSet, vk::ImageView outputView) {
+		vkutils::updateStorageImageDescriptors(*device, descSet, { *hdrImage.view, outputView });
 	}
 
 	void createShaderBindingTable() {
+		sbt = buildShaderBindingTable(*pipeline);
+	}
+
+	// Also called by the shader reloader thread, only touches the new table
+	ShaderBindingTable buildShaderBindingTable(vk::Pipeline rayTracingPipeline) {
+		ShaderBindingTable table{};
 		vk::PhysicalDeviceRayTracingPipelinePropertiesKHR rtProperties = 
 			vkutils::getRayTracingProps(physicalDevice);
 		uint32_t handleSize = rtProperties.shaderGroupHandleSize;
@@ -611,21 +3108,29 @@ private:
 		uint32_t handleSizeAligned = vkutils::alignUp(handleSize, handleAlignment);
 
 		// Set strides and sizes
-		uint32_t raygenShaderCount = 1;  // raygen count must be 1
+		uint32_t raygenShaderCount = 4;  // megakernel, wavefront, adaptive and multiview, one per region
 		uint32_t missShaderCount = 1;
-		uint32_t hitShaderCount = 1;
-
-		raygenRegion.setStride(vkutils::alignUp(handleSizeAligned, baseAlignment));
-		raygenRegion.setSize(raygenRegion.stride);
-
-		missRegion.setStride(handleSizeAligned);
-		missRegion.setSize(vkutils::alignUp(missShaderCount * handleSizeAligned, baseAlignment));
-
-		hitRegion.setStride(handleSizeAligned);
-		hitRegion.setSize(vkutils::alignUp(hitShaderCount * handleSizeAligned, baseAlignment));
-
-		vk::DeviceSize sbtSize = raygenRegion.size + missRegion.size + hitRegion.size;
-		sbt.init(physicalDevice, *device, sbtSize,
+		uint32_t hitShaderCount = static_cast<uint32_t>(materialLibraries.size());
+
+		table.raygenRegion.setStride(vkutils::alignUp(handleSizeAligned, baseAlignment));
+		table.raygenRegion.setSize(table.raygenRegion.stride);
+		table.wavefrontRaygenRegion.setStride(table.raygenRegion.stride);
+		table.wavefrontRaygenRegion.setSize(table.raygenRegion.size);
+		table.adaptiveRaygenRegion.setStride(table.raygenRegion.stride);
+		table.adaptiveRaygenRegion.setSize(table.raygenRegion.size);
+		table.multiviewRaygenRegion.setStride(table.raygenRegion.stride);
+		table.multiviewRaygenRegion.setSize(table.raygenRegion.size);
+
+		table.missRegion.setStride(handleSizeAligned);
+		table.missRegion.setSize(vkutils::alignUp(missShaderCount * handleSizeAligned, baseAlignment));
+
+		table.hitRegion.setStride(handleSizeAligned);
+		table.hitRegion.setSize(vkutils::alignUp(hitShaderCount * handleSizeAligned, baseAlignment));
+
+		vk::DeviceSize raygenSize = table.raygenRegion.size + table.wavefrontRaygenRegion.size +
+			table.adaptiveRaygenRegion.size + table.multiviewRaygenRegion.size;
+		vk::DeviceSize sbtSize = raygenSize + table.missRegion.size + table.hitRegion.size;
+		table.buffer.init(physicalDevice, *device, sbtSize,
 			vk::BufferUsageFlagBits::eShaderBindingTableKHR |
 			vk::BufferUsageFlagBits::eTransferSrc |
 			vk::BufferUsageFlagBits::eShaderDeviceAddress,
@@ -636,43 +3141,68 @@ private:
 		uint32_t handleStorageSize = handleCount * handleSize;
 		std::vector<uint8_t> handleStorage(handleStorageSize);
 		auto result = device->getRayTracingShaderGroupHandlesKHR(
-			*pipeline, 0, handleCount, handleStorageSize, handleStorage.data());
+			rayTracingPipeline, 0, handleCount, handleStorageSize, handleStorage.data());
 		if (result != vk::Result::eSuccess) {
 			std::cerr << "Failed to get ray tracing shader group handles.\n";
 			std::abort();
 		}
 
-		uint8_t* sbtHead = static_cast<uint8_t*>(device->mapMemory(*sbt.memory, 0, sbtSize));
+		uint8_t* sbtHead = static_cast<uint8_t*>(device->mapMemory(*table.buffer.memory, 0, sbtSize));
 		uint8_t* dstPtr = sbtHead;
 		auto copyHandle = [&](uint32_t index) {
 			std::memcpy(dstPtr, handleStorage.data() + handleSize * index, handleSize);
 		};
 
-		uint32_t handleIndex = 0;
-		copyHandle(handleIndex++);
+		// Groups are numbered in link order, see g_RaygenGroup
+		copyHandle(g_RaygenGroup);
+		dstPtr = sbtHead + table.raygenRegion.size;
+		copyHandle(g_WavefrontRaygenGroup);
+		dstPtr = sbtHead + table.raygenRegion.size + table.wavefrontRaygenRegion.size;
+		copyHandle(g_AdaptiveRaygenGroup);
+		dstPtr += table.adaptiveRaygenRegion.size;
+		copyHandle(g_MultiviewRaygenGroup);
 
-		dstPtr = sbtHead + raygenRegion.size;
-		for (uint32_t c = 0; c < missShaderCount; c++) {
-			copyHandle(handleIndex++);
-			dstPtr += missRegion.stride;
-		}
+		dstPtr = sbtHead + raygenSize;
+		copyHandle(g_MissGroup);
 
-		dstPtr = sbtHead + raygenRegion.size + missRegion.size;
+		dstPtr = sbtHead + raygenSize + table.missRegion.size;
 		for (uint32_t c = 0; c < hitShaderCount; c++) {
-			copyHandle(handleIndex++);
-			dstPtr += hitRegion.stride;
+			copyHandle(g_FirstHitGroup + c);
+			dstPtr += table.hitRegion.stride;
 		}
 
-		raygenRegion.setDeviceAddress(sbt.address);
-		missRegion.setDeviceAddress(sbt.address + raygenRegion.size);
-		hitRegion.setDeviceAddress(sbt.address + raygenRegion.size + missRegion.size);
+		table.raygenRegion.setDeviceAddress(table.buffer.address);
+		table.wavefrontRaygenRegion.setDeviceAddress(table.buffer.address + table.raygenRegion.size);
+		table.adaptiveRaygenRegion.setDeviceAddress(
+			table.buffer.address + table.raygenRegion.size + table.wavefrontRaygenRegion.size);
+		table.multiviewRaygenRegion.setDeviceAddress(
+			table.adaptiveRaygenRegion.deviceAddress + table.adaptiveRaygenRegion.size);
+		table.missRegion.setDeviceAddress(table.buffer.address + raygenSize);
+		table.hitRegion.setDeviceAddress(table.buffer.address + raygenSize + table.missRegion.size);
+		device->unmapMemory(*table.buffer.memory);
+		return table;
 	}
 
 	void drawFrame(uint32_t frameIndex) {
 		deawImGui();
 		auto& imageAvailableSemaphore = imageAvailableSemaphores[frameIndex];
 		auto& renderFinishedSemaphore = renderFinishedSemaphores[frameIndex];
+		auto waitStart = std::chrono::steady_clock::now();
 		device->waitForFences(*inFlightFences[frameIndex], VK_TRUE, UINT64_MAX);
+		fenceWaitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+		applyReloadedPipelines();
+		TraceVariant requestedVariant = getRequestedVariant();
+		if (requestedVariant != activeVariant) {
+			switchVariant(requestedVariant);
+		}
+		readTimestamps(frameIndex);
+		updateCamera();
+		updateResidency();
+		if (options.deformable) {
+			deformableMesh.update(frameIndex, static_cast<float>(glfwGetTime()));
+		}
+		updateAdaptiveSampling();
+		writeFrameUniforms(frameIndex);
 		device->resetFences(*inFlightFences[frameIndex]);
 		uint32_t imageIndex = 0u;
 		try {
@@ -692,16 +3222,21 @@ private:
 
 
 		device->resetCommandPool(*commandPoolsPerFrame[frameIndex], {});
-		recordCommandBuffer(commandBuffersPerFrame[frameIndex], swapchainImages[imageIndex], imageIndex, draw_data);
+		recordCommandBuffer(commandBuffersPerFrame[frameIndex], frameIndex,
+			swapchainImages[imageIndex], imageIndex, draw_data);
 
-		vk::PipelineStageFlags waitStage{ vk::PipelineStageFlagBits::eColorAttachmentOutput };
 		vk::SubmitInfo submitInfo{};
-		submitInfo.setWaitDstStageMask(waitStage);
+		submitInfo.setWaitDstStageMask(acquireWaitStage);
 		submitInfo.setCommandBuffers(commandBuffersPerFrame[frameIndex]);
 		submitInfo.setWaitSemaphores(*imageAvailableSemaphore);
 		submitInfo.setSignalSemaphores(*renderFinishedSemaphore);
 		queue.submit(submitInfo, *inFlightFences[frameIndex]);
 
+		if (options.validateDenoiser && frameCount == g_DenoiserValidationFrame) {
+			validateDenoiser();
+		}
+		frameCount++;
+
 		vk::PresentInfoKHR presentInfo{};
 		presentInfo.setSwapchains(static_cast<const vk::SwapchainKHR&>(*swapchain));
 		presentInfo.setImageIndices(imageIndex);
@@ -719,12 +3254,287 @@ private:
 		}
 	}
 
+	void readTimestamps(uint32_t frameIndex) {
+		if (!timestampsWritten[frameIndex]) {
+			return;
+		}
+		timestampsWritten[frameIndex] = false;
+
+		uint64_t timestamps[g_TimestampsPerFrame];
+		uint32_t queryCount = denoiserTimestampsWritten[frameIndex] ? g_TimestampsPerFrame : 2;
+		vk::Result result = device->getQueryPoolResults(*timestampPool, g_TimestampsPerFrame * frameIndex, queryCount,
+			sizeof(timestamps), timestamps, sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+		if (result != vk::Result::eSuccess) {
+			return;
+		}
+		traceMs = static_cast<float>((timestamps[g_TimestampTraceEnd] - timestamps[g_TimestampTraceBegin]) * timestampPeriod / 1e6);
+		const uint32_t* rayCounts = static_cast<const uint32_t*>(
+			device->mapMemory(*rayStatsBuffer.memory, 0, VK_WHOLE_SIZE));
+		tracedRays = rayCounts[frameIndex];
+		raysPerSecond = traceMs > 0.0f ? tracedRays / (traceMs * 1e-3f) : 0.0f;
+		device->unmapMemory(*rayStatsBuffer.memory);
+		const uint32_t* anyHitCounts = static_cast<const uint32_t*>(
+			device->mapMemory(*anyHitStatsBuffer.memory, 0, VK_WHOLE_SIZE));
+		anyHitCount = anyHitCounts[frameIndex];
+		device->unmapMemory(*anyHitStatsBuffer.memory);
+		if (tuningWorkgroup) {
+			updateWorkgroupTuning();
+		}
+		if (particleBenchmarkRunning) {
+			updateParticleBenchmark();
+		}
+		if (presplitBenchmarkRunning) {
+			updatePresplitBenchmark();
+		}
+		if (adaptiveStatsWritten[frameIndex]) {
+			readAdaptiveStats(frameIndex);
+		}
+
+		if (deformTimestampsWritten[frameIndex]) {
+			readDeformTimestamps(frameIndex);
+		}
+		if (tuningBuilds) {
+			updateBuildTuning();
+		}
+
+		if (!denoiserTimestampsWritten[frameIndex]) {
+			return;
+		}
+		denoiserMs = static_cast<float>((timestamps[g_TimestampDenoiserEnd] - timestamps[g_TimestampDenoiserBegin]) * timestampPeriod / 1e6);
+
+		if (options.denoiserBenchmark) {
+			denoiserMsSum += denoiserMs;
+			if (++denoiserMsCount == 100) {
+				std::cout << "Denoiser GPU: " << denoiserMsSum / denoiserMsCount << " ms/frame at "
+					<< renderExtent.width << "x" << renderExtent.height << "\n";
+				denoiserMsSum = 0.0;
+				denoiserMsCount = 0;
+			}
+		}
+	}
+
+	// Skinning, BLAS and TLAS times of a frame, with averages of refit and
+	// rebuild frames printed every 100 frames
+	void readDeformTimestamps(uint32_t frameIndex) {
+		uint64_t timestamps[4];
+		vk::Result result = device->getQueryPoolResults(*timestampPool,
+			g_TimestampsPerFrame * frameIndex + g_TimestampSkinningBegin, 4,
+			sizeof(timestamps), timestamps, sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+		if (result != vk::Result::eSuccess) {
+			return;
+		}
+		auto toMs = [&](uint32_t begin, uint32_t end) {
+			return static_cast<float>((timestamps[end - g_TimestampSkinningBegin] -
+				timestamps[begin - g_TimestampSkinningBegin]) * timestampPeriod / 1e6);
+		};
+		skinningMs = toMs(g_TimestampSkinningBegin, g_TimestampSkinningEnd);
+		blasMs = toMs(g_TimestampSkinningEnd, g_TimestampBlasEnd);
+		tlasMs = toMs(g_TimestampBlasEnd, g_TimestampTlasEnd);
+		blasRebuilt = deformRebuilt[frameIndex];
+
+		skinningMsSum += skinningMs;
+		if (blasRebuilt) {
+			rebuildMsSum += blasMs;
+			rebuildFrames++;
+		}
+		else {
+			refitMsSum += blasMs;
+			refitFrames++;
+		}
+		uint32_t frames = refitFrames + rebuildFrames;
+		if (frames == 100) {
+			std::cout << "Deformable: skinning " << skinningMsSum / frames << " ms"
+				<< ", refit " << (refitFrames ? refitMsSum / refitFrames : 0.0) << " ms x " << refitFrames
+				<< ", rebuild " << (rebuildFrames ? rebuildMsSum / rebuildFrames : 0.0) << " ms x " << rebuildFrames
+				<< ", TLAS refit " << tlasMs << " ms\n";
+			skinningMsSum = 0.0;
+			refitMsSum = 0.0;
+			rebuildMsSum = 0.0;
+			refitFrames = 0;
+			rebuildFrames = 0;
+		}
+	}
+
+	// Runs the CPU reference on the frame captured by the capture passes
+	void validateDenoiser() {
+		device->waitIdle();
+
+		size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+		const uint8_t* data = static_cast<const uint8_t*>(
+			device->mapMemory(*denoiserCaptureBuffer.memory, 0, VK_WHOLE_SIZE));
+		auto readPixels = [&](size_t offset, uint32_t components) {
+			const uint16_t* halves = reinterpret_cast<const uint16_t*>(data + offset);
+			std::vector<denoiser::Pixel> pixels(pixelCount, denoiser::Pixel{});
+			for (size_t i = 0; i < pixelCount; i++) {
+				for (uint32_t c = 0; c < components; c++) {
+					pixels[i][c] = geometry::halfToFloat(halves[i * components + c]);
+				}
+			}
+			return pixels;
+		};
+
+		denoiser::Frame frame{};
+		frame.width = renderExtent.width;
+		frame.height = renderExtent.height;
+		frame.color = readPixels(0, 4);
+		frame.normalDepth = readPixels(pixelCount * 8, 4);
+		for (const auto& motion : readPixels(pixelCount * 16, 2)) {
+			frame.motion.push_back({ motion[0], motion[1] });
+		}
+		std::vector<denoiser::Pixel> gpuOutput = readPixels(pixelCount * 20, 4);
+		device->unmapMemory(*denoiserCaptureBuffer.memory);
+
+		denoiser::Reference reference(denoiserParams);
+		denoiser::Comparison comparison = denoiser::compare(reference.denoise(frame), gpuOutput);
+		std::cout << "Denoiser validation: max error " << comparison.maxError
+			<< ", mean error " << comparison.meanError
+			<< (comparison.meanError < 1e-3f ? " (match)" : " (MISMATCH)") << "\n";
+	}
+
+	// Restarts the accumulation whenever the image it converges to changes.
+	// Animated scenes restart in every frame.
+	void updateAdaptiveSampling() {
+		glm::mat4 view = flyCamera.getView();
+		if (!isAdaptiveSampling() || view != adaptiveView || maxBounces != adaptiveBounces ||
+			activeVariant != adaptiveVariant || uniformLights != adaptiveUniformLights || options.deformable) {
+			adaptiveReset = true;
+		}
+		adaptiveView = view;
+		adaptiveBounces = maxBounces;
+		adaptiveVariant = activeVariant;
+		adaptiveUniformLights = uniformLights;
+	}
+
+	bool isAdaptiveSampling() const {
+		return adaptiveEnabled && adaptiveSampling && traceBackend == g_TraceBackendPipeline;
+	}
+
+	void readAdaptiveStats(uint32_t frameIndex) {
+		adaptiveStatsWritten[frameIndex] = false;
+		const uint32_t* counts = static_cast<const uint32_t*>(
+			device->mapMemory(*adaptiveStatsBuffer.memory, 0, VK_WHOLE_SIZE));
+		const uint32_t* slot = counts + frameIndex * g_AdaptiveStatsSize / sizeof(uint32_t);
+		listedPixels = slot[0];
+		convergedPixels = slot[1];
+		uint32_t pixelCount = renderExtent.width * renderExtent.height;
+		meanPixelError = slot[2] / g_AdaptiveErrorScale / pixelCount;
+		device->unmapMemory(*adaptiveStatsBuffer.memory);
+		// Frames in flight may still use the previous mode
+		if (adaptiveBenchmarkRunning && adaptiveStatsUniform[frameIndex] == adaptiveUniform) {
+			updateAdaptiveBenchmark();
+		}
+		if (lightBenchmarkRunning && adaptiveStatsUniformLights[frameIndex] == uniformLights) {
+			updateLightBenchmark();
+		}
+	}
+
+	// Accumulates one path per pixel and frame with uniform light sampling
+	// until it has used the time budget, then does the same with the light
+	// BVH. Less error after equal time is the better strategy.
+	void updateLightBenchmark() {
+		uint32_t mode = uniformLights ? 0 : 1;
+		lightBenchmarkMs[mode] += traceMs;
+		lightBenchmarkFrames[mode]++;
+		if (lightBenchmarkMs[mode] < g_LightBenchmarkMs) {
+			return;
+		}
+
+		lightBenchmarkError[mode] = meanPixelError;
+		lightBenchmarkConverged[mode] = convergedPixels;
+		if (uniformLights) {
+			uniformLights = false;
+			adaptiveReset = true;
+			return;
+		}
+		uint32_t pixelCount = renderExtent.width * renderExtent.height;
+		const char* names[] = { "Uniform light sampling", "Light BVH sampling" };
+		for (uint32_t i = 0; i < 2; i++) {
+			std::cout << names[i] << ": " << lightBenchmarkFrames[i] << " paths per pixel in "
+				<< lightBenchmarkMs[i] << " ms, mean relative error " << lightBenchmarkError[i] * 100.0
+				<< "%, " << 100.0 * lightBenchmarkConverged[i] / pixelCount << "% of pixels within "
+				<< adaptiveThreshold * 100.0f << "% error\n";
+		}
+		if (lightBenchmarkError[1] > 0.0) {
+			// Error falls with the square root of the samples, so the ratio
+			// squared is the time uniform sampling needs for the same error
+			double ratio = lightBenchmarkError[0] / lightBenchmarkError[1];
+			std::cout << "Light BVH error at equal time: " << ratio << "x lower, "
+				<< ratio * ratio << "x less time to equal error\n";
+		}
+		lightBenchmarkRunning = false;
+		adaptiveUniform = false;
+		adaptiveSampling = options.adaptiveSampling;
+		uniformLights = options.uniformLights;
+	}
+
+	// Accumulates with every pixel listed until the target fraction of the
+	// pixels has converged, then restarts with adaptive sampling and
+	// compares the GPU time both took to get there
+	void updateAdaptiveBenchmark() {
+		uint32_t mode = adaptiveUniform ? 0 : 1;
+		adaptiveBenchmarkMs[mode] += traceMs;
+		adaptiveBenchmarkFrames++;
+		uint32_t pixelCount = renderExtent.width * renderExtent.height;
+		bool reached = convergedPixels >= g_AdaptiveTargetFraction * pixelCount;
+		if (!reached && adaptiveBenchmarkFrames < g_AdaptiveBenchmarkMaxFrames) {
+			return;
+		}
+
+		adaptiveBenchmarkFrameCounts[mode] = adaptiveBenchmarkFrames;
+		adaptiveBenchmarkReached[mode] = reached;
+		adaptiveBenchmarkFrames = 0;
+		if (adaptiveUniform) {
+			adaptiveUniform = false;
+			adaptiveReset = true;
+			return;
+		}
+		const char* names[] = { "Uniform", "Adaptive" };
+		for (uint32_t i = 0; i < 2; i++) {
+			std::cout << names[i] << " sampling: " << adaptiveBenchmarkMs[i] << " ms in "
+				<< adaptiveBenchmarkFrameCounts[i] << " frames "
+				<< (adaptiveBenchmarkReached[i] ? "to reach " : "without reaching ")
+				<< g_AdaptiveTargetFraction * 100.0 << "% of pixels within "
+				<< adaptiveThreshold * 100.0f << "% error\n";
+		}
+		if (adaptiveBenchmarkReached[0] && adaptiveBenchmarkReached[1] && adaptiveBenchmarkMs[1] > 0.0) {
+			std::cout << "Adaptive time to target: " << adaptiveBenchmarkMs[0] / adaptiveBenchmarkMs[1]
+				<< "x faster\n";
+		}
+		adaptiveBenchmarkRunning = false;
+	}
+
+	// Called after the frame fence wait. The other frame in flight may still
+	// trace the evicted BLASes and build from the old instances, they are
+	// retired with the frame. The TLAS keeps its size and descriptors and is
+	// rebuilt in place by the frame's graph, see addTopLevelBuildPass.
+	void updateResidency() {
+		while (!retiredAccels.empty() && retiredAccels.front().frame + g_MaxFramesInFlight <= frameCount) {
+			retiredAccels.pop_front();
+		}
+		if (options.meshPack.empty() || !residency.update(cameraPosition, cameraDirection)) {
+			return;
+		}
+		RetiredAccels retired{};
+		retired.frame = frameCount;
+		retired.accels = residency.takeEvicted();
+		retired.buffers.push_back(std::move(topInstanceBuffer));
+		retiredAccels.push_back(std::move(retired));
+
+		std::vector<vk::AccelerationStructureInstanceKHR> accelInstances = getTopInstances();
+		if (accelInstances.size() != topInstanceCount) {
+			std::cerr << "TLAS instance count changed with residency\n";
+			std::abort();
+		}
+		createTopInstanceBuffer(accelInstances);
+		topAccelRebuild = true;
+	}
+
 	void updateDescriptorSet(vk::DescriptorSet descSet,vk::ImageView imageView) {
 		// DescriptorSetshadersɊe_,esNZɋʂĎg郊\[X܂Ƃ߂
 		// TLASƌʂނ߂̃C[Wʃ\[XƂĐݒ肳Ă
 		// C[WɊւĂ̓Xbv`F[~ڂ݂Ȏw̎d
 
-		std::vector<vk::WriteDescriptorSet> writes(2);
+		std::vector<vk::WriteDescriptorSet> writes(23);
 
 		vk::WriteDescriptorSetAccelerationStructureKHR accelInfo{};
 		accelInfo.setAccelerationStructures(*topAccel.accel);
@@ -744,80 +3554,615 @@ private:
 		writes[1].setDescriptorType(vk::DescriptorType::eStorageImage);
 		writes[1].setImageInfo(imageInfo);
 
+		// G-buffer for the denoiser
+		vk::DescriptorImageInfo normalDepthInfo{ {}, *normalDepthImage.view, vk::ImageLayout::eGeneral };
+		vk::DescriptorImageInfo motionInfo{ {}, *motionImage.view, vk::ImageLayout::eGeneral };
+		writes[2].setDstSet(descSet);
+		writes[2].setDstBinding(2);
+		writes[2].setDescriptorType(vk::DescriptorType::eStorageImage);
+		writes[2].setImageInfo(normalDepthInfo);
+
+		writes[3].setDstSet(descSet);
+		writes[3].setDstBinding(3);
+		writes[3].setDescriptorType(vk::DescriptorType::eStorageImage);
+		writes[3].setImageInfo(motionInfo);
+
+		// Mesh data for shading normals
+		vk::DescriptorBufferInfo indexInfo{ *meshIndexBuffer.buffer, 0, VK_WHOLE_SIZE };
+		vk::DescriptorBufferInfo normalInfo{ *meshNormalBuffer.buffer, 0, VK_WHOLE_SIZE };
+		writes[4].setDstSet(descSet);
+		writes[4].setDstBinding(4);
+		writes[4].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		writes[4].setBufferInfo(indexInfo);
+
+		writes[5].setDstSet(descSet);
+		writes[5].setDstBinding(5);
+		writes[5].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		writes[5].setBufferInfo(normalInfo);
+
+		// Wavefront queues, the trace reads the sorted rays and appends to the queue
+		std::array<vk::DescriptorBufferInfo, 4> rayInfos = {
+			vk::DescriptorBufferInfo{ *sortedRayBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *queuedRayBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *rayCounterBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *rayStatsBuffer.buffer, 0, VK_WHOLE_SIZE },
+		};
+		for (uint32_t i = 0; i < rayInfos.size(); i++) {
+			writes[6 + i].setDstSet(descSet);
+			writes[6 + i].setDstBinding(6 + i);
+			writes[6 + i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			writes[6 + i].setBufferInfo(rayInfos[i]);
+		}
+
+		// Per-frame uniforms, the dynamic offset selects the frame's slot
+		vk::DescriptorBufferInfo frameUniformInfo{ *frameUniformBuffer.buffer, 0, sizeof(FrameUniforms) };
+		writes[10].setDstSet(descSet);
+		writes[10].setDstBinding(10);
+		writes[10].setDescriptorType(vk::DescriptorType::eUniformBufferDynamic);
+		writes[10].setBufferInfo(frameUniformInfo);
+
+		// Alpha test inputs and counters
+		std::array<vk::DescriptorBufferInfo, 3> alphaInfos = {
+			vk::DescriptorBufferInfo{ *alphaMaskBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *alphaUVBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *anyHitStatsBuffer.buffer, 0, VK_WHOLE_SIZE },
+		};
+		for (uint32_t i = 0; i < alphaInfos.size(); i++) {
+			writes[11 + i].setDstSet(descSet);
+			writes[11 + i].setDstBinding(11 + i);
+			writes[11 + i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			writes[11 + i].setBufferInfo(alphaInfos[i]);
+		}
+
+		vk::DescriptorBufferInfo particleInfo{ *particleBuffer.buffer, 0, VK_WHOLE_SIZE };
+		writes[14].setDstSet(descSet);
+		writes[14].setDstBinding(14);
+		writes[14].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		writes[14].setBufferInfo(particleInfo);
+
+		// Adaptive sampling
+		std::array<vk::DescriptorBufferInfo, 3> adaptiveInfos = {
+			vk::DescriptorBufferInfo{ *pixelStatsBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *adaptivePixelBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *adaptiveStatsBuffer.buffer, 0, VK_WHOLE_SIZE },
+		};
+		for (uint32_t i = 0; i < adaptiveInfos.size(); i++) {
+			writes[15 + i].setDstSet(descSet);
+			writes[15 + i].setDstBinding(15 + i);
+			writes[15 + i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			writes[15 + i].setBufferInfo(adaptiveInfos[i]);
+		}
+
+		// Light sampling
+		std::array<vk::DescriptorBufferInfo, 3> lightInfos = {
+			vk::DescriptorBufferInfo{ *environmentBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *lightTreeBuffer.buffer, 0, VK_WHOLE_SIZE },
+			vk::DescriptorBufferInfo{ *lightTriangleBuffer.buffer, 0, VK_WHOLE_SIZE },
+		};
+		for (uint32_t i = 0; i < lightInfos.size(); i++) {
+			writes[18 + i].setDstSet(descSet);
+			writes[18 + i].setDstBinding(18 + i);
+			writes[18 + i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+			writes[18 + i].setBufferInfo(lightInfos[i]);
+		}
+
+		// Multiview layers and cameras
+		vk::DescriptorImageInfo probeImageInfo{ {}, *probeImage.view, vk::ImageLayout::eGeneral };
+		vk::DescriptorBufferInfo probeViewInfo{ *probeViewBuffer.buffer, 0, VK_WHOLE_SIZE };
+		writes[21].setDstSet(descSet);
+		writes[21].setDstBinding(21);
+		writes[21].setDescriptorType(vk::DescriptorType::eStorageImage);
+		writes[21].setImageInfo(probeImageInfo);
+		writes[22].setDstSet(descSet);
+		writes[22].setDstBinding(22);
+		writes[22].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+		writes[22].setBufferInfo(probeViewInfo);
+
 		device->updateDescriptorSets(writes, nullptr);
 	}
 
-	void recordCommandBuffer(vk::CommandBuffer commandBuffer,vk::Image image, uint32_t imageIndex, ImDrawData* draw_data) {
+	void recordCommandBuffer(vk::CommandBuffer commandBuffer, uint32_t frameIndex,
+		vk::Image image, uint32_t imageIndex, ImDrawData* draw_data) {
 		vk::CommandBufferBeginInfo info = {};
 		info.flags |= vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
 
 		commandBuffer.begin(vk::CommandBufferBeginInfo{});;
 
-		auto imageMemoryBarrier = vk::ImageMemoryBarrier()
-			.setSrcAccessMask(vk::AccessFlags{})
-			.setDstAccessMask(vk::AccessFlagBits::eShaderWrite)
-			.setOldLayout(vk::ImageLayout::ePresentSrcKHR)
-			.setNewLayout(vk::ImageLayout::eGeneral)
-			.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-			.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
-			.setImage(image)
-			.setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1));
-
-		commandBuffer.pipelineBarrier(
-			vk::PipelineStageFlagBits::eTopOfPipe,
-			vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-			{},
-			{},
-			{},
-			{ imageMemoryBarrier });
-		
-		commandBuffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *pipeline);
-		
-		commandBuffer.bindDescriptorSets(
-			vk::PipelineBindPoint::eRayTracingKHR,
-			*pipelineLayout,
-			0,
-			descSets[imageIndex],
-			nullptr);
-
-		commandBuffer.traceRaysKHR(
-			raygenRegion,
-			missRegion,
-			hitRegion,
-			{},
-			width,height, 1);
-
-		imageMemoryBarrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
-		imageMemoryBarrier.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
-		imageMemoryBarrier.oldLayout     = vk::ImageLayout::eGeneral;
-		imageMemoryBarrier.newLayout     = vk::ImageLayout::eColorAttachmentOptimal;
-
-		commandBuffer.pipelineBarrier(
-			vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-			vk::PipelineStageFlagBits::eColorAttachmentOutput,
-			{},
-			{},
-			{},
-			{ imageMemoryBarrier });
-
-		vk::RenderPassBeginInfo renderPassInfo{};
-		renderPassInfo.setRenderPass(*renderPass);
-		renderPassInfo.setFramebuffer(*swapchainFramebuffers[imageIndex]);
-		vk::Rect2D rect({ 0,0 }, { (uint32_t)width,(uint32_t)height });
-
-		renderPassInfo.setRenderArea(rect);
-
-		commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
-		ImGui::Render(); // Ŏ~܂Ă
-		//for (;;);
-		draw_data = ImGui::GetDrawData();
-		ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), commandBuffer);
-
-		commandBuffer.endRenderPass();
+		// Passes only declare their accesses, the graph records the barriers
+		rendergraph::RenderGraph& graph = renderGraphs[frameIndex];
+		graph.reset();
+		vk::ImageSubresourceRange colorRange{ vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+		auto hdr = graph.importImage("hdr", *hdrImage.image, colorRange,
+			rendergraph::previousFrame(vk::ImageLayout::eGeneral), vk::ImageLayout::eGeneral);
+		auto swapchainImage = graph.importImage("swapchain", image, colorRange,
+			{ vk::PipelineStageFlagBits2::eNone, vk::AccessFlagBits2::eNone, vk::ImageLayout::ePresentSrcKHR },
+			vk::ImageLayout::ePresentSrcKHR, true);
+		// With a deformable mesh or new residency the TLAS is refit or rebuilt
+		// in the frame while the previous frame may still trace it
+		auto tlas = options.deformable || topAccelRebuild ?
+			graph.importAccel("tlas", rendergraph::previousFrame()) : graph.importAccel("tlas");
+		auto normalDepth = graph.importImage("normal-depth", *normalDepthImage.image, colorRange,
+			rendergraph::previousFrame(vk::ImageLayout::eGeneral), vk::ImageLayout::eGeneral);
+		auto motion = graph.importImage("motion", *motionImage.image, colorRange,
+			rendergraph::previousFrame(vk::ImageLayout::eGeneral), vk::ImageLayout::eGeneral);
+
+		if (timestampPool) {
+			commandBuffer.resetQueryPool(*timestampPool, g_TimestampsPerFrame * frameIndex, g_TimestampsPerFrame);
+		}
+
+		if (topAccelRebuild) {
+			addTopLevelBuildPass(graph, tlas);
+			topAccelRebuild = false;
+		}
+		if (options.deformable) {
+			addDeformPasses(graph, frameIndex, tlas);
+		}
+		addTracePasses(graph, frameIndex, imageIndex, tlas, hdr, normalDepth, motion);
+
+		if (denoiserEnabled) {
+			addDenoiserPasses(graph, frameIndex, hdr, normalDepth, motion);
+		}
+		else {
+			denoiserHistoryValid = false;
+		}
+
+		auto tonemapTarget = swapchainImage;
+		if (!swapchainStorage) {
+			tonemapTarget = graph.createImage("ldr", { vk::Format::eR8G8B8A8Unorm, swapchainExtent,
+				vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc });
+		}
+
+		graph.addPass("tonemap", [&](vk::CommandBuffer commandBuffer) {
+			vk::DescriptorSet descSet = tonemapDescSets[frameIndex];
+			updateTonemapDescriptorSet(descSet, swapchainStorage ?
+				*swapchainImageViews[imageIndex] : graph.getImageView(tonemapTarget));
+
+			TonemapParams params{ exposure, static_cast<uint32_t>(tonemapOperator), tonemapFlags };
+			commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *tonemapPipeline);
+			commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *tonemapPipelineLayout,
+				0, descSet, nullptr);
+			commandBuffer.pushConstants(*tonemapPipelineLayout, vk::ShaderStageFlagBits::eCompute,
+				0, sizeof(TonemapParams), &params);
+			commandBuffer.dispatch((swapchainExtent.width + 7) / 8, (swapchainExtent.height + 7) / 8, 1);
+		})
+			.read(hdr, rendergraph::storageRead(vk::PipelineStageFlagBits2::eComputeShader))
+			.write(tonemapTarget, rendergraph::storageWrite(vk::PipelineStageFlagBits2::eComputeShader));
+
+		if (!swapchainStorage) {
+			// Blit converts to the swapchain format, a copy takes the texels as they are
+			graph.addPass("blit", [&](vk::CommandBuffer commandBuffer) {
+				vk::ImageSubresourceLayers layers{ vk::ImageAspectFlagBits::eColor, 0, 0, 1 };
+				if (!swapchainBlit) {
+					vk::ImageCopy region{ layers, {}, layers, {}, { swapchainExtent.width, swapchainExtent.height, 1 } };
+					commandBuffer.copyImage(
+						graph.getImage(tonemapTarget), vk::ImageLayout::eTransferSrcOptimal,
+						image, vk::ImageLayout::eTransferDstOptimal, region);
+					return;
+				}
+				std::array<vk::Offset3D, 2> offsets = { vk::Offset3D{ 0, 0, 0 },
+					vk::Offset3D{ static_cast<int32_t>(swapchainExtent.width), static_cast<int32_t>(swapchainExtent.height), 1 } };
+				vk::ImageBlit region{ layers, offsets, layers, offsets };
+				commandBuffer.blitImage(
+					graph.getImage(tonemapTarget), vk::ImageLayout::eTransferSrcOptimal,
+					image, vk::ImageLayout::eTransferDstOptimal,
+					region, vk::Filter::eNearest);
+			})
+				.read(tonemapTarget, rendergraph::transferSrc())
+				.write(swapchainImage, rendergraph::transferDst());
+		}
+
+		graph.addPass("imgui", [&](vk::CommandBuffer commandBuffer) {
+			vk::RenderPassBeginInfo renderPassInfo{};
+			renderPassInfo.setRenderPass(*renderPass);
+			renderPassInfo.setFramebuffer(*swapchainFramebuffers[imageIndex]);
+			vk::Rect2D rect({ 0,0 }, { (uint32_t)width,(uint32_t)height });
+
+			renderPassInfo.setRenderArea(rect);
+
+			commandBuffer.beginRenderPass(renderPassInfo, vk::SubpassContents::eInline);
+			ImGui::Render(); // Ŏ~܂Ă
+			//for (;;);
+			draw_data = ImGui::GetDrawData();
+			ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), commandBuffer);
+
+			commandBuffer.endRenderPass();
+		})
+			.write(swapchainImage, rendergraph::colorAttachment());
+
+		graph.compile();
+		graph.execute(commandBuffer);
+		timestampsWritten[frameIndex] = static_cast<bool>(timestampPool);
+		denoiserTimestampsWritten[frameIndex] = timestampPool && denoiserEnabled;
+		deformTimestampsWritten[frameIndex] = timestampPool && options.deformable;
+		deformRebuilt[frameIndex] = options.deformable && deformableMesh.isRebuild();
+		acquireWaitStage = rendergraph::toLegacyStages(graph.getAcquireStage(swapchainImage),
+			vk::PipelineStageFlagBits::eTopOfPipe);
 
 		commandBuffer.end();
 	}
 
+	// Full build of the TLAS over the instances written by updateResidency.
+	// The BLASes it references were built and waited for by residency.
+	void addTopLevelBuildPass(rendergraph::RenderGraph& graph, rendergraph::ResourceHandle tlas) {
+		graph.addPass("tlas-build", [=, this](vk::CommandBuffer commandBuffer) {
+			topAccel.record(commandBuffer, getTopLevelGeometry(), topInstanceCount, false);
+		})
+			.write(tlas, rendergraph::accelBuild());
+	}
+
+	// Skins the character, refits or rebuilds its BLAS as decided on the
+	// host for this pose, then refits the TLAS over it. The position buffer
+	// and the BLAS are rewritten in place, so they wait for earlier frames.
+	void addDeformPasses(rendergraph::RenderGraph& graph, uint32_t frameIndex, rendergraph::ResourceHandle tlas) {
+		auto positions = graph.importBuffer("skinned-positions", deformableMesh.getPositionBuffer(),
+			rendergraph::previousFrame());
+		auto blas = graph.importAccel("deformable-blas", rendergraph::previousFrame());
+		auto writeTimestamp = [=, this](vk::CommandBuffer commandBuffer, uint32_t query) {
+			if (timestampPool) {
+				commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+					g_TimestampsPerFrame * frameIndex + query);
+			}
+		};
+
+		graph.addPass("skinning", [=, this](vk::CommandBuffer commandBuffer) {
+			writeTimestamp(commandBuffer, g_TimestampSkinningBegin);
+			deformableMesh.recordSkinning(commandBuffer, frameIndex);
+			writeTimestamp(commandBuffer, g_TimestampSkinningEnd);
+		})
+			.write(positions, rendergraph::storageWrite(vk::PipelineStageFlagBits2::eComputeShader));
+
+		graph.addPass(deformableMesh.isRebuild() ? "blas-rebuild" : "blas-refit", [=, this](vk::CommandBuffer commandBuffer) {
+			deformableMesh.recordBuild(commandBuffer);
+			writeTimestamp(commandBuffer, g_TimestampBlasEnd);
+		})
+			.read(positions, rendergraph::accelBuildInput())
+			.write(blas, rendergraph::accelBuild());
+
+		graph.addPass("tlas-refit", [=, this](vk::CommandBuffer commandBuffer) {
+			topAccel.record(commandBuffer, getTopLevelGeometry(), topInstanceCount, true);
+			writeTimestamp(commandBuffer, g_TimestampTlasEnd);
+		})
+			.read(blas, rendergraph::accelRead(vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR))
+			.write(tlas, rendergraph::accelBuild());
+	}
+
+	// Megakernel: one traceRays follows every path through all bounces, the
+	// ray query backend does the same in one compute dispatch.
+	// Wavefront: bounce 0 traces the camera rays and queues the bounced rays,
+	// every further bounce sorts the queue by ray_sort.comp keys and traces it
+	// with its own dispatch.
+	void addTracePasses(rendergraph::RenderGraph& graph, uint32_t frameIndex, uint32_t imageIndex,
+		rendergraph::ResourceHandle tlas, rendergraph::ResourceHandle hdr,
+		rendergraph::ResourceHandle normalDepth, rendergraph::ResourceHandle motion) {
+		auto compute = vk::PipelineStageFlagBits2::eComputeShader;
+		auto rayTracing = traceBackend == g_TraceBackendRayQuery ?
+			compute : vk::PipelineStageFlagBits2::eRayTracingShaderKHR;
+		auto stats = graph.importBuffer("ray-stats", *rayStatsBuffer.buffer, rendergraph::previousFrame());
+		auto anyHitStats = graph.importBuffer("any-hit-stats", *anyHitStatsBuffer.buffer, rendergraph::previousFrame());
+		auto queuedRays = graph.importBuffer("queued-rays", *queuedRayBuffer.buffer, rendergraph::previousFrame());
+		auto sortedRays = graph.importBuffer("sorted-rays", *sortedRayBuffer.buffer, rendergraph::previousFrame());
+		auto counters = graph.importBuffer("ray-counters", *rayCounterBuffer.buffer, rendergraph::previousFrame());
+		auto bins = graph.importBuffer("ray-bins", *rayBinBuffer.buffer, rendergraph::previousFrame());
+		auto accumulation = graph.importBuffer("accumulation", *pixelStatsBuffer.buffer, rendergraph::previousFrame());
+		auto adaptivePixels = graph.importBuffer("adaptive-pixels", *adaptivePixelBuffer.buffer, rendergraph::previousFrame());
+		auto adaptiveStats = graph.importBuffer("adaptive-stats", *adaptiveStatsBuffer.buffer, rendergraph::previousFrame());
+
+		bool wavefront = traceBackend == g_TraceBackendWavefront;
+		bool adaptive = isAdaptiveSampling();
+		bool resetAccumulation = adaptive && adaptiveReset;
+		if (adaptive) {
+			adaptiveReset = false;
+		}
+		adaptiveStatsWritten[frameIndex] = adaptive;
+		adaptiveStatsUniform[frameIndex] = adaptiveUniform;
+		adaptiveStatsUniformLights[frameIndex] = uniformLights;
+		vk::Pipeline rayQueryPipeline = traceBackend == g_TraceBackendRayQuery ?
+			*rayQueryPipelines[rayQueryWorkgroup] : vk::Pipeline{};
+		vk::Extent2D workgroup = rayQueryPipeline ? rayQueryWorkgroups[rayQueryWorkgroup] : vk::Extent2D{};
+		uint32_t bounces = static_cast<uint32_t>(maxBounces);
+		TraceParams traceParams{};
+		traceParams.statsSlot = frameIndex;
+		uint32_t frameUniformOffset = static_cast<uint32_t>(frameIndex * frameUniformStride);
+
+		// The wavefront mode counts its camera rays up front, the sort counts the rest
+		graph.addPass("ray-stats-clear", [=, this](vk::CommandBuffer commandBuffer) {
+			uint32_t cameraRays = wavefront ? renderExtent.width * renderExtent.height : 0;
+			commandBuffer.fillBuffer(*rayStatsBuffer.buffer, frameIndex * sizeof(uint32_t), sizeof(uint32_t), cameraRays);
+			commandBuffer.fillBuffer(*anyHitStatsBuffer.buffer, frameIndex * sizeof(uint32_t), sizeof(uint32_t), 0);
+			if (wavefront) {
+				commandBuffer.fillBuffer(*rayCounterBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+				commandBuffer.fillBuffer(*rayBinBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+			}
+			if (adaptive) {
+				// An empty list traced as width x 1 x 1
+				std::array<uint32_t, 4> header = { 0, 1, 1, 0 };
+				commandBuffer.updateBuffer(*adaptivePixelBuffer.buffer, 0, sizeof(header), header.data());
+				commandBuffer.fillBuffer(*adaptiveStatsBuffer.buffer, frameIndex * g_AdaptiveStatsSize,
+					g_AdaptiveStatsSize, 0);
+			}
+			if (resetAccumulation) {
+				commandBuffer.fillBuffer(*pixelStatsBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+			}
+		})
+			.write(stats, rendergraph::transferDst())
+			.write(anyHitStats, rendergraph::transferDst())
+			.write(counters, rendergraph::transferDst())
+			.write(bins, rendergraph::transferDst())
+			.write(adaptivePixels, rendergraph::transferDst())
+			.write(adaptiveStats, rendergraph::transferDst())
+			.write(accumulation, rendergraph::transferDst());
+
+		auto traceBounce = [=, this](vk::CommandBuffer commandBuffer, uint32_t bounce) {
+			TraceParams params = traceParams;
+			params.bounce = bounce;
+			commandBuffer.pushConstants(*pipelineLayout, g_TraceStages, 0, sizeof(TraceParams), &params);
+
+			if (rayQueryPipeline) {
+				// The compute pipeline shares the layout and descriptor sets
+				commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, rayQueryPipeline);
+				commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout,
+					0, descSets[imageIndex], frameUniformOffset);
+				commandBuffer.dispatch((renderExtent.width + workgroup.width - 1) / workgroup.width,
+					(renderExtent.height + workgroup.height - 1) / workgroup.height, 1);
+				return;
+			}
+
+			commandBuffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *pipeline);
+
+			commandBuffer.bindDescriptorSets(
+				vk::PipelineBindPoint::eRayTracingKHR,
+				*pipelineLayout,
+				0,
+				descSets[imageIndex],
+				frameUniformOffset);
+
+			if (adaptive) {
+				// The launch size is the pixel count written by adaptive_compact.comp
+				commandBuffer.traceRaysIndirectKHR(
+					sbt.adaptiveRaygenRegion,
+					sbt.missRegion,
+					sbt.hitRegion,
+					{},
+					adaptivePixelBuffer.address);
+				return;
+			}
+
+			commandBuffer.traceRaysKHR(
+				wavefront ? sbt.wavefrontRaygenRegion : sbt.raygenRegion,
+				sbt.missRegion,
+				sbt.hitRegion,
+				{},
+				renderExtent.width, renderExtent.height, 1);
+		};
+		auto writeTimestamp = [=, this](vk::CommandBuffer commandBuffer, uint32_t query) {
+			if (timestampPool) {
+				commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+					g_TimestampsPerFrame * frameIndex + query);
+			}
+		};
+
+		// The trace time of adaptive sampling includes building the pixel list
+		if (adaptive) {
+			graph.addPass("adaptive-compact", [=, this](vk::CommandBuffer commandBuffer) {
+				writeTimestamp(commandBuffer, g_TimestampTraceBegin);
+				commandBuffer.pushConstants(*pipelineLayout, g_TraceStages, 0, sizeof(TraceParams), &traceParams);
+				commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *adaptiveCompactPipeline);
+				commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout,
+					0, descSets[imageIndex], frameUniformOffset);
+				commandBuffer.dispatch((renderExtent.width + 7) / 8, (renderExtent.height + 7) / 8, 1);
+			})
+				.read(accumulation, rendergraph::storageRead(compute))
+				.write(adaptivePixels, rendergraph::storageReadWrite(compute))
+				.write(adaptiveStats, rendergraph::storageReadWrite(compute))
+				.write(hdr, rendergraph::storageWrite(compute));
+		}
+
+		uint32_t lastBounce = wavefront ? bounces : 0;
+		auto& tracePass = graph.addPass("trace", [=](vk::CommandBuffer commandBuffer) {
+			if (!adaptive) {
+				writeTimestamp(commandBuffer, g_TimestampTraceBegin);
+			}
+			traceBounce(commandBuffer, 0);
+			if (lastBounce == 0) {
+				writeTimestamp(commandBuffer, g_TimestampTraceEnd);
+			}
+		});
+		tracePass.read(tlas, rendergraph::accelRead(rayTracing))
+			.write(hdr, rendergraph::storageWrite(rayTracing))
+			.write(normalDepth, rendergraph::storageWrite(rayTracing))
+			.write(motion, rendergraph::storageWrite(rayTracing))
+			.write(queuedRays, rendergraph::storageWrite(rayTracing))
+			.write(counters, rendergraph::storageReadWrite(rayTracing))
+			.write(stats, rendergraph::storageReadWrite(rayTracing))
+			.write(anyHitStats, rendergraph::storageReadWrite(rayTracing));
+		if (adaptive) {
+			tracePass.read(adaptivePixels, rendergraph::indirectRead(rayTracing))
+				.write(accumulation, rendergraph::storageReadWrite(rayTracing));
+		}
+
+		for (uint32_t bounce = 1; bounce <= lastBounce; bounce++) {
+			for (uint32_t step = 0; step < 3; step++) {
+				const char* names[] = { "ray-sort-histogram", "ray-sort-scan", "ray-sort-scatter" };
+				auto& pass = graph.addPass(names[step], [=, this](vk::CommandBuffer commandBuffer) {
+					// The scan is a single workgroup, the other steps cover the largest queue
+					uint32_t rayCount = renderExtent.width * renderExtent.height;
+					RaySortParams params{ step, frameIndex };
+					commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *raySortPipeline);
+					commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *raySortPipelineLayout,
+						0, raySortDescSet, nullptr);
+					commandBuffer.pushConstants(*raySortPipelineLayout, vk::ShaderStageFlagBits::eCompute,
+						0, sizeof(params), &params);
+					commandBuffer.dispatch(step == 1 ? 1 : (rayCount + 255) / 256, 1, 1);
+				});
+				pass.write(bins, rendergraph::storageReadWrite(compute))
+					.write(counters, rendergraph::storageReadWrite(compute));
+				if (step == 1) {
+					pass.write(stats, rendergraph::storageReadWrite(compute));
+				}
+				else {
+					pass.read(queuedRays, rendergraph::storageRead(compute));
+				}
+				if (step == 2) {
+					pass.write(sortedRays, rendergraph::storageWrite(compute));
+				}
+			}
+
+			graph.addPass("trace-bounce", [=](vk::CommandBuffer commandBuffer) {
+				traceBounce(commandBuffer, bounce);
+				if (bounce == lastBounce) {
+					writeTimestamp(commandBuffer, g_TimestampTraceEnd);
+				}
+			})
+				.read(tlas, rendergraph::accelRead(rayTracing))
+				.read(sortedRays, rendergraph::storageRead(rayTracing))
+				.write(hdr, rendergraph::storageReadWrite(rayTracing))
+				.write(queuedRays, rendergraph::storageWrite(rayTracing))
+				.write(counters, rendergraph::storageReadWrite(rayTracing))
+				.write(stats, rendergraph::storageReadWrite(rayTracing))
+				.write(anyHitStats, rendergraph::storageReadWrite(rayTracing));
+		}
+	}
+
+	void addDenoiserPasses(rendergraph::RenderGraph& graph, uint32_t frameIndex,
+		rendergraph::ResourceHandle hdr, rendergraph::ResourceHandle normalDepth, rendergraph::ResourceHandle motion) {
+		vk::ImageSubresourceRange colorRange{ vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+		auto importHistory = [&](const char* name, Image& image) {
+			return graph.importImage(name, *image.image, colorRange,
+				rendergraph::previousFrame(vk::ImageLayout::eGeneral), vk::ImageLayout::eGeneral);
+		};
+		auto prevNormalDepth = importHistory("prev-normal-depth", prevNormalDepthImage);
+		auto moments = importHistory("moments", momentsImage);
+		auto prevMoments = importHistory("prev-moments", prevMomentsImage);
+		auto historyColor = importHistory("history-color", historyColorImage);
+
+		rendergraph::ImageDesc pingDesc{ vk::Format::eR16G16B16A16Sfloat, renderExtent,
+			vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc };
+		std::array<rendergraph::ResourceHandle, 2> ping = {
+			graph.createImage("svgf-ping", pingDesc),
+			graph.createImage("svgf-pong", pingDesc),
+		};
+
+		// Passes run after this function returns, so they capture locals by value
+		bool capture = options.validateDenoiser && frameCount == g_DenoiserValidationFrame;
+		// History is invalid after the denoiser was off, and is ignored for validation
+		bool reset = !denoiserHistoryValid || capture;
+		denoiserHistoryValid = true;
+
+		vk::DeviceSize pixelCount = static_cast<vk::DeviceSize>(renderExtent.width) * renderExtent.height;
+		auto copyToCapture = [this](vk::CommandBuffer commandBuffer, vk::Image image, vk::DeviceSize offset) {
+			vk::BufferImageCopy region{ offset, 0, 0, { vk::ImageAspectFlagBits::eColor, 0, 0, 1 },
+				{ 0, 0, 0 }, { renderExtent.width, renderExtent.height, 1 } };
+			commandBuffer.copyImageToBuffer(image, vk::ImageLayout::eTransferSrcOptimal,
+				*denoiserCaptureBuffer.buffer, region);
+		};
+		if (capture) {
+			graph.addPass("capture-input", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+				copyToCapture(commandBuffer, *hdrImage.image, 0);
+				copyToCapture(commandBuffer, *normalDepthImage.image, pixelCount * 8);
+				copyToCapture(commandBuffer, *motionImage.image, pixelCount * 16);
+			})
+				.read(hdr, rendergraph::transferSrc())
+				.read(normalDepth, rendergraph::transferSrc())
+				.read(motion, rendergraph::transferSrc())
+				.sideEffect();
+		}
+
+		vk::Extent2D groups{ (renderExtent.width + 7) / 8, (renderExtent.height + 7) / 8 };
+		auto compute = vk::PipelineStageFlagBits2::eComputeShader;
+
+		graph.addPass("svgf-temporal", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+			if (timestampPool) {
+				commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+					g_TimestampsPerFrame * frameIndex + g_TimestampDenoiserBegin);
+			}
+			vk::DescriptorSet descSet = svgfTemporalDescSets[frameIndex];
+			vkutils::updateStorageImageDescriptors(*device, descSet, {
+				*hdrImage.view, *normalDepthImage.view, *motionImage.view, *prevNormalDepthImage.view,
+				*historyColorImage.view, *prevMomentsImage.view, graph.getImageView(ping[0]), *momentsImage.view });
+
+			denoiser::TemporalPushConstants params{ denoiserParams.minAlpha, denoiserParams.maxHistoryLength,
+				reset ? 1u : 0u, 0 };
+			commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *svgfTemporalPipeline);
+			commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *svgfTemporalPipelineLayout,
+				0, descSet, nullptr);
+			commandBuffer.pushConstants(*svgfTemporalPipelineLayout, vk::ShaderStageFlagBits::eCompute,
+				0, sizeof(params), &params);
+			commandBuffer.dispatch(groups.width, groups.height, 1);
+		})
+			.read(hdr, rendergraph::storageRead(compute))
+			.read(normalDepth, rendergraph::storageRead(compute))
+			.read(motion, rendergraph::storageRead(compute))
+			.read(prevNormalDepth, rendergraph::storageRead(compute))
+			.read(historyColor, rendergraph::storageRead(compute))
+			.read(prevMoments, rendergraph::storageRead(compute))
+			.write(ping[0], rendergraph::storageWrite(compute))
+			.write(moments, rendergraph::storageWrite(compute));
+
+		// The current G-buffer and moments become the history of the next frame
+		graph.addPass("svgf-history", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+			vk::ImageCopy region{ { vk::ImageAspectFlagBits::eColor, 0, 0, 1 }, { 0, 0, 0 },
+				{ vk::ImageAspectFlagBits::eColor, 0, 0, 1 }, { 0, 0, 0 },
+				{ renderExtent.width, renderExtent.height, 1 } };
+			commandBuffer.copyImage(*normalDepthImage.image, vk::ImageLayout::eTransferSrcOptimal,
+				*prevNormalDepthImage.image, vk::ImageLayout::eTransferDstOptimal, region);
+			commandBuffer.copyImage(*momentsImage.image, vk::ImageLayout::eTransferSrcOptimal,
+				*prevMomentsImage.image, vk::ImageLayout::eTransferDstOptimal, region);
+		})
+			.read(normalDepth, rendergraph::transferSrc())
+			.read(moments, rendergraph::transferSrc())
+			.write(prevNormalDepth, rendergraph::transferDst())
+			.write(prevMoments, rendergraph::transferDst());
+
+		uint32_t iterations = denoiserParams.iterations;
+		for (uint32_t i = 0; i < iterations; i++) {
+			bool last = i + 1 == iterations;
+			auto src = ping[i % 2];
+			auto dst = last ? hdr : ping[(i + 1) % 2];
+			graph.addPass("svgf-atrous", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+				vk::DescriptorSet descSet = svgfAtrousDescSets[frameIndex * iterations + i];
+				vkutils::updateStorageImageDescriptors(*device, descSet, {
+					graph.getImageView(src), last ? *hdrImage.view : graph.getImageView(dst), *normalDepthImage.view });
+
+				denoiser::AtrousPushConstants params{ static_cast<int32_t>(1u << i), denoiserParams.sigmaDepth,
+					denoiserParams.sigmaNormal, denoiserParams.sigmaLuminance };
+				commandBuffer.bindPipeline(vk::PipelineBindPoint::eCompute, *svgfAtrousPipeline);
+				commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *svgfAtrousPipelineLayout,
+					0, descSet, nullptr);
+				commandBuffer.pushConstants(*svgfAtrousPipelineLayout, vk::ShaderStageFlagBits::eCompute,
+					0, sizeof(params), &params);
+				commandBuffer.dispatch(groups.width, groups.height, 1);
+				if (last && timestampPool) {
+					commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *timestampPool,
+						g_TimestampsPerFrame * frameIndex + g_TimestampDenoiserEnd);
+				}
+			})
+				.read(src, rendergraph::storageRead(compute))
+				.read(normalDepth, rendergraph::storageRead(compute))
+				.write(dst, rendergraph::storageWrite(compute));
+
+			if (i == 0) {
+				// Like SVGF, the first filtered image feeds the next frame
+				graph.addPass("svgf-feedback", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+					vk::ImageCopy region{ { vk::ImageAspectFlagBits::eColor, 0, 0, 1 }, { 0, 0, 0 },
+						{ vk::ImageAspectFlagBits::eColor, 0, 0, 1 }, { 0, 0, 0 },
+						{ renderExtent.width, renderExtent.height, 1 } };
+					commandBuffer.copyImage(graph.getImage(dst), vk::ImageLayout::eTransferSrcOptimal,
+						*historyColorImage.image, vk::ImageLayout::eTransferDstOptimal, region);
+				})
+					.read(dst, rendergraph::transferSrc())
+					.write(historyColor, rendergraph::transferDst());
+			}
+		}
+
+		if (capture) {
+			graph.addPass("capture-output", [=, this, &graph](vk::CommandBuffer commandBuffer) {
+				copyToCapture(commandBuffer, *hdrImage.image, pixelCount * 20);
+			})
+				.read(hdr, rendergraph::transferSrc())
+				.sideEffect();
+		}
+	}
+
 	void initImGui() {
 		imGuicontext = ImGui::CreateContext();
 		ImGui::SetCurrentContext(imGuicontext);
@@ -851,12 +4196,413 @@ private:
 		bool b = false;
 		ImGui::Checkbox("Check Box", &b);
 		ImGui::Text("Yeah");
+		ImGui::SliderFloat("Exposure", &exposure, 0.01f, 16.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+		const char* tonemapOperators[] = { "Clamp", "Reinhard", "ACES" };
+		ImGui::Combo("Tonemap", &tonemapOperator, tonemapOperators, IM_ARRAYSIZE(tonemapOperators));
+		ImGui::Checkbox("Denoiser", &denoiserEnabled);
+		if (denoiserEnabled && timestampPool) {
+			ImGui::Text("Denoiser: %.2f ms", denoiserMs);
+		}
+		ImGui::SliderInt("Bounces", &maxBounces, 0, static_cast<int>(g_MaxBounces));
+		ImGui::Checkbox("Specialize bounces", &specializeBounces);
+		const char* shadingModels[] = { "Path", "Headlight" };
+		ImGui::Combo("Shading", &shadingModel, shadingModels, IM_ARRAYSIZE(shadingModels));
+		const char* debugViews[] = { "Off", "Normals", "Distance" };
+		ImGui::Combo("Debug view", &debugView, debugViews, IM_ARRAYSIZE(debugViews));
+		const char* traceBackends[] = { "Pipeline", "Wavefront", "Ray query" };
+		ImGui::Combo("Backend", &traceBackend, traceBackends, rayQueryEnabled ? 3 : 2);
+		if (traceBackend == g_TraceBackendRayQuery) {
+			std::vector<std::string> workgroupNames;
+			for (auto workgroup : rayQueryWorkgroups) {
+				workgroupNames.push_back(std::to_string(workgroup.width) + "x" + std::to_string(workgroup.height));
+			}
+			std::vector<const char*> workgroupItems;
+			for (const auto& name : workgroupNames) {
+				workgroupItems.push_back(name.c_str());
+			}
+			ImGui::Combo("Workgroup", &rayQueryWorkgroup, workgroupItems.data(), static_cast<int>(workgroupItems.size()));
+			if (!tuningWorkgroup && ImGui::Button("Tune workgroup")) {
+				startWorkgroupTuning();
+			}
+		}
+		if (timestampPool) {
+			ImGui::Text("Trace: %.2f ms, %.1f Mrays/s", traceMs, raysPerSecond * 1e-6f);
+		}
+		ImGui::Text("CPU frame: %.2f ms, %s validation", cpuFrameMs, validation::toString(validationConfig.mode));
+		if (adaptiveEnabled && traceBackend == g_TraceBackendPipeline && !adaptiveBenchmarkRunning) {
+			ImGui::Checkbox("Adaptive sampling", &adaptiveSampling);
+			if (adaptiveSampling) {
+				ImGui::SliderFloat("Error threshold", &adaptiveThreshold, 0.001f, 0.2f, "%.3f", ImGuiSliderFlags_Logarithmic);
+				float pixelCount = static_cast<float>(renderExtent.width * renderExtent.height);
+				ImGui::Text("Traced pixels: %.1f%%, converged: %.1f%%",
+					100.0f * listedPixels / pixelCount, 100.0f * convergedPixels / pixelCount);
+			}
+		}
+		if ((traceFlags & g_TraceFlagLights) && !lightBenchmarkRunning) {
+			ImGui::Checkbox("Uniform light sampling", &uniformLights);
+		}
+		if (traceFlags & g_TraceFlagAlphaTest) {
+			ImGui::Text("Alpha tests: %u, %.2f per ray", anyHitCount,
+				tracedRays > 0 ? static_cast<float>(anyHitCount) / tracedRays : 0.0f);
+		}
+		if (tessellatedParticleAccel.accel && !particleBenchmarkRunning) {
+			bool tessellated = particlesTessellated;
+			if (ImGui::Checkbox("Tessellated particles", &tessellated)) {
+				setParticlesTessellated(tessellated);
+			}
+		}
+		if (presplitCadAccel.accel && !presplitBenchmarkRunning) {
+			bool preprocessed = cadPreprocessed;
+			if (ImGui::Checkbox("Preprocessed CAD mesh", &preprocessed)) {
+				setCadPreprocessed(preprocessed);
+			}
+		}
+		if (!tuningBuilds && !options.particleBenchmark && !options.presplitBenchmark &&
+			ImGui::Button("Tune build flags")) {
+			startBuildTuning();
+		}
+		if (options.deformable) {
+			const deformable::RefitTracker& tracker = deformableMesh.getTracker();
+			if (timestampPool) {
+				ImGui::Text("Skinning: %.3f ms, BLAS %s: %.3f ms, TLAS refit: %.3f ms",
+					skinningMs, blasRebuilt ? "rebuild" : "refit", blasMs, tlasMs);
+			}
+			ImGui::Text("Refits since rebuild: %u/%u, cluster area: %.2fx (rebuild at %.2fx), rebuilds: %u",
+				tracker.getRefitCount(), tracker.getPolicy().maxRefits, tracker.getDegradation(),
+				tracker.getPolicy().maxDegradation, tracker.getRebuildCount());
+		}
 		ImGui::End();
 	}
 };
 
-int main() {
-	Application app;
+// Headless split-frame rendering of the test scene. Every device with ray
+// queries gets its own logical device and scene replica; CPU workers can
+// join or stand in for them. The result is checked against a CPU render.
+static int runSplitFrame(const AppOptions& options) {
+	const uint32_t width = 1280;
+	const uint32_t height = 720;
+	geometry::Mesh mesh = cputracer::makeTestScene();
+	cputracer::Scene scene(mesh);
+	std::cout << "Split-frame scene: " << scene.getTriangleCount() << " triangles, "
+		<< width << "x" << height << ", " << options.splitFrameTileSize << " px tiles\n";
+
+	camera::FlyCamera flyCamera;
+	cputracer::View view = cputracer::makeView(flyCamera.getView(),
+		flyCamera.getProjection(static_cast<float>(width) / height), flyCamera.position);
+	uint32_t tileCount = static_cast<uint32_t>(
+		splitframe::makeTiles(width, height, options.splitFrameTileSize).size());
+
+	// The instance outlives the workers that hold its devices
+	vk::UniqueInstance instance;
+	std::vector<std::unique_ptr<splitframe::Worker>> workers;
+	std::vector<vk::PhysicalDevice> physicalDevices;
+	try {
+		instance = vkutils::createInstance(VK_API_VERSION_1_2, {}, false);
+		physicalDevices = vkutils::pickPhysicalDevices(*instance, devicetracer::getDeviceExtensions());
+	}
+	catch (const vk::SystemError& error) {
+		std::cerr << "No Vulkan instance for split-frame rendering: " << error.what() << "\n";
+	}
+	for (auto physicalDevice : physicalDevices) {
+		for (uint32_t replica = 0; replica < options.splitFrameReplicas; replica++) {
+			workers.push_back(std::make_unique<devicetracer::DeviceWorker>(physicalDevice, mesh,
+				width, height, std::filesystem::current_path(), tileCount));
+		}
+	}
+	uint32_t cpuWorkers = options.cpuWorkers;
+	if (workers.empty() && cpuWorkers == 0) {
+		std::cout << "No ray query devices, using 2 CPU workers\n";
+		cpuWorkers = 2;
+	}
+	uint32_t threadsPerWorker = std::max(1u, std::thread::hardware_concurrency() / std::max(1u, cpuWorkers));
+	for (uint32_t i = 0; i < cpuWorkers; i++) {
+		workers.push_back(std::make_unique<splitframe::CpuWorker>(scene, threadsPerWorker,
+			"CPU " + std::to_string(i) + " (" + std::to_string(threadsPerWorker) + " threads)"));
+	}
+
+	splitframe::Renderer renderer(std::move(workers), width, height, options.splitFrameTileSize);
+	const auto& rendererWorkers = renderer.getWorkers();
+	double totalMs = 0.0;
+	for (uint32_t frame = 0; frame < options.splitFrameFrames; frame++) {
+		splitframe::FrameStats stats = renderer.renderFrame(view);
+		if (frame > 0) {
+			totalMs += stats.ms;
+		}
+		if (frame == 0 || frame + 1 == options.splitFrameFrames) {
+			std::cout << "Frame " << frame << ": " << stats.ms << " ms\n";
+			for (size_t w = 0; w < stats.workers.size(); w++) {
+				const auto& workerStats = stats.workers[w];
+				std::cout << "  " << rendererWorkers[w]->getName() << ": " << workerStats.tileCount << " tiles, "
+					<< 100.0 * workerStats.pixelCount / (static_cast<double>(width) * height) << "% of pixels, "
+					<< workerStats.ms << " ms (predicted " << workerStats.predictedMs << " ms)\n";
+			}
+		}
+	}
+	if (options.splitFrameFrames > 1) {
+		std::cout << "Average after the first frame: " << totalMs / (options.splitFrameFrames - 1) << " ms\n";
+	}
+
+	// Every device must produce the image of the CPU tracer
+	splitframe::Image reference(width, height);
+	splitframe::CpuWorker referenceWorker(scene, std::thread::hardware_concurrency(), "reference");
+	referenceWorker.render(view, splitframe::makeTiles(width, height, options.splitFrameTileSize), reference);
+	float maxError = 0.0f;
+	size_t mismatches = 0;
+	for (size_t pixel = 0; pixel * 4 < reference.pixels.size(); pixel++) {
+		float pixelError = 0.0f;
+		for (size_t c = 0; c < 4; c++) {
+			pixelError = std::max(pixelError,
+				std::abs(reference.pixels[pixel * 4 + c] - renderer.getImage().pixels[pixel * 4 + c]));
+		}
+		maxError = std::max(maxError, pixelError);
+		if (pixelError > g_SplitFrameTolerance) {
+			mismatches++;
+		}
+	}
+	double mismatchFraction = static_cast<double>(mismatches) / (static_cast<double>(width) * height);
+	bool match = mismatchFraction <= g_SplitFrameMismatchFraction;
+	std::cout << "Max difference to the CPU reference: " << maxError << ", "
+		<< mismatches << " pixels over " << g_SplitFrameTolerance
+		<< (match ? " (match)" : " (MISMATCH)") << "\n";
+
+	if (!options.splitFrameOutput.empty()) {
+		if (!renderer.getImage().writePPM(options.splitFrameOutput)) {
+			std::cerr << "Failed to write " << options.splitFrameOutput << "\n";
+			return 1;
+		}
+		std::cout << "Wrote " << options.splitFrameOutput << "\n";
+	}
+	return match ? 0 : 1;
+}
+
+#ifndef _WIN32
+// Camera of frame i of a render farm sequence, orbiting the test scene
+static cputracer::View getOrbitView(uint32_t frame, uint32_t width, uint32_t height) {
+	camera::FlyCamera flyCamera;
+	flyCamera.yaw = 0.1f * frame;
+	flyCamera.position = -flyCamera.getForward() * 5.0f;
+	return cputracer::makeView(flyCamera.getView(),
+		flyCamera.getProjection(static_cast<float>(width) / height), flyCamera.position);
+}
+
+static int runFarmWorker(const AppOptions& options) {
+	std::string name = options.farmName.empty() ? "worker-" + std::to_string(getpid()) : options.farmName;
+	uint32_t threadCount = options.farmThreads > 0 ? options.farmThreads : std::thread::hardware_concurrency();
+
+	// Backends hold on to these until the worker exits
+	vk::UniqueInstance instance;
+	vk::PhysicalDevice physicalDevice;
+	if (options.farmGpu) {
+		try {
+			instance = vkutils::createInstance(VK_API_VERSION_1_2, {}, false);
+			auto physicalDevices = vkutils::pickPhysicalDevices(*instance, devicetracer::getDeviceExtensions());
+			if (!physicalDevices.empty()) {
+				physicalDevice = physicalDevices.front();
+			}
+		}
+		catch (const vk::SystemError& error) {
+			std::cerr << "No Vulkan instance: " << error.what() << "\n";
+		}
+		if (!physicalDevice) {
+			std::cerr << "No ray query device, worker " << name << " traces on the CPU\n";
+		}
+	}
+	std::unique_ptr<cputracer::Scene> scene;
+	auto createBackend = [&](const geometry::Mesh& mesh, uint32_t width, uint32_t height)
+		-> std::unique_ptr<splitframe::Worker> {
+		if (physicalDevice) {
+			// One tile per job
+			return std::make_unique<devicetracer::DeviceWorker>(physicalDevice, mesh,
+				width, height, std::filesystem::current_path(), 1);
+		}
+		scene = std::make_unique<cputracer::Scene>(mesh);
+		return std::make_unique<splitframe::CpuWorker>(*scene, threadCount, name);
+	};
+	return renderfarm::runWorker(options.farmWorker, name, createBackend) ? 0 : 1;
+}
+
+// Renders the frame sequence once with the given worker count and returns
+// the milliseconds, or a negative value on failure
+static double renderFarmSequence(const AppOptions& options, const std::string& executable,
+	uint32_t workerCount, bool spawn, uint32_t workerThreads, renderfarm::FarmReport& report) {
+	renderfarm::FarmSettings settings{};
+	settings.tileSize = options.splitFrameTileSize;
+	settings.frameCount = options.farmFrames;
+	settings.workerCount = workerCount;
+	settings.outputPrefix = options.farmOutput;
+	uint32_t width = settings.width;
+	uint32_t height = settings.height;
+
+	geometry::Mesh mesh = cputracer::makeTestScene();
+	renderfarm::Coordinator coordinator(settings, mesh,
+		[=](uint32_t frame) { return getOrbitView(frame, width, height); });
+
+	std::vector<pid_t> pids;
+	if (spawn) {
+		std::vector<std::string> arguments = { "--farm-threads", std::to_string(workerThreads) };
+		if (options.farmGpu) {
+			arguments.push_back("--farm-gpu");
+		}
+		pids = renderfarm::spawnWorkers(executable, workerCount, options.farmPort, arguments);
+	}
+	bool rendered = coordinator.render(options.farmPort, report);
+	if (!rendered) {
+		for (pid_t pid : pids) {
+			kill(pid, SIGTERM);
+		}
+	}
+	renderfarm::waitForWorkers(pids);
+	return rendered ? report.ms : -1.0;
+}
+
+static int runRenderFarm(const AppOptions& options, const std::string& executable) {
+	if (!options.farmScaling) {
+		renderfarm::FarmReport report{};
+		if (renderFarmSequence(options, executable, options.farmWorkers, options.farmSpawn,
+			options.farmThreads, report) < 0.0) {
+			return 1;
+		}
+		renderfarm::printReport(report, options.farmFrames);
+		return 0;
+	}
+
+	// One thread per worker unless asked otherwise, so the workers and not
+	// the cores of one of them are what scales
+	uint32_t workerThreads = options.farmThreads > 0 ? options.farmThreads : 1;
+	std::vector<double> times;
+	for (uint32_t workerCount = 1; workerCount <= options.farmWorkers; workerCount++) {
+		renderfarm::FarmReport report{};
+		double ms = renderFarmSequence(options, executable, workerCount, true, workerThreads, report);
+		if (ms < 0.0) {
+			return 1;
+		}
+		renderfarm::printReport(report, options.farmFrames);
+		times.push_back(ms);
+	}
+	std::cout << "Workers  ms/frame  speedup  efficiency\n";
+	for (size_t i = 0; i < times.size(); i++) {
+		double speedup = times[0] / times[i];
+		std::cout << std::setw(7) << i + 1 << std::setw(10) << std::fixed << std::setprecision(2)
+			<< times[i] / options.farmFrames << std::setw(9) << speedup
+			<< std::setw(11) << 100.0 * speedup / (i + 1) << "%\n";
+	}
+	return 0;
+}
+#endif
+
+#ifndef _WIN32
+// Runs this executable once per validation mode with the same options and
+// compares the CPU frame times with release mode
+static int runValidationBenchmark(const AppOptions& options, const std::string& executable, int argc, char** argv) {
+	std::vector<std::string> forwarded;
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) != "--validation-benchmark") {
+			forwarded.push_back(argv[i]);
+		}
+	}
+	uint32_t frameCount = options.frameLimit > 0 ? options.frameLimit : g_ValidationBenchmarkFrames;
+
+	const validation::Mode modes[] = {
+		validation::Mode::eRelease, validation::Mode::ePerfWarnings, validation::Mode::eDebug };
+	std::array<double, validation::kModeCount> frameMs{};
+	std::array<bool, validation::kModeCount> measured{};
+	for (validation::Mode mode : modes) {
+		std::string output = (std::filesystem::temp_directory_path() /
+			("frame_time_" + std::to_string(getpid()) + "_" + validation::toString(mode) + ".txt")).string();
+		// Later options override the forwarded ones
+		std::vector<std::string> arguments = { executable };
+		arguments.insert(arguments.end(), forwarded.begin(), forwarded.end());
+		arguments.insert(arguments.end(), { "--validation", validation::toString(mode),
+			"--frame-limit", std::to_string(frameCount), "--frame-time-output", output });
+		std::vector<char*> childArgv;
+		for (auto& argument : arguments) {
+			childArgv.push_back(argument.data());
+		}
+		childArgv.push_back(nullptr);
+
+		std::cout << "Validation benchmark: " << validation::toString(mode) << ", " << frameCount << " frames\n";
+		pid_t pid = 0;
+		if (posix_spawn(&pid, executable.c_str(), nullptr, nullptr, childArgv.data(), environ) != 0) {
+			std::cerr << "Failed to start " << executable << "\n";
+			return 1;
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+
+		// A missing layer makes the run fall back to release, which does not count
+		std::ifstream file(output);
+		std::string ranMode;
+		double ms = 0.0;
+		uint32_t index = static_cast<uint32_t>(mode);
+		if (file >> ranMode >> ms && ranMode == validation::toString(mode)) {
+			frameMs[index] = ms;
+			measured[index] = true;
+		}
+		file.close();
+		std::filesystem::remove(output);
+	}
+
+	double releaseMs = frameMs[static_cast<uint32_t>(validation::Mode::eRelease)];
+	std::cout << "Mode           CPU frame ms  Overhead\n";
+	for (validation::Mode mode : modes) {
+		uint32_t index = static_cast<uint32_t>(mode);
+		std::cout << std::left << std::setw(15) << validation::toString(mode) << std::right;
+		if (!measured[index]) {
+			std::cout << "not available\n";
+			continue;
+		}
+		std::cout << std::setw(12) << frameMs[index];
+		if (mode != validation::Mode::eRelease && releaseMs > 0.0) {
+			std::cout << std::setw(9) << 100.0 * (frameMs[index] / releaseMs - 1.0) << "%";
+		}
+		std::cout << "\n";
+	}
+	return measured[static_cast<uint32_t>(validation::Mode::eRelease)] ? 0 : 1;
+}
+#endif
+
+int main(int argc, char** argv) {
+	AppOptions options = parseOptions(argc, argv);
+	if (!options.writeMeshPack.empty()) {
+		return meshpack::writeTestPack(options.writeMeshPack, options.meshPackGrid, options.lodLevels) ? 0 : 1;
+	}
+
+	if (options.splitFrame) {
+		return runSplitFrame(options);
+	}
+
+	if (options.renderFarm || !options.farmWorker.empty()) {
+#ifndef _WIN32
+		if (!options.farmWorker.empty()) {
+			return runFarmWorker(options);
+		}
+		// Spawned workers run this same executable
+		std::error_code error;
+		std::filesystem::path executable = std::filesystem::read_symlink("/proc/self/exe", error);
+		return runRenderFarm(options, error ? std::string(argv[0]) : executable.string());
+#else
+		std::cerr << "The render farm needs POSIX sockets\n";
+		return 1;
+#endif
+	}
+
+	if (options.validationBenchmark) {
+#ifndef _WIN32
+		std::error_code error;
+		std::filesystem::path executable = std::filesystem::read_symlink("/proc/self/exe", error);
+		return runValidationBenchmark(options, error ? std::string(argv[0]) : executable.string(), argc, argv);
+#else
+		std::cerr << "The validation benchmark needs POSIX processes\n";
+		return 1;
+#endif
+	}
+
+	if (options.denoiserBenchmark) {
+		std::cout << "Denoiser CPU reference: " << denoiser::benchmark(1920, 1080, 3)
+			<< " ms/frame at 1920x1080\n";
+	}
+
+	Application app(options);
 	app.run();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,305 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "geometry.hpp"
+#include "lod.hpp"
+
+// On-disk mesh pack:
+//   Header | MeshEntry[meshCount] | blobs
+// Every blob starts at a multiple of blobAlignment so it can be copied to a
+// staging buffer straight from the mapping. Every mesh has its vertices and
+// one index blob per LOD level, all levels index the same vertices.
+namespace meshpack {
+    constexpr uint32_t packMagic = 0x4B41504Du;  // "MPAK"
+    constexpr uint32_t packVersion = 2;
+    constexpr uint64_t blobAlignment = 256;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t meshCount;
+        uint32_t reserved;
+    };
+
+    struct MeshEntry {
+        float boundsMin[3];
+        float boundsMax[3];
+        uint32_t vertexCount;
+        uint32_t lodCount;
+        uint64_t vertexOffset;  // float xyz
+        uint32_t lodIndexCount[lod::kMaxLevels];
+        float lodError[lod::kMaxLevels];           // object space, see lod::Level
+        uint64_t lodIndexOffset[lod::kMaxLevels];  // uint32
+    };
+
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { close(); }
+
+        bool open(const std::string& path) {
+            close();
+#ifdef _WIN32
+            file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+            if (file == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            LARGE_INTEGER fileSize;
+            GetFileSizeEx(file, &fileSize);
+            mappedSize = static_cast<size_t>(fileSize.QuadPart);
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping) {
+                close();
+                return false;
+            }
+            mappedData = static_cast<const uint8_t*>(
+                MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat fileStat;
+            fstat(fd, &fileStat);
+            mappedSize = static_cast<size_t>(fileStat.st_size);
+            void* ptr = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close();
+                return false;
+            }
+            // Meshes are paged in on demand and in no particular order
+            madvise(ptr, mappedSize, MADV_RANDOM);
+            mappedData = static_cast<const uint8_t*>(ptr);
+#endif
+            return mappedData != nullptr;
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (mappedData) {
+                UnmapViewOfFile(mappedData);
+            }
+            if (mapping) {
+                CloseHandle(mapping);
+            }
+            if (file != INVALID_HANDLE_VALUE) {
+                CloseHandle(file);
+            }
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (mappedData) {
+                munmap(const_cast<uint8_t*>(mappedData), mappedSize);
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            fd = -1;
+#endif
+            mappedData = nullptr;
+            mappedSize = 0;
+        }
+
+        const uint8_t* data() const { return mappedData; }
+        size_t size() const { return mappedSize; }
+
+    private:
+        const uint8_t* mappedData = nullptr;
+        size_t mappedSize = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int fd = -1;
+#endif
+    };
+
+    class Pack {
+    public:
+        bool open(const std::string& path) {
+            if (!file.open(path) || file.size() < sizeof(Header)) {
+                std::cerr << "Failed to map mesh pack: " << path << "\n";
+                return false;
+            }
+            const Header* header = reinterpret_cast<const Header*>(file.data());
+            if (header->magic != packMagic || header->version != packVersion ||
+                sizeof(Header) + header->meshCount * sizeof(MeshEntry) > file.size()) {
+                std::cerr << "Invalid mesh pack: " << path << "\n";
+                file.close();
+                return false;
+            }
+            entries = { reinterpret_cast<const MeshEntry*>(file.data() + sizeof(Header)),
+                        header->meshCount };
+            // Every blob has to lie in the file, aligned for its elements.
+            // The indices are left on disk until a level is first built,
+            // see checkIndices.
+            for (uint32_t mesh = 0; mesh < meshCount(); mesh++) {
+                const MeshEntry& entry = entries[mesh];
+                bool valid = entry.lodCount > 0 && entry.lodCount <= lod::kMaxLevels &&
+                    entry.vertexOffset % sizeof(float) == 0 &&
+                    fits(entry.vertexOffset, static_cast<uint64_t>(entry.vertexCount) * 3 * sizeof(float));
+                for (uint32_t level = 0; valid && level < entry.lodCount; level++) {
+                    valid = entry.lodIndexCount[level] % 3 == 0 &&
+                        entry.lodIndexOffset[level] % sizeof(uint32_t) == 0 &&
+                        fits(entry.lodIndexOffset[level], static_cast<uint64_t>(entry.lodIndexCount[level]) * sizeof(uint32_t));
+                }
+                if (!valid) {
+                    std::cerr << "Invalid mesh pack: " << path << "\n";
+                    file.close();
+                    entries = {};
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        uint32_t meshCount() const { return static_cast<uint32_t>(entries.size()); }
+        const MeshEntry& entry(uint32_t mesh) const { return entries[mesh]; }
+
+        std::span<const float> positions(uint32_t mesh) const {
+            const MeshEntry& e = entries[mesh];
+            return { reinterpret_cast<const float*>(file.data() + e.vertexOffset),
+                     static_cast<size_t>(e.vertexCount) * 3 };
+        }
+
+        std::span<const uint32_t> indices(uint32_t mesh, uint32_t level = 0) const {
+            const MeshEntry& e = entries[mesh];
+            return { reinterpret_cast<const uint32_t*>(file.data() + e.lodIndexOffset[level]),
+                     e.lodIndexCount[level] };
+        }
+
+        std::span<const float> lodErrors(uint32_t mesh) const {
+            const MeshEntry& e = entries[mesh];
+            return { e.lodError, e.lodCount };
+        }
+
+        // Whether every index of the level refers to a vertex of its mesh.
+        // Reads the whole index blob, so it is left to the first use of a
+        // level rather than done for all of them in open.
+        bool checkIndices(uint32_t mesh, uint32_t level) const {
+            uint32_t vertexCount = entries[mesh].vertexCount;
+            for (uint32_t index : indices(mesh, level)) {
+                if (index >= vertexCount) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        MappedFile file;
+        std::span<const MeshEntry> entries;
+
+        bool fits(uint64_t offset, uint64_t size) const {
+            return offset <= file.size() && size <= file.size() - offset;
+        }
+    };
+
+    inline uint64_t alignBlob(uint64_t offset) {
+        return (offset + blobAlignment - 1) & ~(blobAlignment - 1);
+    }
+
+    // Simplifies every mesh into up to lodLevels levels, 1 keeps only the
+    // meshes themselves
+    inline bool writePack(const std::string& path, const std::vector<geometry::Mesh>& meshes, uint32_t lodLevels) {
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "Failed to create mesh pack: " << path << "\n";
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<lod::Level>> chains = lod::buildChains(meshes, lodLevels);
+        double simplifyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::array<uint64_t, lod::kMaxLevels> levelTriangles{};
+        for (const auto& chain : chains) {
+            for (size_t level = 0; level < chain.size(); level++) {
+                levelTriangles[level] += chain[level].triangleCount();
+            }
+        }
+        std::cout << "Simplified " << meshes.size() << " meshes in " << simplifyMs << " ms, triangles per level:";
+        for (uint64_t triangles : levelTriangles) {
+            std::cout << " " << triangles;
+        }
+        std::cout << "\n";
+
+        Header header{ packMagic, packVersion, static_cast<uint32_t>(meshes.size()), 0 };
+        std::vector<MeshEntry> entries(meshes.size());
+        uint64_t offset = alignBlob(sizeof(Header) + entries.size() * sizeof(MeshEntry));
+        for (size_t i = 0; i < meshes.size(); i++) {
+            std::array<float, 3> minBound;
+            std::array<float, 3> maxBound;
+            geometry::computeBounds(meshes[i].positions, minBound, maxBound);
+            std::memcpy(entries[i].boundsMin, minBound.data(), sizeof(entries[i].boundsMin));
+            std::memcpy(entries[i].boundsMax, maxBound.data(), sizeof(entries[i].boundsMax));
+            entries[i].vertexCount = meshes[i].vertexCount();
+            entries[i].lodCount = static_cast<uint32_t>(chains[i].size());
+            entries[i].vertexOffset = offset;
+            offset = alignBlob(offset + meshes[i].positions.size() * sizeof(float));
+            for (uint32_t level = 0; level < entries[i].lodCount; level++) {
+                entries[i].lodIndexCount[level] = static_cast<uint32_t>(chains[i][level].indices.size());
+                entries[i].lodError[level] = chains[i][level].error;
+                entries[i].lodIndexOffset[level] = offset;
+                offset = alignBlob(offset + chains[i][level].indices.size() * sizeof(uint32_t));
+            }
+        }
+
+        auto writeAt = [&](uint64_t position, const void* data, size_t size) {
+            out.seekp(static_cast<std::streamoff>(position));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(sizeof(Header), entries.data(), entries.size() * sizeof(MeshEntry));
+        for (size_t i = 0; i < meshes.size(); i++) {
+            writeAt(entries[i].vertexOffset, meshes[i].positions.data(),
+                meshes[i].positions.size() * sizeof(float));
+            for (uint32_t level = 0; level < entries[i].lodCount; level++) {
+                writeAt(entries[i].lodIndexOffset[level], chains[i][level].indices.data(),
+                    chains[i][level].indices.size() * sizeof(uint32_t));
+            }
+        }
+        return out.good();
+    }
+
+    // Grid of spheres laid out in front of the default camera
+    inline bool writeTestPack(const std::string& path, uint32_t gridSize, uint32_t lodLevels) {
+        std::vector<geometry::Mesh> meshes;
+        meshes.reserve(static_cast<size_t>(gridSize) * gridSize);
+        for (uint32_t z = 0; z < gridSize; z++) {
+            for (uint32_t x = 0; x < gridSize; x++) {
+                std::array<float, 3> center = {
+                    (static_cast<float>(x) - gridSize * 0.5f) * 3.0f,
+                    0.0f,
+                    -static_cast<float>(z) * 3.0f,
+                };
+                meshes.push_back(geometry::makeUvSphere(center, 1.0f, 64, 32));
+            }
+        }
+        std::cout << "Writing " << meshes.size() << " meshes to " << path << "\n";
+        return writePack(path, meshes, lodLevels);
+    }
+}  // namespace meshpack
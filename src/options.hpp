@@ -0,0 +1,394 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Highest bounce count of --bounces and the bounces slider
+constexpr uint32_t g_MaxBounces = 8;
+
+// Command line options
+struct AppOptions {
+	// Stream the scene from a mesh pack instead of the built-in triangle
+	std::string meshPack;
+	// Write a procedural test mesh pack and exit
+	std::string writeMeshPack;
+	uint32_t meshPackGrid = 16;
+	// LOD levels simplified per mesh when writing a mesh pack
+	uint32_t lodLevels = 4;
+	// Screen space error budget of the LOD selection in pixels
+	float lodPixelError = 1.0f;
+	// Cap on resident BLAS memory in MB, 0 leaves only the memory budget
+	uint32_t blasBudgetMB = 0;
+	// Binary scene cache, written on the first run and loaded afterwards
+	std::string sceneCache;
+	// Trace resolution relative to the window, the tonemap pass rescales
+	float renderScale = 1.0f;
+	// Time the CPU reference and the GPU denoiser at 1080p
+	bool denoiserBenchmark = false;
+	// Compare one GPU denoised frame against the CPU reference
+	bool validateDenoiser = false;
+	// Trace bounces as sorted per-bounce dispatches instead of one megakernel
+	bool wavefront = false;
+	// Clamped to g_MaxBounces
+	uint32_t bounces = 1;
+	// Trace with ray queries in a compute shader
+	bool rayQuery = false;
+	// Workgroup size of the ray query shader, e.g. "16x8", empty picks the default
+	std::string queryWorkgroup;
+	// Time every workgroup size of the ray query shader and keep the fastest
+	bool tuneWorkgroup = false;
+	// Recompile and rebuild pipelines when a shader source changes
+	bool hotReload = false;
+	// Shader sources watched by --hot-reload, empty uses the source tree
+	std::string shaderDir;
+	// Time monolithic RT pipeline compiles against linking pipeline libraries
+	bool pipelineLibraryBenchmark = false;
+	// Build the trace pipelines for the bounce count instead of reading it at runtime
+	bool specializeBounces = false;
+	// Headless split-frame rendering over all ray query capable devices
+	bool splitFrame = false;
+	// CPU workers standing in for devices, added to the devices found
+	uint32_t cpuWorkers = 0;
+	// Logical devices per physical device, one lavapipe can pose as several GPUs
+	uint32_t splitFrameReplicas = 1;
+	uint32_t splitFrameFrames = 16;
+	uint32_t splitFrameTileSize = 64;
+	// PPM file of the last composited frame
+	std::string splitFrameOutput;
+	// Coordinate a headless render of a frame sequence over worker processes
+	bool renderFarm = false;
+	// Run as a render farm worker of the coordinator at HOST:PORT
+	std::string farmWorker;
+	std::string farmName;
+	uint16_t farmPort = 7431;
+	// Workers the coordinator waits for, or starts with --farm-spawn
+	uint32_t farmWorkers = 1;
+	bool farmSpawn = false;
+	// Render with 1..--farm-workers local workers and report the scaling
+	bool farmScaling = false;
+	uint32_t farmFrames = 4;
+	// Tracing threads per worker, 0 uses all cores
+	uint32_t farmThreads = 0;
+	// Workers trace on the first ray query device instead of the CPU
+	bool farmGpu = false;
+	// Frames are written to PREFIX_0000.ppm and so on
+	std::string farmOutput;
+	// Use the device at this enumeration index instead of the best scored one
+	int deviceIndex = -1;
+	// Add a skinned character whose BLAS is refit every frame
+	bool deformable = false;
+	// Rebuild instead of refit after this many refits in a row
+	uint32_t refitMaxUpdates = 64;
+	// Rebuild once the refit BLAS is estimated this much worse than a fresh build
+	float refitThreshold = 1.5f;
+	// Skin on the CPU and estimate the refit quality every this many refits
+	uint32_t refitEstimateInterval = 8;
+	// Add a bush of alpha-tested leaf cards
+	bool foliage = false;
+	// Add this many sphere and capsule particles, traced as procedural AABBs
+	uint32_t particleCount = 0;
+	// Trace the particles as their tessellation instead
+	bool particlesTessellated = false;
+	// Compare BLAS memory and rays/s of procedural and tessellated particles
+	bool particleBenchmark = false;
+	// Add a CAD-style test mesh of about this many triangles
+	uint32_t cadTriangles = 0;
+	// Split oversized triangles and put the CAD mesh in Morton order before its BLAS build
+	bool presplit = false;
+	// At most this many added triangles per input triangle
+	float presplitBudget = 0.5f;
+	// Compare build time and rays/s of the raw and the preprocessed CAD mesh
+	bool presplitBenchmark = false;
+	// Accumulate paths while the view is still and trace only unconverged pixels
+	bool adaptiveSampling = false;
+	// Relative error of the mean at which a pixel counts as converged
+	float adaptiveThreshold = 0.02f;
+	// Time uniform and adaptive sampling until the image reaches the error target
+	bool adaptiveBenchmark = false;
+	// Light the scene with this many emissive triangles and a sky, sampled
+	// at every surface hit
+	bool lighting = false;
+	uint32_t lightCount = 0;
+	// Pick emitters uniformly instead of by the light BVH
+	bool uniformLights = false;
+	// Compare the error of uniform and light BVH sampling after equal GPU time
+	bool lightBenchmark = false;
+	// Bake this many cube map light probes at startup in one multiview
+	// dispatch per sample and compare it with one dispatch per face
+	uint32_t probeCount = 0;
+	uint32_t probeSize = 128;
+	uint32_t probeSamples = 16;
+	// Probes are written to PREFIX_0000.pfm and so on
+	std::string probeOutput = "probe";
+	// Time every build flag preset of the static, deformable and streamed
+	// BLASes and keep the best per class
+	bool tuneBuilds = false;
+	// Chosen presets per scene, read at startup and written after tuning
+	std::string buildProfile = "build_profile.txt";
+	// Validation of the instance: release (no layers), debug or
+	// perf-warnings (best practices only, rate limited)
+#ifdef NDEBUG
+	std::string validation = "release";
+#else
+	std::string validation = "debug";
+#endif
+	// Extra checks of debug mode
+	bool gpuAssistedValidation = false;
+	bool syncValidation = false;
+	// Run every validation mode for a fixed number of frames and compare
+	// their CPU frame times
+	bool validationBenchmark = false;
+	// Exit after this many frames, 0 runs until the window is closed
+	uint32_t frameLimit = 0;
+	// Mode and mean CPU frame time are written here on exit
+	std::string frameTimeOutput;
+};
+
+inline AppOptions parseOptions(int argc, char** argv) {
+	AppOptions options{};
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		auto value = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				std::cerr << "Missing value for " << arg << "\n";
+				std::exit(EXIT_FAILURE);
+			}
+			return argv[++i];
+		};
+
+		if (arg == "--mesh-pack") {
+			options.meshPack = value();
+		}
+		else if (arg == "--write-mesh-pack") {
+			options.writeMeshPack = value();
+		}
+		else if (arg == "--mesh-pack-grid") {
+			options.meshPackGrid = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--lod-levels") {
+			options.lodLevels = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--lod-pixel-error") {
+			options.lodPixelError = std::stof(value());
+			if (options.lodPixelError <= 0.0f) {
+				std::cerr << "LOD pixel error must be positive\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--blas-budget-mb") {
+			options.blasBudgetMB = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--scene-cache") {
+			options.sceneCache = value();
+		}
+		else if (arg == "--render-scale") {
+			options.renderScale = std::stof(value());
+			if (options.renderScale <= 0.0f) {
+				std::cerr << "Render scale must be positive\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--denoiser-benchmark") {
+			options.denoiserBenchmark = true;
+		}
+		else if (arg == "--validate-denoiser") {
+			options.validateDenoiser = true;
+		}
+		else if (arg == "--wavefront") {
+			options.wavefront = true;
+		}
+		else if (arg == "--bounces") {
+			options.bounces = std::min(g_MaxBounces, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--ray-query") {
+			options.rayQuery = true;
+		}
+		else if (arg == "--query-workgroup") {
+			options.queryWorkgroup = value();
+		}
+		else if (arg == "--tune-workgroup") {
+			options.tuneWorkgroup = true;
+		}
+		else if (arg == "--hot-reload") {
+			options.hotReload = true;
+		}
+		else if (arg == "--shader-dir") {
+			options.shaderDir = value();
+		}
+		else if (arg == "--pipeline-library-benchmark") {
+			options.pipelineLibraryBenchmark = true;
+		}
+		else if (arg == "--specialize-bounces") {
+			options.specializeBounces = true;
+		}
+		else if (arg == "--split-frame") {
+			options.splitFrame = true;
+		}
+		else if (arg == "--cpu-workers") {
+			options.cpuWorkers = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--split-frame-replicas") {
+			options.splitFrameReplicas = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--split-frame-frames") {
+			options.splitFrameFrames = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--tile-size") {
+			options.splitFrameTileSize = std::max(8u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--split-frame-output") {
+			options.splitFrameOutput = value();
+		}
+		else if (arg == "--render-farm") {
+			options.renderFarm = true;
+		}
+		else if (arg == "--farm-worker") {
+			options.farmWorker = value();
+		}
+		else if (arg == "--farm-name") {
+			options.farmName = value();
+		}
+		else if (arg == "--farm-port") {
+			options.farmPort = static_cast<uint16_t>(std::stoul(value()));
+		}
+		else if (arg == "--farm-workers") {
+			options.farmWorkers = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--farm-spawn") {
+			options.farmSpawn = true;
+		}
+		else if (arg == "--farm-scaling") {
+			options.farmScaling = true;
+		}
+		else if (arg == "--farm-frames") {
+			options.farmFrames = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--farm-threads") {
+			options.farmThreads = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--farm-gpu") {
+			options.farmGpu = true;
+		}
+		else if (arg == "--farm-output") {
+			options.farmOutput = value();
+		}
+		else if (arg == "--device") {
+			options.deviceIndex = std::stoi(value());
+		}
+		else if (arg == "--deformable") {
+			options.deformable = true;
+		}
+		else if (arg == "--refit-max-updates") {
+			options.refitMaxUpdates = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--refit-threshold") {
+			options.refitThreshold = std::stof(value());
+			if (options.refitThreshold < 1.0f) {
+				std::cerr << "Refit threshold must be at least 1\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--refit-estimate-interval") {
+			options.refitEstimateInterval = static_cast<uint32_t>(std::stoul(value()));
+			if (options.refitEstimateInterval < 1) {
+				std::cerr << "Refit estimate interval must be at least 1\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--foliage") {
+			options.foliage = true;
+		}
+		else if (arg == "--particles") {
+			options.particleCount = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--particles-tessellated") {
+			options.particlesTessellated = true;
+		}
+		else if (arg == "--particle-benchmark") {
+			options.particleBenchmark = true;
+		}
+		else if (arg == "--cad-mesh") {
+			options.cadTriangles = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--presplit") {
+			options.presplit = true;
+		}
+		else if (arg == "--presplit-budget") {
+			options.presplitBudget = std::max(0.0f, std::stof(value()));
+		}
+		else if (arg == "--presplit-benchmark") {
+			options.presplitBenchmark = true;
+		}
+		else if (arg == "--adaptive") {
+			options.adaptiveSampling = true;
+		}
+		else if (arg == "--adaptive-threshold") {
+			options.adaptiveThreshold = std::stof(value());
+			if (options.adaptiveThreshold <= 0.0f) {
+				std::cerr << "Adaptive threshold must be positive\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--adaptive-benchmark") {
+			options.adaptiveBenchmark = true;
+		}
+		else if (arg == "--lights") {
+			options.lighting = true;
+			options.lightCount = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--uniform-lights") {
+			options.uniformLights = true;
+		}
+		else if (arg == "--light-benchmark") {
+			options.lightBenchmark = true;
+		}
+		else if (arg == "--bake-probes") {
+			options.probeCount = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--probe-size") {
+			options.probeSize = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--probe-samples") {
+			options.probeSamples = std::max(1u, static_cast<uint32_t>(std::stoul(value())));
+		}
+		else if (arg == "--probe-output") {
+			options.probeOutput = value();
+		}
+		else if (arg == "--tune-builds") {
+			options.tuneBuilds = true;
+		}
+		else if (arg == "--build-profile") {
+			options.buildProfile = value();
+		}
+		else if (arg == "--validation") {
+			options.validation = value();
+			if (options.validation != "release" && options.validation != "debug" &&
+				options.validation != "perf-warnings") {
+				std::cerr << "Validation must be release, debug or perf-warnings\n";
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		else if (arg == "--gpu-assisted-validation") {
+			options.gpuAssistedValidation = true;
+		}
+		else if (arg == "--sync-validation") {
+			options.syncValidation = true;
+		}
+		else if (arg == "--validation-benchmark") {
+			options.validationBenchmark = true;
+		}
+		else if (arg == "--frame-limit") {
+			options.frameLimit = static_cast<uint32_t>(std::stoul(value()));
+		}
+		else if (arg == "--frame-time-output") {
+			options.frameTimeOutput = value();
+		}
+		else {
+			std::cerr << "Unknown option: " << arg << "\n";
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	return options;
+}
@@ -0,0 +1,548 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "geometry.hpp"
+#include "instances.hpp"
+
+// Geometry preprocessing before a BLAS build. Triangles whose bounds are
+// much larger than the surface they hold (long and diagonal, as CAD
+// exports are full of) are split at the midpoint of their longest edge,
+// which tightens the leaves of the BVH the driver builds. Triangles and
+// vertices are then put in Morton order of their centroids so neighbours
+// in space are neighbours in memory for the builder and the traversal.
+// The bounds, counting and reordering passes run on every core. Splitting
+// itself is serial: both triangles of an edge share its midpoint, and a
+// triangle next to a split edge is split there too, so the surface keeps
+// no T-junctions that rays could slip through.
+namespace presplit {
+    // Instance custom index of the CAD test mesh, faces the ray like other
+    // instances without bound normals
+    constexpr uint32_t kInstanceCustomIndex = instances::kCad;
+
+    using Vec3 = std::array<float, 3>;
+
+    struct Settings {
+        // Triangles start splitting at this many times the mean surface
+        // area of the triangle bounds
+        float splitFactor = 4.0f;
+        // At most this many added triangles per input triangle, the
+        // threshold doubles until the splits fit. Neighbours split to keep
+        // the edges closed are not counted.
+        float budget = 0.5f;
+        // Pieces per triangle are capped at 2^maxDepth
+        uint32_t maxDepth = 6;
+        bool split = true;
+        bool reorder = true;
+        // 0 uses all cores
+        uint32_t threadCount = 0;
+    };
+
+    struct Report {
+        uint32_t inputTriangles = 0;
+        uint32_t outputTriangles = 0;
+        uint32_t inputVertices = 0;
+        uint32_t outputVertices = 0;
+        float threshold = 0.0f;
+        // Sum of the surface areas of all triangle bounds, the leaf part
+        // of the SAH cost of a BVH over the mesh
+        double inputBoundsArea = 0.0;
+        double outputBoundsArea = 0.0;
+        double splitMs = 0.0;
+        double reorderMs = 0.0;
+
+        void print(std::ostream& out) const {
+            out << "Preprocess: " << inputTriangles << " -> " << outputTriangles << " triangles, "
+                << inputVertices << " -> " << outputVertices << " vertices, bounds area "
+                << (inputBoundsArea > 0.0 ? outputBoundsArea / inputBoundsArea : 1.0) << "x, split "
+                << splitMs << " ms, reorder " << reorderMs << " ms\n";
+        }
+    };
+
+    namespace detail {
+        inline uint32_t getThreadCount(uint32_t threadCount) {
+            return threadCount != 0 ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // Calls work(begin, end, chunk) for contiguous ranges on up to
+        // threadCount threads and returns the number of chunks
+        template <typename Work>
+        uint32_t forEachChunk(size_t count, uint32_t threadCount, Work work) {
+            size_t chunk = std::max<size_t>((count + threadCount - 1) / threadCount, 1);
+            uint32_t chunkCount = static_cast<uint32_t>((count + chunk - 1) / chunk);
+            std::vector<std::thread> threads;
+            for (uint32_t c = 1; c < chunkCount; c++) {
+                threads.emplace_back(work, c * chunk, std::min(count, (c + 1) * chunk), c);
+            }
+            if (chunkCount > 0) {
+                work(size_t{ 0 }, std::min(count, chunk), 0u);
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            return chunkCount;
+        }
+
+        inline Vec3 getVertex(const std::vector<float>& positions, uint32_t index) {
+            return { positions[index * 3], positions[index * 3 + 1], positions[index * 3 + 2] };
+        }
+
+        inline float getBoundsArea(const Vec3& a, const Vec3& b, const Vec3& c) {
+            float dx = std::max({ a[0], b[0], c[0] }) - std::min({ a[0], b[0], c[0] });
+            float dy = std::max({ a[1], b[1], c[1] }) - std::min({ a[1], b[1], c[1] });
+            float dz = std::max({ a[2], b[2], c[2] }) - std::min({ a[2], b[2], c[2] });
+            return 2.0f * (dx * dy + dy * dz + dz * dx);
+        }
+
+        inline float getSquaredLength(const Vec3& a, const Vec3& b) {
+            float dx = b[0] - a[0], dy = b[1] - a[1], dz = b[2] - a[2];
+            return dx * dx + dy * dy + dz * dz;
+        }
+
+        // Bounds area of every triangle, gathered into one array
+        inline std::vector<float> getBoundsAreas(const geometry::Mesh& mesh, uint32_t threadCount) {
+            std::vector<float> areas(mesh.triangleCount());
+            forEachChunk(areas.size(), threadCount, [&](size_t begin, size_t end, uint32_t) {
+                for (size_t t = begin; t < end; t++) {
+                    const uint32_t* triangle = mesh.indices.data() + t * 3;
+                    areas[t] = getBoundsArea(getVertex(mesh.positions, triangle[0]),
+                        getVertex(mesh.positions, triangle[1]), getVertex(mesh.positions, triangle[2]));
+                }
+            });
+            return areas;
+        }
+
+        // Pieces a triangle splits into at the threshold. Must make the same
+        // decisions as splitTriangle.
+        inline uint32_t countPieces(const Vec3& a, const Vec3& b, const Vec3& c, float threshold, uint32_t depth) {
+            if (depth == 0 || getBoundsArea(a, b, c) <= threshold) {
+                return 1;
+            }
+            float ab = getSquaredLength(a, b), bc = getSquaredLength(b, c), ca = getSquaredLength(c, a);
+            auto midpoint = [](const Vec3& p, const Vec3& q) {
+                return Vec3{ 0.5f * (p[0] + q[0]), 0.5f * (p[1] + q[1]), 0.5f * (p[2] + q[2]) };
+            };
+            if (ab >= bc && ab >= ca) {
+                Vec3 m = midpoint(a, b);
+                return countPieces(a, m, c, threshold, depth - 1) + countPieces(m, b, c, threshold, depth - 1);
+            }
+            if (bc >= ca) {
+                Vec3 m = midpoint(b, c);
+                return countPieces(a, b, m, threshold, depth - 1) + countPieces(a, m, c, threshold, depth - 1);
+            }
+            Vec3 m = midpoint(c, a);
+            return countPieces(a, b, m, threshold, depth - 1) + countPieces(m, b, c, threshold, depth - 1);
+        }
+
+        // Midpoint vertices of split edges, appended to positions once and
+        // shared by every triangle on the edge
+        class EdgeMidpoints {
+        public:
+            explicit EdgeMidpoints(std::vector<float>& positions) : positions(positions) {}
+
+            uint32_t get(uint32_t a, uint32_t b) {
+                auto [it, added] = midpoints.try_emplace(getKey(a, b), static_cast<uint32_t>(positions.size() / 3));
+                if (added) {
+                    // Same rounding whichever way round the edge is visited
+                    for (uint32_t c = 0; c < 3; c++) {
+                        positions.push_back(0.5f * (positions[a * 3 + c] + positions[b * 3 + c]));
+                    }
+                }
+                return it->second;
+            }
+
+            bool find(uint32_t a, uint32_t b, uint32_t& midpoint) const {
+                auto it = midpoints.find(getKey(a, b));
+                if (it == midpoints.end()) {
+                    return false;
+                }
+                midpoint = it->second;
+                return true;
+            }
+
+        private:
+            std::vector<float>& positions;
+            std::unordered_map<uint64_t, uint32_t> midpoints;
+
+            static uint64_t getKey(uint32_t a, uint32_t b) {
+                return static_cast<uint64_t>(std::min(a, b)) << 32 | std::max(a, b);
+            }
+        };
+
+        // Splits the triangle of vertices a, b, c at the midpoint of its
+        // longest edge until its bounds are under the threshold. The winding
+        // is kept.
+        inline void splitTriangle(uint32_t a, uint32_t b, uint32_t c, float threshold, uint32_t depth,
+            const std::vector<float>& positions, EdgeMidpoints& midpoints, std::vector<uint32_t>& indices) {
+            Vec3 pa = getVertex(positions, a), pb = getVertex(positions, b), pc = getVertex(positions, c);
+            if (depth == 0 || getBoundsArea(pa, pb, pc) <= threshold) {
+                indices.insert(indices.end(), { a, b, c });
+                return;
+            }
+            float ab = getSquaredLength(pa, pb), bc = getSquaredLength(pb, pc), ca = getSquaredLength(pc, pa);
+            if (ab >= bc && ab >= ca) {
+                uint32_t m = midpoints.get(a, b);
+                splitTriangle(a, m, c, threshold, depth - 1, positions, midpoints, indices);
+                splitTriangle(m, b, c, threshold, depth - 1, positions, midpoints, indices);
+            }
+            else if (bc >= ca) {
+                uint32_t m = midpoints.get(b, c);
+                splitTriangle(a, b, m, threshold, depth - 1, positions, midpoints, indices);
+                splitTriangle(a, m, c, threshold, depth - 1, positions, midpoints, indices);
+            }
+            else {
+                uint32_t m = midpoints.get(c, a);
+                splitTriangle(a, b, m, threshold, depth - 1, positions, midpoints, indices);
+                splitTriangle(m, b, c, threshold, depth - 1, positions, midpoints, indices);
+            }
+        }
+
+        // Splits every triangle with a midpoint on one of its edges at that
+        // midpoint, the longest such edge first, until no edge has one.
+        // Only existing midpoints are used, so this ends.
+        inline std::vector<uint32_t> closeSplitEdges(const std::vector<uint32_t>& input,
+            const std::vector<float>& positions, const EdgeMidpoints& midpoints) {
+            std::vector<uint32_t> indices;
+            indices.reserve(input.size());
+            std::vector<std::array<uint32_t, 3>> stack;
+            for (size_t t = 0; t < input.size(); t += 3) {
+                stack.push_back({ input[t], input[t + 1], input[t + 2] });
+                while (!stack.empty()) {
+                    auto [a, b, c] = stack.back();
+                    stack.pop_back();
+                    const std::array<uint32_t, 3> triangle = { a, b, c };
+                    uint32_t edge = 3;
+                    uint32_t midpoint = 0;
+                    float longest = -1.0f;
+                    for (uint32_t k = 0; k < 3; k++) {
+                        uint32_t p = triangle[k], q = triangle[(k + 1) % 3];
+                        uint32_t m;
+                        float length = getSquaredLength(getVertex(positions, p), getVertex(positions, q));
+                        if (length > longest && midpoints.find(p, q, m)) {
+                            edge = k;
+                            midpoint = m;
+                            longest = length;
+                        }
+                    }
+                    if (edge == 0) {
+                        stack.push_back({ a, midpoint, c });
+                        stack.push_back({ midpoint, b, c });
+                    }
+                    else if (edge == 1) {
+                        stack.push_back({ a, b, midpoint });
+                        stack.push_back({ a, midpoint, c });
+                    }
+                    else if (edge == 2) {
+                        stack.push_back({ a, b, midpoint });
+                        stack.push_back({ midpoint, b, c });
+                    }
+                    else {
+                        indices.insert(indices.end(), { a, b, c });
+                    }
+                }
+            }
+            return indices;
+        }
+
+        // Spreads the low 10 bits so two zeros follow each bit
+        inline uint32_t expandBits(uint32_t v) {
+            v &= 0x3FFu;
+            v = (v * 0x00010001u) & 0xFF0000FFu;
+            v = (v * 0x00000101u) & 0x0F00F00Fu;
+            v = (v * 0x00000011u) & 0xC30C30C3u;
+            v = (v * 0x00000005u) & 0x49249249u;
+            return v;
+        }
+
+        // Sorts the chunks in parallel, then merges neighbours in rounds
+        inline void parallelSort(std::vector<uint64_t>& keys, uint32_t threadCount) {
+            std::vector<size_t> bounds;
+            uint32_t chunkCount = forEachChunk(keys.size(), threadCount, [&](size_t begin, size_t end, uint32_t) {
+                std::sort(keys.begin() + begin, keys.begin() + end);
+            });
+            size_t chunk = std::max<size_t>((keys.size() + threadCount - 1) / threadCount, 1);
+            for (uint32_t c = 0; c <= chunkCount; c++) {
+                bounds.push_back(std::min(keys.size(), c * chunk));
+            }
+            while (bounds.size() > 2) {
+                std::vector<size_t> merged;
+                std::vector<std::thread> threads;
+                for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+                    merged.push_back(bounds[i]);
+                    threads.emplace_back([&keys, first = bounds[i], middle = bounds[i + 1], last = bounds[i + 2]]() {
+                        std::inplace_merge(keys.begin() + first, keys.begin() + middle, keys.begin() + last);
+                    });
+                }
+                if (bounds.size() % 2 == 0) {
+                    // An odd chunk count leaves the last chunk for the next round
+                    merged.push_back(bounds[bounds.size() - 2]);
+                }
+                merged.push_back(bounds.back());
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+                bounds = std::move(merged);
+            }
+        }
+    }  // namespace detail
+
+    inline double getBoundsAreaSum(const geometry::Mesh& mesh, uint32_t threadCount = 0) {
+        std::vector<float> areas = detail::getBoundsAreas(mesh, detail::getThreadCount(threadCount));
+        double sum = 0.0;
+        for (float area : areas) {
+            sum += area;
+        }
+        return sum;
+    }
+
+    // Splits oversized triangles, see Settings. Returns the threshold used,
+    // 0 when nothing was split.
+    inline float splitTriangles(geometry::Mesh& mesh, const Settings& settings) {
+        uint32_t threadCount = detail::getThreadCount(settings.threadCount);
+        uint32_t triangleCount = mesh.triangleCount();
+        if (triangleCount == 0) {
+            return 0.0f;
+        }
+        std::vector<float> areas = detail::getBoundsAreas(mesh, threadCount);
+        double mean = 0.0;
+        for (float area : areas) {
+            mean += area;
+        }
+        mean /= triangleCount;
+
+        // Pieces per triangle at the threshold, with the total extra count
+        std::vector<uint32_t> pieces(triangleCount, 1);
+        auto countPieces = [&](float threshold) {
+            std::vector<uint64_t> chunkExtra(threadCount, 0);
+            detail::forEachChunk(triangleCount, threadCount, [&](size_t begin, size_t end, uint32_t chunk) {
+                uint64_t extra = 0;
+                for (size_t t = begin; t < end; t++) {
+                    pieces[t] = 1;
+                    if (areas[t] > threshold) {
+                        const uint32_t* triangle = mesh.indices.data() + t * 3;
+                        pieces[t] = detail::countPieces(detail::getVertex(mesh.positions, triangle[0]),
+                            detail::getVertex(mesh.positions, triangle[1]),
+                            detail::getVertex(mesh.positions, triangle[2]), threshold, settings.maxDepth);
+                    }
+                    extra += pieces[t] - 1;
+                }
+                chunkExtra[chunk] = extra;
+            });
+            uint64_t extra = 0;
+            for (uint64_t count : chunkExtra) {
+                extra += count;
+            }
+            return extra;
+        };
+        float threshold = static_cast<float>(settings.splitFactor * mean);
+        uint64_t budget = static_cast<uint64_t>(settings.budget * triangleCount);
+        uint64_t extra = countPieces(threshold);
+        for (uint32_t i = 0; i < 32 && extra > budget; i++) {
+            threshold *= 2.0f;
+            extra = countPieces(threshold);
+        }
+        if (extra == 0) {
+            return 0.0f;
+        }
+
+        // The budget covers the oversized triangles, their neighbours split
+        // to close the edges come on top
+        std::vector<float> positions(mesh.positions);
+        positions.reserve(static_cast<size_t>(mesh.vertexCount() + extra) * 3);
+        detail::EdgeMidpoints midpoints(positions);
+        std::vector<uint32_t> indices;
+        indices.reserve(static_cast<size_t>(triangleCount + extra) * 3);
+        for (uint32_t t = 0; t < triangleCount; t++) {
+            const uint32_t* triangle = mesh.indices.data() + t * 3;
+            if (pieces[t] == 1) {
+                indices.insert(indices.end(), triangle, triangle + 3);
+                continue;
+            }
+            detail::splitTriangle(triangle[0], triangle[1], triangle[2], threshold, settings.maxDepth,
+                positions, midpoints, indices);
+        }
+        mesh.indices = detail::closeSplitEdges(indices, positions, midpoints);
+        mesh.positions = std::move(positions);
+        return threshold;
+    }
+
+    // Sorts the triangles by the Morton code of their centroids in the mesh
+    // bounds, then numbers the vertices in order of first use
+    inline void reorderMorton(geometry::Mesh& mesh, uint32_t threadCount = 0) {
+        threadCount = detail::getThreadCount(threadCount);
+        uint32_t triangleCount = mesh.triangleCount();
+        if (triangleCount == 0) {
+            return;
+        }
+        Vec3 minBound, maxBound;
+        geometry::computeBounds(mesh.positions, minBound, maxBound);
+        Vec3 scale;
+        for (int c = 0; c < 3; c++) {
+            float size = maxBound[c] - minBound[c];
+            // Centroids are the sum of three corners, hence the 1/3
+            scale[c] = size > 0.0f ? 1023.0f / (3.0f * size) : 0.0f;
+        }
+
+        // Code in the high half, the triangle in the low half keeps the
+        // order of ties stable
+        std::vector<uint64_t> keys(triangleCount);
+        detail::forEachChunk(triangleCount, threadCount, [&](size_t begin, size_t end, uint32_t) {
+            for (size_t t = begin; t < end; t++) {
+                const uint32_t* triangle = mesh.indices.data() + t * 3;
+                uint32_t code = 0;
+                for (int c = 0; c < 3; c++) {
+                    float sum = mesh.positions[triangle[0] * 3 + c] + mesh.positions[triangle[1] * 3 + c] +
+                        mesh.positions[triangle[2] * 3 + c];
+                    float cell = std::clamp((sum - 3.0f * minBound[c]) * scale[c], 0.0f, 1023.0f);
+                    code |= detail::expandBits(static_cast<uint32_t>(cell)) << (2 - c);
+                }
+                keys[t] = static_cast<uint64_t>(code) << 32 | t;
+            }
+        });
+        detail::parallelSort(keys, threadCount);
+
+        std::vector<uint32_t> indices(mesh.indices.size());
+        detail::forEachChunk(triangleCount, threadCount, [&](size_t begin, size_t end, uint32_t) {
+            for (size_t t = begin; t < end; t++) {
+                const uint32_t* triangle = mesh.indices.data() + (keys[t] & 0xFFFFFFFFu) * 3;
+                std::copy(triangle, triangle + 3, indices.data() + t * 3);
+            }
+        });
+
+        constexpr uint32_t kUnused = 0xFFFFFFFFu;
+        std::vector<uint32_t> remap(mesh.vertexCount(), kUnused);
+        std::vector<float> positions;
+        positions.reserve(mesh.positions.size());
+        for (uint32_t& index : indices) {
+            if (remap[index] == kUnused) {
+                remap[index] = static_cast<uint32_t>(positions.size() / 3);
+                positions.insert(positions.end(), mesh.positions.begin() + index * 3,
+                    mesh.positions.begin() + index * 3 + 3);
+            }
+            index = remap[index];
+        }
+        mesh.positions = std::move(positions);
+        mesh.indices = std::move(indices);
+    }
+
+    inline geometry::Mesh preprocess(const geometry::Mesh& input, const Settings& settings, Report& report) {
+        using clock = std::chrono::steady_clock;
+        auto elapsedMs = [](clock::time_point start) {
+            return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        };
+        geometry::Mesh mesh = input;
+        report.inputTriangles = input.triangleCount();
+        report.inputVertices = input.vertexCount();
+        report.inputBoundsArea = getBoundsAreaSum(input, settings.threadCount);
+
+        auto start = clock::now();
+        if (settings.split) {
+            report.threshold = splitTriangles(mesh, settings);
+        }
+        report.splitMs = elapsedMs(start);
+        start = clock::now();
+        if (settings.reorder) {
+            reorderMorton(mesh, settings.threadCount);
+        }
+        report.reorderMs = elapsedMs(start);
+
+        report.outputTriangles = mesh.triangleCount();
+        report.outputVertices = mesh.vertexCount();
+        report.outputBoundsArea = getBoundsAreaSum(mesh, settings.threadCount);
+        return mesh;
+    }
+
+    // A CAD-style assembly of about triangleCount triangles in a cube of
+    // half size extent: long thin beams of 12 triangles and polygonal
+    // plates whose caps are fans from one corner, all randomly oriented.
+    // The triangles are shuffled the way exporters tend to leave them.
+    inline geometry::Mesh makeCadMesh(uint32_t triangleCount, float extent = 1.0f) {
+        auto random = [state = 0x9E3779B9u]() mutable {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state & 0xFFFFFF) / static_cast<float>(0x1000000);
+        };
+        auto normalize = [](Vec3 v) {
+            float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+            return Vec3{ v[0] / length, v[1] / length, v[2] / length };
+        };
+        auto cross = [](const Vec3& a, const Vec3& b) {
+            return Vec3{ a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+        };
+
+        // About 100 triangles per part on average
+        float partCount = std::max(1.0f, triangleCount / 100.0f);
+        float partSize = 2.0f * extent / std::cbrt(partCount);
+        geometry::Mesh mesh;
+        while (mesh.triangleCount() < triangleCount) {
+            Vec3 center;
+            for (float& c : center) {
+                c = (random() * 2.0f - 1.0f) * extent;
+            }
+            // Random frame, w is the long axis of beams and the normal of plates
+            Vec3 w = normalize({ random() * 2.0f - 1.0f, random() * 2.0f - 1.0f, random() * 2.0f - 1.0f + 1e-3f });
+            Vec3 helper = std::abs(w[0]) < 0.9f ? Vec3{ 1.0f, 0.0f, 0.0f } : Vec3{ 0.0f, 1.0f, 0.0f };
+            Vec3 u = normalize(cross(helper, w));
+            Vec3 v = cross(w, u);
+            uint32_t first = mesh.vertexCount();
+            auto addVertex = [&](float x, float y, float z) {
+                for (int c = 0; c < 3; c++) {
+                    mesh.positions.push_back(center[c] + x * u[c] + y * v[c] + z * w[c]);
+                }
+            };
+
+            if (random() < 0.5f) {
+                // Beam: a box of square section, 20 to 80 times as long as wide
+                float width = partSize * (0.02f + 0.03f * random());
+                float length = width * (20.0f + 60.0f * random());
+                for (uint32_t corner = 0; corner < 8; corner++) {
+                    addVertex((corner & 1 ? 0.5f : -0.5f) * width, (corner & 2 ? 0.5f : -0.5f) * width,
+                        (corner & 4 ? 0.5f : -0.5f) * length);
+                }
+                const uint32_t faces[6][4] = {
+                    { 0, 2, 6, 4 }, { 1, 5, 7, 3 }, { 0, 4, 5, 1 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 6, 7, 5 },
+                };
+                for (const auto& face : faces) {
+                    mesh.indices.insert(mesh.indices.end(), { first + face[0], first + face[1], first + face[2],
+                        first + face[0], first + face[2], first + face[3] });
+                }
+                continue;
+            }
+
+            // Plate: an extruded n-gon, 4n - 4 triangles
+            uint32_t sides = 16 + static_cast<uint32_t>(random() * 48.0f);
+            float radius = partSize * (0.2f + 0.3f * random());
+            float thickness = radius * 0.05f;
+            for (uint32_t s = 0; s < sides; s++) {
+                float angle = 6.2831853f * s / sides;
+                addVertex(radius * std::cos(angle), radius * std::sin(angle), -0.5f * thickness);
+                addVertex(radius * std::cos(angle), radius * std::sin(angle), 0.5f * thickness);
+            }
+            for (uint32_t s = 0; s < sides; s++) {
+                uint32_t a = first + 2 * s;
+                uint32_t b = first + 2 * ((s + 1) % sides);
+                mesh.indices.insert(mesh.indices.end(), { a, b, b + 1, a, b + 1, a + 1 });
+                if (s >= 1 && s + 1 < sides) {
+                    mesh.indices.insert(mesh.indices.end(), { first, b, a, first + 1, a + 1, b + 1 });
+                }
+            }
+        }
+
+        uint32_t count = mesh.triangleCount();
+        for (uint32_t t = count; t-- > 1;) {
+            uint32_t other = std::min(static_cast<uint32_t>(random() * (t + 1)), t);
+            std::swap_ranges(mesh.indices.begin() + t * 3, mesh.indices.begin() + t * 3 + 3,
+                mesh.indices.begin() + other * 3);
+        }
+        return mesh;
+    }
+}  // namespace presplit
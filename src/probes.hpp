@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// Light probes baked as cube maps. Every face is a view of its own, so a
+// grid of probes renders in one multiview dispatch with six layers per
+// probe, see multiview.rgen.
+namespace probes {
+    constexpr uint32_t kFaceCount = 6;
+
+    // Mirrors ViewData of multiview.rgen
+    struct View {
+        glm::mat4 viewInverse;
+        glm::mat4 projectionInverse;
+        glm::vec4 position;
+    };
+    static_assert(sizeof(View) == 144);
+
+    // The faces of a probe in cube map layer order +X, -X, +Y, -Y, +Z, -Z,
+    // with the up vectors of the cube map convention. The tracer writes row 0
+    // at NDC y = +1 while cube maps put t = 0 in row 0 on the -up side, so
+    // the projection is flipped vertically; then the layers can be uploaded
+    // as a cube map as they are.
+    inline std::array<View, kFaceCount> getCubeViews(const glm::vec3& position) {
+        const std::array<glm::vec3, kFaceCount> forward = { {
+            { 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f },
+            { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f },
+        } };
+        const std::array<glm::vec3, kFaceCount> up = { {
+            { 0.0f, -1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f },
+            { 0.0f, 0.0f, -1.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f },
+        } };
+        // 90 degrees and square, the faces meet without overlap
+        glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, 0.01f, 10000.0f);
+        projection[1][1] = -projection[1][1];
+        glm::mat4 projectionInverse = glm::inverse(projection);
+        std::array<View, kFaceCount> views{};
+        for (uint32_t face = 0; face < kFaceCount; face++) {
+            views[face].viewInverse = glm::inverse(glm::lookAt(position, position + forward[face], up[face]));
+            views[face].projectionInverse = projectionInverse;
+            views[face].position = glm::vec4(position, 1.0f);
+        }
+        return views;
+    }
+
+    // count probes on the smallest cubic grid that holds them, filled in
+    // x, y, z order and spanning a cube of half size extent
+    inline std::vector<glm::vec3> makeGrid(uint32_t count, float extent = 2.0f) {
+        uint32_t side = 1;
+        while (side * side * side < count) {
+            side++;
+        }
+        float spacing = side > 1 ? 2.0f * extent / (side - 1) : 0.0f;
+        float start = side > 1 ? -extent : 0.0f;
+        std::vector<glm::vec3> positions;
+        for (uint32_t i = 0; i < count; i++) {
+            positions.emplace_back(start + spacing * (i % side), start + spacing * (i / side % side),
+                start + spacing * (i / (side * side)));
+        }
+        return positions;
+    }
+
+    // Linear radiance as a little-endian PFM, rows are stored bottom to top.
+    // rgba holds width * height pixels of four floats, top row first.
+    inline bool writePFM(const std::string& path, uint32_t width, uint32_t height, const float* rgba) {
+        std::ofstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        file << "PF\n" << width << " " << height << "\n-1.0\n";
+        std::vector<float> row(static_cast<size_t>(width) * 3);
+        for (uint32_t y = height; y-- > 0;) {
+            for (uint32_t x = 0; x < width; x++) {
+                const float* pixel = rgba + (static_cast<size_t>(y) * width + x) * 4;
+                std::copy(pixel, pixel + 3, row.begin() + static_cast<size_t>(x) * 3);
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+        }
+        return static_cast<bool>(file);
+    }
+
+    // The six faces of a probe side by side in layer order. faces holds the
+    // layers back to back, size * size pixels of four floats each.
+    inline bool writeProbe(const std::string& path, uint32_t size, const float* faces) {
+        uint32_t width = size * kFaceCount;
+        std::vector<float> strip(static_cast<size_t>(width) * size * 4);
+        for (uint32_t face = 0; face < kFaceCount; face++) {
+            for (uint32_t y = 0; y < size; y++) {
+                const float* src = faces + ((static_cast<size_t>(face) * size + y) * size) * 4;
+                float* dst = strip.data() + (static_cast<size_t>(y) * width + face * size) * 4;
+                std::copy(src, src + static_cast<size_t>(size) * 4, dst);
+            }
+        }
+        return writePFM(path, width, size, strip.data());
+    }
+}  // namespace probes
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "instances.hpp"
+
+// Particles and point clouds traced as analytic spheres and capsules. The
+// BLAS holds one AABB per primitive and procedural.rint intersects the
+// shape, so a primitive costs 32 bytes of shape data and 24 bytes of AABB
+// instead of the hundreds of bytes of its tessellation.
+namespace procedural {
+    // Instance custom index of the particles, see hit_common.glsl
+    constexpr uint32_t kInstanceCustomIndex = instances::kProcedural;
+
+    // A capsule swept between a and b, a sphere when a == b. Mirrors the
+    // two vec4 per primitive of procedural_common.glsl.
+    struct Primitive {
+        std::array<float, 3> a;
+        float radius;
+        std::array<float, 3> b;
+        float padding = 0.0f;
+
+        bool isSphere() const { return a == b; }
+    };
+    static_assert(sizeof(Primitive) == 32);
+
+    // Layout of VkAabbPositionsKHR
+    struct Aabb {
+        float minX, minY, minZ;
+        float maxX, maxY, maxZ;
+    };
+
+    inline Aabb getAabb(const Primitive& primitive) {
+        float r = primitive.radius;
+        return {
+            std::min(primitive.a[0], primitive.b[0]) - r,
+            std::min(primitive.a[1], primitive.b[1]) - r,
+            std::min(primitive.a[2], primitive.b[2]) - r,
+            std::max(primitive.a[0], primitive.b[0]) + r,
+            std::max(primitive.a[1], primitive.b[1]) + r,
+            std::max(primitive.a[2], primitive.b[2]) + r,
+        };
+    }
+
+    // One AABB per primitive. The point data is cut into one contiguous
+    // range per thread, 0 threads uses all cores.
+    inline std::vector<Aabb> computeAabbs(const std::vector<Primitive>& primitives, uint32_t threadCount = 0) {
+        std::vector<Aabb> aabbs(primitives.size());
+        if (threadCount == 0) {
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        size_t chunk = (primitives.size() + threadCount - 1) / threadCount;
+        auto work = [&](size_t begin) {
+            size_t end = std::min(begin + chunk, primitives.size());
+            for (size_t i = begin; i < end; i++) {
+                aabbs[i] = getAabb(primitives[i]);
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t begin = chunk; begin < primitives.size(); begin += chunk) {
+            threads.emplace_back(work, begin);
+        }
+        work(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return aabbs;
+    }
+
+    // Particles in a cube of half size extent around the origin. Every
+    // fourth is a capsule, stretched along its velocity.
+    inline std::vector<Primitive> makeParticles(uint32_t count, float extent = 1.0f) {
+        auto random = [state = 0x2545F491u]() mutable {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return (state & 0xFFFFFF) / static_cast<float>(0x1000000);
+        };
+        // Radii scale with the spacing so the density looks the same at any count
+        float spacing = 2.0f * extent / std::cbrt(static_cast<float>(std::max(count, 1u)));
+        std::vector<Primitive> primitives(count);
+        for (uint32_t i = 0; i < count; i++) {
+            Primitive& primitive = primitives[i];
+            for (int c = 0; c < 3; c++) {
+                primitive.a[c] = (random() * 2.0f - 1.0f) * extent;
+            }
+            primitive.radius = spacing * (0.15f + 0.2f * random());
+            primitive.b = primitive.a;
+            if (i % 4 == 3) {
+                for (int c = 0; c < 3; c++) {
+                    primitive.b[c] += (random() * 2.0f - 1.0f) * spacing;
+                }
+            }
+        }
+        return primitives;
+    }
+
+    struct TriangleMesh {
+        std::vector<float> positions;  // xyz
+        std::vector<uint32_t> indices;
+
+        uint32_t triangleCount() const { return static_cast<uint32_t>(indices.size() / 3); }
+        size_t getByteSize() const {
+            return positions.size() * sizeof(float) + indices.size() * sizeof(uint32_t);
+        }
+    };
+
+    // The tessellated equivalent: a pole at either end and latitude rings
+    // of two hemispheres, around a for the lower and around b for the
+    // upper one. A sphere shares its equator ring.
+    inline TriangleMesh tessellate(const std::vector<Primitive>& primitives, uint32_t segments = 12, uint32_t stacks = 4) {
+        constexpr float kHalfPi = 1.57079633f;
+        TriangleMesh mesh;
+        for (const Primitive& primitive : primitives) {
+            std::array<float, 3> axis = {
+                primitive.b[0] - primitive.a[0], primitive.b[1] - primitive.a[1], primitive.b[2] - primitive.a[2] };
+            float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+            std::array<float, 3> w = length > 0.0f ?
+                std::array{ axis[0] / length, axis[1] / length, axis[2] / length } : std::array{ 0.0f, 1.0f, 0.0f };
+            // Any two axes perpendicular to w
+            std::array<float, 3> helper = std::abs(w[0]) < 0.9f ? std::array{ 1.0f, 0.0f, 0.0f } : std::array{ 0.0f, 1.0f, 0.0f };
+            std::array<float, 3> u = {
+                helper[1] * w[2] - helper[2] * w[1], helper[2] * w[0] - helper[0] * w[2], helper[0] * w[1] - helper[1] * w[0] };
+            float uLength = std::sqrt(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+            for (float& c : u) {
+                c /= uLength;
+            }
+            std::array<float, 3> v = {
+                w[1] * u[2] - w[2] * u[1], w[2] * u[0] - w[0] * u[2], w[0] * u[1] - w[1] * u[0] };
+
+            uint32_t first = static_cast<uint32_t>(mesh.positions.size() / 3);
+            auto addVertex = [&](const std::array<float, 3>& center, float latitude, float longitude) {
+                float ring = std::cos(latitude) * primitive.radius;
+                float height = std::sin(latitude) * primitive.radius;
+                for (int c = 0; c < 3; c++) {
+                    mesh.positions.push_back(center[c] + ring * (std::cos(longitude) * u[c] + std::sin(longitude) * v[c]) + height * w[c]);
+                }
+            };
+            addVertex(primitive.a, -kHalfPi, 0.0f);
+            uint32_t ringCount = 0;
+            for (uint32_t k = 1; k <= 2 * stacks - 1; k++) {
+                float latitude = -kHalfPi + k * kHalfPi / stacks;
+                bool upper = k > stacks || (k == stacks && primitive.isSphere());
+                for (uint32_t s = 0; s < segments; s++) {
+                    addVertex(upper ? primitive.b : primitive.a, latitude, s * 4.0f * kHalfPi / segments);
+                }
+                ringCount++;
+                // The cylinder of a capsule runs between two equator rings
+                if (k == stacks && !primitive.isSphere()) {
+                    for (uint32_t s = 0; s < segments; s++) {
+                        addVertex(primitive.b, latitude, s * 4.0f * kHalfPi / segments);
+                    }
+                    ringCount++;
+                }
+            }
+            addVertex(primitive.b, kHalfPi, 0.0f);
+
+            uint32_t bottom = first;
+            uint32_t top = first + 1 + ringCount * segments;
+            auto ringVertex = [&](uint32_t ring, uint32_t s) { return first + 1 + ring * segments + s % segments; };
+            for (uint32_t s = 0; s < segments; s++) {
+                mesh.indices.insert(mesh.indices.end(), { bottom, ringVertex(0, s + 1), ringVertex(0, s) });
+                for (uint32_t ring = 0; ring + 1 < ringCount; ring++) {
+                    uint32_t a = ringVertex(ring, s);
+                    uint32_t b = ringVertex(ring, s + 1);
+                    uint32_t c = ringVertex(ring + 1, s);
+                    uint32_t d = ringVertex(ring + 1, s + 1);
+                    mesh.indices.insert(mesh.indices.end(), { a, b, c, b, d, c });
+                }
+                mesh.indices.insert(mesh.indices.end(), { top, ringVertex(ringCount - 1, s), ringVertex(ringCount - 1, s + 1) });
+            }
+        }
+        return mesh;
+    }
+}  // namespace procedural
@@ -0,0 +1,692 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+#include "splitframe.hpp"
+
+// Distributed offline rendering. A coordinator cuts a sequence of frames
+// into tiles and hands them to worker processes over TCP. Each worker gets
+// the scene once when it connects, then renders one tile per job and sends
+// it back run-length compressed. Workers keep a few jobs queued to hide
+// the round trip, and once the queue runs dry idle workers are given
+// copies of the oldest tiles still out, so a straggler cannot hold up the
+// end of a frame; the first result wins.
+//
+// Every message is a MessageHeader followed by size bytes of payload:
+//   Hello  worker name
+//   Scene  vertex count, index count, positions, indices
+//   Job    job id, frame, tile, image size, View
+//   Result job id, render milliseconds, compressed RGB8 tile
+//   Done   empty, the worker exits
+namespace renderfarm {
+    enum class MessageType : uint32_t {
+        eHello = 1,
+        eScene,
+        eJob,
+        eResult,
+        eDone,
+    };
+
+    struct MessageHeader {
+        MessageType type;
+        uint32_t size;
+    };
+
+    // Appends plain values to a payload
+    class Writer {
+    public:
+        std::vector<uint8_t> data;
+
+        template <typename T>
+        void write(const T& value) {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+            data.insert(data.end(), bytes, bytes + sizeof(T));
+        }
+
+        template <typename T>
+        void writeArray(const std::vector<T>& values) {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(values.data());
+            data.insert(data.end(), bytes, bytes + values.size() * sizeof(T));
+        }
+    };
+
+    // Reads plain values back, fails instead of reading past the end
+    class Reader {
+    public:
+        explicit Reader(const std::vector<uint8_t>& data) : data(data) {}
+
+        template <typename T>
+        bool read(T& value) {
+            if (offset + sizeof(T) > data.size()) {
+                return false;
+            }
+            memcpy(&value, data.data() + offset, sizeof(T));
+            offset += sizeof(T);
+            return true;
+        }
+
+        template <typename T>
+        bool readArray(std::vector<T>& values, size_t count) {
+            if (count > (data.size() - offset) / sizeof(T)) {
+                return false;
+            }
+            values.resize(count);
+            memcpy(values.data(), data.data() + offset, count * sizeof(T));
+            offset += count * sizeof(T);
+            return true;
+        }
+
+        std::vector<uint8_t> readRest() {
+            std::vector<uint8_t> rest(data.begin() + offset, data.end());
+            offset = data.size();
+            return rest;
+        }
+
+    private:
+        const std::vector<uint8_t>& data;
+        size_t offset = 0;
+    };
+
+    // Tiles are quantized to RGB8 like the PPM output and packed in runs of
+    // equal pixels: a count byte n < 128 is followed by n + 1 literal
+    // pixels, n >= 128 by one pixel repeated n - 126 times. Misses and
+    // flat shading make long runs.
+    inline std::vector<uint8_t> compressTile(const float* rgba, size_t pixelCount) {
+        std::vector<uint8_t> rgb(pixelCount * 3);
+        for (size_t i = 0; i < pixelCount; i++) {
+            for (size_t c = 0; c < 3; c++) {
+                rgb[i * 3 + c] = static_cast<uint8_t>(std::clamp(rgba[i * 4 + c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+        auto samePixel = [&](size_t a, size_t b) { return memcmp(&rgb[a * 3], &rgb[b * 3], 3) == 0; };
+
+        std::vector<uint8_t> packed;
+        size_t i = 0;
+        while (i < pixelCount) {
+            size_t run = 1;
+            while (i + run < pixelCount && run < 129 && samePixel(i, i + run)) {
+                run++;
+            }
+            if (run >= 2) {
+                packed.push_back(static_cast<uint8_t>(run + 126));
+                packed.insert(packed.end(), &rgb[i * 3], &rgb[i * 3] + 3);
+                i += run;
+                continue;
+            }
+            // Literals up to the next run of two
+            size_t literals = 1;
+            while (i + literals < pixelCount && literals < 128 &&
+                !(i + literals + 1 < pixelCount && samePixel(i + literals, i + literals + 1))) {
+                literals++;
+            }
+            packed.push_back(static_cast<uint8_t>(literals - 1));
+            packed.insert(packed.end(), &rgb[i * 3], &rgb[i * 3] + literals * 3);
+            i += literals;
+        }
+        return packed;
+    }
+
+    // Unpacks into RGBA floats, fails on a malformed stream
+    inline bool decompressTile(const std::vector<uint8_t>& packed, size_t pixelCount, float* rgba) {
+        size_t pixel = 0;
+        size_t i = 0;
+        auto put = [&](const uint8_t* rgb) {
+            for (size_t c = 0; c < 3; c++) {
+                rgba[pixel * 4 + c] = rgb[c] / 255.0f;
+            }
+            rgba[pixel * 4 + 3] = 1.0f;
+            pixel++;
+        };
+        while (i < packed.size()) {
+            uint8_t count = packed[i++];
+            size_t pixels = count < 128 ? count + 1u : count - 126u;
+            size_t bytes = count < 128 ? pixels * 3 : 3;
+            if (i + bytes > packed.size() || pixel + pixels > pixelCount) {
+                return false;
+            }
+            for (size_t p = 0; p < pixels; p++) {
+                put(&packed[i + (count < 128 ? p * 3 : 0)]);
+            }
+            i += bytes;
+        }
+        return pixel == pixelCount;
+    }
+
+#ifndef _WIN32
+    constexpr uint16_t kDefaultPort = 7431;
+
+    // Blocking message stream over a connected socket
+    class Connection {
+    public:
+        Connection() = default;
+        explicit Connection(int fd) : fd(fd) {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        ~Connection() {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        int getFd() const { return fd; }
+
+        bool send(MessageType type, const std::vector<uint8_t>& payload = {}) {
+            MessageHeader header{ type, static_cast<uint32_t>(payload.size()) };
+            return sendAll(&header, sizeof(header)) && sendAll(payload.data(), payload.size());
+        }
+
+        bool receive(MessageType& type, std::vector<uint8_t>& payload) {
+            MessageHeader header{};
+            if (!receiveAll(&header, sizeof(header))) {
+                return false;
+            }
+            type = header.type;
+            payload.resize(header.size);
+            return receiveAll(payload.data(), payload.size());
+        }
+
+    private:
+        int fd = -1;
+
+        bool sendAll(const void* data, size_t size) {
+            const auto* bytes = static_cast<const uint8_t*>(data);
+            while (size > 0) {
+                ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    return false;
+                }
+                bytes += sent;
+                size -= static_cast<size_t>(sent);
+            }
+            return true;
+        }
+
+        bool receiveAll(void* data, size_t size) {
+            auto* bytes = static_cast<uint8_t*>(data);
+            while (size > 0) {
+                ssize_t received = recv(fd, bytes, size, 0);
+                if (received <= 0) {
+                    return false;
+                }
+                bytes += received;
+                size -= static_cast<size_t>(received);
+            }
+            return true;
+        }
+    };
+
+    inline int listenOn(uint16_t port) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(fd, 64) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // host:port, retried for a while so workers may start before the coordinator
+    inline int connectTo(const std::string& endpoint) {
+        size_t colon = endpoint.rfind(':');
+        if (colon == std::string::npos) {
+            return -1;
+        }
+        std::string host = endpoint.substr(0, colon);
+        std::string port = endpoint.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        for (int attempt = 0; attempt < 50; attempt++) {
+            addrinfo* addresses = nullptr;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) == 0) {
+                for (addrinfo* a = addresses; a; a = a->ai_next) {
+                    int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                        freeaddrinfo(addresses);
+                        return fd;
+                    }
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                }
+                freeaddrinfo(addresses);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return -1;
+    }
+
+    // Creates the tile backend of a worker once the scene and image size are known
+    using BackendFactory = std::function<std::unique_ptr<splitframe::Worker>(
+        const geometry::Mesh& mesh, uint32_t width, uint32_t height)>;
+
+    // Worker process main loop. Returns once the coordinator is done or gone.
+    inline bool runWorker(const std::string& endpoint, const std::string& name, const BackendFactory& createBackend) {
+        int fd = connectTo(endpoint);
+        if (fd < 0) {
+            std::cerr << "Cannot connect to coordinator " << endpoint << "\n";
+            return false;
+        }
+        Connection connection(fd);
+        connection.send(MessageType::eHello, std::vector<uint8_t>(name.begin(), name.end()));
+
+        geometry::Mesh mesh;
+        std::unique_ptr<splitframe::Worker> backend;
+        splitframe::Image image;
+        std::vector<float> rgba;
+        MessageType type{};
+        std::vector<uint8_t> payload;
+        while (connection.receive(type, payload)) {
+            Reader reader(payload);
+            if (type == MessageType::eScene) {
+                uint32_t vertexCount = 0, indexCount = 0;
+                if (!reader.read(vertexCount) || !reader.read(indexCount) ||
+                    !reader.readArray(mesh.positions, static_cast<size_t>(vertexCount) * 3) ||
+                    !reader.readArray(mesh.indices, indexCount)) {
+                    std::cerr << "Malformed scene message\n";
+                    return false;
+                }
+                backend.reset();
+                std::cout << "Worker " << name << ": received " << mesh.triangleCount() << " triangles\n";
+            }
+            else if (type == MessageType::eJob) {
+                uint32_t jobId = 0, frame = 0, width = 0, height = 0;
+                splitframe::Tile tile{};
+                cputracer::View view{};
+                if (!reader.read(jobId) || !reader.read(frame) || !reader.read(tile) ||
+                    !reader.read(width) || !reader.read(height) || !reader.read(view)) {
+                    std::cerr << "Malformed job message\n";
+                    return false;
+                }
+                if (!backend || image.width != width || image.height != height) {
+                    backend = createBackend(mesh, width, height);
+                    image = splitframe::Image(width, height);
+                }
+                auto start = std::chrono::steady_clock::now();
+                backend->render(view, { tile }, image);
+                auto end = std::chrono::steady_clock::now();
+
+                rgba.resize(tile.getPixelCount() * 4);
+                for (uint32_t row = 0; row < tile.height; row++) {
+                    const float* src = image.pixels.data() + (static_cast<size_t>(tile.y + row) * width + tile.x) * 4;
+                    std::copy(src, src + tile.width * 4, rgba.data() + static_cast<size_t>(row) * tile.width * 4);
+                }
+                Writer result;
+                result.write(jobId);
+                result.write(std::chrono::duration<double, std::milli>(end - start).count());
+                result.writeArray(compressTile(rgba.data(), tile.getPixelCount()));
+                if (!connection.send(MessageType::eResult, result.data)) {
+                    return false;
+                }
+            }
+            else if (type == MessageType::eDone) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct FarmSettings {
+        uint32_t width = 1280;
+        uint32_t height = 720;
+        uint32_t tileSize = 64;
+        uint32_t frameCount = 4;
+        uint32_t workerCount = 1;   // workers to wait for before starting
+        uint32_t jobsInFlight = 2;  // per worker
+        std::string outputPrefix;   // PREFIX_0000.ppm per frame when set
+    };
+
+    struct WorkerReport {
+        std::string name;
+        uint32_t tiles = 0;
+        uint32_t duplicates = 0;    // stolen copies it was given
+        uint32_t discarded = 0;     // results that lost the race
+        double renderMs = 0.0;
+    };
+
+    struct FarmReport {
+        double ms = 0.0;            // first job sent to last tile received
+        uint64_t rawBytes = 0;      // the tiles as RGBA floats
+        uint64_t compressedBytes = 0;
+        std::vector<WorkerReport> workers;
+    };
+
+    // Camera of frame i of the sequence: the default view orbiting the origin
+    using ViewFunction = std::function<cputracer::View(uint32_t frame)>;
+
+    class Coordinator {
+    public:
+        Coordinator(FarmSettings settings, const geometry::Mesh& mesh, ViewFunction getView)
+            : settings(std::move(settings)), mesh(mesh), getView(std::move(getView)) {}
+
+        bool render(uint16_t port, FarmReport& report) {
+            int listenFd = listenOn(port);
+            if (listenFd < 0) {
+                std::cerr << "Cannot listen on port " << port << "\n";
+                return false;
+            }
+            // Closes the listening socket on return
+            Connection listener(listenFd);
+
+            std::vector<splitframe::Tile> tiles = splitframe::makeTiles(settings.width, settings.height, settings.tileSize);
+            for (uint32_t frame = 0; frame < settings.frameCount; frame++) {
+                for (const auto& tile : tiles) {
+                    jobs.push_back({ static_cast<uint32_t>(jobs.size()), frame, tile });
+                    pending.push_back(jobs.back().id);
+                }
+            }
+            done.assign(jobs.size(), false);
+            duplicated.assign(jobs.size(), false);
+            tilesLeft.assign(settings.frameCount, static_cast<uint32_t>(tiles.size()));
+            std::vector<uint8_t> scene = packScene();
+
+            std::cout << "Waiting for " << settings.workerCount << " workers on port " << port << "\n";
+            std::chrono::steady_clock::time_point start{};
+            bool started = false;
+            size_t remaining = jobs.size();
+            while (remaining > 0) {
+                if (!started && readyCount() >= settings.workerCount) {
+                    started = true;
+                    start = std::chrono::steady_clock::now();
+                }
+                if (started) {
+                    dispatch();
+                }
+                if (started && workers.empty()) {
+                    std::cerr << "All workers disconnected\n";
+                    return false;
+                }
+
+                std::vector<pollfd> fds{ { listenFd, POLLIN, 0 } };
+                for (const auto& worker : workers) {
+                    fds.push_back({ worker->connection->getFd(), POLLIN, 0 });
+                }
+                if (poll(fds.data(), fds.size(), 1000) <= 0) {
+                    continue;
+                }
+                if (fds[0].revents & POLLIN) {
+                    int fd = accept(listenFd, nullptr, nullptr);
+                    if (fd >= 0) {
+                        auto worker = std::make_unique<WorkerState>();
+                        worker->connection = std::make_unique<Connection>(fd);
+                        workers.push_back(std::move(worker));
+                    }
+                }
+                // New workers were appended after the polled ones
+                for (size_t i = fds.size() - 1; i > 0; i--) {
+                    if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                        continue;
+                    }
+                    if (!handleMessage(*workers[i - 1], scene, remaining, report)) {
+                        dropWorker(i - 1);
+                    }
+                }
+            }
+            report.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            for (auto& worker : workers) {
+                worker->connection->send(MessageType::eDone);
+                report.workers.push_back(worker->report);
+            }
+            for (auto& dropped : droppedReports) {
+                dropped.name += " (disconnected)";
+            }
+            report.workers.insert(report.workers.end(), droppedReports.begin(), droppedReports.end());
+            return true;
+        }
+
+    private:
+        struct Job {
+            uint32_t id;
+            uint32_t frame;
+            splitframe::Tile tile;
+        };
+
+        struct WorkerState {
+            std::unique_ptr<Connection> connection;
+            bool ready = false;
+            std::vector<std::pair<uint32_t, std::chrono::steady_clock::time_point>> outstanding;
+            WorkerReport report;
+        };
+
+        FarmSettings settings;
+        const geometry::Mesh& mesh;
+        ViewFunction getView;
+
+        std::vector<Job> jobs;
+        std::deque<uint32_t> pending;
+        std::vector<bool> done;
+        std::vector<bool> duplicated;
+        std::vector<uint32_t> tilesLeft;
+        // Frames are allocated on their first result and written when complete
+        std::map<uint32_t, splitframe::Image> frames;
+        std::vector<std::unique_ptr<WorkerState>> workers;
+        std::vector<WorkerReport> droppedReports;
+        std::vector<float> rgba;
+
+        uint32_t readyCount() const {
+            return static_cast<uint32_t>(std::count_if(workers.begin(), workers.end(),
+                [](const auto& worker) { return worker->ready; }));
+        }
+
+        std::vector<uint8_t> packScene() const {
+            Writer writer;
+            writer.write(mesh.vertexCount());
+            writer.write(static_cast<uint32_t>(mesh.indices.size()));
+            writer.writeArray(mesh.positions);
+            writer.writeArray(mesh.indices);
+            return writer.data;
+        }
+
+        bool sendJob(WorkerState& worker, uint32_t jobId) {
+            const Job& job = jobs[jobId];
+            Writer writer;
+            writer.write(job.id);
+            writer.write(job.frame);
+            writer.write(job.tile);
+            writer.write(settings.width);
+            writer.write(settings.height);
+            writer.write(getView(job.frame));
+            worker.outstanding.push_back({ jobId, std::chrono::steady_clock::now() });
+            return worker.connection->send(MessageType::eJob, writer.data);
+        }
+
+        void dispatch() {
+            for (auto& worker : workers) {
+                while (worker->ready && worker->outstanding.size() < settings.jobsInFlight && !pending.empty()) {
+                    uint32_t jobId = pending.front();
+                    pending.pop_front();
+                    if (!done[jobId]) {
+                        sendJob(*worker, jobId);
+                    }
+                }
+            }
+            if (!pending.empty()) {
+                return;
+            }
+            // Out of work: an idle worker takes a copy of the oldest tile
+            // another worker still holds
+            for (auto& thief : workers) {
+                if (!thief->ready || !thief->outstanding.empty()) {
+                    continue;
+                }
+                uint32_t oldest = UINT32_MAX;
+                auto oldestTime = std::chrono::steady_clock::time_point::max();
+                for (const auto& victim : workers) {
+                    for (const auto& [jobId, sent] : victim->outstanding) {
+                        if (!done[jobId] && !duplicated[jobId] && sent < oldestTime) {
+                            oldest = jobId;
+                            oldestTime = sent;
+                        }
+                    }
+                }
+                if (oldest == UINT32_MAX) {
+                    return;
+                }
+                duplicated[oldest] = true;
+                thief->report.duplicates++;
+                sendJob(*thief, oldest);
+            }
+        }
+
+        bool handleMessage(WorkerState& worker, const std::vector<uint8_t>& scene,
+            size_t& remaining, FarmReport& report) {
+            MessageType type{};
+            std::vector<uint8_t> payload;
+            if (!worker.connection->receive(type, payload)) {
+                return false;
+            }
+            if (type == MessageType::eHello) {
+                worker.report.name = std::string(payload.begin(), payload.end());
+                worker.ready = worker.connection->send(MessageType::eScene, scene);
+                std::cout << "Worker " << worker.report.name << " connected\n";
+                return worker.ready;
+            }
+            if (type != MessageType::eResult) {
+                return true;
+            }
+
+            Reader reader(payload);
+            uint32_t jobId = 0;
+            double renderMs = 0.0;
+            if (!reader.read(jobId) || !reader.read(renderMs) || jobId >= jobs.size()) {
+                return false;
+            }
+            std::erase_if(worker.outstanding, [&](const auto& entry) { return entry.first == jobId; });
+            worker.report.renderMs += renderMs;
+            if (done[jobId]) {
+                worker.report.discarded++;
+                return true;
+            }
+
+            const Job& job = jobs[jobId];
+            std::vector<uint8_t> packed = reader.readRest();
+            rgba.resize(job.tile.getPixelCount() * 4);
+            if (!decompressTile(packed, job.tile.getPixelCount(), rgba.data())) {
+                return false;
+            }
+            auto frame = frames.try_emplace(job.frame, settings.width, settings.height).first;
+            frame->second.composite(job.tile, rgba.data());
+            done[jobId] = true;
+            remaining--;
+            worker.report.tiles++;
+            report.rawBytes += rgba.size() * sizeof(float);
+            report.compressedBytes += packed.size();
+
+            if (--tilesLeft[job.frame] == 0) {
+                if (!settings.outputPrefix.empty()) {
+                    std::ostringstream path;
+                    path << settings.outputPrefix << "_" << std::setw(4) << std::setfill('0') << job.frame << ".ppm";
+                    if (!frame->second.writePPM(path.str())) {
+                        std::cerr << "Failed to write " << path.str() << "\n";
+                    }
+                }
+                frames.erase(frame);
+            }
+            return true;
+        }
+
+        // Puts the unfinished jobs of a lost worker back in front of the queue
+        void dropWorker(size_t index) {
+            WorkerState& worker = *workers[index];
+            std::cerr << "Worker " << worker.report.name << " disconnected\n";
+            for (auto it = worker.outstanding.rbegin(); it != worker.outstanding.rend(); ++it) {
+                if (!done[it->first]) {
+                    duplicated[it->first] = false;
+                    pending.push_front(it->first);
+                }
+            }
+            if (worker.ready) {
+                droppedReports.push_back(worker.report);
+            }
+            workers.erase(workers.begin() + index);
+        }
+    };
+
+    // Starts local worker processes running this executable
+    inline std::vector<pid_t> spawnWorkers(const std::string& executable, uint32_t count,
+        uint16_t port, const std::vector<std::string>& extraArguments) {
+        std::vector<pid_t> pids;
+        for (uint32_t i = 0; i < count; i++) {
+            std::vector<std::string> arguments = {
+                executable, "--farm-worker", "127.0.0.1:" + std::to_string(port),
+                "--farm-name", "local-" + std::to_string(i),
+            };
+            arguments.insert(arguments.end(), extraArguments.begin(), extraArguments.end());
+            std::vector<char*> argv;
+            for (auto& argument : arguments) {
+                argv.push_back(argument.data());
+            }
+            argv.push_back(nullptr);
+            pid_t pid = 0;
+            if (posix_spawn(&pid, executable.c_str(), nullptr, nullptr, argv.data(), environ) == 0) {
+                pids.push_back(pid);
+            }
+            else {
+                std::cerr << "Failed to start worker " << executable << "\n";
+            }
+        }
+        return pids;
+    }
+
+    inline void waitForWorkers(const std::vector<pid_t>& pids) {
+        for (pid_t pid : pids) {
+            int status = 0;
+            waitpid(pid, &status, 0);
+        }
+    }
+
+    inline void printReport(const FarmReport& report, uint32_t frameCount) {
+        std::cout << "Rendered " << frameCount << " frames in " << report.ms << " ms ("
+            << report.ms / frameCount << " ms/frame)\n";
+        if (report.compressedBytes > 0) {
+            std::cout << "Tile results: " << report.compressedBytes / 1024 << " KB compressed, "
+                << static_cast<double>(report.rawBytes) / report.compressedBytes << "x smaller than RGBA32F\n";
+        }
+        for (const auto& worker : report.workers) {
+            std::cout << "  " << worker.name << ": " << worker.tiles << " tiles, "
+                << worker.renderMs << " ms rendering, " << worker.duplicates << " stolen, "
+                << worker.discarded << " discarded\n";
+        }
+    }
+#endif
+}  // namespace renderfarm
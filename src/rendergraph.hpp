@@ -0,0 +1,684 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "vkutils.hpp"
+
+// Minimal render graph. Passes declare how they access images, buffers and
+// acceleration structures; compile() culls passes whose results are never
+// used, aliases transient images with disjoint lifetimes and computes the
+// barriers between passes, merged into one barrier call per pass.
+// Barriers are recorded with VK_KHR_synchronization2 when it is enabled and
+// with vkCmdPipelineBarrier otherwise, so usages must stick to stage and
+// access bits that also exist in the legacy flags.
+namespace rendergraph {
+    using ResourceHandle = uint32_t;
+
+    struct Usage {
+        vk::PipelineStageFlags2 stage;
+        vk::AccessFlags2 access;
+        vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+    };
+
+    inline Usage storageRead(vk::PipelineStageFlags2 stage) {
+        return { stage, vk::AccessFlagBits2::eShaderRead, vk::ImageLayout::eGeneral };
+    }
+
+    inline Usage storageWrite(vk::PipelineStageFlags2 stage) {
+        return { stage, vk::AccessFlagBits2::eShaderWrite, vk::ImageLayout::eGeneral };
+    }
+
+    inline Usage storageReadWrite(vk::PipelineStageFlags2 stage) {
+        return { stage, vk::AccessFlagBits2::eShaderRead | vk::AccessFlagBits2::eShaderWrite,
+                 vk::ImageLayout::eGeneral };
+    }
+
+    // Indirect dispatch arguments that the stage also reads as storage
+    inline Usage indirectRead(vk::PipelineStageFlags2 stage) {
+        return { stage | vk::PipelineStageFlagBits2::eDrawIndirect,
+                 vk::AccessFlagBits2::eShaderRead | vk::AccessFlagBits2::eIndirectCommandRead,
+                 vk::ImageLayout::eGeneral };
+    }
+
+    inline Usage sampled(vk::PipelineStageFlags2 stage) {
+        return { stage, vk::AccessFlagBits2::eShaderRead, vk::ImageLayout::eShaderReadOnlyOptimal };
+    }
+
+    inline Usage colorAttachment() {
+        return { vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+                 vk::AccessFlagBits2::eColorAttachmentRead | vk::AccessFlagBits2::eColorAttachmentWrite,
+                 vk::ImageLayout::eColorAttachmentOptimal };
+    }
+
+    inline Usage transferSrc() {
+        return { vk::PipelineStageFlagBits2::eTransfer, vk::AccessFlagBits2::eTransferRead,
+                 vk::ImageLayout::eTransferSrcOptimal };
+    }
+
+    inline Usage transferDst() {
+        return { vk::PipelineStageFlagBits2::eTransfer, vk::AccessFlagBits2::eTransferWrite,
+                 vk::ImageLayout::eTransferDstOptimal };
+    }
+
+    inline Usage accelRead(vk::PipelineStageFlags2 stage) {
+        return { stage, vk::AccessFlagBits2::eAccelerationStructureReadKHR };
+    }
+
+    inline Usage accelBuild() {
+        return { vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR,
+                 vk::AccessFlagBits2::eAccelerationStructureReadKHR |
+                 vk::AccessFlagBits2::eAccelerationStructureWriteKHR };
+    }
+
+    // Vertex, index and instance data read by an acceleration structure build
+    inline Usage accelBuildInput() {
+        return { vk::PipelineStageFlagBits2::eAccelerationStructureBuildKHR, vk::AccessFlagBits2::eShaderRead };
+    }
+
+    // Conservative usage for resources last touched by an earlier frame
+    inline Usage previousFrame(vk::ImageLayout layout = vk::ImageLayout::eUndefined) {
+        return { vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eMemoryWrite, layout };
+    }
+
+    inline bool isWriteAccess(vk::AccessFlags2 access) {
+        constexpr vk::AccessFlags2 writeMask =
+            vk::AccessFlagBits2::eShaderWrite |
+            vk::AccessFlagBits2::eColorAttachmentWrite |
+            vk::AccessFlagBits2::eDepthStencilAttachmentWrite |
+            vk::AccessFlagBits2::eTransferWrite |
+            vk::AccessFlagBits2::eHostWrite |
+            vk::AccessFlagBits2::eMemoryWrite |
+            vk::AccessFlagBits2::eAccelerationStructureWriteKHR;
+        return static_cast<bool>(access & writeMask);
+    }
+
+    inline vk::PipelineStageFlags toLegacyStages(vk::PipelineStageFlags2 stages,
+        vk::PipelineStageFlags fallback) {
+        auto bits = static_cast<VkPipelineStageFlags2>(stages);
+        if (bits == 0) {
+            return fallback;
+        }
+        return vk::PipelineStageFlags(static_cast<VkPipelineStageFlags>(bits));
+    }
+
+    inline vk::AccessFlags toLegacyAccess(vk::AccessFlags2 access) {
+        return vk::AccessFlags(static_cast<VkAccessFlags>(static_cast<VkAccessFlags2>(access)));
+    }
+
+    struct ImageDesc {
+        vk::Format format = vk::Format::eUndefined;
+        vk::Extent2D extent;
+        vk::ImageUsageFlags usage;
+
+        bool operator==(const ImageDesc&) const = default;
+    };
+
+    class RenderGraph;
+
+    class Pass {
+    public:
+        Pass& read(ResourceHandle resource, Usage usage) {
+            accesses.push_back({ resource, usage, false });
+            return *this;
+        }
+
+        Pass& write(ResourceHandle resource, Usage usage) {
+            accesses.push_back({ resource, usage, true });
+            return *this;
+        }
+
+        // Keep the pass even if nothing reads its results
+        Pass& sideEffect() {
+            hasSideEffect = true;
+            return *this;
+        }
+
+    private:
+        friend class RenderGraph;
+
+        struct Access {
+            ResourceHandle resource;
+            Usage usage;
+            bool isWrite;
+        };
+
+        struct BarrierBatch {
+            std::vector<vk::ImageMemoryBarrier2> images;
+            std::vector<vk::BufferMemoryBarrier2> buffers;
+            vk::MemoryBarrier2 memory{};
+
+            bool empty() const {
+                return images.empty() && buffers.empty() &&
+                    !memory.srcStageMask && !memory.dstStageMask;
+            }
+        };
+
+        std::string name;
+        std::function<void(vk::CommandBuffer)> execute;
+        std::vector<Access> accesses;
+        bool hasSideEffect = false;
+        bool culled = false;
+        BarrierBatch barriers;
+    };
+
+    class RenderGraph {
+    public:
+        void init(vk::PhysicalDevice physicalDevice, vk::Device device, bool synchronization2) {
+            this->physicalDevice = physicalDevice;
+            this->device = device;
+            this->synchronization2 = synchronization2;
+        }
+
+        // Forget the passes and imports of the previous frame.
+        // Transient images are kept and reused.
+        void reset() {
+            passes.clear();
+            resources.clear();
+            finalBarriers = {};
+            barrierCount = 0;
+            for (auto& physical : physicalImages) {
+                physical.busyUntil = -1;
+                physical.state = {};
+            }
+        }
+
+        // previous: last access recorded before this graph, e.g. by the
+        // previous frame, and the layout the image is currently in.
+        // acquired: the image is handed over by a semaphore, its first
+        // barrier waits on the stage returned by getAcquireStage().
+        ResourceHandle importImage(const std::string& name, vk::Image image,
+            vk::ImageSubresourceRange range,
+            Usage previous, vk::ImageLayout finalLayout,
+            bool acquired = false) {
+            Resource resource{};
+            resource.name = name;
+            resource.kind = ResourceKind::eImage;
+            resource.imported = true;
+            resource.image = image;
+            resource.range = range;
+            resource.finalLayout = finalLayout;
+            resource.acquired = acquired;
+            resource.ownState.layout = previous.layout;
+            if (isWriteAccess(previous.access)) {
+                resource.ownState.writeStages = previous.stage;
+                resource.ownState.writeAccess = previous.access;
+            }
+            else {
+                resource.ownState.readStages = previous.stage;
+            }
+            resources.push_back(resource);
+            return static_cast<ResourceHandle>(resources.size() - 1);
+        }
+
+        // previous: as for importImage, the layout is ignored
+        ResourceHandle importBuffer(const std::string& name, vk::Buffer buffer, Usage previous = {}) {
+            Resource resource{};
+            resource.name = name;
+            resource.kind = ResourceKind::eBuffer;
+            resource.imported = true;
+            resource.buffer = buffer;
+            if (isWriteAccess(previous.access)) {
+                resource.ownState.writeStages = previous.stage;
+                resource.ownState.writeAccess = previous.access;
+            }
+            else {
+                resource.ownState.readStages = previous.stage;
+            }
+            resources.push_back(resource);
+            return static_cast<ResourceHandle>(resources.size() - 1);
+        }
+
+        // Acceleration structures are synchronized with global memory barriers.
+        // previous: as for importBuffer, for structures rebuilt every frame.
+        ResourceHandle importAccel(const std::string& name, Usage previous = {}) {
+            Resource resource{};
+            resource.name = name;
+            resource.kind = ResourceKind::eAccel;
+            resource.imported = true;
+            if (isWriteAccess(previous.access)) {
+                resource.ownState.writeStages = previous.stage;
+                resource.ownState.writeAccess = previous.access;
+            }
+            else {
+                resource.ownState.readStages = previous.stage;
+            }
+            resources.push_back(resource);
+            return static_cast<ResourceHandle>(resources.size() - 1);
+        }
+
+        // Image owned by the graph, only valid between its first and last use
+        ResourceHandle createImage(const std::string& name, const ImageDesc& desc) {
+            Resource resource{};
+            resource.name = name;
+            resource.kind = ResourceKind::eImage;
+            resource.desc = desc;
+            resource.range = { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 };
+            resources.push_back(resource);
+            return static_cast<ResourceHandle>(resources.size() - 1);
+        }
+
+        Pass& addPass(const std::string& name, std::function<void(vk::CommandBuffer)> execute) {
+            Pass& pass = passes.emplace_back();
+            pass.name = name;
+            pass.execute = std::move(execute);
+            return pass;
+        }
+
+        void compile() {
+            cullPasses();
+            allocateTransients();
+
+            for (auto& pass : passes) {
+                if (pass.culled) {
+                    continue;
+                }
+                for (const auto& access : mergeAccesses(pass)) {
+                    addBarrier(pass.barriers, access.resource, access.usage);
+                }
+            }
+
+            // Return imported images in the layout the caller expects. The
+            // transition is chained with all later commands so the next
+            // frame can wait on it.
+            for (ResourceHandle handle = 0; handle < resources.size(); handle++) {
+                Resource& resource = resources[handle];
+                if (resource.kind != ResourceKind::eImage || !resource.imported ||
+                    resource.finalLayout == vk::ImageLayout::eUndefined) {
+                    continue;
+                }
+                ResourceState& state = getState(handle);
+                if (state.layout != resource.finalLayout) {
+                    addImageBarrier(finalBarriers, resource, state,
+                        { vk::PipelineStageFlagBits2::eAllCommands, vk::AccessFlagBits2::eNone, resource.finalLayout });
+                }
+            }
+        }
+
+        void execute(vk::CommandBuffer commandBuffer) {
+            for (auto& pass : passes) {
+                if (pass.culled) {
+                    continue;
+                }
+                recordBarriers(commandBuffer, pass.barriers);
+                pass.execute(commandBuffer);
+            }
+            recordBarriers(commandBuffer, finalBarriers);
+        }
+
+        vk::Image getImage(ResourceHandle handle) const {
+            const Resource& resource = resources[handle];
+            return resource.imported ? resource.image : *physicalImages[resource.physical].image;
+        }
+
+        vk::ImageView getImageView(ResourceHandle handle) const {
+            return *physicalImages[resources[handle].physical].view;
+        }
+
+        // Stage the acquire semaphore has to wait on
+        vk::PipelineStageFlags2 getAcquireStage(ResourceHandle handle) const {
+            return resources[handle].acquireStage;
+        }
+
+        uint32_t getBarrierCount() const { return barrierCount; }
+
+        uint32_t getCulledPassCount() const {
+            uint32_t count = 0;
+            for (const auto& pass : passes) {
+                count += pass.culled ? 1 : 0;
+            }
+            return count;
+        }
+
+    private:
+        enum class ResourceKind {
+            eImage,
+            eBuffer,
+            eAccel,
+        };
+
+        struct ResourceState {
+            vk::ImageLayout layout = vk::ImageLayout::eUndefined;
+            // Last write (or layout transition) and the accesses it is visible to
+            vk::PipelineStageFlags2 writeStages;
+            vk::AccessFlags2 writeAccess;
+            vk::PipelineStageFlags2 visibleStages;
+            vk::AccessFlags2 visibleAccess;
+            // Reads since the last write
+            vk::PipelineStageFlags2 readStages;
+        };
+
+        struct Resource {
+            std::string name;
+            ResourceKind kind = ResourceKind::eImage;
+            bool imported = false;
+            bool acquired = false;
+            vk::Image image;
+            vk::Buffer buffer;
+            vk::ImageSubresourceRange range;
+            vk::ImageLayout finalLayout = vk::ImageLayout::eUndefined;
+            vk::PipelineStageFlags2 acquireStage;
+            ImageDesc desc;
+            ResourceState ownState;
+            // Transient images
+            uint32_t physical = 0;
+            int firstPass = -1;
+            int lastPass = -1;
+        };
+
+        struct PhysicalImage {
+            ImageDesc desc;
+            vk::UniqueImage image;
+            vk::UniqueDeviceMemory memory;
+            vk::UniqueImageView view;
+            int busyUntil = -1;
+            ResourceState state;
+        };
+
+        vk::PhysicalDevice physicalDevice;
+        vk::Device device;
+        bool synchronization2 = false;
+
+        std::deque<Pass> passes;
+        std::vector<Resource> resources;
+        std::vector<PhysicalImage> physicalImages;
+        Pass::BarrierBatch finalBarriers;
+        uint32_t barrierCount = 0;
+
+        ResourceState& getState(ResourceHandle handle) {
+            Resource& resource = resources[handle];
+            return resource.imported ? resource.ownState : physicalImages[resource.physical].state;
+        }
+
+        void cullPasses() {
+            // Walk backwards: a pass is needed if it writes an imported
+            // resource or something a needed pass reads
+            std::vector<bool> needed(resources.size(), false);
+            for (ResourceHandle handle = 0; handle < resources.size(); handle++) {
+                needed[handle] = resources[handle].imported;
+            }
+            for (auto pass = passes.rbegin(); pass != passes.rend(); ++pass) {
+                bool live = pass->hasSideEffect;
+                for (const auto& access : pass->accesses) {
+                    live = live || (access.isWrite && needed[access.resource]);
+                }
+                pass->culled = !live;
+                if (live) {
+                    for (const auto& access : pass->accesses) {
+                        if (!access.isWrite) {
+                            needed[access.resource] = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        void allocateTransients() {
+            std::vector<ResourceHandle> transients;
+            for (int passIndex = 0; passIndex < static_cast<int>(passes.size()); passIndex++) {
+                if (passes[passIndex].culled) {
+                    continue;
+                }
+                for (const auto& access : passes[passIndex].accesses) {
+                    Resource& resource = resources[access.resource];
+                    if (resource.imported) {
+                        continue;
+                    }
+                    if (resource.firstPass < 0) {
+                        resource.firstPass = passIndex;
+                        transients.push_back(access.resource);
+                    }
+                    resource.lastPass = passIndex;
+                }
+            }
+
+            // Transients are visited in order of first use, so a physical
+            // image is reused as soon as its previous owner is done with it
+            for (ResourceHandle handle : transients) {
+                Resource& resource = resources[handle];
+                uint32_t physical = 0;
+                while (physical < physicalImages.size() &&
+                    (physicalImages[physical].desc != resource.desc ||
+                     physicalImages[physical].busyUntil >= resource.firstPass)) {
+                    physical++;
+                }
+                if (physical == physicalImages.size()) {
+                    physicalImages.push_back(createPhysicalImage(resource.desc));
+                }
+                resource.physical = physical;
+                physicalImages[physical].busyUntil = resource.lastPass;
+                // Contents of the previous owner are discarded
+                physicalImages[physical].state.layout = vk::ImageLayout::eUndefined;
+            }
+        }
+
+        PhysicalImage createPhysicalImage(const ImageDesc& desc) {
+            PhysicalImage physical{};
+            physical.desc = desc;
+
+            vk::ImageCreateInfo createInfo{};
+            createInfo.setImageType(vk::ImageType::e2D);
+            createInfo.setFormat(desc.format);
+            createInfo.setExtent({ desc.extent.width, desc.extent.height, 1 });
+            createInfo.setMipLevels(1);
+            createInfo.setArrayLayers(1);
+            createInfo.setSamples(vk::SampleCountFlagBits::e1);
+            createInfo.setTiling(vk::ImageTiling::eOptimal);
+            createInfo.setUsage(desc.usage);
+            createInfo.setInitialLayout(vk::ImageLayout::eUndefined);
+            physical.image = device.createImageUnique(createInfo);
+
+            vk::MemoryRequirements memoryReq = device.getImageMemoryRequirements(*physical.image);
+            vk::MemoryAllocateInfo allocateInfo{};
+            allocateInfo.setAllocationSize(memoryReq.size);
+            allocateInfo.setMemoryTypeIndex(vkutils::getMemoryType(physicalDevice,
+                memoryReq, vk::MemoryPropertyFlagBits::eDeviceLocal));
+            physical.memory = device.allocateMemoryUnique(allocateInfo);
+            device.bindImageMemory(*physical.image, *physical.memory, 0);
+
+            vk::ImageViewCreateInfo viewInfo{};
+            viewInfo.setImage(*physical.image);
+            viewInfo.setViewType(vk::ImageViewType::e2D);
+            viewInfo.setFormat(desc.format);
+            viewInfo.setSubresourceRange({ vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 });
+            physical.view = device.createImageViewUnique(viewInfo);
+            return physical;
+        }
+
+        // A pass touching a resource several times needs a single barrier
+        std::vector<Pass::Access> mergeAccesses(const Pass& pass) const {
+            std::vector<Pass::Access> merged;
+            for (const auto& access : pass.accesses) {
+                auto it = std::find_if(merged.begin(), merged.end(),
+                    [&](const Pass::Access& m) { return m.resource == access.resource; });
+                if (it == merged.end()) {
+                    merged.push_back(access);
+                    continue;
+                }
+                if (it->usage.layout != access.usage.layout) {
+                    std::cerr << "Render graph: pass " << pass.name << " uses "
+                        << resources[access.resource].name << " in two layouts.\n";
+                    std::abort();
+                }
+                it->usage.stage |= access.usage.stage;
+                it->usage.access |= access.usage.access;
+                it->isWrite = it->isWrite || access.isWrite;
+            }
+            return merged;
+        }
+
+        void addBarrier(Pass::BarrierBatch& batch, ResourceHandle handle, const Usage& usage) {
+            Resource& resource = resources[handle];
+            ResourceState& state = getState(handle);
+
+            if (resource.acquired && !resource.acquireStage) {
+                // Chain the first barrier with the acquire semaphore wait
+                resource.acquireStage = usage.stage;
+                state.writeStages = usage.stage;
+            }
+
+            if (resource.kind == ResourceKind::eImage) {
+                addImageBarrier(batch, resource, state, usage);
+                return;
+            }
+
+            bool isWrite = isWriteAccess(usage.access);
+            vk::PipelineStageFlags2 srcStages;
+            vk::AccessFlags2 srcAccess;
+            if (isWrite) {
+                // WAW and WAR hazards
+                srcStages = state.writeStages | state.readStages;
+                srcAccess = state.writeAccess;
+            }
+            else if (state.writeStages &&
+                ((state.visibleStages & usage.stage) != usage.stage ||
+                 (state.visibleAccess & usage.access) != usage.access)) {
+                // RAW hazard not covered by an earlier barrier
+                srcStages = state.writeStages;
+                srcAccess = state.writeAccess;
+            }
+            updateState(state, usage, isWrite, static_cast<bool>(srcStages));
+            if (!srcStages) {
+                return;
+            }
+
+            barrierCount++;
+            if (resource.kind == ResourceKind::eAccel) {
+                batch.memory.srcStageMask |= srcStages;
+                batch.memory.srcAccessMask |= srcAccess;
+                batch.memory.dstStageMask |= usage.stage;
+                batch.memory.dstAccessMask |= usage.access;
+                return;
+            }
+            vk::BufferMemoryBarrier2 barrier{};
+            barrier.setSrcStageMask(srcStages);
+            barrier.setSrcAccessMask(srcAccess);
+            barrier.setDstStageMask(usage.stage);
+            barrier.setDstAccessMask(usage.access);
+            barrier.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+            barrier.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+            barrier.setBuffer(resource.buffer);
+            barrier.setOffset(0);
+            barrier.setSize(VK_WHOLE_SIZE);
+            batch.buffers.push_back(barrier);
+        }
+
+        void addImageBarrier(Pass::BarrierBatch& batch, const Resource& resource,
+            ResourceState& state, const Usage& usage) {
+            bool transition = usage.layout != state.layout;
+            bool isWrite = isWriteAccess(usage.access);
+
+            vk::PipelineStageFlags2 srcStages;
+            vk::AccessFlags2 srcAccess;
+            bool needed = false;
+            if (transition || isWrite) {
+                srcStages = state.writeStages | state.readStages;
+                srcAccess = state.writeAccess;
+                needed = transition || static_cast<bool>(srcStages);
+            }
+            else if (state.writeStages &&
+                ((state.visibleStages & usage.stage) != usage.stage ||
+                 (state.visibleAccess & usage.access) != usage.access)) {
+                srcStages = state.writeStages;
+                srcAccess = state.writeAccess;
+                needed = true;
+            }
+
+            vk::ImageLayout oldLayout = state.layout;
+            if (transition) {
+                // The transition itself is a write made visible to this usage
+                state.layout = usage.layout;
+                state.writeStages = usage.stage;
+                state.writeAccess = isWrite ? usage.access : vk::AccessFlags2{};
+                state.visibleStages = isWrite ? vk::PipelineStageFlags2{} : usage.stage;
+                state.visibleAccess = isWrite ? vk::AccessFlags2{} : usage.access;
+                state.readStages = isWrite ? vk::PipelineStageFlags2{} : usage.stage;
+            }
+            else {
+                updateState(state, usage, isWrite, needed);
+            }
+            if (!needed) {
+                return;
+            }
+
+            barrierCount++;
+            vk::ImageMemoryBarrier2 barrier{};
+            barrier.setSrcStageMask(srcStages);
+            barrier.setSrcAccessMask(srcAccess);
+            barrier.setDstStageMask(usage.stage);
+            barrier.setDstAccessMask(usage.access);
+            barrier.setOldLayout(oldLayout);
+            barrier.setNewLayout(usage.layout);
+            barrier.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+            barrier.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+            barrier.setImage(resource.imported ? resource.image : *physicalImages[resource.physical].image);
+            barrier.setSubresourceRange(resource.range);
+            batch.images.push_back(barrier);
+        }
+
+        static void updateState(ResourceState& state, const Usage& usage,
+            bool isWrite, bool barrierRecorded) {
+            if (isWrite) {
+                state.writeStages = usage.stage;
+                state.writeAccess = usage.access;
+                state.visibleStages = {};
+                state.visibleAccess = {};
+                state.readStages = {};
+                return;
+            }
+            if (barrierRecorded) {
+                state.visibleStages |= usage.stage;
+                state.visibleAccess |= usage.access;
+            }
+            state.readStages |= usage.stage;
+        }
+
+        void recordBarriers(vk::CommandBuffer commandBuffer, const Pass::BarrierBatch& batch) const {
+            if (batch.empty()) {
+                return;
+            }
+
+            if (synchronization2) {
+                vk::DependencyInfo dependencyInfo{};
+                if (batch.memory.srcStageMask || batch.memory.dstStageMask) {
+                    dependencyInfo.setMemoryBarriers(batch.memory);
+                }
+                dependencyInfo.setBufferMemoryBarriers(batch.buffers);
+                dependencyInfo.setImageMemoryBarriers(batch.images);
+                commandBuffer.pipelineBarrier2KHR(dependencyInfo);
+                return;
+            }
+
+            // Legacy barriers share one pair of stage masks
+            vk::PipelineStageFlags2 srcStages = batch.memory.srcStageMask;
+            vk::PipelineStageFlags2 dstStages = batch.memory.dstStageMask;
+            std::vector<vk::MemoryBarrier> memoryBarriers;
+            if (batch.memory.srcStageMask || batch.memory.dstStageMask) {
+                memoryBarriers.emplace_back(toLegacyAccess(batch.memory.srcAccessMask),
+                    toLegacyAccess(batch.memory.dstAccessMask));
+            }
+            std::vector<vk::BufferMemoryBarrier> bufferBarriers;
+            for (const auto& b : batch.buffers) {
+                srcStages |= b.srcStageMask;
+                dstStages |= b.dstStageMask;
+                bufferBarriers.emplace_back(toLegacyAccess(b.srcAccessMask), toLegacyAccess(b.dstAccessMask),
+                    b.srcQueueFamilyIndex, b.dstQueueFamilyIndex, b.buffer, b.offset, b.size);
+            }
+            std::vector<vk::ImageMemoryBarrier> imageBarriers;
+            for (const auto& b : batch.images) {
+                srcStages |= b.srcStageMask;
+                dstStages |= b.dstStageMask;
+                imageBarriers.emplace_back(toLegacyAccess(b.srcAccessMask), toLegacyAccess(b.dstAccessMask),
+                    b.oldLayout, b.newLayout, b.srcQueueFamilyIndex, b.dstQueueFamilyIndex,
+                    b.image, b.subresourceRange);
+            }
+            commandBuffer.pipelineBarrier(
+                toLegacyStages(srcStages, vk::PipelineStageFlagBits::eTopOfPipe),
+                toLegacyStages(dstStages, vk::PipelineStageFlagBits::eBottomOfPipe),
+                {}, memoryBarriers, bufferBarriers, imageBarriers);
+        }
+    };
+}  // namespace rendergraph
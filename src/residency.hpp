@@ -0,0 +1,453 @@
+#pragma once
+#include "resources.hpp"
+#include "meshpack.hpp"
+#include "lod.hpp"
+#include "instances.hpp"
+#include <chrono>
+
+struct ResidencyConfig {
+	// Share of the device local memory budget BLASes may occupy
+	float budgetFraction = 0.5f;
+	// Hard cap on resident BLAS memory, 0 leaves only the budget
+	vk::DeviceSize maxResidentBytes = 0;
+	// Meshes whose bounds are this close to the camera are always streamed in
+	float nearDistance = 10.0f;
+	// Meshes inside the view cone are streamed in up to this distance
+	float viewDistance = 100.0f;
+	float viewConeCosine = 0.5f;
+	// Builds are blocking, so limit how many happen per frame
+	uint32_t maxBuildsPerUpdate = 4;
+	// Screen space error budget of the LOD selection
+	lod::SelectionConfig lodSelection;
+	// LOD levels are reselected every this many updates, so LOD switches
+	// rebuild the TLAS at most this often
+	uint32_t lodUpdateInterval = 8;
+	// Flags of the BLAS builds, compaction is always allowed
+	vk::BuildAccelerationStructureFlagsKHR buildFlags =
+		vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+};
+
+// Streams meshes from a mapped mesh pack and keeps a BLAS per LOD level
+// resident while the mesh is near or in front of the camera and the level
+// is selected for it. Least recently used BLASes are evicted once the memory
+// budget is exceeded. A mesh whose selected level is not built yet shows
+// its nearest resident level, meshes with none are represented in the TLAS
+// by a box proxy scaled to their bounds.
+class ResidencyManager {
+public:
+	bool init(vk::PhysicalDevice physicalDevice, vk::Device device,
+		vk::CommandPool commandPool, vk::Queue queue,
+		const std::string& packPath, const ResidencyConfig& residencyConfig) {
+		this->physicalDevice = physicalDevice;
+		this->device = device;
+		this->commandPool = commandPool;
+		this->queue = queue;
+		config = residencyConfig;
+
+		if (!pack.open(packPath)) {
+			return false;
+		}
+		if (pack.meshCount() > instances::kMaxMeshes) {
+			// Mesh indices are instance custom indices, keep them out of the reserved range
+			std::cerr << "Mesh pack has " << pack.meshCount() << " meshes, at most "
+				<< instances::kMaxMeshes << " are supported\n";
+			return false;
+		}
+		memoryBudgetEnabled = vkutils::checkDeviceExtensionSupport(
+			physicalDevice, { VK_EXT_MEMORY_BUDGET_EXTENSION_NAME });
+		meshes.resize(pack.meshCount());
+		for (uint32_t mesh = 0; mesh < pack.meshCount(); mesh++) {
+			meshes[mesh].levels.resize(pack.entry(mesh).lodCount);
+		}
+		encoding = choosePositionEncoding(physicalDevice);
+		createProxyAccel();
+
+		std::cout << "Mesh pack: " << pack.meshCount() << " meshes, BLAS budget "
+			<< getBudget() / (1024 * 1024) << " MB\n";
+		return true;
+	}
+
+	// Stream BLASes in and out around the camera and select LOD levels.
+	// Returns true when the instances of the TLAS have changed.
+	bool update(std::array<float, 3> cameraPosition, std::array<float, 3> cameraDirection) {
+		frame++;
+		bool selectLevels = (frame - 1) % std::max(config.lodUpdateInterval, 1u) == 0;
+
+		// Meshes wanted this frame, nearest first
+		std::vector<std::pair<float, uint32_t>> wanted;
+		for (uint32_t mesh = 0; mesh < pack.meshCount(); mesh++) {
+			const meshpack::MeshEntry& entry = pack.entry(mesh);
+			float distance = distanceToBounds(entry, cameraPosition);
+			bool isNear = distance <= config.nearDistance;
+			bool isVisible = distance <= config.viewDistance &&
+				isInViewCone(entry, cameraPosition, cameraDirection);
+			if (isNear || isVisible) {
+				wanted.emplace_back(distance, mesh);
+			}
+		}
+		std::sort(wanted.begin(), wanted.end());
+
+		if (selectLevels) {
+			for (const auto& [distance, mesh] : wanted) {
+				MeshState& state = meshes[mesh];
+				state.selectedLevel = lod::selectLevel(pack.lodErrors(mesh), distance,
+					state.selectedLevel, config.lodSelection);
+			}
+		}
+
+		// Touch the levels in use first so they are not evicted for the new ones
+		for (const auto& [distance, mesh] : wanted) {
+			MeshState& state = meshes[mesh];
+			for (uint32_t level : { state.selectedLevel, state.shownLevel }) {
+				if (level < state.levels.size() && state.levels[level].resident) {
+					state.levels[level].lastUsed = frame;
+				}
+			}
+		}
+
+		bool changed = buildFlagsChanged;
+		buildFlagsChanged = false;
+		vk::DeviceSize budget = getBudget();
+		uint32_t builds = 0;
+		for (const auto& [distance, mesh] : wanted) {
+			MeshState& state = meshes[mesh];
+			const LevelState& level = state.levels[state.selectedLevel];
+			if (level.resident || level.invalid) {
+				continue;
+			}
+			if (builds >= config.maxBuildsPerUpdate) {
+				break;
+			}
+			if (residentBytes >= budget && !evictLeastRecentlyUsed()) {
+				break;
+			}
+			if (buildLevel(mesh, state.selectedLevel)) {
+				builds++;
+			}
+		}
+		// The instances of evicted levels are updated with the shown levels below
+		while (residentBytes > budget && evictLeastRecentlyUsed()) {
+		}
+
+		std::array<uint32_t, lod::kMaxLevels> shownCounts{};
+		for (MeshState& state : meshes) {
+			uint32_t shown = getShownLevel(state);
+			changed |= shown != state.shownLevel;
+			state.shownLevel = shown;
+			if (shown != kNoLevel) {
+				shownCounts[shown]++;
+			}
+		}
+
+		if (changed) {
+			std::cout << "Residency: " << residentCount << " levels of " << pack.meshCount()
+				<< " meshes, " << residentBytes / 1024 << " KB of "
+				<< budget / 1024 << " KB, meshes per LOD:";
+			for (uint32_t count : shownCounts) {
+				std::cout << " " << count;
+			}
+			std::cout << "\n";
+		}
+		return changed;
+	}
+
+	// Evicted BLASes may still be referenced by frames in flight,
+	// call this once the device is idle.
+	void releaseEvicted() {
+		evicted.clear();
+	}
+
+	// Hands the evicted BLASes over to be destroyed once the frames in
+	// flight that may use them retire
+	std::vector<AccelStruct> takeEvicted() {
+		return std::move(evicted);
+	}
+
+	std::vector<vk::AccelerationStructureInstanceKHR> getInstances() const {
+		std::vector<vk::AccelerationStructureInstanceKHR> instances(meshes.size());
+		for (uint32_t mesh = 0; mesh < meshes.size(); mesh++) {
+			const MeshState& state = meshes[mesh];
+			vk::AccelerationStructureInstanceKHR& instance = instances[mesh];
+			// Below instances::kMaxMeshes, checked in create
+			instance.setInstanceCustomIndex(mesh);
+			instance.setMask(0xFF);
+			instance.setInstanceShaderBindingTableRecordOffset(0);
+			instance.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+			if (state.shownLevel != kNoLevel) {
+				const LevelState& level = state.levels[state.shownLevel];
+				instance.setTransform(level.transform);
+				instance.setAccelerationStructureReference(level.blas.buffer.address);
+			}
+			else {
+				instance.setTransform(getProxyTransform(pack.entry(mesh)));
+				instance.setAccelerationStructureReference(proxyAccel.buffer.address);
+			}
+		}
+		return instances;
+	}
+
+	// Evicts every level, they are streamed in again with the new flags
+	// by the following updates
+	void setBuildFlags(vk::BuildAccelerationStructureFlagsKHR buildFlags) {
+		config.buildFlags = buildFlags;
+		for (auto& state : meshes) {
+			for (auto& level : state.levels) {
+				if (level.resident) {
+					residentBytes -= level.blas.size;
+					residentCount--;
+					level.resident = false;
+					evicted.push_back(std::move(level.blas));
+					level.blas = AccelStruct{};
+				}
+			}
+		}
+		buildFlagsChanged = true;
+	}
+
+	uint32_t getResidentCount() const { return residentCount; }
+	vk::DeviceSize getResidentBytes() const { return residentBytes; }
+	// Time spent in BLAS builds and compactions since init
+	double getBuildMs() const { return buildMs; }
+
+private:
+	static constexpr uint32_t kNoLevel = ~0u;
+
+	struct LevelState {
+		AccelStruct blas;
+		vk::TransformMatrixKHR transform{};
+		bool resident = false;
+		uint64_t lastUsed = 0;
+		// Indices checked on the first build, an invalid level is never built
+		bool checked = false;
+		bool invalid = false;
+	};
+
+	struct MeshState {
+		std::vector<LevelState> levels;
+		uint32_t selectedLevel = 0;
+		// Level in the TLAS, kNoLevel for the proxy
+		uint32_t shownLevel = kNoLevel;
+	};
+
+	vk::PhysicalDevice physicalDevice;
+	vk::Device device;
+	vk::CommandPool commandPool;
+	vk::Queue queue;
+	ResidencyConfig config;
+	bool memoryBudgetEnabled = false;
+
+	meshpack::Pack pack;
+	geometry::PositionEncoding encoding = geometry::PositionEncoding::eFloat32;
+	std::vector<MeshState> meshes;
+	std::vector<AccelStruct> evicted;
+	AccelStruct proxyAccel;
+
+	uint64_t frame = 0;
+	uint32_t residentCount = 0;
+	vk::DeviceSize residentBytes = 0;
+	double buildMs = 0.0;
+	// The next update must report changed instances even if the shown
+	// levels stay the same, their BLASes were replaced
+	bool buildFlagsChanged = false;
+
+	vk::DeviceSize getBudget() const {
+		// The reported budget already accounts for our own BLASes
+		vk::DeviceSize available = vkutils::getDeviceLocalBudget(physicalDevice, memoryBudgetEnabled);
+		vk::DeviceSize budget = static_cast<vk::DeviceSize>(
+			static_cast<double>(available + residentBytes) * config.budgetFraction);
+		if (config.maxResidentBytes > 0) {
+			budget = std::min(budget, config.maxResidentBytes);
+		}
+		return budget;
+	}
+
+	static float distanceToBounds(const meshpack::MeshEntry& entry, std::array<float, 3> point) {
+		float squaredDistance = 0.0f;
+		for (uint32_t c = 0; c < 3; c++) {
+			float d = std::max({ entry.boundsMin[c] - point[c], 0.0f, point[c] - entry.boundsMax[c] });
+			squaredDistance += d * d;
+		}
+		return std::sqrt(squaredDistance);
+	}
+
+	bool isInViewCone(const meshpack::MeshEntry& entry,
+		std::array<float, 3> position, std::array<float, 3> direction) const {
+		float toCenter[3];
+		float length = 0.0f;
+		float radius = 0.0f;
+		for (uint32_t c = 0; c < 3; c++) {
+			toCenter[c] = (entry.boundsMin[c] + entry.boundsMax[c]) * 0.5f - position[c];
+			length += toCenter[c] * toCenter[c];
+			float halfExtent = (entry.boundsMax[c] - entry.boundsMin[c]) * 0.5f;
+			radius += halfExtent * halfExtent;
+		}
+		length = std::sqrt(length);
+		radius = std::sqrt(radius);
+		if (length <= radius) {
+			return true;
+		}
+		float cosine = (toCenter[0] * direction[0] + toCenter[1] * direction[1] +
+			toCenter[2] * direction[2]) / length;
+		// Widen the cone by the angular radius of the bounding sphere
+		float sine = radius / length;
+		float coneSine = std::sqrt(std::max(0.0f, 1.0f - config.viewConeCosine * config.viewConeCosine));
+		float widened = config.viewConeCosine * std::sqrt(1.0f - sine * sine) - coneSine * sine;
+		return cosine >= widened;
+	}
+
+	static vk::TransformMatrixKHR getProxyTransform(const meshpack::MeshEntry& entry) {
+		float scale[3];
+		float offset[3];
+		for (uint32_t c = 0; c < 3; c++) {
+			offset[c] = (entry.boundsMin[c] + entry.boundsMax[c]) * 0.5f;
+			scale[c] = std::max((entry.boundsMax[c] - entry.boundsMin[c]) * 0.5f, 1e-6f);
+		}
+		return std::array{
+			std::array{scale[0], 0.0f, 0.0f, offset[0]},
+			std::array{0.0f, scale[1], 0.0f, offset[1]},
+			std::array{0.0f, 0.0f, scale[2], offset[2]},
+		};
+	}
+
+	// The selected level if it is resident, otherwise the nearest resident
+	// one, the finer of two at the same distance
+	static uint32_t getShownLevel(const MeshState& state) {
+		uint32_t levelCount = static_cast<uint32_t>(state.levels.size());
+		for (uint32_t offset = 0; offset < levelCount; offset++) {
+			if (state.selectedLevel >= offset && state.levels[state.selectedLevel - offset].resident) {
+				return state.selectedLevel - offset;
+			}
+			if (state.selectedLevel + offset < levelCount && state.levels[state.selectedLevel + offset].resident) {
+				return state.selectedLevel + offset;
+			}
+		}
+		return kNoLevel;
+	}
+
+	bool evictLeastRecentlyUsed() {
+		// Levels used by the current frame are never evicted
+		LevelState* victim = nullptr;
+		for (auto& state : meshes) {
+			for (auto& level : state.levels) {
+				if (level.resident && level.lastUsed < frame &&
+					(!victim || level.lastUsed < victim->lastUsed)) {
+					victim = &level;
+				}
+			}
+		}
+		if (!victim) {
+			return false;
+		}
+		residentBytes -= victim->blas.size;
+		residentCount--;
+		victim->resident = false;
+		evicted.push_back(std::move(victim->blas));
+		victim->blas = AccelStruct{};
+		return true;
+	}
+
+	bool buildLevel(uint32_t mesh, uint32_t level) {
+		LevelState& state = meshes[mesh].levels[level];
+		if (!state.checked) {
+			state.checked = true;
+			state.invalid = !pack.checkIndices(mesh, level);
+			if (state.invalid) {
+				std::cerr << "Mesh pack: mesh " << mesh << " level " << level
+					<< " has out of range indices, keeping it out of the TLAS\n";
+			}
+		}
+		if (state.invalid) {
+			return false;
+		}
+		geometry::CompressedMesh compressed = geometry::compressMesh(
+			pack.positions(mesh), pack.indices(mesh, level), encoding);
+
+		vk::BufferUsageFlags bufferUsage{
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress
+		};
+		vk::MemoryPropertyFlags memoryProperty{
+			vk::MemoryPropertyFlagBits::eHostVisible |
+			vk::MemoryPropertyFlagBits::eHostCoherent };
+
+		Buffer vertexBuffer;
+		Buffer indexBuffer;
+		vertexBuffer.init(physicalDevice, device, compressed.positions.size(),
+			bufferUsage, memoryProperty, compressed.positions.data());
+		indexBuffer.init(physicalDevice, device, compressed.indices.size(),
+			bufferUsage, memoryProperty, compressed.indices.data());
+
+		vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+		triangles.setVertexFormat(getVertexFormat(encoding));
+		triangles.setVertexData(vertexBuffer.address);
+		triangles.setVertexStride(compressed.positionStride);
+		triangles.setMaxVertex(compressed.vertexCount);
+		triangles.setIndexType(compressed.use16BitIndices ? vk::IndexType::eUint16 : vk::IndexType::eUint32);
+		triangles.setIndexData(indexBuffer.address);
+
+		vk::AccelerationStructureGeometryKHR geometry{};
+		geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+		geometry.setGeometry({ triangles });
+		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+		auto start = std::chrono::steady_clock::now();
+		state.blas.init(physicalDevice, device, commandPool, queue,
+			vk::AccelerationStructureTypeKHR::eBottomLevel,
+			geometry, compressed.indexCount / 3,
+			config.buildFlags | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction);
+		state.blas.compact(physicalDevice, device, commandPool, queue);
+		buildMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		state.transform = getDecodeTransform(compressed.decodeScale.data(), compressed.decodeOffset.data());
+		state.resident = true;
+		state.lastUsed = frame;
+
+		residentBytes += state.blas.size;
+		residentCount++;
+		return true;
+	}
+
+	void createProxyAccel() {
+		// Unit cube, scaled to the bounds of each evicted mesh
+		std::vector<Vertex> vertices;
+		for (uint32_t i = 0; i < 8; i++) {
+			vertices.push_back({ { i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f } });
+		}
+		std::vector<uint32_t> indices = {
+			0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,
+			0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,
+			0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5,
+		};
+
+		vk::BufferUsageFlags bufferUsage{
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress
+		};
+		vk::MemoryPropertyFlags memoryProperty{
+			vk::MemoryPropertyFlagBits::eHostVisible |
+			vk::MemoryPropertyFlagBits::eHostCoherent };
+
+		Buffer vertexBuffer;
+		Buffer indexBuffer;
+		vertexBuffer.init(physicalDevice, device, vertices.size() * sizeof(Vertex),
+			bufferUsage, memoryProperty, vertices.data());
+		indexBuffer.init(physicalDevice, device, indices.size() * sizeof(uint32_t),
+			bufferUsage, memoryProperty, indices.data());
+
+		vk::AccelerationStructureGeometryTrianglesDataKHR triangles{};
+		triangles.setVertexFormat(vk::Format::eR32G32B32Sfloat);
+		triangles.setVertexData(vertexBuffer.address);
+		triangles.setVertexStride(sizeof(Vertex));
+		triangles.setMaxVertex(static_cast<uint32_t>(vertices.size()));
+		triangles.setIndexType(vk::IndexType::eUint32);
+		triangles.setIndexData(indexBuffer.address);
+
+		vk::AccelerationStructureGeometryKHR geometry{};
+		geometry.setGeometryType(vk::GeometryTypeKHR::eTriangles);
+		geometry.setGeometry({ triangles });
+		geometry.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+
+		proxyAccel.init(physicalDevice, device, commandPool, queue,
+			vk::AccelerationStructureTypeKHR::eBottomLevel,
+			geometry, static_cast<uint32_t>(indices.size() / 3));
+	}
+};
@@ -0,0 +1,421 @@
+#pragma once
+#include "vkutils.hpp"
+#include "geometry.hpp"
+
+struct Buffer {
+	vk::UniqueBuffer buffer;
+	vk::UniqueDeviceMemory memory;
+	vk::DeviceAddress address;
+
+	void init(vk::PhysicalDevice physicalDevice,
+		vk::Device device,
+		vk::DeviceSize size,
+		vk::BufferUsageFlags usage,
+		vk::MemoryPropertyFlags memoryProperty,
+		const void* data = nullptr) {
+		// create buffer
+		vk::BufferCreateInfo createInfo{};
+		createInfo.setSize(size);
+		createInfo.setUsage(usage);
+		buffer = device.createBufferUnique(createInfo);
+
+		//Allocate memory
+		vk::MemoryAllocateFlagsInfo allocateFlags{};
+		if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
+			allocateFlags.flags = vk::MemoryAllocateFlagBits::eDeviceAddress;
+		}
+
+		vk::MemoryRequirements memoryReq = 
+			device.getBufferMemoryRequirements(*buffer);
+		uint32_t memoryType = vkutils::getMemoryType(physicalDevice,
+			memoryReq, memoryProperty);
+		vk::MemoryAllocateInfo allocateInfo{};
+		allocateInfo.setAllocationSize(memoryReq.size);
+		allocateInfo.setMemoryTypeIndex(memoryType);
+		allocateInfo.setPNext(&allocateFlags);
+		memory = device.allocateMemoryUnique(allocateInfo);
+
+		device.bindBufferMemory(*buffer, *memory, 0);
+
+		if (data) {
+			void* mappedPtr = device.mapMemory(*memory, 0, size);
+			memcpy(mappedPtr, data, size);
+			device.unmapMemory(*memory);
+		}
+
+		if (usage & vk::BufferUsageFlagBits::eShaderDeviceAddress) {
+			vk::BufferDeviceAddressInfo addressInfo{};
+			addressInfo.setBuffer(*buffer);
+			address = device.getBufferAddressKHR(&addressInfo);
+		}
+	}
+};
+
+struct Image {
+	vk::UniqueImage image;
+	vk::UniqueDeviceMemory memory;
+	vk::UniqueImageView view;
+	vk::Format format = vk::Format::eUndefined;
+	vk::Extent2D extent;
+	uint32_t layers = 1;
+
+	// An e2DArray view type gives shaders an image2DArray of all layers
+	void init(vk::PhysicalDevice physicalDevice,
+		vk::Device device,
+		vk::Extent2D extent,
+		vk::Format format,
+		vk::ImageUsageFlags usage,
+		uint32_t layers = 1,
+		vk::ImageViewType viewType = vk::ImageViewType::e2D) {
+		this->format = format;
+		this->extent = extent;
+		this->layers = layers;
+
+		vk::ImageCreateInfo createInfo{};
+		createInfo.setImageType(vk::ImageType::e2D);
+		createInfo.setFormat(format);
+		createInfo.setExtent({ extent.width, extent.height, 1 });
+		createInfo.setMipLevels(1);
+		createInfo.setArrayLayers(layers);
+		createInfo.setSamples(vk::SampleCountFlagBits::e1);
+		createInfo.setTiling(vk::ImageTiling::eOptimal);
+		createInfo.setUsage(usage);
+		createInfo.setInitialLayout(vk::ImageLayout::eUndefined);
+		image = device.createImageUnique(createInfo);
+
+		vk::MemoryRequirements memoryReq = device.getImageMemoryRequirements(*image);
+		vk::MemoryAllocateInfo allocateInfo{};
+		allocateInfo.setAllocationSize(memoryReq.size);
+		allocateInfo.setMemoryTypeIndex(vkutils::getMemoryType(physicalDevice,
+			memoryReq, vk::MemoryPropertyFlagBits::eDeviceLocal));
+		memory = device.allocateMemoryUnique(allocateInfo);
+		device.bindImageMemory(*image, *memory, 0);
+
+		vk::ImageViewCreateInfo viewInfo{};
+		viewInfo.setImage(*image);
+		viewInfo.setViewType(viewType);
+		viewInfo.setFormat(format);
+		viewInfo.setSubresourceRange({ vk::ImageAspectFlagBits::eColor, 0, 1, 0, layers });
+		view = device.createImageViewUnique(viewInfo);
+	}
+};
+
+struct Vertex {
+	float pose[3];
+};
+
+// Instance transform that dequantizes the compressed positions of a BLAS
+inline vk::TransformMatrixKHR getDecodeTransform(const float decodeScale[3], const float decodeOffset[3]) {
+	return std::array{
+		std::array{decodeScale[0], 0.0f, 0.0f, decodeOffset[0]},
+		std::array{0.0f, decodeScale[1], 0.0f, decodeOffset[1]},
+		std::array{0.0f, 0.0f, decodeScale[2], decodeOffset[2]},
+	};
+}
+
+inline vk::Format getVertexFormat(geometry::PositionEncoding encoding) {
+	switch (encoding) {
+	case geometry::PositionEncoding::eFloat16: return vk::Format::eR16G16B16A16Sfloat;
+	case geometry::PositionEncoding::eSnorm16: return vk::Format::eR16G16B16A16Snorm;
+	default:                                   return vk::Format::eR32G32B32Sfloat;
+	}
+}
+
+inline geometry::PositionEncoding choosePositionEncoding(vk::PhysicalDevice physicalDevice) {
+	// Prefer the format with the best precision per bit, snorm16 spends all bits on the mesh bounds
+	if (vkutils::isAccelerationStructureVertexFormatSupported(physicalDevice, vk::Format::eR16G16B16A16Snorm)) {
+		return geometry::PositionEncoding::eSnorm16;
+	}
+	if (vkutils::isAccelerationStructureVertexFormatSupported(physicalDevice, vk::Format::eR16G16B16A16Sfloat)) {
+		return geometry::PositionEncoding::eFloat16;
+	}
+	return geometry::PositionEncoding::eFloat32;
+}
+
+struct AccelStruct {
+	vk::UniqueAccelerationStructureKHR accel;
+	Buffer buffer;
+	vk::AccelerationStructureTypeKHR type{};
+	vk::BuildAccelerationStructureFlagsKHR flags{};
+	vk::DeviceSize size = 0;
+	// Kept by init for structures built with eAllowUpdate, sized for both
+	// modes, or when asked to keep it for later rebuilds
+	Buffer scratchBuffer;
+
+	void init(vk::PhysicalDevice physicalDevice, vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue,
+		vk::AccelerationStructureTypeKHR type,
+		vk::AccelerationStructureGeometryKHR geometry,
+		uint32_t primitiveCount,
+		vk::BuildAccelerationStructureFlagsKHR flags =
+		vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace,
+		bool keepScratch = false) {
+		init(physicalDevice, device, commandPool, queue, type,
+			std::span(&geometry, 1), std::span(&primitiveCount, 1), flags, keepScratch);
+	}
+
+	// Several geometries in one structure. A hit takes the SBT record of its
+	// geometry index, see the record stride of traceRayEXT in the raygen shaders.
+	void init(vk::PhysicalDevice physicalDevice, vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue,
+		vk::AccelerationStructureTypeKHR type,
+		std::span<const vk::AccelerationStructureGeometryKHR> geometries,
+		std::span<const uint32_t> primitiveCounts,
+		vk::BuildAccelerationStructureFlagsKHR flags =
+		vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace,
+		bool keepScratch = false) {
+		
+		this->type = type;
+		this->flags = flags;
+
+		vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
+		buildInfo.setType(type);
+		buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+		buildInfo.setFlags(flags);
+		buildInfo.setGeometryCount(static_cast<uint32_t>(geometries.size()));
+		buildInfo.setPGeometries(geometries.data());
+
+		vk::AccelerationStructureBuildSizesInfoKHR buildSizes =
+			device.getAccelerationStructureBuildSizesKHR(
+				vk::AccelerationStructureBuildTypeKHR::eDevice, buildInfo,
+				vk::ArrayProxy<const uint32_t>(static_cast<uint32_t>(primitiveCounts.size()), primitiveCounts.data()));
+
+		buffer.init(physicalDevice, device,
+			buildSizes.accelerationStructureSize,
+			vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+		vk::AccelerationStructureCreateInfoKHR createInfo{};
+		createInfo.setBuffer(*buffer.buffer);
+		createInfo.setSize(buildSizes.accelerationStructureSize);
+		createInfo.setType(type);
+		accel = device.createAccelerationStructureKHRUnique(createInfo);
+		size = buildSizes.accelerationStructureSize;
+
+		bool updatable = static_cast<bool>(flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate);
+		scratchBuffer.init(physicalDevice, device,
+			updatable ? std::max(buildSizes.buildScratchSize, buildSizes.updateScratchSize) : buildSizes.buildScratchSize,
+			vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+		vkutils::oneTimeSubmit(
+			device, commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				record(commandBuffer, geometries, primitiveCounts, false);
+			});
+		if (!updatable && !keepScratch) {
+			scratchBuffer = Buffer{};
+		}
+
+		vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
+		addressInfo.setAccelerationStructure(*accel);
+		buffer.address = device.getAccelerationStructureAddressKHR(addressInfo);
+	}
+
+	// Records a rebuild, or an update in place from the geometry's current
+	// data. Outside of init the structure must have eAllowUpdate or a kept
+	// scratch buffer, a rebuild must not need more space than init. The address
+	// does not change, so instances referencing it stay valid.
+	void record(vk::CommandBuffer commandBuffer,
+		vk::AccelerationStructureGeometryKHR geometry,
+		uint32_t primitiveCount, bool update) const {
+		record(commandBuffer, std::span(&geometry, 1), std::span(&primitiveCount, 1), update);
+	}
+
+	void record(vk::CommandBuffer commandBuffer,
+		std::span<const vk::AccelerationStructureGeometryKHR> geometries,
+		std::span<const uint32_t> primitiveCounts, bool update) const {
+		vk::AccelerationStructureBuildGeometryInfoKHR buildInfo{};
+		buildInfo.setType(type);
+		buildInfo.setFlags(flags);
+		buildInfo.setGeometryCount(static_cast<uint32_t>(geometries.size()));
+		buildInfo.setPGeometries(geometries.data());
+		if (update) {
+			buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eUpdate);
+			buildInfo.setSrcAccelerationStructure(*accel);
+		}
+		else {
+			buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+		}
+		buildInfo.setDstAccelerationStructure(*accel);
+		buildInfo.setScratchData(scratchBuffer.address);
+
+		std::vector<vk::AccelerationStructureBuildRangeInfoKHR> buildRangeInfos(primitiveCounts.size());
+		for (size_t i = 0; i < primitiveCounts.size(); i++) {
+			buildRangeInfos[i].setPrimitiveCount(primitiveCounts[i]);
+			buildRangeInfos[i].setPrimitiveOffset(0);
+			buildRangeInfos[i].setFirstVertex(0);
+			buildRangeInfos[i].setTransformOffset(0);
+		}
+		commandBuffer.buildAccelerationStructuresKHR(buildInfo, buildRangeInfos.data());
+	}
+
+	// Compacted or serialization size of the built structure
+	vk::DeviceSize queryProperty(vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue,
+		vk::QueryType queryType) const {
+		vk::QueryPoolCreateInfo queryPoolInfo{};
+		queryPoolInfo.setQueryType(queryType);
+		queryPoolInfo.setQueryCount(1);
+		vk::UniqueQueryPool queryPool = device.createQueryPoolUnique(queryPoolInfo);
+
+		vkutils::oneTimeSubmit(
+			device, commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				// Make the previous build visible to the query
+				vk::MemoryBarrier barrier{};
+				barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+				barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR);
+				commandBuffer.pipelineBarrier(
+					vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+					vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+					{}, barrier, {}, {});
+				commandBuffer.resetQueryPool(*queryPool, 0, 1);
+				commandBuffer.writeAccelerationStructuresPropertiesKHR(
+					*accel, queryType, *queryPool, 0);
+			});
+
+		vk::DeviceSize value = 0;
+		vk::Result result = device.getQueryPoolResults(*queryPool, 0, 1,
+			sizeof(value), &value, sizeof(value),
+			vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWait);
+		return result == vk::Result::eSuccess ? value : 0;
+	}
+
+	// Replace the structure with a compacted copy.
+	// It must have been built with eAllowCompaction.
+	void compact(vk::PhysicalDevice physicalDevice, vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue) {
+		vk::DeviceSize compactedSize = queryProperty(device, commandPool, queue,
+			vk::QueryType::eAccelerationStructureCompactedSizeKHR);
+		if (compactedSize == 0 || compactedSize >= size) {
+			return;
+		}
+
+		Buffer compactedBuffer;
+		compactedBuffer.init(physicalDevice, device, compactedSize,
+			vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+		vk::AccelerationStructureCreateInfoKHR createInfo{};
+		createInfo.setBuffer(*compactedBuffer.buffer);
+		createInfo.setSize(compactedSize);
+		createInfo.setType(type);
+		vk::UniqueAccelerationStructureKHR compactedAccel =
+			device.createAccelerationStructureKHRUnique(createInfo);
+
+		vkutils::oneTimeSubmit(
+			device, commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				vk::CopyAccelerationStructureInfoKHR copyInfo{};
+				copyInfo.setSrc(*accel);
+				copyInfo.setDst(*compactedAccel);
+				copyInfo.setMode(vk::CopyAccelerationStructureModeKHR::eCompact);
+				commandBuffer.copyAccelerationStructureKHR(copyInfo);
+			});
+
+		accel = std::move(compactedAccel);
+		buffer = std::move(compactedBuffer);
+		size = compactedSize;
+
+		vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
+		addressInfo.setAccelerationStructure(*accel);
+		buffer.address = device.getAccelerationStructureAddressKHR(addressInfo);
+	}
+
+	// Device specific serialized copy, see deserialize()
+	std::vector<uint8_t> serialize(vk::PhysicalDevice physicalDevice, vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue) const {
+		vk::DeviceSize serializedSize = queryProperty(device, commandPool, queue,
+			vk::QueryType::eAccelerationStructureSerializationSizeKHR);
+		if (serializedSize == 0) {
+			return {};
+		}
+
+		Buffer serializedBuffer;
+		serializedBuffer.init(physicalDevice, device, serializedSize,
+			vk::BufferUsageFlagBits::eTransferDst |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eHostVisible |
+			vk::MemoryPropertyFlagBits::eHostCoherent);
+
+		vkutils::oneTimeSubmit(
+			device, commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				vk::CopyAccelerationStructureToMemoryInfoKHR copyInfo{};
+				copyInfo.setSrc(*accel);
+				copyInfo.setDst(vk::DeviceOrHostAddressKHR{ serializedBuffer.address });
+				copyInfo.setMode(vk::CopyAccelerationStructureModeKHR::eSerialize);
+				commandBuffer.copyAccelerationStructureToMemoryKHR(copyInfo);
+
+				vk::MemoryBarrier barrier{};
+				barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite |
+					vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+				barrier.setDstAccessMask(vk::AccessFlagBits::eHostRead);
+				commandBuffer.pipelineBarrier(
+					vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+					vk::PipelineStageFlagBits::eHost,
+					{}, barrier, {}, {});
+			});
+
+		std::vector<uint8_t> data(serializedSize);
+		void* mappedPtr = device.mapMemory(*serializedBuffer.memory, 0, serializedSize);
+		memcpy(data.data(), mappedPtr, serializedSize);
+		device.unmapMemory(*serializedBuffer.memory);
+		return data;
+	}
+
+	// Recreate the structure from serialize() output.
+	// The data must have passed vkutils::isAccelerationStructureCompatible.
+	bool deserialize(vk::PhysicalDevice physicalDevice, vk::Device device,
+		VkCommandPool commandPool, vk::Queue queue,
+		vk::AccelerationStructureTypeKHR type,
+		std::span<const uint8_t> data) {
+		// Header: driver UUID, compatibility UUID, serialized size, deserialized size
+		constexpr size_t deserializedSizeOffset = 2 * VK_UUID_SIZE + sizeof(uint64_t);
+		if (data.size() < deserializedSizeOffset + sizeof(uint64_t)) {
+			return false;
+		}
+		uint64_t deserializedSize = 0;
+		memcpy(&deserializedSize, data.data() + deserializedSizeOffset, sizeof(deserializedSize));
+
+		this->type = type;
+
+		Buffer serializedBuffer;
+		serializedBuffer.init(physicalDevice, device, data.size(),
+			vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eHostVisible |
+			vk::MemoryPropertyFlagBits::eHostCoherent,
+			data.data());
+
+		buffer.init(physicalDevice, device, deserializedSize,
+			vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+			vk::BufferUsageFlagBits::eShaderDeviceAddress,
+			vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+		vk::AccelerationStructureCreateInfoKHR createInfo{};
+		createInfo.setBuffer(*buffer.buffer);
+		createInfo.setSize(deserializedSize);
+		createInfo.setType(type);
+		accel = device.createAccelerationStructureKHRUnique(createInfo);
+		size = deserializedSize;
+
+		vkutils::oneTimeSubmit(
+			device, commandPool, queue,
+			[&](vk::CommandBuffer commandBuffer) {
+				vk::CopyMemoryToAccelerationStructureInfoKHR copyInfo{};
+				copyInfo.setSrc(vk::DeviceOrHostAddressConstKHR{ serializedBuffer.address });
+				copyInfo.setDst(*accel);
+				copyInfo.setMode(vk::CopyAccelerationStructureModeKHR::eDeserialize);
+				commandBuffer.copyMemoryToAccelerationStructureKHR(copyInfo);
+			});
+
+		vk::AccelerationStructureDeviceAddressInfoKHR addressInfo{};
+		addressInfo.setAccelerationStructure(*accel);
+		buffer.address = device.getAccelerationStructureAddressKHR(addressInfo);
+		return true;
+	}
+};
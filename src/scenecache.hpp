@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "meshpack.hpp"
+
+// Binary scene cache:
+//   Header | MeshRecord[meshCount] | blobs
+// Blobs are aligned for direct upload from the mapping. The serialized BLAS
+// blob is only valid on the device recorded in the header, otherwise the
+// positions blob is used to rebuild.
+namespace scenecache {
+    constexpr uint32_t cacheMagic = 0x48434353u;  // "SCCH"
+    constexpr uint32_t cacheVersion = 1;
+    constexpr uint64_t blobAlignment = 256;
+    constexpr size_t uuidSize = 16;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t meshCount;
+        uint32_t reserved;
+        uint8_t deviceUUID[uuidSize];
+        uint8_t driverUUID[uuidSize];
+    };
+
+    struct MeshRecord {
+        uint32_t positionEncoding;  // geometry::PositionEncoding
+        uint32_t positionStride;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t use16BitIndices;
+        uint32_t buildFlags;  // VkBuildAccelerationStructureFlagsKHR of the serialized BLAS
+        float decodeScale[3];
+        float decodeOffset[3];
+        uint64_t positionOffset;
+        uint64_t positionSize;
+        uint64_t indexOffset;
+        uint64_t indexSize;
+        uint64_t normalOffset;
+        uint64_t normalSize;
+        uint64_t accelOffset;
+        uint64_t accelSize;  // 0 when no serialized BLAS is stored
+    };
+
+    // Mesh data either backed by the cache mapping or by a CompressedMesh
+    struct MeshView {
+        MeshRecord record{};
+        std::span<const uint8_t> positions;
+        std::span<const uint8_t> indices;
+        std::span<const uint8_t> normals;
+        std::span<const uint8_t> accel;
+    };
+
+    inline MeshView makeView(const geometry::CompressedMesh& mesh) {
+        MeshView view{};
+        view.record.positionEncoding = static_cast<uint32_t>(mesh.positionEncoding);
+        view.record.positionStride = mesh.positionStride;
+        view.record.vertexCount = mesh.vertexCount;
+        view.record.indexCount = mesh.indexCount;
+        view.record.use16BitIndices = mesh.use16BitIndices ? 1 : 0;
+        std::memcpy(view.record.decodeScale, mesh.decodeScale.data(), sizeof(view.record.decodeScale));
+        std::memcpy(view.record.decodeOffset, mesh.decodeOffset.data(), sizeof(view.record.decodeOffset));
+        view.positions = mesh.positions;
+        view.indices = mesh.indices;
+        view.normals = { reinterpret_cast<const uint8_t*>(mesh.normals.data()),
+                         mesh.normals.size() * sizeof(uint32_t) };
+        return view;
+    }
+
+    // Float positions and 32 bit indices of a mesh, to compress it again in
+    // an encoding the device can build from
+    inline void decodeMesh(const MeshView& view, std::vector<float>& positions, std::vector<uint32_t>& indices) {
+        geometry::CompressedMesh mesh{};
+        mesh.positionEncoding = static_cast<geometry::PositionEncoding>(view.record.positionEncoding);
+        mesh.positions.assign(view.positions.begin(), view.positions.end());
+        mesh.positionStride = view.record.positionStride;
+        std::memcpy(mesh.decodeScale.data(), view.record.decodeScale, sizeof(view.record.decodeScale));
+        std::memcpy(mesh.decodeOffset.data(), view.record.decodeOffset, sizeof(view.record.decodeOffset));
+        positions.resize(static_cast<size_t>(view.record.vertexCount) * 3);
+        for (uint32_t v = 0; v < view.record.vertexCount; v++) {
+            auto p = mesh.decodePosition(v);
+            std::copy(p.begin(), p.end(), positions.begin() + static_cast<size_t>(v) * 3);
+        }
+
+        indices.resize(view.record.indexCount);
+        for (uint32_t i = 0; i < view.record.indexCount; i++) {
+            if (view.record.use16BitIndices) {
+                uint16_t index;
+                std::memcpy(&index, view.indices.data() + i * sizeof(uint16_t), sizeof(uint16_t));
+                indices[i] = index;
+            }
+            else {
+                std::memcpy(&indices[i], view.indices.data() + i * sizeof(uint32_t), sizeof(uint32_t));
+            }
+        }
+    }
+
+    class Cache {
+    public:
+        bool open(const std::string& path) {
+            if (!file.open(path)) {
+                return false;
+            }
+            if (file.size() < sizeof(Header)) {
+                return invalidate(path);
+            }
+            header = reinterpret_cast<const Header*>(file.data());
+            if (header->magic != cacheMagic || header->version != cacheVersion ||
+                sizeof(Header) + header->meshCount * sizeof(MeshRecord) > file.size()) {
+                return invalidate(path);
+            }
+            records = { reinterpret_cast<const MeshRecord*>(file.data() + sizeof(Header)),
+                        header->meshCount };
+            for (uint32_t mesh = 0; mesh < records.size(); mesh++) {
+                if (!checkRecord(records[mesh]) || !checkIndices(mesh)) {
+                    return invalidate(path);
+                }
+            }
+            return true;
+        }
+
+        void close() {
+            file.close();
+            header = nullptr;
+            records = {};
+        }
+
+        bool matchesDevice(const uint8_t* deviceUUID, const uint8_t* driverUUID) const {
+            return std::memcmp(header->deviceUUID, deviceUUID, uuidSize) == 0 &&
+                std::memcmp(header->driverUUID, driverUUID, uuidSize) == 0;
+        }
+
+        uint32_t meshCount() const { return static_cast<uint32_t>(records.size()); }
+
+        MeshView mesh(uint32_t index) const {
+            const MeshRecord& record = records[index];
+            MeshView view{};
+            view.record = record;
+            view.positions = blob(record.positionOffset, record.positionSize);
+            view.indices = blob(record.indexOffset, record.indexSize);
+            view.normals = blob(record.normalOffset, record.normalSize);
+            view.accel = blob(record.accelOffset, record.accelSize);
+            return view;
+        }
+
+    private:
+        meshpack::MappedFile file;
+        const Header* header = nullptr;
+        std::span<const MeshRecord> records;
+
+        std::span<const uint8_t> blob(uint64_t offset, uint64_t size) const {
+            if (size == 0) {
+                return {};
+            }
+            return { file.data() + offset, static_cast<size_t>(size) };
+        }
+
+        // Empty blobs at the end are placed past the last written byte
+        bool fits(uint64_t offset, uint64_t size) const {
+            return size == 0 || (offset <= file.size() && size <= file.size() - offset);
+        }
+
+        // Blobs inside the file and large enough for the counts of the record
+        bool checkRecord(const MeshRecord& record) const {
+            if (!fits(record.positionOffset, record.positionSize) || !fits(record.indexOffset, record.indexSize) ||
+                !fits(record.normalOffset, record.normalSize) || !fits(record.accelOffset, record.accelSize)) {
+                return false;
+            }
+            uint32_t minStride = 0;
+            switch (record.positionEncoding) {
+            case static_cast<uint32_t>(geometry::PositionEncoding::eFloat32): minStride = 3 * sizeof(float); break;
+            case static_cast<uint32_t>(geometry::PositionEncoding::eFloat16): minStride = 4 * sizeof(uint16_t); break;
+            case static_cast<uint32_t>(geometry::PositionEncoding::eSnorm16): minStride = 4 * sizeof(int16_t); break;
+            default: return false;
+            }
+            uint64_t indexStride = record.use16BitIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+            uint64_t normalSize = static_cast<uint64_t>(record.vertexCount) * sizeof(uint32_t);
+            return record.positionStride >= minStride && record.indexCount % 3 == 0 &&
+                record.positionSize >= static_cast<uint64_t>(record.vertexCount) * record.positionStride &&
+                record.indexSize >= record.indexCount * indexStride &&
+                (record.normalSize == 0 || record.normalSize >= normalSize);
+        }
+
+        // Every index names a vertex of the mesh, checkRecord first
+        bool checkIndices(uint32_t mesh) const {
+            const MeshRecord& record = records[mesh];
+            const uint8_t* data = file.data() + record.indexOffset;
+            for (uint32_t i = 0; i < record.indexCount; i++) {
+                uint32_t index;
+                if (record.use16BitIndices) {
+                    uint16_t index16;
+                    std::memcpy(&index16, data + i * sizeof(uint16_t), sizeof(uint16_t));
+                    index = index16;
+                }
+                else {
+                    std::memcpy(&index, data + i * sizeof(uint32_t), sizeof(uint32_t));
+                }
+                if (index >= record.vertexCount) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool invalidate(const std::string& path) {
+            std::cerr << "Ignoring invalid scene cache: " << path << "\n";
+            close();
+            return false;
+        }
+    };
+
+    inline uint64_t alignBlob(uint64_t offset) {
+        return (offset + blobAlignment - 1) & ~(blobAlignment - 1);
+    }
+
+    inline bool writeCache(const std::string& path,
+        const uint8_t* deviceUUID, const uint8_t* driverUUID,
+        const std::vector<MeshView>& meshes) {
+        std::ofstream out(path, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "Failed to create scene cache: " << path << "\n";
+            return false;
+        }
+
+        Header header{ cacheMagic, cacheVersion, static_cast<uint32_t>(meshes.size()), 0, {}, {} };
+        std::memcpy(header.deviceUUID, deviceUUID, uuidSize);
+        std::memcpy(header.driverUUID, driverUUID, uuidSize);
+
+        std::vector<MeshRecord> records(meshes.size());
+        uint64_t offset = alignBlob(sizeof(Header) + records.size() * sizeof(MeshRecord));
+        auto place = [&](std::span<const uint8_t> data, uint64_t& blobOffset, uint64_t& blobSize) {
+            blobOffset = offset;
+            blobSize = data.size();
+            offset = alignBlob(offset + data.size());
+        };
+        for (size_t i = 0; i < meshes.size(); i++) {
+            records[i] = meshes[i].record;
+            place(meshes[i].positions, records[i].positionOffset, records[i].positionSize);
+            place(meshes[i].indices, records[i].indexOffset, records[i].indexSize);
+            place(meshes[i].normals, records[i].normalOffset, records[i].normalSize);
+            place(meshes[i].accel, records[i].accelOffset, records[i].accelSize);
+        }
+
+        auto writeAt = [&](uint64_t position, const void* data, size_t size) {
+            out.seekp(static_cast<std::streamoff>(position));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(sizeof(Header), records.data(), records.size() * sizeof(MeshRecord));
+        for (size_t i = 0; i < meshes.size(); i++) {
+            writeAt(records[i].positionOffset, meshes[i].positions.data(), meshes[i].positions.size());
+            writeAt(records[i].indexOffset, meshes[i].indices.data(), meshes[i].indices.size());
+            writeAt(records[i].normalOffset, meshes[i].normals.data(), meshes[i].normals.size());
+            writeAt(records[i].accelOffset, meshes[i].accel.data(), meshes[i].accel.size());
+        }
+        return out.good();
+    }
+}  // namespace scenecache
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Hot shader reload. A background thread watches the GLSL sources,
+// recompiles the changed stages with glslc and passes the rebuilt SPIR-V
+// names to a callback on the same thread, which builds the new pipelines.
+// Swapping them in is up to the application.
+namespace shaderreload {
+    namespace fs = std::filesystem;
+
+    inline bool isShaderSource(const fs::path& path) {
+        static const std::set<std::string> extensions = {
+            ".rgen", ".rmiss", ".rchit", ".rahit", ".rint", ".comp", ".glsl",
+        };
+        return extensions.count(path.extension().string()) > 0;
+    }
+
+    // Include files are not compiled on their own
+    inline bool isInclude(const fs::path& path) {
+        return path.extension() == ".glsl";
+    }
+
+    // Watches a directory for written shader sources. Uses inotify on Linux
+    // and compares modification times elsewhere.
+    class Watcher {
+    public:
+        Watcher() = default;
+        Watcher(const Watcher&) = delete;
+        Watcher& operator=(const Watcher&) = delete;
+
+        ~Watcher() {
+#ifdef __linux__
+            if (fd >= 0) {
+                close(fd);
+            }
+#endif
+        }
+
+        bool init(const fs::path& watchDirectory) {
+            directory = watchDirectory;
+            if (!fs::is_directory(directory)) {
+                return false;
+            }
+#ifdef __linux__
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            // Editors often save by renaming a temporary file over the source
+            return fd >= 0 &&
+                inotify_add_watch(fd, directory.string().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0;
+#else
+            scan(writeTimes);
+            return true;
+#endif
+        }
+
+        // Waits up to timeout for changes, returns the changed file names
+        std::set<std::string> wait(std::chrono::milliseconds timeout) {
+            std::set<std::string> changed;
+#ifdef __linux__
+            pollfd pollFd{ fd, POLLIN, 0 };
+            if (poll(&pollFd, 1, static_cast<int>(timeout.count())) <= 0) {
+                return changed;
+            }
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + length;) {
+                    auto* event = reinterpret_cast<inotify_event*>(p);
+                    if (event->len > 0 && isShaderSource(event->name)) {
+                        changed.insert(event->name);
+                    }
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+#else
+            std::this_thread::sleep_for(timeout);
+            std::map<std::string, fs::file_time_type> current;
+            scan(current);
+            for (const auto& [name, time] : current) {
+                auto it = writeTimes.find(name);
+                if (it == writeTimes.end() || it->second != time) {
+                    changed.insert(name);
+                }
+            }
+            writeTimes = std::move(current);
+#endif
+            return changed;
+        }
+
+    private:
+        fs::path directory;
+#ifdef __linux__
+        int fd = -1;
+#else
+        std::map<std::string, fs::file_time_type> writeTimes;
+
+        void scan(std::map<std::string, fs::file_time_type>& times) {
+            std::error_code error;
+            for (const auto& entry : fs::directory_iterator(directory, error)) {
+                if (entry.is_regular_file(error) && isShaderSource(entry.path())) {
+                    times[entry.path().filename().string()] = entry.last_write_time(error);
+                }
+            }
+        }
+#endif
+    };
+
+    inline bool includes(const fs::path& source, const std::string& name) {
+        std::ifstream file(source);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.find("#include") != std::string::npos &&
+                line.find("\"" + name + "\"") != std::string::npos) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Stages to recompile for the changed files: the changed stages and
+    // every stage that includes a changed file, directly or not.
+    inline std::set<std::string> getAffectedStages(const fs::path& directory,
+        const std::set<std::string>& changed) {
+        std::set<std::string> affected = changed;
+        bool grown = true;
+        while (grown) {
+            grown = false;
+            std::error_code error;
+            for (const auto& entry : fs::directory_iterator(directory, error)) {
+                std::string name = entry.path().filename().string();
+                if (!isShaderSource(entry.path()) || affected.count(name)) {
+                    continue;
+                }
+                for (const auto& include : affected) {
+                    if (isInclude(include) && includes(entry.path(), include)) {
+                        affected.insert(name);
+                        grown = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        std::set<std::string> stages;
+        for (const auto& name : affected) {
+            if (!isInclude(name)) {
+                stages.insert(name);
+            }
+        }
+        return stages;
+    }
+
+    // Where compile leaves the SPIR-V of output until publish
+    inline fs::path getTemporaryPath(const fs::path& output) {
+        fs::path temporary = output;
+        temporary += ".tmp";
+        return temporary;
+    }
+
+    // Compiles source next to output, the file at output stays as it is
+    // until publish. glslc prints its errors itself.
+    inline bool compile(const std::string& compiler, const fs::path& source, const fs::path& output) {
+        fs::path temporary = getTemporaryPath(output);
+        std::string command = "\"" + compiler + "\" -c \"" + source.string() + "\" -o \"" +
+            temporary.string() + "\" --target-env=vulkan1.2";
+#ifdef _WIN32
+        // cmd.exe strips the outer quotes of the whole command
+        command = "\"" + command + "\"";
+#endif
+        return std::system(command.c_str()) == 0;
+    }
+
+    // Renames the compiled SPIR-V to output, so a reader never sees a
+    // partial file
+    inline bool publish(const fs::path& output) {
+        std::error_code error;
+        fs::rename(getTemporaryPath(output), output, error);
+        return !error;
+    }
+
+    inline void discard(const fs::path& output) {
+        std::error_code error;
+        fs::remove(getTemporaryPath(output), error);
+    }
+
+    class Reloader {
+    public:
+        // Receives the names of the rebuilt .spv files
+        using RebuildFunction = std::function<void(const std::set<std::string>&)>;
+
+        Reloader() = default;
+        Reloader(const Reloader&) = delete;
+        Reloader& operator=(const Reloader&) = delete;
+
+        ~Reloader() {
+            stop();
+        }
+
+        bool start(const fs::path& sourceDirectory, const fs::path& outputDirectory,
+            const std::string& compilerPath, RebuildFunction rebuildFunction) {
+            if (!watcher.init(sourceDirectory)) {
+                std::cerr << "Cannot watch shader directory " << sourceDirectory << "\n";
+                return false;
+            }
+            sourceDir = sourceDirectory;
+            outputDir = outputDirectory;
+            compiler = compilerPath;
+            rebuild = std::move(rebuildFunction);
+            running = true;
+            thread = std::thread([this]() { run(); });
+            std::cout << "Watching shaders in " << sourceDir << "\n";
+            return true;
+        }
+
+        void stop() {
+            running = false;
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+
+    private:
+        Watcher watcher;
+        fs::path sourceDir;
+        fs::path outputDir;
+        std::string compiler;
+        RebuildFunction rebuild;
+        std::atomic<bool> running{ false };
+        std::thread thread;
+
+        void run() {
+            while (running) {
+                std::set<std::string> changed = watcher.wait(std::chrono::milliseconds(200));
+                if (changed.empty()) {
+                    continue;
+                }
+                // Saving often touches several files, collect them all
+                for (auto more = watcher.wait(std::chrono::milliseconds(100)); !more.empty();
+                    more = watcher.wait(std::chrono::milliseconds(100))) {
+                    changed.insert(more.begin(), more.end());
+                }
+
+                // A change is taken as a whole: stages built from a shared
+                // include must not mix old and new code
+                std::set<std::string> stages = getAffectedStages(sourceDir, changed);
+                bool failed = false;
+                for (const auto& stage : stages) {
+                    std::cout << "Recompiling " << stage << "\n";
+                    if (!compile(compiler, sourceDir / stage, outputDir / (stage + ".spv"))) {
+                        failed = true;
+                    }
+                }
+                if (failed) {
+                    for (const auto& stage : stages) {
+                        discard(outputDir / (stage + ".spv"));
+                    }
+                    std::cerr << "Shader compilation failed, keeping the previous pipelines\n";
+                    continue;
+                }
+
+                std::set<std::string> rebuilt;
+                for (const auto& stage : stages) {
+                    if (!publish(outputDir / (stage + ".spv"))) {
+                        std::cerr << "Cannot replace " << (outputDir / (stage + ".spv")) << "\n";
+                        continue;
+                    }
+                    rebuilt.insert(stage + ".spv");
+                }
+                if (!rebuilt.empty()) {
+                    rebuild(rebuilt);
+                }
+            }
+        }
+    };
+}  // namespace shaderreload
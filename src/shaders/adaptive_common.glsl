@@ -0,0 +1,50 @@
+// Progressive accumulation of adaptive sampling, shared by adaptive.rgen and
+// adaptive_compact.comp. Include after trace_common.glsl.
+
+// Running sums of the paths of one pixel since the view last changed
+struct PixelStats {
+    vec3 sum;           // radiance
+    uint count;         // paths
+    float sumSquares;   // luminance squared
+    float padding[3];
+};
+layout(binding = 15) buffer Accumulation { PixelStats pixelStats[]; };
+
+// The pixels still to trace, appended by adaptive_compact.comp. The first
+// three words are the VkTraceRaysIndirectCommandKHR of adaptive.rgen.
+layout(binding = 16) buffer AdaptivePixels {
+    uint traceWidth;    // pixels in the list
+    uint traceHeight;
+    uint traceDepth;
+    uint padding;
+    uint adaptivePixels[];
+};
+
+// Traced and converged pixels per frame in flight, indexed like the ray
+// counts, and the summed relative error of all pixels in units of
+// 1/kErrorScale while every pixel is listed
+layout(binding = 17) buffer AdaptiveStats { uvec4 adaptiveCounts[]; };
+const float kErrorScale = 256.0;
+
+// A pixel is tested only after this many paths, fewer give no usable variance
+const uint kMinSamples = 4u;
+// Paths per pixel and frame, however few pixels are left
+const uint kMaxSamplesPerFrame = 16u;
+// Dark pixels are compared against this luminance instead of their mean
+const float kMinLuminance = 0.05;
+
+float getLuminance(vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Standard error of the mean luminance relative to the mean
+float getRelativeError(PixelStats stats) {
+    float n = float(stats.count);
+    float mean = getLuminance(stats.sum) / n;
+    float variance = max(stats.sumSquares / n - mean * mean, 0.0) * n / max(n - 1.0, 1.0);
+    return sqrt(variance / n) / max(mean, kMinLuminance);
+}
+
+bool isConverged(PixelStats stats) {
+    return stats.count >= kMinSamples && getRelativeError(stats) <= frameData.adaptiveThreshold;
+}
@@ -0,0 +1,29 @@
+// Alpha test of the mixed triangles of alpha-tested geometry, shared by
+// alphatest.rahit and trace_query.comp. Include after trace_common.glsl.
+// Fully opaque and fully transparent triangles never get here, see
+// foliage::classify.
+
+// 8 bit alpha, four texels per word
+layout(binding = 11) readonly buffer AlphaMask {
+    uint maskSize;
+    uint maskTexels[];
+};
+// Corner UVs of the mixed triangles, three per primitive
+layout(binding = 12) readonly buffer AlphaUVs { vec2 alphaUVs[]; };
+// Alpha tests per frame in flight, indexed like the ray counts
+layout(binding = 13) buffer AnyHitStats { uint anyHitCounts[]; };
+
+const float kAlphaCutoff = 0.5;  // foliage::kAlphaCutoff
+
+bool alphaTest(int primitiveID, vec2 attribs) {
+    atomicAdd(anyHitCounts[params.statsSlot], 1u);
+
+    vec3 baryCoords = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+    uint base = 3u * uint(primitiveID);
+    vec2 uv = baryCoords.x * alphaUVs[base] + baryCoords.y * alphaUVs[base + 1u] + baryCoords.z * alphaUVs[base + 2u];
+    // Nearest texel with wrapping, like foliage::AlphaMask::sample
+    uvec2 texel = min(uvec2(fract(uv) * float(maskSize)), uvec2(maskSize - 1u));
+    uint index = texel.y * maskSize + texel.x;
+    float alpha = float((maskTexels[index / 4u] >> (8u * (index % 4u))) & 0xFFu) / 255.0;
+    return alpha >= kAlphaCutoff;
+}
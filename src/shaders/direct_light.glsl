@@ -0,0 +1,31 @@
+// Next event estimation of the ray generation shaders: one light sample at
+// every surface hit, counted if its shadow ray reaches the light. Include
+// after declaring topLevelAS and the payload.
+
+// The shadow ray skips closest-hit shaders, so only a miss overwrites the
+// negative distance. Any-hit and intersection shaders still run and keep
+// alpha-tested and procedural geometry in the shadows.
+vec3 getDirectLight(HitInfo hit, vec3 origin, vec3 direction, inout uint rngState, inout uint rayCount) {
+    if (!needsLightSample(hit)) {
+        return vec3(0.0);
+    }
+    vec3 position = origin + direction * hit.distance;
+    LightSample light = sampleLight(position, faceforward(hit.normal, direction, hit.normal), rngState);
+    if (light.distance <= 0.0) {
+        return vec3(0.0);
+    }
+    payload.distance = -1.0;
+    traceRayEXT(
+        topLevelAS,
+        getTraceRayFlags() | gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT,
+        0xff,
+        0, 1, 0,
+        position,
+        0.001,
+        light.direction,
+        light.distance,
+        0
+    );
+    rayCount++;
+    return payload.distance == 0.0 ? hit.color * light.contribution : vec3(0.0);
+}
@@ -0,0 +1,51 @@
+// Shading of a triangle hit, shared by closesthit.rchit and trace_query.comp.
+// Include after trace_common.glsl.
+
+// Compressed shading data of the mesh, see geometry::CompressedMesh
+layout(binding = 4) readonly buffer Indices { uint indices[]; };
+layout(binding = 5) readonly buffer Normals { uint normals[]; };
+
+uint getIndex(uint i) {
+    if ((frameData.flags & 2u) != 0u) {
+        uint packed = indices[i / 2u];
+        return (i & 1u) == 0u ? (packed & 0xFFFFu) : (packed >> 16);
+    }
+    return indices[i];
+}
+
+// Inverse of geometry::encodeOctahedral
+vec3 decodeOctahedral(uint packed) {
+    vec2 e = unpackSnorm2x16(packed);
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+        n.xy = (1.0 - abs(n.yx)) * s;
+    }
+    return normalize(n);
+}
+
+// instanceIndex is the instance custom index, see instances.glsl: only the
+// static mesh has its normals bound. Other instances, such as deformable
+// meshes or mesh pack meshes, have none and face the ray. Hits of
+// emitters (kLightInstance) return the light, shadePath looks up its
+// emission.
+HitInfo getHitInfo(vec2 attribs, int primitiveID, int instanceIndex, float hitT, vec3 rayDirection) {
+    vec3 baryCoords = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+    HitInfo info;
+    info.color = baryCoords;
+    info.distance = hitT;
+    info.light = instanceIndex == kLightInstance ? uint(primitiveID) : kNoLight;
+
+    if ((frameData.flags & 1u) != 0u && instanceIndex == kStaticMeshInstance) {
+        // Normals are stored in world space, the instance only dequantizes positions
+        uint base = 3u * uint(primitiveID);
+        info.normal = normalize(
+            baryCoords.x * decodeOctahedral(normals[getIndex(base)]) +
+            baryCoords.y * decodeOctahedral(normals[getIndex(base + 1u)]) +
+            baryCoords.z * decodeOctahedral(normals[getIndex(base + 2u)]));
+    }
+    else {
+        info.normal = -rayDirection;
+    }
+    return info;
+}
@@ -0,0 +1,11 @@
+// Instance custom indices of the fixed instances, mirrors instances.hpp.
+// Mesh pack instances take their mesh index, always below kReservedInstance.
+// Included by trace_common.glsl.
+
+const int kReservedInstance = 0xFFFF00;
+const int kStaticMeshInstance = kReservedInstance + 0;
+const int kDeformableInstance = kReservedInstance + 1;
+const int kFoliageInstance = kReservedInstance + 2;
+const int kProceduralInstance = kReservedInstance + 3;
+const int kLightInstance = kReservedInstance + 4;
+const int kCadInstance = kReservedInstance + 5;
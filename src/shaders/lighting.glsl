@@ -0,0 +1,214 @@
+// Light sampling for next event estimation, built by lights.hpp. Included by
+// trace_common.glsl; only the ray generation shaders, trace_query.comp and
+// the hits of emitters read these buffers.
+
+const float kPi = 3.14159265;
+const uint kLightLeaf = 0x80000000u;
+// Length of shadow rays towards the environment
+const float kEnvironmentDistance = 10000.0;
+
+// Equirectangular radiance map with its alias table, see
+// lights::buildEnvironmentTexels
+struct EnvironmentTexel {
+    vec3 radiance;
+    float probability;  // of keeping the texel, the alias gets the rest
+    uint alias;
+    float pdf;          // weight relative to the mean weight
+    uint padding[2];
+};
+layout(binding = 18) readonly buffer Environment {
+    uint environmentWidth;  // 0 without an environment
+    uint environmentHeight;
+    uint environmentPadding[2];
+    EnvironmentTexel environmentTexels[];
+};
+
+// Light BVH in depth-first order, see lights::Node
+struct LightNode {
+    vec3 boundsMin;
+    uint child;         // right child, or kLightLeaf and the light index
+    vec3 boundsMax;
+    float power;
+};
+layout(binding = 19) readonly buffer LightTree {
+    uint lightCount;    // 0 without emissive triangles
+    uint lightTreePadding[3];
+    LightNode lightNodes[];
+};
+
+// Emissive triangles in world space, emitting on both sides
+struct LightTriangle {
+    vec4 p0;            // w: area
+    vec4 p1;
+    vec4 p2;
+    vec4 emission;      // w: power
+};
+layout(binding = 20) readonly buffer LightTriangles { LightTriangle lightTriangles[]; };
+
+// A sampled light: the radiance a white diffuse surface reflects towards the
+// viewer from it, divided by the sample's pdf, and the shadow ray that must
+// reach it. distance is 0 when there is nothing to trace.
+struct LightSample {
+    vec3 direction;
+    float distance;
+    vec3 contribution;
+};
+
+// Flag 16: emitters and the environment light the scene
+bool isLit() {
+    return (frameData.flags & 16u) != 0u;
+}
+
+// Emitters and misses end lit paths, only surface hits sample lights
+bool needsLightSample(HitInfo hit) {
+    return isLit() && kDebugView == kDebugViewOff && kShadingModel == kShadingPath &&
+           hit.distance > 0.0 && hit.light == kNoLight;
+}
+
+vec3 getLightEmission(uint light) {
+    return lightTriangles[light].emission.rgb;
+}
+
+vec3 getEnvironmentDirection(vec2 uv) {
+    float phi = 2.0 * kPi * uv.x;
+    float theta = kPi * uv.y;
+    return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+vec3 getEnvironment(vec3 direction) {
+    if (environmentWidth == 0u) {
+        return vec3(0.0);
+    }
+    float u = atan(direction.z, direction.x) / (2.0 * kPi);
+    float v = acos(clamp(direction.y, -1.0, 1.0)) / kPi;
+    uint x = min(uint(fract(u) * float(environmentWidth)), environmentWidth - 1u);
+    uint y = min(uint(v * float(environmentHeight)), environmentHeight - 1u);
+    return environmentTexels[y * environmentWidth + x].radiance;
+}
+
+LightSample noLightSample() {
+    LightSample light;
+    light.direction = vec3(0.0);
+    light.distance = 0.0;
+    light.contribution = vec3(0.0);
+    return light;
+}
+
+// O(1): a uniform texel, kept or swapped for its alias, then a uniform point
+// in it. The solid angle pdf divides the texel pdf by the area of the map
+// on the sphere, 2 pi^2 sin(theta).
+LightSample sampleEnvironment(vec3 normal, float selection, inout uint rngState) {
+    uint count = environmentWidth * environmentHeight;
+    uint index = min(uint(random(rngState) * float(count)), count - 1u);
+    if (random(rngState) >= environmentTexels[index].probability) {
+        index = environmentTexels[index].alias;
+    }
+    EnvironmentTexel texel = environmentTexels[index];
+    vec2 uv = (vec2(index % environmentWidth, index / environmentWidth) + vec2(random(rngState), random(rngState))) /
+              vec2(environmentWidth, environmentHeight);
+
+    LightSample light = noLightSample();
+    vec3 direction = getEnvironmentDirection(uv);
+    float cosine = dot(normal, direction);
+    float pdf = selection * texel.pdf / (2.0 * kPi * kPi * max(sin(kPi * uv.y), 1e-6));
+    if (cosine > 0.0 && pdf > 0.0) {
+        light.direction = direction;
+        light.distance = kEnvironmentDistance;
+        light.contribution = texel.radiance * cosine / (kPi * pdf);
+    }
+    return light;
+}
+
+// Estimated contribution of a subtree: its power over the squared distance,
+// clamped to its own size when the point is close. A box entirely below the
+// surface cannot light it and is never picked.
+float getNodeImportance(LightNode node, vec3 position, vec3 normal) {
+    vec3 farthest = mix(node.boundsMin, node.boundsMax, step(0.0, normal));
+    if (dot(farthest - position, normal) <= 0.0) {
+        return 0.0;
+    }
+    vec3 offset = 0.5 * (node.boundsMin + node.boundsMax) - position;
+    vec3 extent = node.boundsMax - node.boundsMin;
+    return node.power / max(dot(offset, offset), 0.25 * dot(extent, extent));
+}
+
+// Stochastic descent of the light BVH: every step picks a child in
+// proportion to its importance. Returns the light, selection is its
+// probability and 0 if no light faces the point.
+uint sampleLightTree(vec3 position, vec3 normal, out float selection, inout uint rngState) {
+    uint node = 0u;
+    selection = 1.0;
+    while ((lightNodes[node].child & kLightLeaf) == 0u) {
+        uint left = node + 1u;
+        uint right = lightNodes[node].child;
+        float leftImportance = getNodeImportance(lightNodes[left], position, normal);
+        float rightImportance = getNodeImportance(lightNodes[right], position, normal);
+        float total = leftImportance + rightImportance;
+        if (total <= 0.0) {
+            selection = 0.0;
+            return 0u;
+        }
+        float leftProbability = leftImportance / total;
+        if (random(rngState) < leftProbability) {
+            node = left;
+            selection *= leftProbability;
+        }
+        else {
+            node = right;
+            selection *= 1.0 - leftProbability;
+        }
+    }
+    return lightNodes[node].child & ~kLightLeaf;
+}
+
+// A uniform point on the triangle, converted to a solid angle pdf
+LightSample sampleTriangle(uint index, vec3 position, vec3 normal, float selection, inout uint rngState) {
+    LightTriangle triangle = lightTriangles[index];
+    float r = sqrt(random(rngState));
+    float s = random(rngState);
+    vec3 point = (1.0 - r) * triangle.p0.xyz + r * (1.0 - s) * triangle.p1.xyz + r * s * triangle.p2.xyz;
+
+    LightSample light = noLightSample();
+    vec3 offset = point - position;
+    float distanceSquared = dot(offset, offset);
+    float lightDistance = sqrt(distanceSquared);
+    vec3 direction = offset / lightDistance;
+    vec3 lightNormal = normalize(cross(triangle.p1.xyz - triangle.p0.xyz, triangle.p2.xyz - triangle.p0.xyz));
+    float cosine = dot(normal, direction);
+    float lightCosine = abs(dot(lightNormal, direction));
+    float pdf = selection * distanceSquared / max(lightCosine * triangle.p0.w, 1e-12);
+    if (cosine > 0.0 && lightCosine > 0.0 && selection > 0.0) {
+        light.direction = direction;
+        // Stop short of the emitter itself
+        light.distance = lightDistance * 0.999;
+        light.contribution = triangle.emission.rgb * cosine / (kPi * pdf);
+    }
+    return light;
+}
+
+// One light sample for a surface point with the normal facing the viewer.
+// The environment and the emitters split the samples evenly when both
+// exist. Emitters come from the light BVH, or uniformly with flag 32 as the
+// reference for the noise comparison.
+LightSample sampleLight(vec3 position, vec3 normal, inout uint rngState) {
+    bool environment = environmentWidth != 0u;
+    bool triangles = lightCount != 0u;
+    float environmentSelection = environment ? (triangles ? 0.5 : 1.0) : 0.0;
+    if (random(rngState) < environmentSelection) {
+        return sampleEnvironment(normal, environmentSelection, rngState);
+    }
+    if (!triangles) {
+        return noLightSample();
+    }
+
+    uint index;
+    float selection;
+    if ((frameData.flags & 32u) != 0u) {
+        index = min(uint(random(rngState) * float(lightCount)), lightCount - 1u);
+        selection = 1.0 / float(lightCount);
+    }
+    else {
+        index = sampleLightTree(position, normal, selection, rngState);
+    }
+    return sampleTriangle(index, position, normal, selection * (1.0 - environmentSelection), rngState);
+}
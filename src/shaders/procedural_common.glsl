@@ -0,0 +1,65 @@
+// Analytic spheres and capsules of procedural.hpp, shared by
+// procedural.rint, procedural.rchit and trace_query.comp. Include after
+// trace_common.glsl.
+
+// Two vec4 per primitive: a and radius, then b. A sphere has a == b.
+layout(binding = 14) readonly buffer Primitives { vec4 primitives[]; };
+
+// Entry distance of an object space ray into the capsule, negative on a
+// miss. direction need not be normalized, the distance is in its units.
+float intersectPrimitive(int primitiveID, vec3 origin, vec3 direction) {
+    vec4 first = primitives[2 * primitiveID];
+    vec3 pa = first.xyz;
+    vec3 pb = primitives[2 * primitiveID + 1].xyz;
+    float radius = first.w;
+
+    float scale = length(direction);
+    vec3 rd = direction / scale;
+    vec3 ba = pb - pa;
+    vec3 oa = origin - pa;
+    float baba = dot(ba, ba);
+    float bard = dot(ba, rd);
+    float baoa = dot(ba, oa);
+
+    // Cylinder body, skipped for spheres
+    if (baba > 0.0) {
+        float a = baba - bard * bard;
+        float b = baba * dot(rd, oa) - baoa * bard;
+        float c = baba * dot(oa, oa) - baoa * baoa - radius * radius * baba;
+        float h = b * b - a * c;
+        if (h < 0.0) {
+            return -1.0;
+        }
+        float t = (-b - sqrt(h)) / a;
+        float y = baoa + t * bard;
+        if (y > 0.0 && y < baba) {
+            return t / scale;
+        }
+        // Otherwise the cap on the side the body was entered
+        oa = y <= 0.0 ? oa : origin - pb;
+    }
+    float b = dot(rd, oa);
+    float c = dot(oa, oa) - radius * radius;
+    float h = b * b - c;
+    if (h < 0.0) {
+        return -1.0;
+    }
+    return (-b - sqrt(h)) / scale;
+}
+
+HitInfo getProceduralHitInfo(int primitiveID, vec3 origin, vec3 direction, float hitT, mat4x3 objectToWorld) {
+    vec3 pa = primitives[2 * primitiveID].xyz;
+    vec3 pb = primitives[2 * primitiveID + 1].xyz;
+    vec3 ba = pb - pa;
+    vec3 position = origin + direction * hitT;
+    float baba = dot(ba, ba);
+    float h = baba > 0.0 ? clamp(dot(position - pa, ba) / baba, 0.0, 1.0) : 0.0;
+
+    HitInfo info;
+    info.color = mix(vec3(0.9, 0.6, 0.3), vec3(0.3, 0.6, 0.9), h);
+    info.distance = hitT;
+    info.light = kNoLight;
+    // Instances place particles without scaling
+    info.normal = normalize(mat3(objectToWorld) * (position - (pa + h * ba)));
+    return info;
+}
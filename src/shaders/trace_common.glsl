@@ -0,0 +1,180 @@
+// Shared by all ray tracing and ray query shaders. Every backend must trace
+// the same rays so their throughput can be compared.
+
+const uint kNoLight = 0xffffffffu;
+
+struct HitInfo {
+    vec3 color;      // albedo, or the emission of a light
+    float distance;  // 0 on miss
+    vec3 normal;
+    uint light;      // emissive triangle that was hit, kNoLight otherwise
+};
+
+// Queued ray of the wavefront mode, 48 bytes
+struct Ray {
+    vec3 origin;
+    uint pixel;
+    vec3 direction;
+    uint key;        // sort key, see getSortKey
+    vec3 throughput;
+    uint rngState;
+};
+
+// Per-dispatch data
+layout(push_constant) uniform TraceParams {
+    uint bounce;     // wavefront mode: bounce traced by this dispatch
+    uint statsSlot;
+    uint viewOffset;  // multiview mode: view of launch depth 0
+    uint sampleIndex; // multiview mode: samples accumulated before this dispatch
+} params;
+
+// Per-frame data, a ring buffer slot per frame in flight selected by the
+// dynamic offset of the descriptor set binding
+layout(binding = 10) uniform FrameUniforms {
+    mat4 viewInverse;
+    mat4 projectionInverse;
+    mat4 previousViewProjection;
+    vec4 cameraPosition;
+    uint frame;
+    uint maxBounces;
+    uint flags;
+    float adaptiveThreshold;  // relative error of a converged pixel, see adaptive_common.glsl
+} frameData;
+
+// Trace variant, fixed per pipeline so the loops below can be unrolled and
+// unused features removed. Mirrors g_TraceVariantConstants in main.cpp.
+// Ids 0 and 1 are the workgroup size of trace_query.comp.
+const uint kRuntimeBounces = 0xffffffffu;
+const uint kShadingPath = 0u;       // diffuse path tracing
+const uint kShadingHeadlight = 1u;  // light from the camera, no bounces
+const uint kDebugViewOff = 0u;
+const uint kDebugViewNormals = 1u;
+const uint kDebugViewDistance = 2u;
+
+layout(constant_id = 10) const uint kMaxBounces = 0xffffffffu;  // kRuntimeBounces: use frameData.maxBounces
+layout(constant_id = 11) const uint kShadingModel = 0u;
+layout(constant_id = 12) const uint kDebugView = 0u;
+
+uint getMaxBounces() {
+    return kMaxBounces == kRuntimeBounces ? frameData.maxBounces : kMaxBounces;
+}
+
+// Rays are forced opaque unless the scene has alpha-tested geometry (flag
+// 4). Even then opaque geometry skips any-hit by its own geometry flag.
+uint getTraceRayFlags() {
+    return (frameData.flags & 4u) != 0u ? gl_RayFlagsNoneEXT : gl_RayFlagsOpaqueEXT;
+}
+
+// Color of rays that leave the scene
+HitInfo getMissInfo() {
+    HitInfo info;
+    info.color = vec3(0.0, 0.5, 0.2);
+    info.distance = 0.0;
+    info.normal = vec3(0.0);
+    info.light = kNoLight;
+    return info;
+}
+
+// World space ray direction for a screen position, uv.y points down
+vec3 getRayDirection(vec2 uv, mat4 viewInverse, mat4 projectionInverse) {
+    vec4 target = projectionInverse * vec4(uv.x * 2.0 - 1.0, 1.0 - uv.y * 2.0, 1.0, 1.0);
+    return (viewInverse * vec4(target.xyz / target.w, 0.0)).xyz;
+}
+
+vec3 getRayDirection(vec2 uv) {
+    return getRayDirection(uv, frameData.viewInverse, frameData.projectionInverse);
+}
+
+// Screen-space offset of a hit point to where the previous camera saw it
+vec2 getMotion(vec2 uv, vec3 hitPoint) {
+    vec4 clip = frameData.previousViewProjection * vec4(hitPoint, 1.0);
+    vec2 previousUV = vec2(clip.x, -clip.y) / clip.w * 0.5 + 0.5;
+    return previousUV - uv;
+}
+
+uint hash(uint x) {
+    // PCG output permutation
+    uint state = x * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+uint initRandom(uint pixel, uint frame) {
+    return hash(pixel ^ hash(frame));
+}
+
+float random(inout uint state) {
+    state = state * 1664525u + 1013904223u;
+    return float(hash(state) >> 8) / 16777216.0;
+}
+
+vec3 sampleCosine(vec3 n, inout uint state) {
+    float phi = 6.2831853 * random(state);
+    float r = sqrt(random(state));
+    vec3 t = normalize(abs(n.x) > 0.5 ? cross(n, vec3(0.0, 1.0, 0.0)) : cross(n, vec3(1.0, 0.0, 0.0)));
+    vec3 b = cross(n, t);
+    return normalize(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(max(0.0, 1.0 - r * r)));
+}
+
+// Direction octant in the top 3 of 12 bits, then a 9 bit Morton code of the
+// origin in a cube around the camera. Rays with equal keys start close
+// together and head the same way.
+const float kSortRadius = 16.0;
+
+uint getSortKey(vec3 origin, vec3 direction) {
+    uint octant = (direction.x < 0.0 ? 1u : 0u) | (direction.y < 0.0 ? 2u : 0u) | (direction.z < 0.0 ? 4u : 0u);
+    vec3 cell = clamp((origin - frameData.cameraPosition.xyz) / (2.0 * kSortRadius) + 0.5, 0.0, 0.999) * 8.0;
+    uvec3 c = uvec3(cell);
+    uint morton = 0u;
+    for (uint bit = 0u; bit < 3u; bit++) {
+        morton |= ((c.x >> bit) & 1u) << (3u * bit + 2u);
+        morton |= ((c.y >> bit) & 1u) << (3u * bit + 1u);
+        morton |= ((c.z >> bit) & 1u) << (3u * bit);
+    }
+    return (octant << 9) | morton;
+}
+
+#include "instances.glsl"
+#include "lighting.glsl"
+
+// Adds the hit to the path and picks the next ray. Returns false when the
+// path ends: on a miss, or at the last bounce where the hit color is used
+// unlit as before bounces existed. Lit scenes (flag 16) add light samples
+// at every surface hit before this, so only the emitters and the
+// environment seen by camera rays are added here and the last bounce adds
+// nothing.
+bool shadePath(HitInfo hit, uint bounce, inout vec3 radiance, inout vec3 throughput,
+               inout vec3 origin, inout vec3 direction, inout uint rngState) {
+    if (kDebugView == kDebugViewNormals) {
+        radiance = hit.normal * 0.5 + 0.5;
+        return false;
+    }
+    if (kDebugView == kDebugViewDistance) {
+        radiance = vec3(1.0 - exp(-0.1 * hit.distance));
+        return false;
+    }
+    if (kShadingModel == kShadingHeadlight) {
+        float light = hit.distance > 0.0 ? abs(dot(hit.normal, direction)) : 1.0;
+        radiance += throughput * hit.color * light;
+        return false;
+    }
+    if (isLit()) {
+        if (hit.distance <= 0.0 || hit.light != kNoLight) {
+            if (bounce == 0u) {
+                radiance += throughput * (hit.distance > 0.0 ? getLightEmission(hit.light) : getEnvironment(direction));
+            }
+            return false;
+        }
+        if (bounce >= getMaxBounces()) {
+            return false;
+        }
+    }
+    else if (hit.distance <= 0.0 || bounce >= getMaxBounces()) {
+        radiance += throughput * hit.color;
+        return false;
+    }
+    throughput *= hit.color;
+    origin += direction * hit.distance;
+    direction = sampleCosine(faceforward(hit.normal, direction, hit.normal), rngState);
+    return true;
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cputracer.hpp"
+
+// Split-frame rendering over several workers, each a device or a group of
+// CPU threads holding its own copy of the scene. The image is cut into
+// tiles, the tiles are dealt out by predicted cost every frame and the
+// results are composited into one host image.
+namespace splitframe {
+    struct Tile {
+        uint32_t x, y, width, height;
+
+        uint64_t getPixelCount() const { return static_cast<uint64_t>(width) * height; }
+    };
+
+    inline std::vector<Tile> makeTiles(uint32_t width, uint32_t height, uint32_t tileSize) {
+        std::vector<Tile> tiles;
+        for (uint32_t y = 0; y < height; y += tileSize) {
+            for (uint32_t x = 0; x < width; x += tileSize) {
+                tiles.push_back({ x, y, std::min(tileSize, width - x), std::min(tileSize, height - y) });
+            }
+        }
+        return tiles;
+    }
+
+    // Host image, RGBA float
+    struct Image {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<float> pixels;
+
+        Image() = default;
+        Image(uint32_t width, uint32_t height)
+            : width(width), height(height), pixels(static_cast<size_t>(width) * height * 4) {}
+
+        // Copies the tightly packed pixels of a tile into place. Tiles do
+        // not overlap, so workers may composite at the same time.
+        void composite(const Tile& tile, const float* rgba) {
+            for (uint32_t row = 0; row < tile.height; row++) {
+                const float* src = rgba + static_cast<size_t>(row) * tile.width * 4;
+                float* dst = pixels.data() + (static_cast<size_t>(tile.y + row) * width + tile.x) * 4;
+                std::copy(src, src + tile.width * 4, dst);
+            }
+        }
+
+        bool writePPM(const std::string& path) const {
+            std::ofstream file(path, std::ios::binary);
+            if (!file) {
+                return false;
+            }
+            file << "P6\n" << width << " " << height << "\n255\n";
+            std::vector<uint8_t> row(width * 3);
+            for (uint32_t y = 0; y < height; y++) {
+                for (uint32_t x = 0; x < width; x++) {
+                    for (uint32_t c = 0; c < 3; c++) {
+                        float value = std::clamp(pixels[(static_cast<size_t>(y) * width + x) * 4 + c], 0.0f, 1.0f);
+                        row[x * 3 + c] = static_cast<uint8_t>(value * 255.0f + 0.5f);
+                    }
+                }
+                file.write(reinterpret_cast<const char*>(row.data()), row.size());
+            }
+            return static_cast<bool>(file);
+        }
+    };
+
+    class Worker {
+    public:
+        virtual ~Worker() = default;
+        virtual std::string getName() const = 0;
+        // Renders the tiles, composites them into image and returns the
+        // milliseconds spent on each tile
+        virtual std::vector<double> render(const cputracer::View& view,
+            const std::vector<Tile>& tiles, Image& image) = 0;
+    };
+
+    // Stand-in for a device: a pool of threads tracing with the CPU tracer
+    class CpuWorker : public Worker {
+    public:
+        CpuWorker(const cputracer::Scene& scene, uint32_t threadCount, std::string name)
+            : scene(scene), threadCount(std::max(1u, threadCount)), name(std::move(name)) {}
+
+        std::string getName() const override { return name; }
+
+        std::vector<double> render(const cputracer::View& view,
+            const std::vector<Tile>& tiles, Image& image) override {
+            std::vector<double> tileMs(tiles.size());
+            std::atomic<size_t> next{ 0 };
+            auto work = [&]() {
+                std::vector<float> rgba;
+                for (size_t i = next++; i < tiles.size(); i = next++) {
+                    const Tile& tile = tiles[i];
+                    rgba.resize(tile.getPixelCount() * 4);
+                    auto start = std::chrono::steady_clock::now();
+                    scene.renderRegion(view, image.width, image.height,
+                        tile.x, tile.y, tile.width, tile.height, rgba.data());
+                    auto end = std::chrono::steady_clock::now();
+                    // Threads share the worker, charge a tile its share of it
+                    tileMs[i] = std::chrono::duration<double, std::milli>(end - start).count() / threadCount;
+                    image.composite(tile, rgba.data());
+                }
+            };
+            std::vector<std::thread> threads;
+            for (uint32_t t = 1; t < threadCount; t++) {
+                threads.emplace_back(work);
+            }
+            work();
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            return tileMs;
+        }
+
+    private:
+        const cputracer::Scene& scene;
+        uint32_t threadCount;
+        std::string name;
+    };
+
+    // Predicts the cost of every tile on every worker from the measured
+    // tile times. A tile's cost is kept in worker independent units
+    // (milliseconds on a worker of speed 1) and every worker has a speed,
+    // both smoothed over frames so one noisy frame does not reshuffle
+    // the split. The first measurement replaces the initial guess.
+    class LoadBalancer {
+    public:
+        static constexpr double kSmoothing = 0.3;
+
+        LoadBalancer(size_t workerCount, size_t tileCount)
+            : msPerUnit(workerCount, 1.0), tileCost(tileCount, 1.0),
+              workerMeasured(workerCount, false), tileMeasured(tileCount, false) {}
+
+        // Longest predicted tile first, each to the worker that would
+        // finish it earliest. Returns the tile indices per worker.
+        std::vector<std::vector<uint32_t>> assign() const {
+            std::vector<uint32_t> order(tileCost.size());
+            std::iota(order.begin(), order.end(), 0u);
+            std::stable_sort(order.begin(), order.end(),
+                [&](uint32_t a, uint32_t b) { return tileCost[a] > tileCost[b]; });
+
+            std::vector<std::vector<uint32_t>> assignment(msPerUnit.size());
+            std::vector<double> finish(msPerUnit.size(), 0.0);
+            for (uint32_t tile : order) {
+                size_t best = 0;
+                for (size_t w = 1; w < msPerUnit.size(); w++) {
+                    if (finish[w] + tileCost[tile] * msPerUnit[w] < finish[best] + tileCost[tile] * msPerUnit[best]) {
+                        best = w;
+                    }
+                }
+                finish[best] += tileCost[tile] * msPerUnit[best];
+                assignment[best].push_back(tile);
+            }
+            return assignment;
+        }
+
+        // Predicted milliseconds of a worker for the tiles
+        double predict(size_t worker, const std::vector<uint32_t>& tiles) const {
+            double units = 0.0;
+            for (uint32_t tile : tiles) {
+                units += tileCost[tile];
+            }
+            return units * msPerUnit[worker];
+        }
+
+        void record(size_t worker, const std::vector<uint32_t>& tiles, const std::vector<double>& tileMs) {
+            double units = 0.0;
+            double ms = 0.0;
+            for (size_t i = 0; i < tiles.size(); i++) {
+                units += tileCost[tiles[i]];
+                ms += tileMs[i];
+            }
+            if (units <= 0.0 || ms <= 0.0) {
+                return;
+            }
+            blend(msPerUnit[worker], ms / units, workerMeasured[worker]);
+            for (size_t i = 0; i < tiles.size(); i++) {
+                double cost = std::max(tileMs[i] / msPerUnit[worker], 1e-6);
+                blend(tileCost[tiles[i]], cost, tileMeasured[tiles[i]]);
+            }
+        }
+
+        double getMsPerUnit(size_t worker) const { return msPerUnit[worker]; }
+
+    private:
+        std::vector<double> msPerUnit;
+        std::vector<double> tileCost;
+        std::vector<bool> workerMeasured;
+        std::vector<bool> tileMeasured;
+
+        static void blend(double& estimate, double sample, std::vector<bool>::reference measured) {
+            estimate = measured ? estimate + (sample - estimate) * kSmoothing : sample;
+            measured = true;
+        }
+    };
+
+    struct WorkerStats {
+        uint32_t tileCount = 0;
+        uint64_t pixelCount = 0;
+        double predictedMs = 0.0;
+        double ms = 0.0;
+    };
+
+    struct FrameStats {
+        double ms = 0.0;
+        std::vector<WorkerStats> workers;
+    };
+
+    class Renderer {
+    public:
+        Renderer(std::vector<std::unique_ptr<Worker>> renderWorkers,
+            uint32_t width, uint32_t height, uint32_t tileSize)
+            : workers(std::move(renderWorkers)),
+              tiles(makeTiles(width, height, tileSize)),
+              balancer(workers.size(), tiles.size()),
+              image(width, height) {}
+
+        const Image& getImage() const { return image; }
+        const std::vector<std::unique_ptr<Worker>>& getWorkers() const { return workers; }
+
+        FrameStats renderFrame(const cputracer::View& view) {
+            std::vector<std::vector<uint32_t>> assignment = balancer.assign();
+            FrameStats stats{};
+            stats.workers.resize(workers.size());
+            std::vector<std::vector<double>> tileMs(workers.size());
+
+            auto frameStart = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            for (size_t w = 0; w < workers.size(); w++) {
+                std::vector<Tile> workerTiles;
+                for (uint32_t tile : assignment[w]) {
+                    workerTiles.push_back(tiles[tile]);
+                    stats.workers[w].pixelCount += tiles[tile].getPixelCount();
+                }
+                stats.workers[w].tileCount = static_cast<uint32_t>(workerTiles.size());
+                stats.workers[w].predictedMs = balancer.predict(w, assignment[w]);
+                threads.emplace_back([&, w, workerTiles = std::move(workerTiles)]() {
+                    auto start = std::chrono::steady_clock::now();
+                    tileMs[w] = workers[w]->render(view, workerTiles, image);
+                    auto end = std::chrono::steady_clock::now();
+                    stats.workers[w].ms = std::chrono::duration<double, std::milli>(end - start).count();
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            auto frameEnd = std::chrono::steady_clock::now();
+            stats.ms = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+
+            for (size_t w = 0; w < workers.size(); w++) {
+                balancer.record(w, assignment[w], tileMs[w]);
+            }
+            return stats;
+        }
+
+    private:
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<Tile> tiles;
+        LoadBalancer balancer;
+        Image image;
+    };
+}  // namespace splitframe
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vkutils.hpp"
+
+// Validation of the main instance, chosen at startup:
+// release        no layers and no debug messenger, nothing on the API path
+// debug          the Khronos validation layer, optionally with GPU-assisted
+//                or synchronization validation, messages printed as they come
+// perf-warnings  the layer with only its best practices checks, and only
+//                performance messages. The callback queues them without
+//                locking and the render loop prints them deduplicated and
+//                rate limited.
+namespace validation {
+    constexpr const char* kLayerName = "VK_LAYER_KHRONOS_validation";
+
+    enum class Mode : uint32_t {
+        eRelease,
+        eDebug,
+        ePerfWarnings,
+    };
+    constexpr uint32_t kModeCount = 3;
+
+    inline const char* toString(Mode mode) {
+        switch (mode) {
+        case Mode::eRelease: return "release";
+        case Mode::eDebug: return "debug";
+        case Mode::ePerfWarnings: return "perf-warnings";
+        }
+        return "unknown";
+    }
+
+    inline bool parseMode(const std::string& name, Mode& mode) {
+        for (uint32_t i = 0; i < kModeCount; i++) {
+            if (name == toString(static_cast<Mode>(i))) {
+                mode = static_cast<Mode>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct Config {
+        Mode mode = Mode::eRelease;
+        // Debug mode only, both slow the GPU down considerably
+        bool gpuAssisted = false;
+        bool synchronization = false;
+    };
+
+    // A message as copied out of the callback. The sizes are fixed so that
+    // queueing never allocates, longer texts are cut.
+    struct Message {
+        int32_t id = 0;
+        std::array<char, 64> name{};
+        std::array<char, 448> text{};
+    };
+
+    // Bounded lock-free queue of many producers and one consumer, after
+    // Vyukov. A producer claims a cell by advancing the tail, the sequence
+    // of a cell tells whether it is free or holds a message. The callback
+    // runs on whichever thread calls into Vulkan.
+    class MessageQueue {
+    public:
+        // capacity must be a power of two
+        explicit MessageQueue(size_t capacity = 1024) : cells(new Cell[capacity]), mask(capacity - 1) {
+            for (size_t i = 0; i < capacity; i++) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        // Fails when the queue is full, the message is then counted as dropped
+        bool push(const Message& message) {
+            size_t position = tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Cell& cell = cells[position & mask];
+                size_t sequence = cell.sequence.load(std::memory_order_acquire);
+                auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+                if (difference == 0) {
+                    if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell.message = message;
+                        cell.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (difference < 0) {
+                    dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                else {
+                    position = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Only ever called by the consumer
+        bool pop(Message& message) {
+            Cell& cell = cells[head & mask];
+            if (cell.sequence.load(std::memory_order_acquire) != head + 1) {
+                return false;
+            }
+            message = cell.message;
+            cell.sequence.store(head + mask + 1, std::memory_order_release);
+            head++;
+            return true;
+        }
+
+        uint64_t takeDropped() {
+            return dropped.exchange(0, std::memory_order_relaxed);
+        }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence{ 0 };
+            Message message;
+        };
+        std::unique_ptr<Cell[]> cells;
+        size_t mask = 0;
+        std::atomic<size_t> tail{ 0 };
+        size_t head = 0;
+        std::atomic<uint64_t> dropped{ 0 };
+    };
+
+    // Debug messenger callback of perf-warnings mode, pUserData is the MessageQueue
+    static VKAPI_ATTR VkBool32 VKAPI_CALL queueMessage(
+        VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
+        VkDebugUtilsMessageTypeFlagsEXT messageTypes,
+        VkDebugUtilsMessengerCallbackDataEXT const* pCallbackData,
+        void* pUserData) {
+        Message message{};
+        message.id = pCallbackData->messageIdNumber;
+        if (pCallbackData->pMessageIdName) {
+            std::strncpy(message.name.data(), pCallbackData->pMessageIdName, message.name.size() - 1);
+        }
+        if (pCallbackData->pMessage) {
+            std::strncpy(message.text.data(), pCallbackData->pMessage, message.text.size() - 1);
+        }
+        static_cast<MessageQueue*>(pUserData)->push(message);
+        return VK_FALSE;
+    }
+
+    // Prints queued messages on the render thread. The first message of
+    // every id is printed while the rate allows, repeats and messages over
+    // the rate only show up as counts in a summary every few seconds.
+    class MessageLog {
+    public:
+        explicit MessageLog(double linesPerSecond = 10.0, double summarySeconds = 5.0)
+            : linesPerSecond(linesPerSecond), summarySeconds(summarySeconds), tokens(linesPerSecond) {}
+
+        void drain(MessageQueue& queue, std::ostream& out) {
+            auto now = clock::now();
+            double seconds = std::chrono::duration<double>(now - lastDrain).count();
+            lastDrain = now;
+            tokens = std::min(linesPerSecond, tokens + seconds * linesPerSecond);
+
+            Message message;
+            while (queue.pop(message)) {
+                Entry& entry = entries[getKey(message)];
+                if (entry.count++ == 0) {
+                    entry.name = message.name[0] != '\0' ? message.name.data() : "message " + std::to_string(message.id);
+                    if (tokens >= 1.0) {
+                        tokens -= 1.0;
+                        out << "[" << entry.name << "] " << message.text.data() << "\n";
+                        continue;
+                    }
+                }
+                entry.suppressed++;
+            }
+            dropped += queue.takeDropped();
+            if (std::chrono::duration<double>(now - lastSummary).count() >= summarySeconds) {
+                summarize(out);
+                lastSummary = now;
+            }
+        }
+
+        // Counts of the messages not printed since the last summary
+        void summarize(std::ostream& out) {
+            for (auto& [key, entry] : entries) {
+                if (entry.suppressed > 0) {
+                    out << "[" << entry.name << "] " << entry.suppressed << " more, "
+                        << entry.count << " in total\n";
+                    entry.suppressed = 0;
+                }
+            }
+            if (dropped > 0) {
+                out << dropped << " validation messages dropped, the queue was full\n";
+                dropped = 0;
+            }
+        }
+
+    private:
+        using clock = std::chrono::steady_clock;
+        struct Entry {
+            std::string name;
+            uint64_t count = 0;
+            uint64_t suppressed = 0;
+        };
+
+        double linesPerSecond;
+        double summarySeconds;
+        double tokens;
+        clock::time_point lastDrain = clock::now();
+        clock::time_point lastSummary = clock::now();
+        std::unordered_map<uint64_t, Entry> entries;
+        uint64_t dropped = 0;
+
+        // Messages without an id are told apart by their text
+        static uint64_t getKey(const Message& message) {
+            if (message.id != 0) {
+                return static_cast<uint32_t>(message.id);
+            }
+            uint64_t hash = 0xCBF29CE484222325ull;
+            for (const char* c = message.text.data(); *c != '\0'; c++) {
+                hash = (hash ^ static_cast<unsigned char>(*c)) * 0x100000001B3ull;
+            }
+            return hash | (1ull << 63);
+        }
+    };
+
+    inline std::vector<const char*> getLayers(const Config& config) {
+        if (config.mode == Mode::eRelease) {
+            return {};
+        }
+        return { kLayerName };
+    }
+
+    // Debug mode prints every message like before, perf-warnings queues
+    // performance messages only
+    inline vk::DebugUtilsMessengerCreateInfoEXT getMessengerCreateInfo(const Config& config, MessageQueue* queue) {
+        vk::DebugUtilsMessengerCreateInfoEXT createInfo = vkutils::createDebugCreateInfo();
+        if (config.mode == Mode::ePerfWarnings) {
+            createInfo.setMessageType(vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance);
+            createInfo.setPfnUserCallback(&queueMessage);
+            createInfo.setPUserData(queue);
+        }
+        return createInfo;
+    }
+
+    // Checks of the layer to enable and disable, chained into the instance
+    // create info through get
+    struct Features {
+        std::vector<vk::ValidationFeatureEnableEXT> enabled;
+        std::vector<vk::ValidationFeatureDisableEXT> disabled;
+
+        bool empty() const { return enabled.empty() && disabled.empty(); }
+
+        vk::ValidationFeaturesEXT get() const {
+            vk::ValidationFeaturesEXT features{};
+            features.setEnabledValidationFeatures(enabled);
+            features.setDisabledValidationFeatures(disabled);
+            return features;
+        }
+    };
+
+    inline Features getFeatures(const Config& config) {
+        Features features;
+        if (config.mode == Mode::eDebug) {
+            if (config.gpuAssisted) {
+                features.enabled.push_back(vk::ValidationFeatureEnableEXT::eGpuAssisted);
+                features.enabled.push_back(vk::ValidationFeatureEnableEXT::eGpuAssistedReserveBindingSlot);
+            }
+            if (config.synchronization) {
+                features.enabled.push_back(vk::ValidationFeatureEnableEXT::eSynchronizationValidation);
+            }
+        }
+        else if (config.mode == Mode::ePerfWarnings) {
+            // Best practices alone, the expensive correctness checks are off
+            features.enabled.push_back(vk::ValidationFeatureEnableEXT::eBestPractices);
+            features.disabled = {
+                vk::ValidationFeatureDisableEXT::eCoreChecks,
+                vk::ValidationFeatureDisableEXT::eShaders,
+                vk::ValidationFeatureDisableEXT::eThreadSafety,
+                vk::ValidationFeatureDisableEXT::eApiParameters,
+                vk::ValidationFeatureDisableEXT::eObjectLifetimes,
+            };
+        }
+        return features;
+    }
+}  // namespace validation
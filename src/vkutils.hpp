@@ -46,14 +46,18 @@ namespace vkutils {
         return true;
     }
 
-    inline std::vector<const char*> getRequiredExtensions() {
-        uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions =
-            glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-        std::vector<const char*> extensions(glfwExtensions,
-            glfwExtensions + glfwExtensionCount);
-        extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    // Headless instances skip the window system extensions of glfw
+    inline std::vector<const char*> getRequiredExtensions(bool presentation = true, bool debugUtils = true) {
+        std::vector<const char*> extensions;
+        if (presentation) {
+            uint32_t glfwExtensionCount = 0;
+            const char** glfwExtensions =
+                glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+            extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+        }
+        if (debugUtils) {
+            extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+        }
         return extensions;
     }
 
@@ -70,16 +74,27 @@ namespace vkutils {
         return createInfo;
     }
 
+    // Global functions only, enough to query layers before createInstance
+    inline void initLoader() {
+        static vk::DynamicLoader dl;
+        auto vkGetInstanceProcAddr =
+            dl.getProcAddress<PFN_vkGetInstanceProcAddr>("vkGetInstanceProcAddr");
+        VULKAN_HPP_DEFAULT_DISPATCHER.init(vkGetInstanceProcAddr);
+    }
+
+    // Without debugCreateInfo the instance gets neither VK_EXT_debug_utils
+    // nor a messenger for its creation. validationFeatures configure the
+    // validation layer, which must be among the layers.
     inline vk::UniqueInstance createInstance(
         uint32_t apiVersion,
-        const std::vector<const char*>& layers) {
+        const std::vector<const char*>& layers,
+        bool presentation = true,
+        const vk::DebugUtilsMessengerCreateInfoEXT* debugCreateInfo = nullptr,
+        const vk::ValidationFeaturesEXT* validationFeatures = nullptr) {
         std::cout << "Create instance\n";
 
         // Setup dynamic loader
-        static vk::DynamicLoader dl;
-        auto vkGetInstanceProcAddr =
-            dl.getProcAddress<PFN_vkGetInstanceProcAddr>("vkGetInstanceProcAddr");
-        VULKAN_HPP_DEFAULT_DISPATCHER.init(vkGetInstanceProcAddr);
+        initLoader();
 
         // Check layer support
         if (!checkLayerSupport(layers)) {
@@ -91,25 +106,41 @@ namespace vkutils {
         vk::ApplicationInfo appInfo{};
         appInfo.setApiVersion(apiVersion);
 
-        std::vector<const char*> extensions = getRequiredExtensions();
-
-        vk::DebugUtilsMessengerCreateInfoEXT debugCreateInfo =
-            createDebugCreateInfo();
+        std::vector<const char*> extensions = getRequiredExtensions(presentation, debugCreateInfo != nullptr);
+        if (validationFeatures) {
+            extensions.push_back(VK_EXT_VALIDATION_FEATURES_EXTENSION_NAME);
+        }
 
         vk::InstanceCreateInfo instanceCreateInfo{};
         instanceCreateInfo.setPApplicationInfo(&appInfo);
         instanceCreateInfo.setPEnabledLayerNames(layers);
         instanceCreateInfo.setPEnabledExtensionNames(extensions);
-        instanceCreateInfo.setPNext(&debugCreateInfo);
+
+        // Copies, so the chain does not change what the caller passed
+        vk::DebugUtilsMessengerCreateInfoEXT debugInfo{};
+        vk::ValidationFeaturesEXT featuresInfo{};
+        const void* next = nullptr;
+        if (validationFeatures) {
+            featuresInfo = *validationFeatures;
+            featuresInfo.setPNext(next);
+            next = &featuresInfo;
+        }
+        if (debugCreateInfo) {
+            debugInfo = *debugCreateInfo;
+            debugInfo.setPNext(next);
+            next = &debugInfo;
+        }
+        instanceCreateInfo.setPNext(next);
         vk::UniqueInstance instance = vk::createInstanceUnique(instanceCreateInfo);
         VULKAN_HPP_DEFAULT_DISPATCHER.init(*instance);
         return instance;
     }
 
     inline vk::UniqueDebugUtilsMessengerEXT createDebugMessenger(
-        vk::Instance instance) {
+        vk::Instance instance,
+        const vk::DebugUtilsMessengerCreateInfoEXT& createInfo = createDebugCreateInfo()) {
         std::cout << "Create debug messenger\n";
-        return instance.createDebugUtilsMessengerEXTUnique(createDebugCreateInfo());
+        return instance.createDebugUtilsMessengerEXTUnique(createInfo);
     }
 
     inline vk::UniqueSurfaceKHR createSurface(vk::Instance instance,
@@ -179,6 +210,30 @@ namespace vkutils {
         std::abort();
     }
 
+    // Every device with the extensions, for headless multi-device work
+    inline std::vector<vk::PhysicalDevice> pickPhysicalDevices(
+        vk::Instance instance,
+        const std::vector<const char*>& deviceExtensions) {
+        std::vector<vk::PhysicalDevice> devices;
+        for (const auto& device : instance.enumeratePhysicalDevices()) {
+            if (checkDeviceExtensionSupport(device, deviceExtensions)) {
+                devices.push_back(device);
+            }
+        }
+        return devices;
+    }
+
+    inline uint32_t findComputeQueueFamily(vk::PhysicalDevice physicalDevice) {
+        auto queueFamilies = physicalDevice.getQueueFamilyProperties();
+        for (uint32_t i = 0; i < queueFamilies.size(); i++) {
+            if (queueFamilies[i].queueFlags & vk::QueueFlagBits::eCompute) {
+                return i;
+            }
+        }
+        std::cerr << "Failed to find compute queue family.\n";
+        std::abort();
+    }
+
     inline auto getRayTracingProps(vk::PhysicalDevice physicalDevice) {
         auto deviceProperties = physicalDevice.getProperties2<
             vk::PhysicalDeviceProperties2,
@@ -187,12 +242,88 @@ namespace vkutils {
             .get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
     }
 
+    // Identifies the device and driver that produced serialized data
+    inline void getDeviceUUIDs(vk::PhysicalDevice physicalDevice,
+        uint8_t deviceUUID[VK_UUID_SIZE],
+        uint8_t driverUUID[VK_UUID_SIZE]) {
+        auto properties = physicalDevice.getProperties2<
+            vk::PhysicalDeviceProperties2,
+            vk::PhysicalDeviceIDProperties>();
+        const auto& idProperties = properties.get<vk::PhysicalDeviceIDProperties>();
+        memcpy(deviceUUID, idProperties.deviceUUID.data(), VK_UUID_SIZE);
+        memcpy(driverUUID, idProperties.driverUUID.data(), VK_UUID_SIZE);
+    }
+
+    // Checks the version header of a serialized acceleration structure
+    inline bool isAccelerationStructureCompatible(vk::Device device,
+        const uint8_t* serializedData) {
+        vk::AccelerationStructureVersionInfoKHR versionInfo{};
+        versionInfo.setPVersionData(serializedData);
+        return device.getAccelerationStructureCompatibilityKHR(versionInfo) ==
+            vk::AccelerationStructureCompatibilityKHR::eCompatible;
+    }
+
+    inline bool isAccelerationStructureVertexFormatSupported(
+        vk::PhysicalDevice physicalDevice,
+        vk::Format format) {
+        vk::FormatProperties properties = physicalDevice.getFormatProperties(format);
+        return static_cast<bool>(properties.bufferFeatures &
+            vk::FormatFeatureFlagBits::eAccelerationStructureVertexBufferKHR);
+    }
+
+    // Memory still available on device local heaps (VK_EXT_memory_budget).
+    // Falls back to the heap sizes when the extension is not enabled.
+    inline vk::DeviceSize getDeviceLocalBudget(vk::PhysicalDevice physicalDevice,
+        bool memoryBudgetEnabled) {
+        if (!memoryBudgetEnabled) {
+            vk::DeviceSize heapSize = 0;
+            auto memoryProperties = physicalDevice.getMemoryProperties();
+            for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+                if (memoryProperties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal) {
+                    heapSize += memoryProperties.memoryHeaps[i].size;
+                }
+            }
+            return heapSize;
+        }
+
+        auto properties = physicalDevice.getMemoryProperties2<
+            vk::PhysicalDeviceMemoryProperties2,
+            vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+        const auto& memoryProperties =
+            properties.get<vk::PhysicalDeviceMemoryProperties2>().memoryProperties;
+        const auto& budget =
+            properties.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+
+        vk::DeviceSize available = 0;
+        for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+            if ((memoryProperties.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal) &&
+                budget.heapBudget[i] > budget.heapUsage[i]) {
+                available += budget.heapBudget[i] - budget.heapUsage[i];
+            }
+        }
+        return available;
+    }
+
     inline vk::UniqueDevice createLogicalDevice(
         vk::PhysicalDevice physicalDevice,
         uint32_t queueFamilyIndex,
-        const std::vector<const char*>& deviceExtensions) {
+        const std::vector<const char*>& deviceExtensions,
+        void* pNextFeatures = nullptr) {
         std::cout << "Create device\n";
 
+        // Only enable what the device reports
+        auto supported = physicalDevice.getFeatures2<
+            vk::PhysicalDeviceFeatures2,
+            vk::PhysicalDeviceRayTracingPipelineFeaturesKHR,
+            vk::PhysicalDeviceAccelerationStructureFeaturesKHR,
+            vk::PhysicalDeviceBufferDeviceAddressFeatures>();
+        if (!supported.get<vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>().rayTracingPipeline ||
+            !supported.get<vk::PhysicalDeviceAccelerationStructureFeaturesKHR>().accelerationStructure ||
+            !supported.get<vk::PhysicalDeviceBufferDeviceAddressFeatures>().bufferDeviceAddress) {
+            std::cerr << "Device lacks ray tracing features.\n";
+            std::abort();
+        }
+
         float queuePriority = 1.0f;
         vk::DeviceQueueCreateInfo queueCreateInfo{
             {}, queueFamilyIndex, 1, &queuePriority };
@@ -201,12 +332,19 @@ namespace vkutils {
         deviceCreateInfo.setQueueCreateInfos(queueCreateInfo);
         deviceCreateInfo.setPEnabledExtensionNames(deviceExtensions);
 
+        // Indirect trace dispatches are optional, see adaptive sampling
+        vk::PhysicalDeviceRayTracingPipelineFeaturesKHR rayTracingFeatures{VK_TRUE};
+        rayTracingFeatures.setRayTracingPipelineTraceRaysIndirect(
+            supported.get<vk::PhysicalDeviceRayTracingPipelineFeaturesKHR>().rayTracingPipelineTraceRaysIndirect);
+
         vk::StructureChain createInfoChain{
             deviceCreateInfo,
-            vk::PhysicalDeviceRayTracingPipelineFeaturesKHR{VK_TRUE},
+            rayTracingFeatures,
             vk::PhysicalDeviceAccelerationStructureFeaturesKHR{VK_TRUE},
             vk::PhysicalDeviceBufferDeviceAddressFeatures{VK_TRUE},
         };
+        // Optional features enabled by the application
+        createInfoChain.get<vk::PhysicalDeviceBufferDeviceAddressFeatures>().setPNext(pNextFeatures);
 
         vk::UniqueDevice device = physicalDevice.createDeviceUnique(
             createInfoChain.get<vk::DeviceCreateInfo>());
@@ -214,6 +352,32 @@ namespace vkutils {
         return device;
     }
 
+    // Device for ray queries in compute shaders, one of several in the
+    // process. The dispatcher keeps the instance level entry points, which
+    // go through the loader to whichever device a handle belongs to, so
+    // unlike createLogicalDevice this does not bind the dispatcher to it.
+    inline vk::UniqueDevice createRayQueryDevice(
+        vk::PhysicalDevice physicalDevice,
+        uint32_t queueFamilyIndex,
+        const std::vector<const char*>& deviceExtensions) {
+        float queuePriority = 1.0f;
+        vk::DeviceQueueCreateInfo queueCreateInfo{
+            {}, queueFamilyIndex, 1, &queuePriority };
+
+        vk::DeviceCreateInfo deviceCreateInfo{};
+        deviceCreateInfo.setQueueCreateInfos(queueCreateInfo);
+        deviceCreateInfo.setPEnabledExtensionNames(deviceExtensions);
+
+        vk::StructureChain createInfoChain{
+            deviceCreateInfo,
+            vk::PhysicalDeviceRayQueryFeaturesKHR{VK_TRUE},
+            vk::PhysicalDeviceAccelerationStructureFeaturesKHR{VK_TRUE},
+            vk::PhysicalDeviceBufferDeviceAddressFeatures{VK_TRUE},
+        };
+        return physicalDevice.createDeviceUnique(
+            createInfoChain.get<vk::DeviceCreateInfo>());
+    }
+
     inline vk::SurfaceFormatKHR chooseSurfaceFormat(
         vk::PhysicalDevice physicalDevice,
         vk::SurfaceKHR surface) {
@@ -226,6 +390,20 @@ namespace vkutils {
         return availableFormats[0];
     }
 
+    // Formats the hardware encodes to sRGB on writes, blits included
+    inline bool isSrgbFormat(vk::Format format) {
+        switch (format) {
+        case vk::Format::eR8G8B8A8Srgb:
+        case vk::Format::eB8G8R8A8Srgb:
+        case vk::Format::eA8B8G8R8SrgbPack32:
+        case vk::Format::eR8G8B8Srgb:
+        case vk::Format::eB8G8R8Srgb:
+            return true;
+        default:
+            return false;
+        }
+    }
+
     inline vk::PresentModeKHR choosePresentMode(vk::PhysicalDevice physicalDevice,
         vk::SurfaceKHR surface) {
         auto availablePresentModes =
@@ -389,16 +567,164 @@ namespace vkutils {
         return device.createShaderModuleUnique(createInfo);
     }
 
+    inline vk::UniquePipeline createComputePipeline(vk::Device device,
+        vk::ShaderModule shaderModule,
+        vk::PipelineLayout pipelineLayout,
+        const vk::SpecializationInfo* specialization = nullptr) {
+        vk::ComputePipelineCreateInfo createInfo{};
+        createInfo.setLayout(pipelineLayout);
+        createInfo.setStage({ {}, vk::ShaderStageFlagBits::eCompute, shaderModule, "main", specialization });
+        auto result = device.createComputePipelineUnique(nullptr, createInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to create compute pipeline\n";
+            std::abort();
+        }
+        return std::move(result.value);
+    }
+
+    // Builds a pipeline library from a subset of the ray tracing stages. All
+    // libraries linked together must share the layout and the interface.
+    inline vk::UniquePipeline createRayTracingLibrary(vk::Device device,
+        vk::PipelineLayout pipelineLayout,
+        const std::vector<vk::PipelineShaderStageCreateInfo>& stages,
+        const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups,
+        const vk::RayTracingPipelineInterfaceCreateInfoKHR& libraryInterface) {
+        vk::RayTracingPipelineCreateInfoKHR createInfo{};
+        createInfo.setFlags(vk::PipelineCreateFlagBits::eLibraryKHR);
+        createInfo.setLayout(pipelineLayout);
+        createInfo.setStages(stages);
+        createInfo.setGroups(groups);
+        createInfo.setPLibraryInterface(&libraryInterface);
+        createInfo.setMaxPipelineRayRecursionDepth(1);
+        auto result = device.createRayTracingPipelineKHRUnique(nullptr, nullptr, createInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to create ray tracing pipeline library\n";
+            std::abort();
+        }
+        return std::move(result.value);
+    }
+
+    // Links pipeline libraries into an executable ray tracing pipeline. The
+    // shader groups are numbered in library order.
+    inline vk::UniquePipeline linkRayTracingPipeline(vk::Device device,
+        vk::PipelineLayout pipelineLayout,
+        const std::vector<vk::Pipeline>& libraries,
+        const vk::RayTracingPipelineInterfaceCreateInfoKHR& libraryInterface) {
+        vk::PipelineLibraryCreateInfoKHR libraryInfo{};
+        libraryInfo.setLibraries(libraries);
+        vk::RayTracingPipelineCreateInfoKHR createInfo{};
+        createInfo.setLayout(pipelineLayout);
+        createInfo.setPLibraryInfo(&libraryInfo);
+        createInfo.setPLibraryInterface(&libraryInterface);
+        createInfo.setMaxPipelineRayRecursionDepth(1);
+        auto result = device.createRayTracingPipelineKHRUnique(nullptr, nullptr, createInfo);
+        if (result.result != vk::Result::eSuccess) {
+            std::cerr << "Failed to link ray tracing pipeline\n";
+            std::abort();
+        }
+        return std::move(result.value);
+    }
+
+    // Layout of a compute pass that only binds storage images
+    inline vk::UniqueDescriptorSetLayout createStorageImageSetLayout(vk::Device device,
+        uint32_t imageCount) {
+        std::vector<vk::DescriptorSetLayoutBinding> bindings(imageCount);
+        for (uint32_t i = 0; i < imageCount; i++) {
+            bindings[i].setBinding(i);
+            bindings[i].setDescriptorType(vk::DescriptorType::eStorageImage);
+            bindings[i].setDescriptorCount(1);
+            bindings[i].setStageFlags(vk::ShaderStageFlagBits::eCompute);
+        }
+        vk::DescriptorSetLayoutCreateInfo createInfo{};
+        createInfo.setBindings(bindings);
+        return device.createDescriptorSetLayoutUnique(createInfo);
+    }
+
+    // Binds the views in the general layout to bindings 0..n-1
+    inline void updateStorageImageDescriptors(vk::Device device,
+        vk::DescriptorSet descSet,
+        const std::vector<vk::ImageView>& views) {
+        std::vector<vk::DescriptorImageInfo> imageInfos;
+        for (auto view : views) {
+            imageInfos.push_back({ {}, view, vk::ImageLayout::eGeneral });
+        }
+        std::vector<vk::WriteDescriptorSet> writes(views.size());
+        for (uint32_t i = 0; i < writes.size(); i++) {
+            writes[i].setDstSet(descSet);
+            writes[i].setDstBinding(i);
+            writes[i].setDescriptorType(vk::DescriptorType::eStorageImage);
+            writes[i].setImageInfo(imageInfos[i]);
+        }
+        device.updateDescriptorSets(writes, nullptr);
+    }
+
+    // Layout of a compute pass that only binds storage buffers
+    inline vk::UniqueDescriptorSetLayout createStorageBufferSetLayout(vk::Device device,
+        uint32_t bufferCount) {
+        std::vector<vk::DescriptorSetLayoutBinding> bindings(bufferCount);
+        for (uint32_t i = 0; i < bufferCount; i++) {
+            bindings[i].setBinding(i);
+            bindings[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+            bindings[i].setDescriptorCount(1);
+            bindings[i].setStageFlags(vk::ShaderStageFlagBits::eCompute);
+        }
+        vk::DescriptorSetLayoutCreateInfo createInfo{};
+        createInfo.setBindings(bindings);
+        return device.createDescriptorSetLayoutUnique(createInfo);
+    }
+
+    // Binds the whole buffers to bindings 0..n-1
+    inline void updateStorageBufferDescriptors(vk::Device device,
+        vk::DescriptorSet descSet,
+        const std::vector<vk::Buffer>& buffers) {
+        std::vector<vk::DescriptorBufferInfo> bufferInfos;
+        for (auto buffer : buffers) {
+            bufferInfos.push_back({ buffer, 0, VK_WHOLE_SIZE });
+        }
+        std::vector<vk::WriteDescriptorSet> writes(buffers.size());
+        for (uint32_t i = 0; i < writes.size(); i++) {
+            writes[i].setDstSet(descSet);
+            writes[i].setDstBinding(i);
+            writes[i].setDescriptorType(vk::DescriptorType::eStorageBuffer);
+            writes[i].setBufferInfo(bufferInfos[i]);
+        }
+        device.updateDescriptorSets(writes, nullptr);
+    }
+
+    // Stages that perform the given accesses
+    inline vk::PipelineStageFlags getStageMask(vk::AccessFlags accessMask,
+        vk::PipelineStageFlags fallback) {
+        vk::PipelineStageFlags stageMask{};
+        if (accessMask & vk::AccessFlagBits::eHostWrite) {
+            stageMask |= vk::PipelineStageFlagBits::eHost;
+        }
+        if (accessMask & (vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite)) {
+            stageMask |= vk::PipelineStageFlagBits::eTransfer;
+        }
+        if (accessMask & (vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite)) {
+            stageMask |= vk::PipelineStageFlagBits::eColorAttachmentOutput;
+        }
+        if (accessMask & vk::AccessFlagBits::eDepthStencilAttachmentWrite) {
+            stageMask |= vk::PipelineStageFlagBits::eEarlyFragmentTests |
+                vk::PipelineStageFlagBits::eLateFragmentTests;
+        }
+        if (accessMask & (vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite)) {
+            stageMask |= vk::PipelineStageFlagBits::eFragmentShader |
+                vk::PipelineStageFlagBits::eComputeShader |
+                vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+        }
+        return stageMask ? stageMask : fallback;
+    }
+
+    // Stage masks left empty are derived from the access masks of the layouts
     inline void setImageLayout(vk::CommandBuffer commandBuffer,
         vk::Image image,
         vk::ImageLayout oldImageLayout,
         vk::ImageLayout newImageLayout,
         vk::ImageSubresourceRange subresourceRange =
         { vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1 },
-        vk::PipelineStageFlags srcStageMask =
-        vk::PipelineStageFlagBits::eAllCommands,
-        vk::PipelineStageFlags dstStageMask =
-        vk::PipelineStageFlagBits::eAllCommands) {
+        vk::PipelineStageFlags srcStageMask = {},
+        vk::PipelineStageFlags dstStageMask = {}) {
         vk::ImageMemoryBarrier imageMemoryBarrier{};
         imageMemoryBarrier.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
         imageMemoryBarrier.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
@@ -470,6 +796,14 @@ namespace vkutils {
         }
 
         // R}hobt@ɃoAς
+        if (!srcStageMask) {
+            srcStageMask = getStageMask(imageMemoryBarrier.srcAccessMask,
+                vk::PipelineStageFlagBits::eTopOfPipe);
+        }
+        if (!dstStageMask) {
+            dstStageMask = getStageMask(imageMemoryBarrier.dstAccessMask,
+                vk::PipelineStageFlagBits::eBottomOfPipe);
+        }
         commandBuffer.pipelineBarrier(srcStageMask, dstStageMask,  //
             {}, {}, {}, imageMemoryBarrier);
     }